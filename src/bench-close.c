@@ -0,0 +1,118 @@
+/*
+ * Benchmark for close() processing.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures open/close throughput in 1, 2, 4, ... up to -p worker processes
+ * in three cases:
+ *
+ *   - "untracked": the process has no LIBCx file descriptions at all;
+ *   - "filtered": the process has one tracked file but opens and closes
+ *     another one, so close() takes the process-local fast path;
+ *   - "tracked": the process opens and closes the tracked file itself, so
+ *     close() has to look it up in shared data (i.e. no fast path).
+ */
+
+#include "bench-skeleton.c"
+
+enum { Untracked, Filtered, Tracked };
+
+static long bench_close(int idx, void *arg)
+{
+  int mode = (int)arg;
+  char path[PATH_MAX];
+  char tpath[PATH_MAX];
+  char buf[16];
+  int fd, tfd = -1, i;
+
+  memset(buf, 'a' + idx % 26, sizeof(buf));
+
+  bench_path(path, sizeof(path), "close", idx);
+  bench_path(tpath, sizeof(tpath), "close-tracked", idx);
+
+  if (mode != Untracked)
+  {
+    /* Make LIBCx track this file for the whole run */
+    tfd = open(tpath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (tfd == -1)
+      perrno_and(return -1, "open %s", tpath);
+    if (pwrite(tfd, buf, sizeof(buf), 0) != sizeof(buf))
+      perrno_and(return -1, "pwrite");
+  }
+
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    perrno_and(return -1, "open %s", path);
+  close(fd);
+
+  for (i = 0; i < bench_iterations; ++i)
+  {
+    fd = open(mode == Tracked ? tpath : path, O_RDWR);
+    if (fd == -1)
+      perrno_and(return -1, "open");
+    if (close(fd) == -1)
+      perrno_and(return -1, "close");
+  }
+
+  if (tfd != -1)
+  {
+    close(tfd);
+    unlink(tpath);
+  }
+  unlink(path);
+
+  return bench_iterations;
+}
+
+static struct
+{
+  const char *name;
+  int mode;
+}
+benchmarks[] =
+{
+  { "open/close untracked", Untracked },
+  { "open/close filtered", Filtered },
+  { "open/close tracked", Tracked },
+};
+
+static int do_bench(void)
+{
+  int i, nprocs;
+
+  for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i)
+  {
+    nprocs = 1;
+    while (1)
+    {
+      long ops;
+      double secs = bench_run_procs(nprocs, bench_close, (void *)benchmarks[i].mode, &ops);
+      if (secs < 0)
+        return 1;
+      bench_report(benchmarks[i].name, nprocs, ops, secs);
+
+      if (nprocs == bench_procs)
+        break;
+      /* Make sure the max number is always measured */
+      nprocs = nprocs * 2 < bench_procs ? nprocs * 2 : bench_procs;
+    }
+  }
+
+  return 0;
+}
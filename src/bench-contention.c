@@ -0,0 +1,151 @@
+/*
+ * Benchmark for contention on LIBCx shared data.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs 1, 2, 4, ... up to -p worker processes where each process hammers its
+ * own file (i.e. files are unrelated) with pwrite, fcntl lock/unlock and
+ * open/close calls. Ideally, the per-operation time should not grow with the
+ * number of processes (given enough CPUs) as there is no real contention
+ * between them.
+ */
+
+#include "bench-skeleton.c"
+
+enum { RecSize = 64, NumRecs = 16, TrackEvery = 64 };
+
+static long bench_pwrite(int idx, void *arg)
+{
+  char path[PATH_MAX];
+  char buf[RecSize];
+  int fd, i;
+
+  memset(buf, 'a' + idx % 26, sizeof(buf));
+
+  fd = open(bench_path(path, sizeof(path), "pwrite", idx), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    perrno_and(return -1, "open %s", path);
+
+  for (i = 0; i < bench_iterations; ++i)
+  {
+    if (pwrite(fd, buf, sizeof(buf), (i % NumRecs) * RecSize) != sizeof(buf))
+      perrno_and(return -1, "pwrite");
+  }
+
+  close(fd);
+  unlink(path);
+
+  return bench_iterations;
+}
+
+static long bench_fcntl(int idx, void *arg)
+{
+  char path[PATH_MAX];
+  struct flock fl;
+  int fd, i;
+
+  fd = open(bench_path(path, sizeof(path), "fcntl", idx), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    perrno_and(return -1, "open %s", path);
+
+  fl.l_whence = SEEK_SET;
+  fl.l_len = RecSize;
+
+  for (i = 0; i < bench_iterations; ++i)
+  {
+    fl.l_start = (i % NumRecs) * RecSize;
+    fl.l_type = F_WRLCK;
+    if (fcntl(fd, F_SETLK, &fl) == -1)
+      perrno_and(return -1, "fcntl(F_WRLCK)");
+    fl.l_type = F_UNLCK;
+    if (fcntl(fd, F_SETLK, &fl) == -1)
+      perrno_and(return -1, "fcntl(F_UNLCK)");
+  }
+
+  close(fd);
+  unlink(path);
+
+  return bench_iterations * 2;
+}
+
+static long bench_open_close(int idx, void *arg)
+{
+  char path[PATH_MAX];
+  char buf[RecSize];
+  int fd, i;
+
+  memset(buf, 'a' + idx % 26, sizeof(buf));
+
+  bench_path(path, sizeof(path), "open", idx);
+
+  for (i = 0; i < bench_iterations; ++i)
+  {
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+      perrno_and(return -1, "open %s", path);
+
+    /* Make LIBCx track the file every now and then */
+    if (i % TrackEvery == 0 && pwrite(fd, buf, sizeof(buf), 0) != sizeof(buf))
+      perrno_and(return -1, "pwrite");
+
+    if (close(fd) == -1)
+      perrno_and(return -1, "close");
+  }
+
+  unlink(path);
+
+  return bench_iterations;
+}
+
+static struct
+{
+  const char *name;
+  BENCH_WORKER *worker;
+}
+benchmarks[] =
+{
+  { "pwrite", bench_pwrite },
+  { "fcntl lock/unlock", bench_fcntl },
+  { "open/close", bench_open_close },
+};
+
+static int do_bench(void)
+{
+  int i, nprocs;
+
+  for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i)
+  {
+    nprocs = 1;
+    while (1)
+    {
+      long ops;
+      double secs = bench_run_procs(nprocs, benchmarks[i].worker, NULL, &ops);
+      if (secs < 0)
+        return 1;
+      bench_report(benchmarks[i].name, nprocs, ops, secs);
+
+      if (nprocs == bench_procs)
+        break;
+      /* Make sure the max number is always measured */
+      nprocs = nprocs * 2 < bench_procs ? nprocs * 2 : bench_procs;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * Benchmark for mmap exception handling on already committed pages.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Maps one shared file in the parent process and touches all its pages so
+ * that they get committed. Then 1, 2, 4, ... up to -p worker processes map
+ * the same file over and over again and read every page of it. Each first
+ * access to a page in a new mapping ends up in the LIBCx exception handler
+ * which only needs to find out that the page is already there. These lookups
+ * don't change LIBCx data and should not serialize the workers.
+ */
+
+#define BENCH_ITERATIONS 1000
+#include "bench-skeleton.c"
+
+#include <sys/mman.h>
+
+#define PAGE_SIZE 4096
+
+enum { NumPages = 64 };
+
+static long bench_fault(int idx, void *arg)
+{
+  const char *path = (const char *)arg;
+  volatile char *addr;
+  int fd, i, j;
+  long sum = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    perrno_and(return -1, "open %s", path);
+
+  for (i = 0; i < bench_iterations; ++i)
+  {
+    addr = mmap(NULL, NumPages * PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+      perrno_and(return -1, "mmap");
+
+    for (j = 0; j < NumPages; ++j)
+      sum += addr[j * PAGE_SIZE];
+
+    if (munmap((void *)addr, NumPages * PAGE_SIZE) == -1)
+      perrno_and(return -1, "munmap");
+  }
+
+  close(fd);
+
+  /* Pages are filled with 1 */
+  if (sum != (long)bench_iterations * NumPages)
+    perr_and(return -1, "sum is %ld", sum);
+
+  return (long)bench_iterations * NumPages;
+}
+
+static int do_bench(void)
+{
+  char path[PATH_MAX];
+  char buf[PAGE_SIZE];
+  char *addr;
+  int fd, i, nprocs, rc = 0;
+
+  fd = open(bench_path(path, sizeof(path), "fault", 0), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    perrno_and(return 1, "open %s", path);
+
+  memset(buf, 0, sizeof(buf));
+  buf[0] = 1;
+  for (i = 0; i < NumPages; ++i)
+  {
+    if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+      perrno_and(return 1, "write");
+  }
+
+  /* Keep the mapping during the run so that all pages stay committed */
+  addr = mmap(NULL, NumPages * PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED)
+    perrno_and(return 1, "mmap");
+
+  for (i = 0; i < NumPages; ++i)
+    rc += addr[i * PAGE_SIZE];
+  if (rc != NumPages)
+    perr_and(return 1, "sum is %d", rc);
+  rc = 0;
+
+  nprocs = 1;
+  while (1)
+  {
+    long ops;
+    double secs = bench_run_procs(nprocs, bench_fault, path, &ops);
+    if (secs < 0)
+    {
+      rc = 1;
+      break;
+    }
+    bench_report("fault on committed", nprocs, ops, secs);
+
+    if (nprocs == bench_procs)
+      break;
+    /* Make sure the max number is always measured */
+    nprocs = nprocs * 2 < bench_procs ? nprocs * 2 : bench_procs;
+  }
+
+  munmap(addr, NumPages * PAGE_SIZE);
+  close(fd);
+  unlink(path);
+
+  return rc;
+}
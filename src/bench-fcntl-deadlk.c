@@ -0,0 +1,200 @@
+/*
+ * Benchmark for fcntl deadlock detection with many blocked processes.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Builds a chain of -k helper processes (4 by default) where each helper
+ * holds one byte and waits in F_SETLKW for the byte of the next one, the last
+ * one waiting for a byte held by the benchmark itself. Then repeatedly asks
+ * for the byte of the first helper with F_SETLKW which closes a cycle of
+ * -k + 1 processes and must fail with EDEADLK. This is measured with no other
+ * blocked processes and then with 16, 32, ... up to -w (256 by default)
+ * processes blocked on an unrelated byte. The procs column of the report
+ * shows the number of these extra blocked processes. The time per operation
+ * should not depend on it. Note that cycles of more than 64 processes are not
+ * detected, so -k should be less than that.
+ */
+
+#define BENCH_OPTIONS "k:w:"
+#define BENCH_OPTION(opt, arg) bench_option(opt, arg)
+static int bench_option(int opt, const char *arg);
+
+#include "bench-skeleton.c"
+
+#define CHAIN_START 100 /* First byte of the helper chain */
+
+static int chain = 4;
+static int max_waiters = 256;
+static char path[PATH_MAX];
+static int fd;
+static int children; /* Number of started children */
+
+static int bench_option(int opt, const char *arg)
+{
+  switch (opt)
+  {
+    case 'k':
+      chain = atoi(arg);
+      return chain <= 0 ? -1 : 0;
+    case 'w':
+      max_waiters = atoi(arg);
+      return max_waiters < 0 ? -1 : 0;
+  }
+
+  return -1;
+}
+
+static int lock_byte(int cmd, short type, off_t offset)
+{
+  struct flock fl;
+
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = offset;
+  fl.l_len = 1;
+
+  return fcntl(fd, cmd, &fl);
+}
+
+/**
+ * Starts a child that locks byte @a own (unless it's -1), reports that to
+ * @a ready and then waits for byte @a wait until it gets it.
+ */
+static int start_child(int ready, off_t own, off_t wait)
+{
+  pid_t pid = fork();
+  if (pid == -1)
+    perrno_and(return -1, "fork");
+
+  if (pid == 0)
+  {
+    if (own != -1 && lock_byte(F_SETLK, F_WRLCK, own) == -1)
+      perrno_and(_exit(1), "fcntl(F_SETLK)");
+    if (write(ready, "", 1) != 1)
+      _exit(1);
+    while (lock_byte(F_SETLKW, F_WRLCK, wait) == -1)
+      if (errno != EINTR)
+        perrno_and(_exit(1), "fcntl(F_SETLKW)");
+    /* Exit releases the locks */
+    _exit(0);
+  }
+
+  ++children;
+
+  return 0;
+}
+
+/**
+ * Waits for @a n children to report to @a ready and gives them some time
+ * to block.
+ */
+static int wait_ready(int ready, int n)
+{
+  char c;
+
+  while (n-- > 0)
+    if (read(ready, &c, 1) != 1)
+      perr_and(return -1, "child failed to start");
+
+  DosSleep(500);
+
+  return 0;
+}
+
+static int do_bench(void)
+{
+  char name[32];
+  int ready[2];
+  int i, n, waiters = 0, rc = 0;
+
+  fd = open(bench_path(path, sizeof(path), "deadlk", 0), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    perrno_and(return 1, "open %s", path);
+
+  if (pipe(ready) == -1)
+    perrno_and(return 1, "pipe");
+
+  /* Byte 0 is for extra waiters and the last chain byte is for the last helper */
+  if (lock_byte(F_SETLK, F_WRLCK, 0) == -1 ||
+      lock_byte(F_SETLK, F_WRLCK, CHAIN_START + chain) == -1)
+    perrno_and(return 1, "fcntl(F_SETLK)");
+
+  for (i = 0; i < chain && !rc; ++i)
+    rc = start_child(ready[1], CHAIN_START + i, CHAIN_START + i + 1);
+  if (!rc)
+    rc = wait_ready(ready[0], chain);
+
+  snprintf(name, sizeof(name), "deadlk %d hops", chain + 1);
+
+  while (!rc)
+  {
+    double start, secs;
+
+    start = bench_time();
+    for (i = 0; i < bench_iterations; ++i)
+    {
+      if (lock_byte(F_SETLKW, F_WRLCK, CHAIN_START) != -1 || errno != EDEADLK)
+      {
+        perrno("fcntl(F_SETLKW) didn't fail with EDEADLK");
+        rc = 1;
+        break;
+      }
+    }
+    secs = bench_time() - start;
+    if (rc)
+      break;
+
+    bench_report(name, waiters, bench_iterations, secs);
+
+    if (waiters == max_waiters)
+      break;
+
+    /* Add more blocked processes, make sure the max number is always measured */
+    i = waiters ? waiters * 2 : 16;
+    if (i > max_waiters)
+      i = max_waiters;
+    n = children;
+    for (; waiters < i && !rc; ++waiters)
+      rc = start_child(ready[1], -1, 0);
+    if (!rc)
+      rc = wait_ready(ready[0], children - n);
+  }
+
+  /* Release everybody */
+  if (lock_byte(F_SETLK, F_UNLCK, 0) == -1 ||
+      lock_byte(F_SETLK, F_UNLCK, CHAIN_START + chain) == -1)
+    perrno_and(rc = 1, "fcntl(F_UNLCK)");
+
+  close(ready[0]);
+  close(ready[1]);
+
+  for (; children > 0; --children)
+  {
+    int status;
+    if (wait(&status) == -1)
+      perrno_and(return 1, "wait");
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      perr_and(rc = 1, "child failed with status 0x%x", status);
+  }
+
+  close(fd);
+  unlink(path);
+
+  return rc;
+}
@@ -0,0 +1,140 @@
+/*
+ * Benchmark for F_SETLKW latency with short critical sections.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs 2, 4, ... up to -p worker processes that repeatedly write lock the
+ * same byte of a file with F_SETLKW, hold the lock for -t microseconds (5 by
+ * default, busy-waiting like a tdb record update does) and unlock it. Prints
+ * the 50th and 99th percentiles and the maximum of the time it took to
+ * acquire the lock in addition to the usual throughput numbers.
+ */
+
+#define BENCH_OPTIONS "t:"
+#define BENCH_OPTION(opt, arg) bench_option(opt, arg)
+static int bench_option(int opt, const char *arg);
+
+#include "bench-skeleton.c"
+
+static double hold_us = 5;
+static char path[PATH_MAX];
+static float *samples; /* Acquire times in us, bench_iterations per worker */
+
+static int bench_option(int opt, const char *arg)
+{
+  if (opt == 't')
+  {
+    hold_us = atof(arg);
+    return hold_us < 0 ? -1 : 0;
+  }
+
+  return -1;
+}
+
+static long bench_acquire(int idx, void *arg)
+{
+  float *my = samples + (size_t)idx * bench_iterations;
+  struct flock fl;
+  double start, end;
+  int fd, i;
+
+  if (DosGetSharedMem(samples, PAG_READ | PAG_WRITE) != NO_ERROR)
+    perr_and(return -1, "DosGetSharedMem");
+
+  fd = open(path, O_RDWR);
+  if (fd == -1)
+    perrno_and(return -1, "open %s", path);
+
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 1;
+
+  for (i = 0; i < bench_iterations; ++i)
+  {
+    fl.l_type = F_WRLCK;
+    start = bench_time();
+    if (fcntl(fd, F_SETLKW, &fl) == -1)
+      perrno_and(return -1, "fcntl(F_WRLCK)");
+    end = bench_time();
+    my[i] = (float)((end - start) * 1000000.0);
+
+    /* The critical section */
+    end += hold_us / 1000000.0;
+    while (bench_time() < end);
+
+    fl.l_type = F_UNLCK;
+    if (fcntl(fd, F_SETLK, &fl) == -1)
+      perrno_and(return -1, "fcntl(F_UNLCK)");
+  }
+
+  close(fd);
+
+  return bench_iterations;
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+  float fa = *(const float *)a, fb = *(const float *)b;
+  return fa < fb ? -1 : fa > fb;
+}
+
+static int do_bench(void)
+{
+  char name[32];
+  size_t size = (size_t)bench_procs * bench_iterations;
+  int fd, nprocs = bench_procs < 2 ? 1 : 2, rc = 0;
+
+  if (DosAllocSharedMem((PPVOID)&samples, NULL, size * sizeof(*samples),
+                        PAG_READ | PAG_WRITE | PAG_COMMIT | OBJ_GETTABLE) != NO_ERROR)
+    perr_and(return 1, "DosAllocSharedMem");
+
+  fd = open(bench_path(path, sizeof(path), "latency", 0), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    perrno_and(return 1, "open %s", path);
+  close(fd);
+
+  snprintf(name, sizeof(name), "hold %g us", hold_us);
+
+  while (1)
+  {
+    long ops;
+    size_t n = (size_t)nprocs * bench_iterations;
+    double secs = bench_run_procs(nprocs, bench_acquire, NULL, &ops);
+    if (secs < 0)
+    {
+      rc = 1;
+      break;
+    }
+    bench_report(name, nprocs, ops, secs);
+
+    qsort(samples, n, sizeof(*samples), compare_floats);
+    printf("%-24s procs %3d  acquire p50 %9.2f us  p99 %9.2f us  max %9.2f us\n",
+           name, nprocs, samples[n / 2], samples[n * 99 / 100], samples[n - 1]);
+
+    if (nprocs == bench_procs)
+      break;
+    /* Make sure the max number is always measured */
+    nprocs = nprocs * 2 < bench_procs ? nprocs * 2 : bench_procs;
+  }
+
+  unlink(path);
+  DosFreeMem(samples);
+
+  return rc;
+}
@@ -0,0 +1,101 @@
+/*
+ * Benchmark for fcntl read locks shared by many processes.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs 1, 2, 4, ... up to -p worker processes (try -p 256) that read lock
+ * the same file as a whole (like database readers do) and then repeatedly
+ * unlock and relock a random record. Each unlock splits the shared read
+ * region and removes one owner from the middle part and each relock adds it
+ * back and joins the parts, so the cost of these operations depends on how
+ * owner sets are stored, copied and compared.
+ */
+
+#include "bench-skeleton.c"
+
+enum { RecSize = 64, NumRecs = 1024 };
+
+static char path[PATH_MAX];
+
+static long bench_readers(int idx, void *arg)
+{
+  struct flock fl;
+  int fd, i;
+
+  fd = open(path, O_RDWR);
+  if (fd == -1)
+    perrno_and(return -1, "open %s", path);
+
+  fl.l_type = F_RDLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = RecSize * NumRecs;
+  if (fcntl(fd, F_SETLKW, &fl) == -1)
+    perrno_and(return -1, "fcntl(F_RDLCK)");
+
+  srand(getpid());
+
+  fl.l_len = RecSize;
+
+  for (i = 0; i < bench_iterations; ++i)
+  {
+    fl.l_start = (rand() % NumRecs) * RecSize;
+    fl.l_type = F_UNLCK;
+    if (fcntl(fd, F_SETLK, &fl) == -1)
+      perrno_and(return -1, "fcntl(F_UNLCK)");
+    fl.l_type = F_RDLCK;
+    if (fcntl(fd, F_SETLK, &fl) == -1)
+      perrno_and(return -1, "fcntl(F_RDLCK)");
+  }
+
+  close(fd);
+
+  return bench_iterations * 2;
+}
+
+static int do_bench(void)
+{
+  int fd, nprocs = 1, rc = 0;
+
+  fd = open(bench_path(path, sizeof(path), "readers", 0), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    perrno_and(return 1, "open %s", path);
+  close(fd);
+
+  while (1)
+  {
+    long ops;
+    double secs = bench_run_procs(nprocs, bench_readers, NULL, &ops);
+    if (secs < 0)
+    {
+      rc = 1;
+      break;
+    }
+    bench_report("read unlock/relock", nprocs, ops, secs);
+
+    if (nprocs == bench_procs)
+      break;
+    /* Make sure the max number is always measured */
+    nprocs = nprocs * 2 < bench_procs ? nprocs * 2 : bench_procs;
+  }
+
+  unlink(path);
+
+  return rc;
+}
@@ -0,0 +1,153 @@
+/*
+ * Benchmark for fcntl locking with many lock regions.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The parent process splits a file into 10, 100, ... up to 100000 lock
+ * regions by write locking every 4th byte and then runs one worker that
+ * write locks and unlocks a random byte in the middle of a free gap (which
+ * splits the gap into three regions and joins them back) and another one
+ * that queries a random offset with F_GETLK (which finds the parent lock).
+ * Ideally, the per-operation time should grow no more than logarithmically
+ * with the number of regions. The -p option is ignored.
+ */
+
+#include "bench-skeleton.c"
+
+enum { Stride = 4, MaxRegions = 100000 };
+
+static char path[PATH_MAX];
+static int num_locks;
+
+static long bench_setlk(int idx, void *arg)
+{
+  struct flock fl;
+  int fd, i;
+
+  fd = open(path, O_RDWR);
+  if (fd == -1)
+    perrno_and(return -1, "open %s", path);
+
+  fl.l_whence = SEEK_SET;
+  fl.l_len = 1;
+
+  srand(getpid());
+
+  for (i = 0; i < bench_iterations; ++i)
+  {
+    fl.l_start = (off_t)(rand() % num_locks) * Stride + Stride / 2;
+    fl.l_type = F_WRLCK;
+    if (fcntl(fd, F_SETLK, &fl) == -1)
+      perrno_and(return -1, "fcntl(F_WRLCK)");
+    fl.l_type = F_UNLCK;
+    if (fcntl(fd, F_SETLK, &fl) == -1)
+      perrno_and(return -1, "fcntl(F_UNLCK)");
+  }
+
+  close(fd);
+
+  return bench_iterations * 2;
+}
+
+static long bench_getlk(int idx, void *arg)
+{
+  struct flock fl;
+  int fd, i;
+
+  fd = open(path, O_RDWR);
+  if (fd == -1)
+    perrno_and(return -1, "open %s", path);
+
+  srand(getpid());
+
+  for (i = 0; i < bench_iterations; ++i)
+  {
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (off_t)(rand() % num_locks) * Stride;
+    fl.l_len = 1;
+    if (fcntl(fd, F_GETLK, &fl) == -1)
+      perrno_and(return -1, "fcntl(F_GETLK)");
+    if (fl.l_type != F_WRLCK || fl.l_pid != getppid())
+      perr_and(return -1, "fcntl(F_GETLK) returned type %d pid %d",
+               fl.l_type, fl.l_pid);
+  }
+
+  close(fd);
+
+  return bench_iterations;
+}
+
+static int do_bench(void)
+{
+  struct flock fl;
+  int fd, regions, rc = 0;
+
+  fd = open(bench_path(path, sizeof(path), "regions", 0), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    perrno_and(return 1, "open %s", path);
+
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_len = 1;
+
+  for (regions = 10; regions <= MaxRegions && !rc; regions *= 10)
+  {
+    int added = num_locks;
+    long ops;
+    double start, secs;
+
+    /* Each lock adds a locked region and a free gap after it */
+    start = bench_time();
+    for (; num_locks < regions / 2; ++num_locks)
+    {
+      fl.l_start = (off_t)num_locks * Stride;
+      if (fcntl(fd, F_SETLK, &fl) == -1)
+      {
+        perrno("fcntl(F_WRLCK)");
+        rc = 1;
+        break;
+      }
+    }
+    if (rc)
+      break;
+    secs = bench_time() - start;
+    added = num_locks - added;
+
+    printf("%d regions:\n", regions);
+    bench_report("add regions", 1, added, secs);
+
+    secs = bench_run_procs(1, bench_setlk, NULL, &ops);
+    if (secs < 0)
+      rc = 1;
+    else
+      bench_report("F_SETLK lock/unlock", 1, ops, secs);
+
+    secs = bench_run_procs(1, bench_getlk, NULL, &ops);
+    if (secs < 0)
+      rc = 1;
+    else
+      bench_report("F_GETLK", 1, ops, secs);
+  }
+
+  close(fd);
+  unlink(path);
+
+  return rc;
+}
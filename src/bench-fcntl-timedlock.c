@@ -0,0 +1,225 @@
+/*
+ * Benchmark for libcx_fcntl_timedlock.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs 2, 4, ... up to -p worker processes that repeatedly write lock the
+ * same byte of a file, hold the lock for -t microseconds (5 by default) and
+ * unlock it, each time with one of these methods:
+ *
+ *   setlkw     F_SETLKW.
+ *   timedlock  libcx_fcntl_timedlock with a timeout that never expires.
+ *   poll       F_SETLK retried after DosSleep(1) on EAGAIN, which is what
+ *              applications had to do to get a timed wait before.
+ *
+ * Prints the 50th and 99th percentiles and the maximum of the acquire time
+ * for each method. Then lets -p workers call libcx_fcntl_timedlock with a
+ * timeout of -w milliseconds (20 by default) -c times (50 by default) each
+ * on a byte that stays locked and prints the same statistics for how much
+ * later than requested the calls returned ETIMEDOUT.
+ */
+
+#define BENCH_OPTIONS "t:w:c:"
+#define BENCH_OPTION(opt, arg) bench_option(opt, arg)
+static int bench_option(int opt, const char *arg);
+
+#include "bench-skeleton.c"
+
+#include "fcntl/libcx/fcntl.h"
+
+enum { Setlkw, Timedlock, Poll, Timeout };
+
+static const char *method_names[] = { "setlkw", "timedlock", "poll" };
+
+static double hold_us = 5;
+static int timeout_ms = 20;
+static int timeout_count = 50;
+static char path[PATH_MAX];
+static float *samples; /* Times in us, one per iteration of each worker */
+
+static int bench_option(int opt, const char *arg)
+{
+  switch (opt)
+  {
+    case 't':
+      hold_us = atof(arg);
+      return hold_us < 0 ? -1 : 0;
+    case 'w':
+      timeout_ms = atoi(arg);
+      return timeout_ms < 0 ? -1 : 0;
+    case 'c':
+      timeout_count = atoi(arg);
+      return timeout_count <= 0 ? -1 : 0;
+  }
+
+  return -1;
+}
+
+static int acquire(int fd, int method, struct flock *fl)
+{
+  switch (method)
+  {
+    case Setlkw:
+      return fcntl(fd, F_SETLKW, fl);
+    case Timedlock:
+      return libcx_fcntl_timedlock(fd, F_SETLKW, fl, 60000);
+    case Poll:
+      while (fcntl(fd, F_SETLK, fl) == -1)
+      {
+        if (errno != EAGAIN && errno != EACCES)
+          return -1;
+        DosSleep(1);
+      }
+      return 0;
+  }
+
+  return -1;
+}
+
+static long bench_acquire(int idx, void *arg)
+{
+  int method = (int)arg;
+  int iterations = method == Timeout ? timeout_count : bench_iterations;
+  float *my = samples + (size_t)idx * iterations;
+  struct flock fl;
+  double start, end;
+  int fd, i;
+
+  if (DosGetSharedMem(samples, PAG_READ | PAG_WRITE) != NO_ERROR)
+    perr_and(return -1, "DosGetSharedMem");
+
+  fd = open(path, O_RDWR);
+  if (fd == -1)
+    perrno_and(return -1, "open %s", path);
+
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 1;
+
+  for (i = 0; i < iterations; ++i)
+  {
+    fl.l_type = F_WRLCK;
+
+    if (method == Timeout)
+    {
+      start = bench_time();
+      if (libcx_fcntl_timedlock(fd, F_SETLKW, &fl, timeout_ms) != -1 ||
+          errno != ETIMEDOUT)
+        perrno_and(return -1, "libcx_fcntl_timedlock didn't time out");
+      my[i] = (float)((bench_time() - start) * 1000000.0 - timeout_ms * 1000.0);
+      continue;
+    }
+
+    start = bench_time();
+    if (acquire(fd, method, &fl) == -1)
+      perrno_and(return -1, "%s", method_names[method]);
+    end = bench_time();
+    my[i] = (float)((end - start) * 1000000.0);
+
+    /* The critical section */
+    end += hold_us / 1000000.0;
+    while (bench_time() < end);
+
+    fl.l_type = F_UNLCK;
+    if (fcntl(fd, F_SETLK, &fl) == -1)
+      perrno_and(return -1, "fcntl(F_UNLCK)");
+  }
+
+  close(fd);
+
+  return iterations;
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+  float fa = *(const float *)a, fb = *(const float *)b;
+  return fa < fb ? -1 : fa > fb;
+}
+
+static int run(const char *name, int nprocs, int method)
+{
+  long ops;
+  size_t n = (size_t)nprocs * (method == Timeout ? timeout_count : bench_iterations);
+  double secs = bench_run_procs(nprocs, bench_acquire, (void *)method, &ops);
+  if (secs < 0)
+    return 1;
+  bench_report(name, nprocs, ops, secs);
+
+  qsort(samples, n, sizeof(*samples), compare_floats);
+  printf("%-24s procs %3d  %s p50 %9.2f us  p99 %9.2f us  max %9.2f us\n",
+         name, nprocs, method == Timeout ? "overshoot" : "acquire",
+         samples[n / 2], samples[n * 99 / 100], samples[n - 1]);
+  fflush(stdout);
+
+  return 0;
+}
+
+static int do_bench(void)
+{
+  char name[32];
+  int per_proc = bench_iterations > timeout_count ? bench_iterations : timeout_count;
+  size_t size = (size_t)bench_procs * per_proc;
+  struct flock fl;
+  int fd, method, nprocs, rc = 0;
+
+  if (DosAllocSharedMem((PPVOID)&samples, NULL, size * sizeof(*samples),
+                        PAG_READ | PAG_WRITE | PAG_COMMIT | OBJ_GETTABLE) != NO_ERROR)
+    perr_and(return 1, "DosAllocSharedMem");
+
+  fd = open(bench_path(path, sizeof(path), "timedlock", 0), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    perrno_and(return 1, "open %s", path);
+
+  for (method = Setlkw; method <= Poll && !rc; ++method)
+  {
+    snprintf(name, sizeof(name), "%s %g us", method_names[method], hold_us);
+
+    nprocs = bench_procs < 2 ? 1 : 2;
+    while (1)
+    {
+      rc = run(name, nprocs, method);
+      if (rc || nprocs == bench_procs)
+        break;
+      /* Make sure the max number is always measured */
+      nprocs = nprocs * 2 < bench_procs ? nprocs * 2 : bench_procs;
+    }
+  }
+
+  if (!rc)
+  {
+    /* Hold the lock in this process so that the workers always time out */
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 1;
+    if (fcntl(fd, F_SETLK, &fl) == -1)
+      perrno_and(rc = 1, "fcntl(F_SETLK)");
+    else
+    {
+      snprintf(name, sizeof(name), "timeout %d ms", timeout_ms);
+      rc = run(name, bench_procs, Timeout);
+    }
+  }
+
+  close(fd);
+  unlink(path);
+  DosFreeMem(samples);
+
+  return rc;
+}
@@ -0,0 +1,231 @@
+/*
+ * Benchmark for F_SETLKW wakeups with many blocked processes.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs pairs of worker processes (-p of them in total) where both processes
+ * of a pair pass a write lock on their own file back and forth with F_SETLKW
+ * while 0, 1/4 and all of -w idle processes (64 by default) are blocked in
+ * F_SETLKW on regions of other files held by the parent. Ideally, the
+ * per-operation time should not depend on the number of idle waiters as
+ * unlocks should only wake up processes waiting on the released regions.
+ */
+
+#define BENCH_OPTIONS "w:"
+#define BENCH_OPTION(opt, arg) bench_option(opt, arg)
+static int bench_option(int opt, const char *arg);
+
+#include "bench-skeleton.c"
+
+enum { IdleFiles = 16 };
+
+static int max_waiters = 64;
+
+/* Note: bench_path() includes the PID so children use names from here */
+static char idle_paths[IdleFiles][PATH_MAX];
+static char (*pair_paths)[PATH_MAX];
+
+static int bench_option(int opt, const char *arg)
+{
+  if (opt == 'w')
+  {
+    max_waiters = atoi(arg);
+    return max_waiters < 0 ? -1 : 0;
+  }
+
+  return -1;
+}
+
+static long bench_pingpong(int idx, void *arg)
+{
+  const char *path = pair_paths[idx / 2];
+  struct flock fl;
+  int fd, i;
+
+  /* Both processes of a pair use the same file */
+  fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1)
+    perrno_and(return -1, "open %s", path);
+
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 1;
+
+  for (i = 0; i < bench_iterations; ++i)
+  {
+    fl.l_type = F_WRLCK;
+    if (fcntl(fd, F_SETLKW, &fl) == -1)
+      perrno_and(return -1, "fcntl(F_WRLCK)");
+    fl.l_type = F_UNLCK;
+    if (fcntl(fd, F_SETLKW, &fl) == -1)
+      perrno_and(return -1, "fcntl(F_UNLCK)");
+  }
+
+  close(fd);
+
+  return bench_iterations;
+}
+
+/**
+ * Starts @a n idle processes blocked on files held by the parent. Each
+ * process writes a byte to @a ready right before blocking and exits once the
+ * parent releases its files. Returns the number of started processes.
+ */
+static int start_waiters(int n, int ready)
+{
+  struct flock fl;
+  int i, fd;
+
+  for (i = 0; i < n; ++i)
+  {
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+      perrno("fork");
+      break;
+    }
+
+    if (pid == 0)
+    {
+      fd = open(idle_paths[i % IdleFiles], O_RDWR);
+      if (fd == -1)
+        perrno_and(_exit(1), "open %s", idle_paths[i % IdleFiles]);
+
+      fl.l_type = F_WRLCK;
+      fl.l_whence = SEEK_SET;
+      fl.l_start = i;
+      fl.l_len = 1;
+
+      if (write(ready, "", 1) != 1)
+        _exit(1);
+      if (fcntl(fd, F_SETLKW, &fl) == -1)
+        perrno_and(_exit(1), "fcntl(F_SETLKW)");
+
+      close(fd);
+      _exit(0);
+    }
+  }
+
+  return i;
+}
+
+static int do_bench(void)
+{
+  char name[32];
+  struct flock fl;
+  int fds[IdleFiles];
+  int counts[3];
+  int ready[2];
+  int nprocs = bench_procs < 2 ? 2 : bench_procs & ~1;
+  int i, j, started, rc = 0;
+
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 0;
+
+  pair_paths = malloc(nprocs / 2 * sizeof(*pair_paths));
+  if (!pair_paths)
+    perr_and(return 1, "out of memory");
+  for (i = 0; i < nprocs / 2; ++i)
+    bench_path(pair_paths[i], sizeof(pair_paths[i]), "pingpong", i);
+
+  for (i = 0; i < IdleFiles; ++i)
+  {
+    bench_path(idle_paths[i], sizeof(idle_paths[i]), "idle", i);
+    fds[i] = open(idle_paths[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fds[i] == -1)
+      perrno_and(return 1, "open %s", idle_paths[i]);
+  }
+
+  counts[0] = 0;
+  counts[1] = max_waiters / 4;
+  counts[2] = max_waiters;
+
+  for (j = 0; j < 3 && !rc; ++j)
+  {
+    long ops;
+    double secs;
+    char c;
+
+    if (j && counts[j] == counts[j - 1])
+      continue;
+
+    /* Hold the idle files */
+    for (i = 0; i < IdleFiles; ++i)
+    {
+      fl.l_type = F_WRLCK;
+      if (fcntl(fds[i], F_SETLK, &fl) == -1)
+        perrno_and(return 1, "fcntl(F_WRLCK)");
+    }
+
+    if (pipe(ready) == -1)
+      perrno_and(return 1, "pipe");
+
+    started = start_waiters(counts[j], ready[1]);
+    if (started < counts[j])
+      rc = 1;
+
+    /* Wait for all waiters to get ready and give them time to block */
+    for (i = 0; i < started && !rc; ++i)
+      if (read(ready[0], &c, 1) != 1)
+        perrno_and(rc = 1, "read");
+    close(ready[0]);
+    close(ready[1]);
+    DosSleep(200);
+
+    if (!rc)
+    {
+      snprintf(name, sizeof(name), "%d idle waiters", counts[j]);
+      secs = bench_run_procs(nprocs, bench_pingpong, NULL, &ops);
+      if (secs < 0)
+        rc = 1;
+      else
+        bench_report(name, nprocs, ops, secs);
+    }
+
+    /* Release the idle files to let the waiters finish */
+    for (i = 0; i < IdleFiles; ++i)
+    {
+      fl.l_type = F_UNLCK;
+      if (fcntl(fds[i], F_SETLK, &fl) == -1)
+        perrno_and(return 1, "fcntl(F_UNLCK)");
+    }
+
+    for (i = 0; i < started; ++i)
+    {
+      int status;
+      if (wait(&status) == -1)
+        perrno_and(return 1, "wait");
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+        perr_and(rc = 1, "waiter failed with status 0x%x", status);
+    }
+  }
+
+  for (i = 0; i < IdleFiles; ++i)
+  {
+    close(fds[i]);
+    unlink(idle_paths[i]);
+  }
+  for (i = 0; i < nprocs / 2; ++i)
+    unlink(pair_paths[i]);
+  free(pair_paths);
+
+  return rc;
+}
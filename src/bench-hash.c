@@ -0,0 +1,119 @@
+/*
+ * Benchmark for the path hash function.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Hashes every path of the corpus from hash-corpus.c -n times with the RS
+ * hash LIBCx used before and with hash_string() (both one-shot and
+ * incremental by path components) in one process. The hash is CPU bound so
+ * more processes would only measure the number of CPUs. Also prints chain
+ * statistics of both hashes at FILE_DESC_LOCKS buckets and after growth.
+ */
+
+#define BENCH_ITERATIONS 100
+#include "bench-skeleton.c"
+
+#include "hash-corpus.c"
+
+#include "shared.h" /* FILE_DESC_LOCKS */
+
+static char **paths;
+static size_t num_paths;
+static volatile size_t sink;
+
+static size_t hash_by_components(const char *str)
+{
+  HashState st;
+  const char *p;
+
+  hash_init(&st);
+  while ((p = strchr(str, '\\')))
+  {
+    hash_update(&st, str, p - str + 1);
+    str = p + 1;
+  }
+  hash_update(&st, str, strlen(str));
+
+  return hash_final(&st);
+}
+
+static long bench_hash(int idx, void *arg)
+{
+  HASH_FN *fn = (HASH_FN *)arg;
+  size_t sum = 0, i;
+  int n;
+
+  for (n = 0; n < bench_iterations; ++n)
+    for (i = 0; i < num_paths; ++i)
+      sum += fn(paths[i]);
+
+  sink = sum;
+
+  return (long)bench_iterations * num_paths;
+}
+
+static struct
+{
+  const char *name;
+  HASH_FN *fn;
+}
+hashes[] =
+{
+  { "RS hash", rs_hash_string },
+  { "hash_string", hash_string },
+  { "hash_update by components", hash_by_components },
+};
+
+static int do_bench(void)
+{
+  static const size_t sizes[] = { FILE_DESC_LOCKS, FILE_DESC_LOCKS * 8 };
+  int i, j;
+
+  paths = make_corpus(&num_paths);
+  if (!paths)
+    perr_and(return 1, "out of memory");
+
+  for (i = 0; i < sizeof(hashes) / sizeof(hashes[0]); ++i)
+  {
+    long ops;
+    double secs = bench_run_procs(1, bench_hash, hashes[i].fn, &ops);
+    if (secs < 0)
+      return 1;
+    bench_report(hashes[i].name, 1, ops, secs);
+  }
+
+  printf("\n%u paths, chain statistics (max, empty buckets, avg probes):\n",
+         (unsigned)num_paths);
+  for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); ++j)
+  {
+    for (i = 0; i < 2; ++i)
+    {
+      ChainStats stats;
+      if (chain_stats(paths, num_paths, sizes[j], hashes[i].fn, &stats))
+        perr_and(return 1, "out of memory");
+      printf("%5u buckets, %-12s %4u %5u %8.2f\n", (unsigned)sizes[j],
+             hashes[i].name, (unsigned)stats.max, (unsigned)stats.empty,
+             stats.probes);
+    }
+  }
+
+  free(paths);
+
+  return 0;
+}
@@ -0,0 +1,233 @@
+/*
+ * Skeleton for benchmark programs.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Include this file at the beginning of the benchmark source and define
+ * the do_bench() function that performs the actual measurements using
+ * bench_run_procs() and bench_report(). Common command line options are
+ * parsed here:
+ *
+ *   -p N  Maximum number of concurrent worker processes (default is 8).
+ *   -n N  Number of iterations per worker (default is set by BENCH_ITERATIONS).
+ *   -d D  Directory for temporary files (default is the current directory).
+ *
+ * Any other options are passed to the BENCH_OPTION handler if it's defined.
+ */
+
+#define INCL_BASE
+#include <os2.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define perr(msg, ...) printf("ERROR: " msg "\n" , ##__VA_ARGS__)
+#define perrno(msg, ...) printf("ERROR: " msg ": %s (%d)\n", ##__VA_ARGS__, strerror (errno), errno)
+
+#define perr_and(stmt, msg, ...) do { perr(msg, ##__VA_ARGS__); stmt; } while (0)
+#define perrno_and(stmt, msg, ...) do { perrno(msg, ##__VA_ARGS__); stmt; } while (0)
+
+#ifndef BENCH_ITERATIONS
+#define BENCH_ITERATIONS 10000
+#endif
+
+#ifndef BENCH_OPTIONS
+#define BENCH_OPTIONS ""
+#endif
+
+/** Maximum number of concurrent worker processes (-p). */
+static int bench_procs = 8;
+/** Number of iterations per worker (-n). */
+static int bench_iterations = BENCH_ITERATIONS;
+/** Directory for temporary files (-d). */
+static const char *bench_dir = ".";
+
+/**
+ * Worker function run by bench_run_procs() in each child process. @a idx is
+ * the worker index (starting from 0). Returns the number of performed
+ * operations or -1 on failure.
+ */
+typedef long BENCH_WORKER(int idx, void *arg);
+
+static int do_bench(void);
+
+/**
+ * Returns the current high resolution time in seconds.
+ */
+static double bench_time(void)
+{
+  static ULONG freq = 0;
+  QWORD qw;
+
+  if (!freq)
+    DosTmrQueryFreq(&freq);
+  DosTmrQueryTime(&qw);
+
+  return ((double)qw.ulHi * 4294967296.0 + qw.ulLo) / freq;
+}
+
+/**
+ * Builds a path to a temporary file named @a name in the benchmark directory.
+ */
+static char *bench_path(char *buf, size_t size, const char *name, int idx)
+{
+  snprintf(buf, size, "%s/bench-%d-%s-%d.tmp", bench_dir, getpid(), name, idx);
+  return buf;
+}
+
+/**
+ * Runs @a worker in @a nprocs child processes at once and waits for all of
+ * them to finish. The workers are released simultaneously after all children
+ * are started. The total number of operations is returned in @a ops.
+ * Returns the wall time in seconds or -1 on failure.
+ */
+static double bench_run_procs(int nprocs, BENCH_WORKER *worker, void *arg, long *ops)
+{
+  int go[2], res[2];
+  int i, rc = 0;
+  double start;
+
+  *ops = 0;
+
+  if (pipe(go) == -1 || pipe(res) == -1)
+  {
+    perrno("pipe");
+    return -1;
+  }
+
+  for (i = 0; i < nprocs; ++i)
+  {
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+      perrno("fork");
+      rc = -1;
+      break;
+    }
+
+    if (pid == 0)
+    {
+      char c;
+      long n;
+
+      close(go[1]);
+      close(res[0]);
+
+      /* Wait for the go signal (EOF when the parent closes its end) */
+      while (read(go[0], &c, 1) == -1 && errno == EINTR);
+
+      n = worker(i, arg);
+      if (write(res[1], &n, sizeof(n)) != sizeof(n))
+        _exit(1);
+      _exit(n < 0);
+    }
+  }
+
+  close(go[0]);
+  close(res[1]);
+
+  start = bench_time();
+
+  /* Release all workers */
+  close(go[1]);
+
+  for (; i > 0; --i)
+  {
+    int status;
+    if (wait(&status) == -1)
+    {
+      perrno("wait");
+      rc = -1;
+      break;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+    {
+      perr("worker failed with status 0x%x", status);
+      rc = -1;
+    }
+  }
+
+  double elapsed = bench_time() - start;
+
+  {
+    long n;
+    while (read(res[0], &n, sizeof(n)) == sizeof(n))
+      if (n > 0)
+        *ops += n;
+  }
+
+  close(res[0]);
+
+  return rc ? -1 : elapsed;
+}
+
+/**
+ * Prints a single result line in a uniform format.
+ */
+static void bench_report(const char *name, int nprocs, long ops, double secs)
+{
+  printf("%-24s procs %3d  ops %10ld  time %9.3f s  rate %12.0f ops/s  %9.3f us/op\n",
+         name, nprocs, ops, secs, secs > 0 ? ops / secs : 0.0,
+         ops > 0 ? secs * 1000000.0 / ops : 0.0);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:n:d:" BENCH_OPTIONS)) != -1)
+  {
+    switch (opt)
+    {
+      case 'p':
+        bench_procs = atoi(optarg);
+        break;
+      case 'n':
+        bench_iterations = atoi(optarg);
+        break;
+      case 'd':
+        bench_dir = optarg;
+        break;
+      default:
+#ifdef BENCH_OPTION
+        if (BENCH_OPTION(opt, optarg) == 0)
+          break;
+#endif
+        fprintf(stderr, "Usage: %s [-p procs] [-n iterations] [-d dir]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  if (bench_procs < 1 || bench_iterations < 1)
+  {
+    perr("invalid arguments");
+    return 2;
+  }
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  return do_bench();
+}
@@ -0,0 +1,187 @@
+/*
+ * Benchmark for the cost of disabled LIBCx tracepoints.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures pread and mmap page fault paths (both full of tracepoints) in 1
+ * and -p worker processes with all trace groups disabled at runtime. Compare
+ * the numbers with a LIBCx build compiled with TRACE_DISABLED to see the cost
+ * of disabled tracepoints. With -t, the same is also measured with the pwrite
+ * and mmap trace groups enabled (best combined with LIBCX_TRACE_RING).
+ */
+
+#define BENCH_OPTIONS "t"
+#define BENCH_OPTION(opt, arg) bench_option(opt, arg)
+static int bench_option(int opt, const char *arg);
+
+#include "bench-skeleton.c"
+
+#include <sys/mman.h>
+
+#define PAGE_SIZE 4096
+
+enum { RecSize = 64, NumRecs = 16, NumPages = 16 };
+
+int libcx_trace_set_groups(const char *spec);
+
+static int trace_on = 0;
+
+static int bench_option(int opt, const char *arg)
+{
+  if (opt == 't')
+  {
+    trace_on = 1;
+    return 0;
+  }
+
+  return -1;
+}
+
+static long bench_pread(int idx, void *arg)
+{
+  char path[PATH_MAX];
+  char buf[RecSize];
+  int fd, i;
+
+  memset(buf, 'a' + idx % 26, sizeof(buf));
+
+  fd = open(bench_path(path, sizeof(path), "pread", idx), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    perrno_and(return -1, "open %s", path);
+
+  for (i = 0; i < NumRecs; ++i)
+  {
+    if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+      perrno_and(return -1, "write");
+  }
+
+  for (i = 0; i < bench_iterations; ++i)
+  {
+    if (pread(fd, buf, sizeof(buf), (i % NumRecs) * RecSize) != sizeof(buf))
+      perrno_and(return -1, "pread");
+  }
+
+  close(fd);
+  unlink(path);
+
+  return bench_iterations;
+}
+
+static long bench_mmap_fault(int idx, void *arg)
+{
+  char path[PATH_MAX];
+  char buf[PAGE_SIZE];
+  volatile char *addr;
+  int fd, i, j;
+
+  memset(buf, 'a' + idx % 26, sizeof(buf));
+
+  fd = open(bench_path(path, sizeof(path), "fault", idx), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    perrno_and(return -1, "open %s", path);
+
+  for (i = 0; i < NumPages; ++i)
+  {
+    if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+      perrno_and(return -1, "write");
+  }
+
+  /* Each iteration faults in all pages of a new mapping */
+  for (i = 0; i < bench_iterations / NumPages; ++i)
+  {
+    addr = mmap(NULL, NumPages * PAGE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+      perrno_and(return -1, "mmap");
+
+    for (j = 0; j < NumPages; ++j)
+    {
+      if (addr[j * PAGE_SIZE] != buf[0])
+        perr_and(return -1, "page %d has wrong contents", j);
+    }
+
+    if (munmap((void *)addr, NumPages * PAGE_SIZE) == -1)
+      perrno_and(return -1, "munmap");
+  }
+
+  close(fd);
+  unlink(path);
+
+  return (long)i * NumPages;
+}
+
+static struct
+{
+  const char *name;
+  BENCH_WORKER *worker;
+}
+benchmarks[] =
+{
+  { "pread", bench_pread },
+  { "mmap fault", bench_mmap_fault },
+};
+
+static int run_benchmarks(const char *mode)
+{
+  char name[64];
+  int i, nprocs;
+
+  for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i)
+  {
+    snprintf(name, sizeof(name), "%s (%s)", benchmarks[i].name, mode);
+
+    nprocs = 1;
+    while (1)
+    {
+      long ops;
+      double secs = bench_run_procs(nprocs, benchmarks[i].worker, NULL, &ops);
+      if (secs < 0)
+        return 1;
+      bench_report(name, nprocs, ops, secs);
+
+      if (nprocs == bench_procs)
+        break;
+      nprocs = bench_procs;
+    }
+  }
+
+  return 0;
+}
+
+static int do_bench(void)
+{
+  /* Workers inherit trace group settings from us */
+  if (libcx_trace_set_groups("-all") == -1)
+    perrno_and(return 1, "libcx_trace_set_groups");
+
+  if (run_benchmarks("trace off"))
+    return 1;
+
+  if (trace_on)
+  {
+    if (libcx_trace_set_groups("+pwrite+mmap") == -1)
+      perrno_and(return 1, "libcx_trace_set_groups");
+
+    if (run_benchmarks("trace on"))
+      return 1;
+
+    libcx_trace_set_groups("-all");
+  }
+
+  return 0;
+}
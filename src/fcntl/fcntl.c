@@ -36,27 +36,84 @@
 #include <limits.h>
 #include <io.h>
 #include <emx/io.h>
+#include <sys/file.h>
 
 #undef fcntl
 
 #define TRACE_GROUP TRACE_GROUP_FCNTL
 #include "../shared.h"
+#include "../hash.h"
+
+#include "libcx/fcntl.h"
 
 #define PID_LIST_MIN_SIZE 8
 
+/* Max number of owner lists lock_reserve may reserve for one series */
+#define LOCK_RESERVE_MAX_PIDS 1024
+
+/*
+ * Internal fcntl_locking commands for whole-file flock() locks (non-blocking
+ * and blocking).
+ */
+enum
+{
+  F_FLOCK = 0x10000,
+  F_FLOCKW,
+};
+
+/**
+ * Owners of an 'r' lock region (always more than one). PIDs are sorted in
+ * ascending order so that lookups are O(log n) and equal sets are equal
+ * arrays. A list is shared by all regions with the same owners that were
+ * split from one another and it's copied on write (see lock_mark). Lists
+ * are only shared within one file and hence guarded by SharedFileDesc::lock.
+ */
 typedef struct PidList
 {
   size_t size;
   size_t used;
-  pid_t list[0]; /* PID or 0 for empty cell */
+  union
+  {
+    size_t refcnt; /* Number of users of this list */
+    struct PidList *next_free; /* Next unused list in LockReserve */
+  };
+  pid_t list[0]; /* Sorted PIDs, only first used are valid */
 } PidList;
 
 /**
- * Fcntl file lock (linked list entry).
+ * Memory reserved for applying a series of lock requests so that it can't
+ * fail half way (see lock_reserve). Regions and owner lists are taken from
+ * here instead of allocating them.
+ */
+typedef struct LockReserve
+{
+  struct FcntlLock *locks; /* Unused regions linked through next */
+  PidList *pids; /* Unused owner lists of pids_size each */
+  size_t pids_size;
+} LockReserve;
+
+/**
+ * Last copy-on-write change of a shared PidList made by lock_mark() in
+ * a series of calls with the same lock type and PID. Lets other regions
+ * sharing the same list reuse the result instead of making more copies.
+ */
+typedef struct PidsMemo
+{
+  PidList *from; /* Original list */
+  PidList *to; /* Resulting list or NULL if the region became 'R' */
+  pid_t pid; /* Owner of the resulting 'R' region */
+  LockReserve *reserve; /* Memory to take new lists from or NULL */
+} PidsMemo;
+
+/**
+ * Fcntl file lock (linked list entry). Regions are also linked into a treap
+ * keyed by start (see lock_find) to avoid walking the list on every call.
  */
 typedef struct FcntlLock
 {
   struct FcntlLock *next;
+  struct FcntlLock *left; /* Treap child with a lower start */
+  struct FcntlLock *right; /* Treap child with a higher start */
 
   char type; /* 'R' = read lock, 'r' = multiple read locks, 'W' = write lock, 0 = no lock */
   off_t start; /* start of the lock region */
@@ -68,40 +125,152 @@ typedef struct FcntlLock
 } FcntlLock;
 
 /**
- * Blocked process (linked list entry).
+ * Blocked process (hash map entry). Each entry holds the edges of the
+ * wait-for graph from @a pid to the processes owning the region it is blocked
+ * on (@a blocker and @a blockers) kept in FcntlLocking::waiters. It is also
+ * linked into the list of the file it waits on (SharedFileDesc::fcntl_blocked)
+ * which is doubly linked through pointers to the previous entry's fnext field
+ * (or the list head) so that an entry can be removed w/o searching for it.
  */
 typedef struct ProcBlock
 {
-  struct ProcBlock *next;
+  struct ProcBlock *next; /* Next entry in the FcntlLocking::waiters bucket */
+  struct ProcBlock *fnext; /* Next process blocked on the same file */
+  struct ProcBlock **pfnext; /* Link to us in the file list, NULL if not linked */
   pid_t pid; /* pid of the blocked process */
 
   char type; /* Type of the requested lock, 'R' or 'W' */
   off_t start; /* Start of the requested lock */
   off_t end; /* End of the requested lock */
-  char path[PATH_MAX]; /* File hame with full path */
+  SharedFileDesc *g; /* File we are blocked on */
 
-  pid_t blocker; /* pid of the blocking process */
+  pid_t blocker; /* pid of the blocking process (first one if many), 0 if none */
+  PidList *blockers; /* pids of all blocking processes if many, NULL otherwise */
+  HEV hev; /* Semaphore the blocked process waits on */
 } ProcBlock;
 
+/**
+ * Initial number of FcntlLocking::waiters buckets (must be a power of two).
+ */
+#define FCNTL_WAITERS_SIZE 16
+
+/**
+ * Max number of wait-for graph edges visited by find_deadlock() (which also
+ * limits the length of detected cycles). Cycles longer than that are not
+ * reported, like on other systems that bound this search.
+ */
+#define FCNTL_DEADLK_EDGES 64
+
 /**
  * Global fcntl locking data structure.
  */
 typedef struct FcntlLocking
 {
-  HEV hEvSem; /* Semaphore for blocked processes to wait on */
-  ProcBlock *blocked; /* Processes blocked in F_SETLKW */
+  SharedLock lock; /* Guards waiters and all ProcBlock entries and lists */
+  SharedLock waiters_resize_lock; /* Guards waiters resize (see hash_map_add()) */
+  HashMap waiters; /* Processes blocked in F_SETLKW by their pid (wait-for graph) */
 } FcntlLocking;
 
 static int gbTerminate = 0; /* 1 after fcntl_locking_term is called */
+static ULONG gNumCPUs = 1; /* Number of CPUs in the system */
+
+/*
+ * Bounds of the adaptive spin in F_SETLKW. Before going to sleep, a blocked
+ * process rechecks the lock up to twice the recent average number of checks
+ * that were needed to get a lock on this file (plus FCNTL_SPIN_MIN) but no
+ * more than FCNTL_SPIN_MAX times. Each check is preceeded by
+ * FCNTL_SPIN_PAUSES CPU pauses (or by yielding the time slice if there is
+ * only one CPU).
+ */
+#define FCNTL_SPIN_MIN 10
+#define FCNTL_SPIN_MAX 200
+#define FCNTL_SPIN_PAUSES 64
+
+static PidList *new_pids(size_t size)
+{
+  PidList *list;
+  GLOBAL_NEW_PLUS_ARRAY(list, list->list, size);
+  if (list)
+  {
+    list->size = size;
+    list->used = 0;
+    list->refcnt = 1;
+  }
+  return list;
+}
+
+/**
+ * Returns a new list of at least @a size entries, taking it from the reserve
+ * of @a memo if there is one (see new_pids).
+ */
+static PidList *memo_new_pids(PidsMemo *memo, size_t size)
+{
+  PidList *list;
+
+  if (!memo || !memo->reserve)
+    return new_pids(size);
+
+  list = memo->reserve->pids;
+  ASSERT(list && list->size >= size);
+  memo->reserve->pids = list->next_free;
+  list->used = 0;
+  list->refcnt = 1;
+  return list;
+}
+
+inline static PidList *share_pids(PidList *list)
+{
+  ASSERT(list && list->refcnt);
+  ++list->refcnt;
+  return list;
+}
+
+inline static void release_pids(PidList *list)
+{
+  ASSERT(list && list->refcnt);
+  if (--list->refcnt == 0)
+    free(list);
+}
+
+/**
+ * Returns the index of the first PID in @a list not less than @a pid.
+ */
+static size_t find_pid(const PidList *list, pid_t pid)
+{
+  size_t lo = 0, hi = list->used;
+
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    if (list->list[mid] < pid)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
 
-static PidList *copy_pids(const PidList *list)
+static void memo_done(PidsMemo *memo)
 {
-  ASSERT(list);
-  PidList *nlist;
-  GLOBAL_NEW_PLUS_ARRAY(nlist, list->list, list->size);
-  if (nlist)
-    COPY_STRUCT_PLUS_ARRAY(nlist, list, list->list, list->size);
-  return nlist;
+  if (memo->from)
+  {
+    release_pids(memo->from);
+    if (memo->to)
+      release_pids(memo->to);
+    memo->from = memo->to = NULL;
+  }
+}
+
+static void memo_set(PidsMemo *memo, PidList *from, PidList *to, pid_t pid)
+{
+  if (memo)
+  {
+    memo_done(memo);
+    memo->from = share_pids(from);
+    memo->to = to ? share_pids(to) : NULL;
+    memo->pid = pid;
+  }
 }
 
 static pid_t first_pid(struct FcntlLock *l)
@@ -110,37 +279,48 @@ static pid_t first_pid(struct FcntlLock *l)
     return 0;
   if (l->type == 'r')
   {
-    int i;
-    ASSERT(l->pids && l->pids->used);
-    for (i = 0; i < l->pids->size; ++i)
-      if (l->pids->list[i])
-        return l->pids->list[i];
-    ASSERT(FALSE);
+    ASSERT(l->pids && l->pids->used > 1);
+    return l->pids->list[0];
   }
   return l->pid;
 }
 
 static int equal_pids(PidList *l1, PidList *l2)
 {
-  int i1, i2;
+  return l1 == l2 ||
+         (l1->used == l2->used &&
+          !memcmp(l1->list, l2->list, l1->used * sizeof(*l1->list)));
+}
 
-  if (l1->used != l2->used)
-    return 0;
+/*
+ * Owners of OFD locks (F_OFD_SETLK etc.) are negative numbers made of the PID
+ * of the process and the fd it used to set the lock (OS/2 PIDs fit in 16 bits)
+ * so that they never clash with PIDs (owners of normal locks) and all OFD
+ * owners of one process follow each other in sorted PidList arrays.
+ */
+#define OFD_MAX_FD 0x7FFF
 
-  for (i1 = 0; i1 < l1->size; ++i1)
-  {
-    if (l1->list[i1])
-    {
-      for (i2 = 0; i2 < l2->size; ++i2)
-        if (l2->list[i2] && l1->list[i1] == l2->list[i2])
-          break;
-      /* fail the comparison if l1 pid is not found in l2 */
-      if (i2 == l2->size)
-        return 0;
-    }
-  }
+inline static pid_t ofd_owner(pid_t pid, int fd)
+{
+  ASSERT(pid > 0 && pid <= 0xFFFF && fd >= 0 && fd <= OFD_MAX_FD);
+  return (pid_t)(0x80000000U | ((unsigned)pid << 15) | (unsigned)fd);
+}
+
+/**
+ * Returns the owner PID to report in struct flock::l_pid (-1 for OFD locks
+ * as on Linux).
+ */
+inline static pid_t owner_pid(pid_t owner)
+{
+  return owner < 0 ? -1 : owner;
+}
 
-  return 1;
+/**
+ * Returns the PID of the process @a owner (a PID or an OFD owner) belongs to.
+ */
+inline static pid_t owner_proc(pid_t owner)
+{
+  return owner < 0 ? (pid_t)(((unsigned)owner >> 15) & 0xFFFF) : owner;
 }
 
 static int lock_has_pid(struct FcntlLock *l, pid_t pid)
@@ -148,12 +328,10 @@ static int lock_has_pid(struct FcntlLock *l, pid_t pid)
   ASSERT(l->type != 0 && pid != 0);
   if (l->type == 'r')
   {
-    int i;
-    ASSERT(l->pids && l->pids->used);
-    for (i = 0; i < l->pids->size; ++i)
-      if (l->pids->list[i] == pid)
-        return 1;
-    return 0;
+    size_t i;
+    ASSERT(l->pids && l->pids->used > 1);
+    i = find_pid(l->pids, pid);
+    return i < l->pids->used && l->pids->list[i] == pid;
   }
   return l->pid == pid;
 }
@@ -172,55 +350,65 @@ static int lock_needs_mark(struct FcntlLock *l, short type, pid_t pid)
 
 /**
  * Marks the given lock region l with type and pid. Doesn't check for
- * possible blocking and such.
+ * possible blocking and such. Shared owner lists are copied before changing
+ * them. If @a memo is not NULL, it's used to reuse such a copy for other
+ * regions in a series of calls with the same type and pid (the caller must
+ * call memo_done() at the end of the series).
  * Returns 0 on success or -1 if there is no memory.
  */
-static int lock_mark(struct FcntlLock *l, short type, pid_t pid)
+static int lock_mark(struct FcntlLock *l, short type, pid_t pid, PidsMemo *memo)
 {
+  if (l->type == 'r' && memo && memo->from == l->pids)
+  {
+    /* This list was already changed the same way, reuse the result */
+    release_pids(l->pids);
+    if (memo->to)
+      l->pids = share_pids(memo->to);
+    else
+    {
+      l->type = 'R';
+      l->pid = memo->pid;
+    }
+    return 0;
+  }
+
   switch (type)
   {
     case F_UNLCK:
       ASSERT(l->type != 0);
       if (l->type == 'r')
       {
-        int i;
-        pid_t p = 0;
-        ASSERT(l->pids && l->pids->used);
-        for (i = 0; i < l->pids->size; ++i)
+        PidList *list = l->pids;
+        size_t i = find_pid(list, pid);
+        ASSERT(i < list->used && list->list[i] == pid);
+        if (list->used == 2)
         {
-          if (l->pids->list[i] == pid)
-          {
-            l->pids->list[i] = 0;
-            --l->pids->used;
-            if (l->pids->used == 1)
-            {
-              /* Convert to R (blocker detection relies on this) */
-              if (!p)
-              {
-                /* Didn't see the other pid yet, search for it */
-                while (++i < l->pids->size && !l->pids->list[i]);
-                ASSERT(i < l->pids->size);
-                p = l->pids->list[i];
-              }
-              free(l->pids);
-              l->type = 'R';
-              l->pid = p;
-            }
-            else if (l->pids->used == 0)
-            {
-              free(l->pids);
-              l->type = 0;
-              l->pid = 0;
-            }
-            break;
-          }
-          else if (l->pids->used == 2 && l->pids->list[i])
-          {
-            /* Remember the other pid in the table */
-            p = l->pids->list[i];
-          }
+          /* Convert to R (blocker detection relies on this) */
+          l->type = 'R';
+          l->pid = list->list[1 - i];
+          if (list->refcnt > 1)
+            memo_set(memo, list, NULL, l->pid);
+          release_pids(list);
+        }
+        else if (list->refcnt > 1)
+        {
+          PidList *nlist = memo_new_pids(memo, list->size);
+          if (!nlist)
+            return -1;
+          memcpy(nlist->list, list->list, i * sizeof(pid_t));
+          memcpy(nlist->list + i, list->list + i + 1,
+                 (list->used - i - 1) * sizeof(pid_t));
+          nlist->used = list->used - 1;
+          memo_set(memo, list, nlist, 0);
+          release_pids(list);
+          l->pids = nlist;
+        }
+        else
+        {
+          memmove(list->list + i, list->list + i + 1,
+                  (list->used - i - 1) * sizeof(pid_t));
+          --list->used;
         }
-        ASSERT(l->type == 0 || l->type == 'R' || i < l->pids->size);
       }
       else
       {
@@ -237,48 +425,44 @@ static int lock_mark(struct FcntlLock *l, short type, pid_t pid)
     case F_RDLCK:
       if (l->type == 'r')
       {
-        int i;
-        ASSERT(l->pids && l->pids->used);
-        if (l->pids->used < l->pids->size)
+        PidList *list = l->pids;
+        size_t i = find_pid(list, pid);
+        ASSERT(i == list->used || list->list[i] != pid);
+        if (list->refcnt > 1 || list->used == list->size)
         {
-          for (i = 0; i < l->pids->size; ++i)
-          {
-            if (l->pids->list[i] == 0)
-            {
-              l->pids->list[i] = pid;
-              ++l->pids->used;
-              break;
-            }
-          }
-          ASSERT(i < l->pids->size);
-        }
-        else
-        {
-          /* Need more space */
-          ASSERT(l->pids->used == l->pids->size);
-          size_t nsize = l->pids->size + PID_LIST_MIN_SIZE;
-          PidList *nlist = l->pids;
-          RENEW_PLUS_ARRAY(nlist, nlist->list, nlist->size, nsize);
+          /* Need a copy or more space */
+          size_t nsize = list->used < list->size ? list->size :
+                         list->size + PID_LIST_MIN_SIZE;
+          PidList *nlist = memo_new_pids(memo, nsize);
           if (!nlist)
             return -1;
-          nlist->list[nlist->size] = pid;
-          nlist->size = nsize;
-          ++nlist->used;
+          memcpy(nlist->list, list->list, i * sizeof(pid_t));
+          nlist->list[i] = pid;
+          memcpy(nlist->list + i + 1, list->list + i,
+                 (list->used - i) * sizeof(pid_t));
+          nlist->used = list->used + 1;
+          if (list->refcnt > 1)
+            memo_set(memo, list, nlist, 0);
+          release_pids(list);
           l->pids = nlist;
         }
+        else
+        {
+          memmove(list->list + i + 1, list->list + i,
+                  (list->used - i) * sizeof(pid_t));
+          list->list[i] = pid;
+          ++list->used;
+        }
       }
       else if (l->type == 'R')
       {
         ASSERT(l->pid && l->pid != pid);
-        size_t nsize = PID_LIST_MIN_SIZE;
-        PidList *nlist;
-        GLOBAL_NEW_PLUS_ARRAY(nlist, nlist->list, nsize);
+        PidList *nlist = memo_new_pids(memo, PID_LIST_MIN_SIZE);
         if (!nlist)
           return -1;
-        nlist->size = nsize;
         nlist->used = 2;
-        nlist->list[0] = l->pid;
-        nlist->list[1] = pid;
+        nlist->list[0] = l->pid < pid ? l->pid : pid;
+        nlist->list[1] = l->pid < pid ? pid : l->pid;
         l->type = 'r';
         l->pids = nlist;
       }
@@ -296,6 +480,32 @@ static int lock_mark(struct FcntlLock *l, short type, pid_t pid)
   return 0;
 }
 
+/**
+ * Removes @a pid from the owners of region @a l like lock_mark() with F_UNLCK
+ * does but changes a shared owner list in place rather than copying it, so
+ * it never needs memory. This also removes @a pid from all other regions
+ * using the same list and is therefore only valid when @a pid is removed
+ * from all regions of the file at once (see unlock_all).
+ */
+static void lock_unmark_all(struct FcntlLock *l, pid_t pid)
+{
+  if (l->type == 'r' && l->pids->used > 2)
+  {
+    PidList *list = l->pids;
+    size_t i = find_pid(list, pid);
+    ASSERT(i < list->used && list->list[i] == pid);
+    memmove(list->list + i, list->list + i + 1,
+            (list->used - i - 1) * sizeof(pid_t));
+    --list->used;
+  }
+  else
+  {
+    /* Neither of the remaining cases allocates */
+    if (lock_mark(l, F_UNLCK, pid, NULL) == -1)
+      ASSERT_FAILED();
+  }
+}
+
 inline static off_t lock_end(struct FcntlLock *l)
 {
     return l->next ? l->next->start - 1 : OFF_MAX;
@@ -306,49 +516,176 @@ inline static off_t lock_len(struct FcntlLock *l)
     return l->next ? l->next->start - l->start : 0;
 }
 
-static void lock_free(struct FcntlLock *l)
+/**
+ * Returns the treap priority of the given lock region. It is derived from the
+ * region address which is random enough with regard to region order and
+ * doesn't need to be stored.
+ */
+inline static uint32_t lock_prio(struct FcntlLock *l)
+{
+  return hash_finish(hash_mix(HASH_SEED, (uint32_t)(uintptr_t)l), 0, 4);
+}
+
+/**
+ * Returns the lock region of @a desc that contains the given offset, i.e.
+ * the one with the greatest start not above @a off.
+ */
+static struct FcntlLock *lock_find(SharedFileDesc *desc, off_t off)
+{
+  struct FcntlLock *l = desc->fcntl_lock_tree, *found = NULL;
+
+  while (l)
+  {
+    if (l->start <= off)
+    {
+      found = l;
+      l = l->right;
+    }
+    else
+      l = l->left;
+  }
+
+  ASSERT(found);
+  return found;
+}
+
+/**
+ * Inserts @a l into the treap rooted at @a t. Returns the new root.
+ */
+static struct FcntlLock *lock_tree_insert(struct FcntlLock *t, struct FcntlLock *l)
+{
+  struct FcntlLock *c;
+
+  if (!t)
+    return l;
+
+  ASSERT(l->start != t->start);
+  if (l->start < t->start)
+  {
+    t->left = lock_tree_insert(t->left, l);
+    if (lock_prio(t->left) > lock_prio(t))
+    {
+      c = t->left;
+      t->left = c->right;
+      c->right = t;
+      t = c;
+    }
+  }
+  else
+  {
+    t->right = lock_tree_insert(t->right, l);
+    if (lock_prio(t->right) > lock_prio(t))
+    {
+      c = t->right;
+      t->right = c->left;
+      c->left = t;
+      t = c;
+    }
+  }
+
+  return t;
+}
+
+/**
+ * Removes @a l from the treap of @a desc.
+ */
+static void lock_tree_remove(SharedFileDesc *desc, struct FcntlLock *l)
 {
+  struct FcntlLock **p = &desc->fcntl_lock_tree, *c;
+
+  while (*p != l)
+  {
+    ASSERT(*p);
+    p = l->start < (*p)->start ? &(*p)->left : &(*p)->right;
+  }
+
+  /* Rotate l down until it becomes a leaf */
+  while (l->left || l->right)
+  {
+    if (!l->right || (l->left && lock_prio(l->left) > lock_prio(l->right)))
+    {
+      c = l->left;
+      l->left = c->right;
+      c->right = l;
+      *p = c;
+      p = &c->right;
+    }
+    else
+    {
+      c = l->right;
+      l->right = c->left;
+      c->left = l;
+      *p = c;
+      p = &c->left;
+    }
+  }
+
+  *p = NULL;
+}
 
+/**
+ * Frees the given lock region and removes it from the treap of @a desc.
+ * Unlinking it from the list is up to the caller.
+ */
+static void lock_free(SharedFileDesc *desc, struct FcntlLock *l)
+{
+  lock_tree_remove(desc, l);
   if (l->type == 'r')
-    free(l->pids);
-  free(l);
+    release_pids(l->pids);
+  slab_free(l);
 }
 
 /**
- * Splits the given lock region at the given split point.
- * Returns the newly created region or NULL if there is
- * not enough memory.
+ * Splits the given lock region at the given split point. The new region is
+ * taken from @a res if it's not NULL. Returns the newly created region or
+ * NULL if there is not enough memory.
  */
-static struct FcntlLock *lock_split(struct FcntlLock *l, off_t split)
+static struct FcntlLock *lock_split(SharedFileDesc *desc, struct FcntlLock *l,
+                                    off_t split, LockReserve *res)
 {
   struct FcntlLock *ln = NULL;
 
   ASSERT(l);
   ASSERT(l->start < split && split <= lock_end(l));
 
-  GLOBAL_NEW(ln);
-  if (!ln)
-    return NULL;
+  if (res)
+  {
+    ln = res->locks;
+    ASSERT(ln);
+    res->locks = ln->next;
+  }
+  else
+  {
+    GLOBAL_NEW_SLAB(ln, SlabFcntlLock);
+    if (!ln)
+      return NULL;
+  }
 
+  ln->left = ln->right = NULL;
   ln->start = split;
   ln->type = l->type;
   if (l->type == 'r')
-  {
-    ln->pids = copy_pids(l->pids);
-    if (!ln->pids)
-    {
-      free(ln);
-      return NULL;
-    }
-  }
+    ln->pids = share_pids(l->pids);
   else
     ln->pid = l->pid;
   ln->next = l->next;
   l->next = ln;
 
+  desc->fcntl_lock_tree = lock_tree_insert(desc->fcntl_lock_tree, ln);
+
   return ln;
 }
 
+/**
+ * Returns 1 if regions @a l1 and @a l2 have the same type and owners.
+ */
+inline static int lock_equal(struct FcntlLock *l1, struct FcntlLock *l2)
+{
+  return l1->type == l2->type &&
+         (l1->type == 0 ||
+          (l1->type == 'r' ? equal_pids(l1->pids, l2->pids) : l1->pid == l2->pid));
+}
+
 /**
  * Optimize file lock regions by joining matching ones.
  * @a desc is the file description, @a lpb is the region preceeding @a lb,
@@ -366,98 +703,465 @@ static void optimize_locks(SharedFileDesc *desc, struct FcntlLock *lpb,
   while (l->next && (!le || l != le->next))
   {
     struct FcntlLock *ln = l->next;
-    if (l->type == ln->type)
+    if (lock_equal(l, ln))
     {
-      if (l->type == 0 ||
-          (l->type == 'r' ? equal_pids(l->pids, ln->pids) : l->pid == ln->pid))
-      {
-        /* Region types match, join them */
-        l->next = ln->next;
-        lock_free(ln);
-        continue;
-      }
+      /* Region types match, join them */
+      l->next = ln->next;
+      lock_free(desc, ln);
+      continue;
     }
     l = l->next;
   }
 }
 
 /**
- * Initializes the fcntl portion of SharedFileDesc and FileDesc.
- * Called right after the SharedFileDesc and/or FileDesc pointers are allocated.
- * Returns 0 on success or -1 on failure.
+ * Returns an OFD owner of region @a l in range [@a first, @a last] or 0 if
+ * there is none.
  */
-int fcntl_locking_filedesc_init(FileDesc *desc)
+static pid_t lock_ofd_owner(struct FcntlLock *l, pid_t first, pid_t last)
 {
-  if (desc->g->refcnt == 1)
+  pid_t owner;
+
+  if (l->type == 0)
+    return 0;
+
+  if (l->type == 'r')
   {
-    /* Add one free region that covers the entire file */
-    GLOBAL_NEW(desc->g->fcntl_locks);
-    if (!desc->g->fcntl_locks)
-      return -1;
+    size_t i = find_pid(l->pids, first);
+    if (i == l->pids->used)
+      return 0;
+    owner = l->pids->list[i];
   }
+  else
+    owner = l->pid;
 
-  return 0;
+  return owner >= first && owner <= last ? owner : 0;
 }
 
 /**
- * Uninitializes the fcntl portion of SharedFileDesc and FileDesc.
- * Called right before the SharedFileDesc and/or FileDesc pointers are freed.
+ * Unlocks region @a l for @a pid and for OFD owners in [@a first, @a last]
+ * (see unlock_all). Returns 1 if anything was unlocked and 0 otherwise.
  */
-void fcntl_locking_filedesc_term(FileDesc *desc)
+static int unlock_owners(SharedFileDesc *desc, struct FcntlLock *l, pid_t pid,
+                         pid_t first, pid_t last)
 {
-  if (desc->g->refcnt == 1)
+  int bNeededMark = 0;
+  pid_t owner;
+
+  if (lock_needs_mark(l, F_UNLCK, pid))
   {
-    struct FcntlLock *l = desc->g->fcntl_locks;
-    while (l)
-    {
-      TRACE_BEGIN_IF(l->type, "WARNING! Forgotten lock: type '%c' start %lld, len %lld, ",
-                     l->type ? l->type : ' ', (uint64_t)l->start,
-                     (uint64_t)lock_len(l));
-      if (l->type == 'r')
-      {
-        int i;
-        TRACE_CONT("pids ");
-        for (i = 0; i < l->pids->size; ++i)
-          if (l->pids->list[i])
-            TRACE_CONT("%d ", l->pids->list[i]);
-        TRACE_CONT("\n");
-      }
-      else
-        TRACE_CONT("pid %d\n", l->pid);
-      TRACE_END();
-      struct FcntlLock *n = l->next;
-      free(l);
-      l = n;
-    }
+    TRACE("Will unlock [%s], type '%c', start %lld, len %lld\n",
+          desc->path, l->type ? l->type : ' ', (uint64_t)l->start, (uint64_t)lock_len(l));
+    lock_unmark_all(l, pid);
+    bNeededMark = 1;
+  }
+  /* Each iteration removes one owner as lock_unmark_all can't fail */
+  while ((owner = lock_ofd_owner(l, first, last)))
+  {
+    TRACE("Will unlock [%s], type '%c', start %lld, len %lld, OFD owner %d\n",
+          desc->path, l->type, (uint64_t)l->start, (uint64_t)lock_len(l), owner);
+    lock_unmark_all(l, owner);
+    bNeededMark = 1;
   }
+
+  return bNeededMark;
 }
 
 /**
- * Initializes the fcntl shared structures.
- * Called upon each process startup after successfull ProcDesc and gpData
- * allocation.
+ * Unlocks all regions of @a desc owned by @a pid and joins matching regions
+ * in the same pass. Also unlocks OFD and flock() locks set by this process
+ * through @a fd or through any fd if @a fd is -1. Returns 1 if anything was
+ * unlocked and 0 otherwise. Never fails: as all regions are unlocked, shared
+ * owner lists are changed in place (see lock_unmark_all) so that cleanup on
+ * close and termination doesn't depend on free memory.
  */
-void fcntl_locking_init(ProcDesc *proc)
+static int unlock_all(SharedFileDesc *desc, pid_t pid, int fd)
 {
-  APIRET arc;
+  struct FcntlLock *lp = NULL, *l = desc->fcntl_locks;
+  int bNeededMark;
+  pid_t first, last;
 
-  if (gpData->refcnt == 1)
+  if (fd > OFD_MAX_FD)
   {
-    /* We are the first processs, initialize fcntl structures */
+    /* Such fds can't be used for OFD locks */
+    first = last = 0;
+  }
+  else
+  {
+    first = ofd_owner(pid, fd == -1 ? 0 : fd);
+    last = ofd_owner(pid, fd == -1 ? OFD_MAX_FD : fd);
+  }
+
+  bNeededMark = unlock_owners(desc, desc->flock_lock, pid, first, last);
+
+  while (l)
+  {
+    if (unlock_owners(desc, l, pid, first, last))
+      bNeededMark = 1;
+    if (lp && lock_equal(lp, l))
+    {
+      /* Join with the previous region */
+      lp->next = l->next;
+      lock_free(desc, l);
+      l = lp->next;
+      continue;
+    }
+    lp = l;
+    l = l->next;
+  }
+
+  return bNeededMark;
+}
+
+static size_t proc_block_entry_hash(HashMapEntry *entry)
+{
+  return ((ProcBlock *)entry)->pid;
+}
+
+/**
+ * Returns the FcntlLocking::waiters bucket for the entries of blocked process
+ * @a pid (the map is keyed by the waiting process, not by its blocker).
+ * Must be called under FcntlLocking::lock.
+ */
+static ProcBlock **waiters_bucket(pid_t pid)
+{
+  /* PIDs are sequential so identity is good enough as a hash function */
+  return (ProcBlock **)hash_map_bucket(&gpData->fcntl_locking->waiters, pid, 1,
+                                       proc_block_entry_hash);
+}
+
+/**
+ * Adds @a blocked to the list of processes blocked on @a blocked->g and to
+ * the wait-for graph. Must be called under FcntlLocking::lock.
+ */
+static void link_blocked(ProcBlock *blocked)
+{
+  ProcBlock **head = &blocked->g->fcntl_blocked;
+
+  ASSERT(!blocked->pfnext);
+
+  blocked->fnext = *head;
+  if (*head)
+    (*head)->pfnext = &blocked->fnext;
+  blocked->pfnext = head;
+  *head = blocked;
+
+  hash_map_add(&gpData->fcntl_locking->waiters,
+               (HashMapEntry **)waiters_bucket(blocked->pid), (HashMapEntry *)blocked,
+               0, &gpData->fcntl_locking->lock, 1,
+               &gpData->fcntl_locking->waiters_resize_lock, proc_block_entry_hash);
+}
+
+/**
+ * Removes @a blocked from the blocked lists if it's still there.
+ * Must be called under FcntlLocking::lock.
+ */
+static void unlink_blocked(ProcBlock *blocked)
+{
+  ProcBlock **b;
+
+  if (!blocked->pfnext)
+    return;
+
+  *blocked->pfnext = blocked->fnext;
+  if (blocked->fnext)
+    blocked->fnext->pfnext = blocked->pfnext;
+  blocked->pfnext = NULL;
+
+  /* Buckets only hold a few PIDs (and their threads), just search */
+  b = waiters_bucket(blocked->pid);
+  while (*b != blocked)
+    b = &(*b)->next;
+  *b = blocked->next;
+  __atomic_decrement_u32(&gpData->fcntl_locking->waiters.count);
+}
+
+/**
+ * Records the processes owning region @a l as the blockers of @a b in the
+ * wait-for graph. OFD owners are recorded as their processes and the blocked
+ * process itself is skipped (it only waits for other threads then which is
+ * not a deadlock). If there is no memory to record all owners of an 'r'
+ * region, only the first one is recorded (and deadlocks through the others
+ * are not detected). Must be called under FcntlLocking::lock.
+ */
+static void set_blockers(ProcBlock *b, struct FcntlLock *l)
+{
+  if (b->blockers)
+  {
+    release_pids(b->blockers);
+    b->blockers = NULL;
+  }
+
+  b->blocker = owner_proc(l->type == 'r' ? l->pids->list[0] : l->pid);
+  if (b->blocker == b->pid)
+    b->blocker = 0;
+
+  if (l->type == 'r')
+  {
+    size_t i;
+    for (i = 0; i < l->pids->used; ++i)
+    {
+      pid_t p = owner_proc(l->pids->list[i]);
+      if (p == b->pid || p == b->blocker ||
+          (b->blockers && p == b->blockers->list[b->blockers->used - 1]))
+        continue;
+      if (!b->blocker)
+      {
+        b->blocker = p;
+        continue;
+      }
+      if (!b->blockers)
+      {
+        b->blockers = new_pids(l->pids->used);
+        if (!b->blockers)
+        {
+          TRACE("No memory, only pid %d is recorded\n", b->blocker);
+          break;
+        }
+        b->blockers->list[b->blockers->used++] = b->blocker;
+      }
+      b->blockers->list[b->blockers->used++] = p;
+    }
+  }
+}
+
+/**
+ * Frees @a b (which must not be in the blocked lists).
+ */
+static void free_proc_block(ProcBlock *b)
+{
+  if (b->blockers)
+    release_pids(b->blockers);
+  slab_free(b);
+}
+
+/**
+ * Checks if @a pid blocked by the lock region @a blocker would close a cycle
+ * in the wait-for graph, i.e. if some owner of @a blocker is waiting, directly
+ * or through other processes, for @a pid. Follows edges from the owners in
+ * depth-first order visiting no more than FCNTL_DEADLK_EDGES of them, so the
+ * cost doesn't depend on the total number of blocked processes.
+ * Must be called under FcntlLocking::lock.
+ */
+static int find_deadlock(pid_t pid, struct FcntlLock *blocker)
+{
+  /* Owners of @a blocker plus one entry per visited edge at most */
+  pid_t stack[FCNTL_DEADLK_EDGES * 2];
+  int n = 0, edges = 0;
+
+  if (blocker->type == 'r')
+  {
+    size_t i;
+    for (i = 0; i < blocker->pids->used && n < FCNTL_DEADLK_EDGES; ++i)
+      if (owner_proc(blocker->pids->list[i]) != pid)
+        stack[n++] = owner_proc(blocker->pids->list[i]);
+  }
+  else
+    stack[n++] = owner_proc(blocker->pid);
+
+  while (n)
+  {
+    pid_t waiter = stack[--n];
+    ProcBlock *b = *waiters_bucket(waiter);
+
+    for (; b; b = b->next)
+    {
+      size_t i, num = b->blockers ? b->blockers->used : b->blocker ? 1 : 0;
+
+      if (b->pid != waiter)
+        continue;
+
+      for (i = 0; i < num; ++i)
+      {
+        pid_t next = b->blockers ? b->blockers->list[i] : b->blocker;
+        if (next == pid)
+        {
+          TRACE("Deadlock: pid %d waits for us\n", waiter);
+          return 1;
+        }
+        if (++edges == FCNTL_DEADLK_EDGES)
+        {
+          TRACE("Gave up after %d edges\n", edges);
+          return 0;
+        }
+        stack[n++] = next;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Wakes up processes blocked in F_SETLKW on @a desc_g whose requested region
+ * overlaps [@a start, @a end] and removes them from the blocked lists (they
+ * will add themselves back if they still need to wait). Other blocked
+ * processes are not affected. Must be called under FcntlLocking::lock.
+ * Their semaphores are only opened here (so that they stay valid even if the
+ * waiters give up and close them) and stored in @a wake which the caller must
+ * pass to fcntl_locking_wake() after releasing all spin locks. Returns the
+ * number of woken up processes.
+ */
+static int wake_blocked(SharedFileDesc *desc_g, off_t start, off_t end,
+                        FcntlWakeList *wake)
+{
+  ProcBlock *b = desc_g->fcntl_blocked;
+  int n = 0;
+
+  while (b)
+  {
+    ProcBlock *bn = b->fnext;
+    if (b->start <= end && start <= b->end)
+    {
+      /* The semaphore belongs to the blocked process, open it for us */
+      HEV hev = b->hev;
+      APIRET arc = DosOpenEventSem(NULL, &hev);
+      if (arc == NO_ERROR)
+      {
+        if (wake->num < FCNTL_WAKE_BATCH)
+          wake->hevs[wake->num++] = hev;
+        else
+        {
+          /* No room (unlikely), post it right away */
+          arc = DosPostEventSem(hev);
+          DosCloseEventSem(hev);
+        }
+      }
+      TRACE("Woke up pid %d (type '%c', start %lld, len %lld), arc %lu\n",
+            b->pid, b->type, (uint64_t)b->start,
+            (uint64_t)(b->end == OFF_MAX ? 0 : b->end - b->start + 1), arc);
+      unlink_blocked(b);
+      ++n;
+    }
+    b = bn;
+  }
+
+  return n;
+}
+
+/**
+ * Posts and closes the semaphores collected in @a wake by wake_blocked() and
+ * empties it. Must be called with no spin locks held.
+ */
+void fcntl_locking_wake(FcntlWakeList *wake)
+{
+  int i;
+
+  for (i = 0; i < wake->num; ++i)
+  {
+    APIRET arc = DosPostEventSem(wake->hevs[i]);
+    TRACE_IF(arc, "DosPostEventSem = %lu\n", arc);
+    DosCloseEventSem(wake->hevs[i]);
+  }
+
+  wake->num = 0;
+}
+
+/**
+ * Initializes the fcntl portion of SharedFileDesc and FileDesc.
+ * Called right after the SharedFileDesc and/or FileDesc pointers are allocated.
+ * Returns 0 on success or -1 on failure.
+ */
+int fcntl_locking_filedesc_init(FileDesc *desc)
+{
+  if (desc->g->refcnt == 1)
+  {
+    /* Add one free region that covers the entire file */
+    GLOBAL_NEW_SLAB(desc->g->fcntl_locks, SlabFcntlLock);
+    if (!desc->g->fcntl_locks)
+      return -1;
+    desc->g->fcntl_lock_tree = desc->g->fcntl_locks;
+
+    /* And one free region for flock() */
+    GLOBAL_NEW_SLAB(desc->g->flock_lock, SlabFcntlLock);
+    if (!desc->g->flock_lock)
+    {
+      slab_free(desc->g->fcntl_locks);
+      desc->g->fcntl_locks = desc->g->fcntl_lock_tree = NULL;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Uninitializes the fcntl portion of SharedFileDesc and FileDesc.
+ * Called right before the SharedFileDesc and/or FileDesc pointers are freed.
+ */
+void fcntl_locking_filedesc_term(FileDesc *desc)
+{
+  if (desc->g->refcnt == 1)
+  {
+    struct FcntlLock *l = desc->g->fcntl_locks;
+
+    /*
+     * Threads of this process may still wait on this file if another thread
+     * closed it, release them as their records refer to us. Note that our
+     * caller holds the bucket lock while we post but this is a rare case.
+     */
+    if (desc->g->fcntl_blocked)
+    {
+      FcntlWakeList wake;
+      wake.num = 0;
+      shared_lock(&gpData->fcntl_locking->lock);
+      wake_blocked(desc->g, 0, OFF_MAX, &wake);
+      shared_unlock(&gpData->fcntl_locking->lock);
+      fcntl_locking_wake(&wake);
+    }
+
+    TRACE_IF(desc->g->flock_lock->type, "WARNING! Forgotten flock: type '%c'\n",
+             desc->g->flock_lock->type);
+    if (desc->g->flock_lock->type == 'r')
+      release_pids(desc->g->flock_lock->pids);
+    slab_free(desc->g->flock_lock);
+
+    while (l)
+    {
+      TRACE_BEGIN_IF(l->type, "WARNING! Forgotten lock: type '%c' start %lld, len %lld, ",
+                     l->type ? l->type : ' ', (uint64_t)l->start,
+                     (uint64_t)lock_len(l));
+      if (l->type == 'r')
+      {
+        int i;
+        TRACE_CONT("pids ");
+        for (i = 0; i < l->pids->used; ++i)
+          TRACE_CONT("%d ", l->pids->list[i]);
+        TRACE_CONT("\n");
+      }
+      else
+        TRACE_CONT("pid %d\n", l->pid);
+      TRACE_END();
+      struct FcntlLock *n = l->next;
+      slab_free(l);
+      l = n;
+    }
+  }
+}
+
+/**
+ * Initializes the fcntl shared structures.
+ * Called upon each process startup after successfull ProcDesc and gpData
+ * allocation.
+ */
+void fcntl_locking_init(ProcDesc *proc)
+{
+  if (gpData->refcnt == 1)
+  {
+    /* We are the first processs, initialize fcntl structures */
     GLOBAL_NEW(gpData->fcntl_locking);
     ASSERT(gpData->fcntl_locking);
-
-    arc = DosCreateEventSem(NULL, &gpData->fcntl_locking->hEvSem,
-                            DC_SEM_SHARED | DCE_AUTORESET, FALSE);
-    ASSERT_MSG(arc == NO_ERROR, "%ld", arc);
+    if (hash_map_init(&gpData->fcntl_locking->waiters, FCNTL_WAITERS_SIZE) == -1)
+      ASSERT_MSG(0, "no memory");
   }
   else
   {
     ASSERT(gpData->fcntl_locking);
-    ASSERT(gpData->fcntl_locking->hEvSem);
-    arc = DosOpenEventSem(NULL, &gpData->fcntl_locking->hEvSem);
-    ASSERT_MSG(arc == NO_ERROR, "%ld", arc);
   }
+
+  if (DosQuerySysInfo(QSV_NUMPROCESSORS, QSV_NUMPROCESSORS, &gNumCPUs,
+                      sizeof(gNumCPUs)) != NO_ERROR || !gNumCPUs)
+    gNumCPUs = 1;
 }
 
 /**
@@ -468,135 +1172,120 @@ void fcntl_locking_init(ProcDesc *proc)
 void fcntl_locking_term(ProcDesc *proc)
 {
   APIRET arc;
-  int rc, i;
+  int i;
 
   gbTerminate = 1;
 
+  /* Release the lock we might have left after a crash */
+  shared_lock_reset(&gpData->fcntl_locking->lock);
+
   /*
    * Note: while fcntl_locking works with SharedFileDesc, we assume that no
    * SharedFileDesc were used in this process (and hence nothing to unlock on
    * termination) unless theere are also FileDesc for these files.
    */
-  if (gpData->files && proc && proc->files)
+  if (gpData->files.buckets && proc && proc->files.buckets)
   {
     pid_t pid = getpid();
-    int bNeededMark = 0;
+    FcntlWakeList wake;
 
-    /* Go through all locks to unlock any regions this process owns */
-    /* Note: this code is similar to one in fcntl_locking_close */
-    for (i = 0; i < FILE_DESC_HASH_SIZE; ++i)
+    wake.num = 0;
+
+    /* Go through all files to unlock any regions this process owns */
+    for (i = 0; i < FILE_DESC_LOCKS; ++i)
     {
-      FileDesc *desc = proc->files[i];
-      while (desc)
+      size_t b;
+
+      file_desc_lock(i);
+      file_desc_rehash(i, proc);
+
+      for (b = i; b < proc->files.size; b += FILE_DESC_LOCKS)
       {
-        struct FcntlLock *l = desc->g->fcntl_locks;
-        while (l)
+        FileDesc *desc = (FileDesc *)proc->files.buckets[b];
+        while (desc)
         {
-          if (lock_needs_mark(l, F_UNLCK, pid))
+          shared_lock(&desc->g->lock);
+
+          if (unlock_all(desc->g, pid, -1))
           {
-            TRACE("Will unlock [%s], type '%c', start %lld, len %lld\n",
-                  desc->g->path, l->type ? l->type : ' ', (uint64_t)l->start, (uint64_t)lock_len(l));
-            rc = lock_mark(l, F_UNLCK, pid);
-            TRACE_IF(rc, "rc = %d\n", rc);
-            bNeededMark = 1;
+            /* Release processes blocked on this file to let them recheck */
+            shared_lock(&gpData->fcntl_locking->lock);
+            wake_blocked(desc->g, 0, OFF_MAX, &wake);
+            shared_unlock(&gpData->fcntl_locking->lock);
           }
-          l = l->next;
-        }
 
-        if (bNeededMark)
-          optimize_locks(desc->g, NULL, desc->g->fcntl_locks, NULL);
+          shared_unlock(&desc->g->lock);
 
-        desc = desc->next;
+          desc = desc->next;
+        }
       }
+
+      file_desc_unlock(i);
+
+      fcntl_locking_wake(&wake);
     }
 
-    /* Go through all blocked processes and remove ourselves */
-    if (gpData->fcntl_locking->blocked)
+    shared_lock(&gpData->fcntl_locking->lock);
+
+    /* Go through all our blocked threads and remove them */
     {
-      ProcBlock *bp = NULL, *b = gpData->fcntl_locking->blocked;
+      ProcBlock *b = *waiters_bucket(pid);
       while (b)
       {
+        ProcBlock *bn = b->next;
         if (b->pid == pid)
         {
           TRACE("Will unblock [%s], type '%c', start %lld, len %lld\n",
-                b->path, b->type, (uint64_t)b->start,
+                b->g->path, b->type, (uint64_t)b->start,
                 (uint64_t)(b->end == OFF_MAX ? 0 : b->end - b->start + 1));
-          ProcBlock *bn = b->next;
-          if (bp)
-            bp->next = bn;
-          else
-            gpData->fcntl_locking->blocked = bn;
-          free(b);
-          b = bn;
-        }
-        else
-        {
-          bp = b;
-          b = b->next;
+          unlink_blocked(b);
+          /* Release our waiting thread (it will see gbTerminate) */
+          arc = DosPostEventSem(b->hev);
+          TRACE("DosPostEventSem = %lu\n", arc);
+          free_proc_block(b);
         }
+        b = bn;
       }
     }
 
-    if (bNeededMark && gpData->fcntl_locking->blocked)
-    {
-      /* We unblocked something and there are blocked threads, release them */
-      arc = DosPostEventSem(gpData->fcntl_locking->hEvSem);
-      TRACE("DosPostEventSem = %lu\n", arc);
-      /* Invalidate the blocked list (see the other DosPostEventSem call) */
-      gpData->fcntl_locking->blocked = NULL;
-    }
+    shared_unlock(&gpData->fcntl_locking->lock);
   }
 
   if (gpData->refcnt == 0)
   {
     /* We are the last process, free fcntl structures */
-    TRACE("gpData->fcntl_locking->blocked %p\n", gpData->fcntl_locking->blocked);
-    if (gpData->fcntl_locking->blocked)
+    HashMap *waiters = &gpData->fcntl_locking->waiters;
+    if (waiters->old_buckets)
+      hash_map_rehash(waiters, 0, 1, proc_block_entry_hash);
+    for (i = 0; i < waiters->size; ++i)
     {
-      ProcBlock *b = gpData->fcntl_locking->blocked;
+      ProcBlock *b = (ProcBlock *)waiters->buckets[i];
       while (b)
       {
-        TRACE("WARNING! Blocked proc: pid %d, path [%s], type='%c', start %lld, len %lld\n",
-              b->pid, b->path, b->type, (uint64_t)b->start,
+        TRACE("WARNING! Blocked proc: pid %d, blocker %d, type='%c', start %lld, len %lld\n",
+              b->pid, b->blocker, b->type, (uint64_t)b->start,
               (uint64_t)(b->end == OFF_MAX ? 0 : b->end - b->start + 1));
         ProcBlock *n = b->next;
-        free(b);
+        free_proc_block(b);
         b = n;
       }
     }
-
-    arc = DosCloseEventSem(gpData->fcntl_locking->hEvSem);
-    if (arc == ERROR_SEM_BUSY)
-    {
-      /* The semaphore may be owned by us, try to release it */
-      arc = DosPostEventSem(gpData->fcntl_locking->hEvSem);
-      TRACE("DosPostEventSem = %lu\n", arc);
-      arc = DosCloseEventSem(gpData->fcntl_locking->hEvSem);
-    }
-    TRACE("DosCloseEventSem = %lu\n", arc);
+    hash_map_free(waiters);
 
     free(gpData->fcntl_locking);
   }
 }
 
-static int fcntl_locking(int fildes, int cmd, struct flock *fl)
+/**
+ * Converts the region of @a fl to absolute [@a start, @a end] offsets in the
+ * file @a fildes. Returns 0 on success or -1 and sets errno on failure.
+ */
+static int lock_range(int fildes, const struct flock *fl, off_t *o_start, off_t *o_end)
 {
-  APIRET arc;
-  int rc, bSeenOtherPid, bNoMem = 0, bNeededMark = 0;
   off_t start, end;
-  SharedFileDesc *desc_g = NULL;
-  struct FcntlLock *lpb = NULL, *lb = NULL, *le = NULL;
-  struct FcntlLock *blocker = NULL;
-  ProcBlock *blocked = NULL;
   struct stat st;
-  __LIBC_PFH pFH;
-
-  pid_t pid = getpid();
 
-  TRACE("fd %d, cmd %d=%s, type %d=%s, whence %d=%s, start %lld, len %lld, pid %d\n",
-        fildes, cmd, cmd == F_GETLK ? "F_GETLK" :
-                     cmd == F_SETLK ? "F_SETLK" :
-                     cmd == F_SETLKW ? "F_SETLKW" : "?",
+  TRACE("type %d=%s, whence %d=%s, start %lld, len %lld, pid %d\n",
         fl->l_type, fl->l_type == F_RDLCK ? "F_RDLCK" :
                     fl->l_type == F_UNLCK ? "F_UNLCK" :
                     fl->l_type == F_WRLCK ? "F_WRLCK" :
@@ -606,35 +1295,6 @@ static int fcntl_locking(int fildes, int cmd, struct flock *fl)
                       fl->l_whence == SEEK_END ? "SEEK_END" : "?",
         (uint64_t)fl->l_start, (uint64_t)fl->l_len, fl->l_pid);
 
-  /*
-   * Get the native path from LIBC (it should always be a fully resolved
-   * absolute canonicalized path of PATH_MAX-1 length that we use as a
-   * key in the locks hash map).
-   */
-  pFH = __libc_FH(fildes);
-  if (!pFH || !pFH->pszNativePath)
-  {
-    errno = !pFH ? EBADF : EINVAL;
-    return -1;
-  }
-
-  TRACE("pszNativePath %s, fFlags %x\n", pFH->pszNativePath, pFH->fFlags);
-
-  /*
-   * Disable the below check because there are Linux/BSD distros violating
-   * POSIX docs and even Linux own man pages and allowing for write locks
-   * on readonly files.
-   */
-#if 0
-  /* Check for proper file access */
-  if ((fl->l_type == F_WRLCK && (pFH->fFlags & O_ACCMODE) == O_RDONLY) ||
-      (fl->l_type == F_RDLCK && (pFH->fFlags & O_ACCMODE) == O_WRONLY))
-  {
-    errno = EBADF;
-    return -1;
-  }
-#endif
-
   /* Normalize & check start and length */
   switch (fl->l_whence)
   {
@@ -685,23 +1345,677 @@ static int fcntl_locking(int fildes, int cmd, struct flock *fl)
     return -1;
   }
 
-  rc = 0; /* be optimistic :) */
+  *o_start = start;
+  *o_end = end;
+
+  return 0;
+}
+
+/**
+ * Returns 1 if region @a l blocks setting a lock of the given type for @a pid
+ * and 0 otherwise.
+ */
+static int lock_blocks(struct FcntlLock *l, short type, pid_t pid)
+{
+  if (l->type == 'r')
+  {
+    /* 'r' implies other PIDs hold a read lock, so write is blocked */
+    ASSERT(l->pids->used > 1);
+    return type == F_WRLCK;
+  }
+
+  return type != F_UNLCK &&
+         (l->type == 'W' || (l->type == 'R' && type == F_WRLCK)) &&
+         l->pid != pid;
+}
+
+/**
+ * Same as lock_blocks but ignores owners of @a l belonging to process
+ * @a self. Used between flock() and fcntl locks which only conflict if they
+ * belong to different processes (otherwise a process could block itself
+ * forever as no deadlock detection is done for fd owners).
+ */
+static int lock_blocks_other(struct FcntlLock *l, short type, pid_t owner, pid_t self)
+{
+  if (l->type == 'r')
+  {
+    size_t i;
+    if (type != F_WRLCK)
+      return 0;
+    for (i = 0; i < l->pids->used; ++i)
+      if (l->pids->list[i] != owner && owner_proc(l->pids->list[i]) != self)
+        return 1;
+    return 0;
+  }
+
+  return lock_blocks(l, type, owner) && owner_proc(l->pid) != self;
+}
+
+/**
+ * Finds the regions of @a desc overlapping [@a start, @a end]: the first one
+ * in @a o_lb, the one preceeding it in @a o_lpb (NULL if none) and the last
+ * one in @a o_le. Sets @a o_bSeenOtherPid to 1 if any of them is locked by
+ * an owner other than @a pid (such regions must not be joined away). Returns the first region that would block
+ * setting a lock of the given type for @a pid or NULL if there is none.
+ */
+static struct FcntlLock *find_regions(SharedFileDesc *desc, short type, pid_t pid,
+                                      off_t start, off_t end,
+                                      struct FcntlLock **o_lpb,
+                                      struct FcntlLock **o_lb,
+                                      struct FcntlLock **o_le,
+                                      int *o_bSeenOtherPid)
+{
+  struct FcntlLock *lpb, *lb, *le, *blocker = NULL;
+  int bSeenOtherPid = 0;
+
+  /* Search for the first overlapping region */
+  ASSERT(desc->fcntl_locks);
+  ASSERT(desc->fcntl_locks->start == 0);
+  lb = lock_find(desc, start);
+  /* prev to lb or NULL */
+  lpb = lb->start ? lock_find(desc, lb->start - 1) : NULL;
+  ASSERT(lpb ? lpb->next == lb : lb == desc->fcntl_locks);
+
+  /*
+   * Search for the last overlapping region and also check if there are any
+   * regions locked by other processes (includng the blocking ones).
+   */
+  le = lb;
+  while (1)
+  {
+    if (!bSeenOtherPid)
+      bSeenOtherPid = le->type == 'r' || (le->type && le->pid != pid);
+    if (!blocker && lock_blocks(le, type, pid))
+      blocker = le;
+    if (le->next && le->next->start <= end)
+      le = le->next;
+    else
+      break;
+  }
+
+  TRACE_BEGIN_IF(blocker, "Would block on type '%c', start %lld, len %lld, ",
+                 blocker->type, (uint64_t)blocker->start,
+                 (uint64_t)lock_len(blocker));
+  if (blocker->type == 'r')
+  {
+    int i;
+    TRACE_CONT("pids ");
+    for (i = 0; i < blocker->pids->used; ++i)
+      TRACE_CONT("%d ", blocker->pids->list[i]);
+    TRACE_CONT("\n");
+  }
+  else
+    TRACE_CONT("pid %d\n", blocker->pid);
+  TRACE_END();
+
+  if (o_lpb)
+    *o_lpb = lpb;
+  if (o_lb)
+    *o_lb = lb;
+  if (o_le)
+    *o_le = le;
+  if (o_bSeenOtherPid)
+    *o_bSeenOtherPid = bSeenOtherPid;
+
+  return blocker;
+}
+
+/**
+ * Sets or clears a lock of the given type on [@a start, @a end] for @a pid.
+ * The caller must make sure nothing blocks it (see find_regions). Sets
+ * @a o_bNeededMark to 1 if any region was actually changed. Memory is taken
+ * from @a res if it's not NULL (see lock_reserve). Returns 0 on success or
+ * -1 if there is not enough memory.
+ */
+static int set_lock(SharedFileDesc *desc_g, short type, pid_t pid,
+                    off_t start, off_t end, LockReserve *res, int *o_bNeededMark)
+{
+  struct FcntlLock *lpb, *lb, *le;
+  int rc = 0, bSeenOtherPid, bNeededMark = 0;
+  PidsMemo memo = {0};
+
+  memo.reserve = res;
+
+  if (find_regions(desc_g, type, pid, start, end, &lpb, &lb, &le, &bSeenOtherPid))
+    ASSERT_FAILED();
+
+  do
+  {
+    /* Process the first region */
+    if (lock_needs_mark(lb, type, pid))
+    {
+      bNeededMark = 1;
+      if (lb->start == start && lock_end(lb) == end)
+      {
+        /* Simplest case (all done in one step) */
+        rc = lock_mark(lb, type, pid, &memo);
+        break;
+      }
+      else
+      {
+        /* Split the non-aligned region (head) */
+        struct FcntlLock *ln = NULL;
+        if (lb->start < start)
+        {
+          ln = lock_split(desc_g, lb, start, res);
+          if (!ln)
+          {
+            rc = -1;
+            break;
+          }
+        }
+        if (lb == le)
+        {
+          /* No more regions */
+          if (ln)
+          {
+            /* Update lpb/lb, it is used later */
+            lpb = lb;
+            lb = ln;
+          }
+          if (lock_end(lb) > end)
+          {
+            /* Split the non-aligned region (tail) */
+            if (!lock_split(desc_g, lb, end + 1, res))
+            {
+              rc = -1;
+              break;
+            }
+          }
+          /* All done */
+          rc = lock_mark(lb, type, pid, &memo);
+          break;
+        }
+        if (ln)
+        {
+          /* Update lpb/lb, it is used later */
+          lpb = lb;
+          lb = ln;
+        }
+        rc = lock_mark(lb, type, pid, &memo);
+        if (rc == -1)
+          break;
+      }
+    }
+    else if (lb == le)
+    {
+      /* No more regions */
+      break;
+    }
+
+    /* Process the last region */
+    if (lock_needs_mark(le, type, pid))
+    {
+      bNeededMark = 1;
+      if (bSeenOtherPid)
+      {
+        /* There are regions with other PIDs, we have to split */
+        if (lock_end(le) > end)
+        {
+          /* Split the non-aligned last region */
+          if (!lock_split(desc_g, le, end + 1, res))
+          {
+            rc = -1;
+            break;
+          }
+        }
+        rc = lock_mark(le, type, pid, &memo);
+        if (rc == -1)
+          break;
+      }
+      /* Note: !bSeenOtherPid case is processed later */
+    }
+
+    /* Process the remaining regions */
+    if (!bSeenOtherPid)
+    {
+      /* No regions with other PIDs, we may join */
+      if (lb->next != le)
+      {
+        /* Delete regions between first and last */
+        struct FcntlLock *l = lb->next;
+        while (l != le)
+        {
+          ASSERT(l);
+          struct FcntlLock *next = l->next;
+          lock_free(desc_g, l);
+          l = next;
+        }
+        lb->next = le;
+      }
+      if (lock_end(le) == end)
+      {
+        /* The last region is fully inside the join */
+        lb->next = le->next;
+        lock_free(desc_g, le);
+      }
+      else
+      {
+        /*
+         * Move the start point of the last region (this keeps the
+         * treap order as all regions in between are gone now)
+         */
+        le->start = end + 1;
+      }
+      /* Update le, it is used later */
+      le = lb;
+    }
+    else
+    {
+      /* Just mark the regions with our type/pid */
+      struct FcntlLock *l = lb->next;
+      while (l != le)
+      {
+        ASSERT(l);
+        if (lock_needs_mark(l, type, pid))
+        {
+          bNeededMark = 1;
+          rc = lock_mark(l, type, pid, &memo);
+          if (rc == -1)
+            break;
+        }
+        l = l->next;
+      }
+    }
+  }
+  while (0);
+
+  memo_done(&memo);
+
+  /* We may only get -1 above due to mem alloc failure */
+  if (rc != -1)
+    optimize_locks(desc_g, lpb, lb, le);
+
+  *o_bNeededMark = bNeededMark;
+
+  return rc;
+}
+
+/**
+ * Returns the lock that would block setting a whole-file flock() lock of the
+ * given type for @a owner or NULL if there is none. Only the flock() lock is
+ * checked if there are no fcntl locks on the file. Note that fcntl locks of
+ * the same process don't block flock() (see lock_blocks_other).
+ */
+static struct FcntlLock *flock_blocker(SharedFileDesc *desc, short type, pid_t owner)
+{
+  struct FcntlLock *l = desc->fcntl_locks;
+  pid_t self = owner_proc(owner);
+
+  if (lock_blocks(desc->flock_lock, type, owner))
+    return desc->flock_lock;
+
+  for (; l; l = l->next)
+    if (lock_blocks_other(l, type, owner, self))
+      return l;
+
+  return NULL;
+}
+
+/**
+ * Sets or clears the whole-file flock() lock of the given type for @a owner.
+ * The caller must make sure nothing blocks it (see flock_blocker). Sets
+ * @a o_bNeededMark to 1 if the lock was changed. Returns 0 on success and -1
+ * if there is no memory.
+ */
+static int flock_set(SharedFileDesc *desc, short type, pid_t owner, int *o_bNeededMark)
+{
+  struct FcntlLock *l = desc->flock_lock;
+
+  *o_bNeededMark = 0;
+
+  if (!lock_needs_mark(l, type, owner))
+    return 0;
+
+  *o_bNeededMark = 1;
+
+  return lock_mark(l, type, owner, NULL);
+}
+
+/**
+ * Returns the maximum number of spins for a F_SETLKW waiter on @a desc.
+ */
+inline static int spin_max(SharedFileDesc *desc)
+{
+  unsigned max = desc->fcntl_spins / 4 + FCNTL_SPIN_MIN;
+  return max < FCNTL_SPIN_MAX ? max : FCNTL_SPIN_MAX;
+}
+
+/**
+ * Updates the recent average number of spins on @a desc with the number of
+ * @a spins a F_SETLKW waiter needed to get its lock (or with 0 if spinning
+ * didn't help and it had to sleep). Locks held for a short time make the
+ * waiters spin longer and locks held for a long time make them go to sleep
+ * sooner. Must be called under SharedFileDesc::lock.
+ */
+inline static void spin_update(SharedFileDesc *desc, int spins)
+{
+  /* Exponential moving average with weight 1/8 (scaled by 8) */
+  desc->fcntl_spins = desc->fcntl_spins - desc->fcntl_spins / 8 + spins;
+}
+
+/**
+ * Waits a bit before a F_SETLKW waiter checks its lock again.
+ */
+static void spin_pause(void)
+{
+  if (gNumCPUs > 1)
+  {
+    int i;
+    for (i = 0; i < FCNTL_SPIN_PAUSES; ++i)
+      __asm__ __volatile__("pause");
+  }
+  else
+  {
+    /* Spinning is useless if the lock owner can't run, let it run instead */
+    DosSleep(0);
+  }
+}
+
+/**
+ * Request to set or clear a lock (see fcntl_locking).
+ */
+typedef struct LockReq
+{
+  short type; /* F_RDLCK, F_WRLCK or F_UNLCK */
+  off_t start; /* Start of the region */
+  off_t end; /* End of the region */
+  int bNeededMark; /* 1 if set_lock changed any regions */
+} LockReq;
+
+/**
+ * Frees memory left in @a res by lock_reserve.
+ */
+static void lock_reserve_free(LockReserve *res)
+{
+  while (res->locks)
+  {
+    struct FcntlLock *l = res->locks;
+    res->locks = l->next;
+    slab_free(l);
+  }
+  while (res->pids)
+  {
+    PidList *list = res->pids;
+    res->pids = list->next_free;
+    free(list);
+  }
+}
+
+/**
+ * Returns 1 if region @a l has owners other than @a owner and 0 otherwise.
+ */
+inline static int lock_is_foreign(struct FcntlLock *l, pid_t owner)
+{
+  return l->type == 'r' || (l->type == 'R' && l->pid != owner);
+}
+
+/**
+ * Returns 1 if splitting at @a split would cut a region having owners other
+ * than @a owner in two and 0 otherwise.
+ */
+static int lock_cuts_foreign(SharedFileDesc *desc_g, off_t split, pid_t owner)
+{
+  struct FcntlLock *l = lock_find(desc_g, split);
+  return l->start < split && lock_is_foreign(l, owner);
+}
+
+/**
+ * Reserves enough memory in @a res to apply all @a num_reqs requests of
+ * @a reqs for @a owner with set_lock so that it can't fail (see
+ * libcx_fcntl_lockv). Each request splits at most two regions. It may also
+ * need a new owner list for every region with other owners it covers at the
+ * time it is applied (only such regions have lists to copy or get one when
+ * read locked). Our requests never add other owners, so these regions are
+ * pieces of the ones that have other owners now: one per such region in the
+ * covered range plus one per split point of an earlier request that falls
+ * inside both the range and such a region. Nothing is reserved for ranges
+ * with no other owners. No list grows by more than one owner in the series,
+ * so lists PID_LIST_MIN_SIZE larger than the largest list in the covered
+ * ranges are enough for any of them. Must be called under
+ * SharedFileDesc::lock. Returns 0 on success or -1 if there is not enough
+ * memory or more than LOCK_RESERVE_MAX_PIDS lists would be needed (nothing
+ * is reserved then).
+ */
+static int lock_reserve(SharedFileDesc *desc_g, LockReq *reqs, size_t num_reqs,
+                        pid_t owner, LockReserve *res)
+{
+  size_t i, j, num_pids = 0;
+
+  res->locks = NULL;
+  res->pids = NULL;
+  res->pids_size = PID_LIST_MIN_SIZE;
+
+  for (i = 0; i < num_reqs; ++i)
+  {
+    struct FcntlLock *l;
+    size_t n = 0;
+
+    if (reqs[i].type == F_WRLCK)
+    {
+      /* Write locks are only set on regions with no other owners */
+      continue;
+    }
+
+    for (l = lock_find(desc_g, reqs[i].start); l && l->start <= reqs[i].end; l = l->next)
+    {
+      if (lock_is_foreign(l, owner))
+      {
+        ++n;
+        if (l->type == 'r' && res->pids_size < l->pids->size + PID_LIST_MIN_SIZE)
+          res->pids_size = l->pids->size + PID_LIST_MIN_SIZE;
+      }
+    }
+
+    if (n)
+    {
+      /* Add pieces split off by earlier requests within this range */
+      for (j = 0; j < i; ++j)
+      {
+        if (reqs[j].start > reqs[i].start && reqs[j].start <= reqs[i].end &&
+            lock_cuts_foreign(desc_g, reqs[j].start, owner))
+          ++n;
+        if (reqs[j].end >= reqs[i].start && reqs[j].end < reqs[i].end &&
+            lock_cuts_foreign(desc_g, reqs[j].end + 1, owner))
+          ++n;
+      }
+    }
+
+    num_pids += n;
+    if (num_pids > LOCK_RESERVE_MAX_PIDS)
+    {
+      TRACE("Too many owner lists to reserve (over %u)\n", LOCK_RESERVE_MAX_PIDS);
+      return -1;
+    }
+  }
+
+  for (i = 0; i < num_reqs * 2; ++i)
+  {
+    struct FcntlLock *l;
+    GLOBAL_NEW_SLAB(l, SlabFcntlLock);
+    if (!l)
+      break;
+    l->next = res->locks;
+    res->locks = l;
+  }
+
+  if (i == num_reqs * 2)
+  {
+    for (i = 0; i < num_pids; ++i)
+    {
+      PidList *list = new_pids(res->pids_size);
+      if (!list)
+        break;
+      list->next_free = res->pids;
+      res->pids = list;
+    }
+    if (i == num_pids)
+      return 0;
+  }
+
+  lock_reserve_free(res);
+  return -1;
+}
+
+/**
+ * Implements F_GETLK, F_SETLK and F_SETLKW, their OFD variants and flock()
+ * (F_FLOCK and F_FLOCKW with a single whole-file lock in @a fls). In case of
+ * F_SETLK and F_SETLKW, @a fls may contain more than one lock (see
+ * libcx_fcntl_lockv). These locks are set or cleared in order under one file
+ * lock and only if none of them is blocked by other processes. F_SETLKW waits
+ * no longer than @a timeout ms (SEM_INDEFINITE_WAIT means forever) and fails
+ * with ETIMEDOUT after that.
+ */
+static int fcntl_locking(int fildes, int cmd, struct flock *fls, size_t num_locks,
+                         ULONG timeout)
+{
+  APIRET arc;
+  int rc, bNoMem = 0, bNeedWake = 0, bPosted = 0, bFlock = 0;
+  int spins = 0, max_spins = -1;
+  ULONG start_ms = 0, wait_ms = SEM_INDEFINITE_WAIT;
+  size_t hash, i;
+  SharedFileDesc *desc_g = NULL;
+  struct FcntlLock *blocker = NULL;
+  ProcBlock *blocked = NULL;
+  struct flock *fl = fls;
+  LockReq req, *reqs = &req, *breq = NULL;
+  LockReserve res, *pres = NULL;
+  FcntlWakeList wake;
+  __LIBC_PFH pFH;
+
+  pid_t pid = getpid();
+  pid_t owner = pid;
+
+  wake.num = 0;
+
+  ASSERT(num_locks == 1 || (cmd != F_GETLK && cmd != F_OFD_GETLK));
+
+  TRACE("fd %d, cmd %d=%s, num_locks %u\n",
+        fildes, cmd, cmd == F_GETLK ? "F_GETLK" :
+                     cmd == F_SETLK ? "F_SETLK" :
+                     cmd == F_SETLKW ? "F_SETLKW" :
+                     cmd == F_OFD_GETLK ? "F_OFD_GETLK" :
+                     cmd == F_OFD_SETLK ? "F_OFD_SETLK" :
+                     cmd == F_OFD_SETLKW ? "F_OFD_SETLKW" :
+                     cmd == F_FLOCK ? "F_FLOCK" :
+                     cmd == F_FLOCKW ? "F_FLOCKW" : "?",
+        num_locks);
+
+  /*
+   * Get the native path from LIBC (it should always be a fully resolved
+   * absolute canonicalized path of PATH_MAX-1 length that we use as a
+   * key in the locks hash map).
+   */
+  pFH = __libc_FH(fildes);
+  if (!pFH || !pFH->pszNativePath)
+  {
+    errno = !pFH ? EBADF : EINVAL;
+    return -1;
+  }
+
+  TRACE("pszNativePath %s, fFlags %x\n", pFH->pszNativePath, pFH->fFlags);
+
+  if (cmd == F_OFD_GETLK || cmd == F_OFD_SETLK || cmd == F_OFD_SETLKW ||
+      cmd == F_FLOCK || cmd == F_FLOCKW)
+  {
+    /*
+     * OFD locks are owned by the open file description rather than by the
+     * process. As we can't tell which fds share the same description (e.g.
+     * after dup() or fork()), the fd in this process is the owner. The rest
+     * works the same way as for normal locks. Locks set by flock() are owned
+     * the same way but they are kept in SharedFileDesc::flock_lock rather
+     * than in regions.
+     */
+    if (fildes > OFD_MAX_FD)
+    {
+      errno = ENOLCK;
+      return -1;
+    }
+    owner = ofd_owner(pid, fildes);
+    bFlock = cmd == F_FLOCK || cmd == F_FLOCKW;
+    cmd = cmd == F_OFD_GETLK ? F_GETLK :
+          cmd == F_OFD_SETLK || cmd == F_FLOCK ? F_SETLK : F_SETLKW;
+    ASSERT(!bFlock || num_locks == 1);
+  }
+
+  /*
+   * Disable the below check because there are Linux/BSD distros violating
+   * POSIX docs and even Linux own man pages and allowing for write locks
+   * on readonly files.
+   */
+#if 0
+  /* Check for proper file access */
+  if ((fl->l_type == F_WRLCK && (pFH->fFlags & O_ACCMODE) == O_RDONLY) ||
+      (fl->l_type == F_RDLCK && (pFH->fFlags & O_ACCMODE) == O_WRONLY))
+  {
+    errno = EBADF;
+    return -1;
+  }
+#endif
+
+  if (num_locks > 1)
+  {
+    NEW_ARRAY(reqs, num_locks);
+    if (!reqs)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  for (i = 0; i < num_locks; ++i)
+  {
+    if (cmd != F_GETLK && fls[i].l_type != F_RDLCK &&
+        fls[i].l_type != F_WRLCK && fls[i].l_type != F_UNLCK)
+    {
+      TRACE("Bad type %d\n", fls[i].l_type);
+      errno = EINVAL;
+      break;
+    }
+    if (lock_range(fildes, &fls[i], &reqs[i].start, &reqs[i].end) == -1)
+      break;
+    reqs[i].type = fls[i].l_type;
+    reqs[i].bNeededMark = 0;
+  }
+  if (i < num_locks)
+  {
+    if (reqs != &req)
+      free(reqs);
+    return -1;
+  }
+
+  rc = 0; /* be optimistic :) */
+
+  if (timeout != SEM_INDEFINITE_WAIT)
+    DosQuerySysInfo(QSV_MS_COUNT, QSV_MS_COUNT, &start_ms, sizeof(start_ms));
 
-  global_lock();
+  hash = file_desc_hash(pFH->pszNativePath);
 
   while (1)
   {
+    file_desc_lock(hash);
+
     if (cmd == F_GETLK)
     {
-      find_file_desc(pFH->pszNativePath, &desc_g);
+      find_file_desc(pFH->pszNativePath, hash, &desc_g);
     }
     else
     {
-      FileDesc *desc = get_file_desc(fildes, pFH->pszNativePath);
+      FileDesc *desc = get_file_desc(fildes, pFH->pszNativePath, hash);
       if (desc)
         desc_g = desc->g;
     }
 
+    /*
+     * Lock the regions of this file and release the bucket to let operations
+     * on other files in it run in parallel. Note that desc_g may not be freed
+     * while we hold its lock (see free_file_desc).
+     */
+    if (desc_g)
+      shared_lock(&desc_g->lock);
+
+    file_desc_unlock(hash);
+
     if (!desc_g)
     {
       if (cmd == F_GETLK)
@@ -736,9 +2050,8 @@ static int fcntl_locking(int fildes, int cmd, struct flock *fl)
         {
           int i;
           TRACE_CONT("pids ");
-          for (i = 0; i < l->pids->size; ++i)
-            if (l->pids->list[i])
-              TRACE_CONT("%d ", l->pids->list[i]);
+          for (i = 0; i < l->pids->used; ++i)
+            TRACE_CONT("%d ", l->pids->list[i]);
           TRACE_CONT("\n");
         }
         else
@@ -747,81 +2060,24 @@ static int fcntl_locking(int fildes, int cmd, struct flock *fl)
     }
     TRACE_END();
 
-    /* Search for the first overlapping region */
-    ASSERT(desc_g->fcntl_locks);
-    ASSERT(desc_g->fcntl_locks->start == 0);
-    lpb = NULL; /* prev to lb or NULL */
-    lb = desc_g->fcntl_locks;
-    while (lb->next && lb->next->start <= start)
-    {
-      lpb = lb;
-      lb = lb->next;
-    }
-
-    if (cmd == F_GETLK && fl->l_type == -1)
-    {
-      /* LIBCx extension: return the existing lock at the given position */
-      fl->l_type = lb->type == 'W' ? F_WRLCK : lb->type == 0 ? F_UNLCK : F_RDLCK;
-      fl->l_start = lb->start;
-      fl->l_whence = SEEK_SET;
-      fl->l_len = lock_len(lb);
-      fl->l_pid = first_pid(lb);
-      break;
-    }
-
-    /*
-     * Search for the last overlapping region and also check if there are any
-     * regions locked by other processes (includng the blocking ones).
-     */
-    bSeenOtherPid = 0;
-    blocker = NULL;
-    le = lb;
-    while (1)
+    if (cmd == F_GETLK)
     {
-      if (!bSeenOtherPid)
-        bSeenOtherPid = le->type == 'r' || (le->type == 'R' && le->pid != pid);
-      if (!blocker)
+      if (fl->l_type == -1)
       {
-        if (le->type == 'r')
-        {
-          if (fl->l_type == F_WRLCK)
-          {
-            /* 'r' implies other PIDs hold a read lock, so write is blocked */
-            ASSERT(le->pids->used > 1);
-            blocker = le;
-          }
-        }
-        else if (fl->l_type != F_UNLCK)
-        {
-          if ((le->type == 'W' || (le->type == 'R' && fl->l_type == F_WRLCK)) &&
-              le->pid != pid)
-            blocker = le;
-        }
-      }
-      if (le->next && le->next->start <= end)
-        le = le->next;
-      else
+        /* LIBCx extension: return the existing lock at the given position */
+        struct FcntlLock *lb = lock_find(desc_g, req.start);
+        fl->l_type = lb->type == 'W' ? F_WRLCK : lb->type == 0 ? F_UNLCK : F_RDLCK;
+        fl->l_start = lb->start;
+        fl->l_whence = SEEK_SET;
+        fl->l_len = lock_len(lb);
+        fl->l_pid = owner_pid(first_pid(lb));
         break;
-    }
-
-    TRACE_BEGIN_IF(blocker, "Would block on type '%c', start %lld, len %lld, ",
-                   blocker->type, (uint64_t)blocker->start,
-                   (uint64_t)lock_len(blocker));
-    if (blocker->type == 'r')
-    {
-      int i;
-      TRACE_CONT("pids ");
-      for (i = 0; i < blocker->pids->size; ++i)
-        if (blocker->pids->list[i])
-          TRACE_CONT("%d ", blocker->pids->list[i]);
-      TRACE_CONT("\n");
-    }
-    else
-      TRACE_CONT("pid %d\n", blocker->pid);
-    TRACE_END();
+      }
 
-    if (cmd == F_GETLK)
-    {
+      blocker = find_regions(desc_g, fl->l_type, owner, req.start, req.end,
+                             NULL, NULL, NULL, NULL);
+      if (!blocker && lock_blocks_other(desc_g->flock_lock, fl->l_type, owner, pid))
+        blocker = desc_g->flock_lock;
       if (blocker)
       {
         /* Copy over the blocking lock data */
@@ -829,276 +2085,258 @@ static int fcntl_locking(int fildes, int cmd, struct flock *fl)
         fl->l_whence = SEEK_SET;
         fl->l_start = blocker->start;
         fl->l_len = lock_len(blocker);
-        fl->l_pid = first_pid(blocker);
+        fl->l_pid = owner_pid(first_pid(blocker));
       }
       else
       {
         /* No blocking locks on this file */
         fl->l_type = F_UNLCK;
       }
+      break;
     }
-    else
+
+    /*
+     * Check if any of the requested locks would block (note that our own
+     * locks never block us so setting some of them can't make others block).
+     */
+    blocker = NULL;
+    for (i = 0; i < num_locks && !blocker; ++i)
     {
-      if (blocker)
+      if (reqs[i].type != F_UNLCK)
+      {
+        breq = &reqs[i];
+        if (bFlock)
+          blocker = flock_blocker(desc_g, breq->type, owner);
+        else
+        {
+          blocker = find_regions(desc_g, breq->type, owner, breq->start, breq->end,
+                                 NULL, NULL, NULL, NULL);
+          if (!blocker && lock_blocks_other(desc_g->flock_lock, breq->type, owner, pid))
+            blocker = desc_g->flock_lock;
+        }
+      }
+    }
+
+    if (blocker)
+    {
+      if (cmd == F_SETLK)
+      {
+        /*
+         * While POSIX lists both EACCES and EAGAIN as possible errors for a
+         * blocking condition and the original kLIBC call returns EACCES, we
+         * use EAGAIN here to be GNU/Linux compatible (and the POSIX conforming
+         * app should check for both). This suppresses false failed tdb_brloock
+         * trace log records in Samba.
+         */
+        errno = EAGAIN;
+        rc = -1;
+      }
+      else
       {
-        if (cmd == F_SETLK)
+        if (timeout != SEM_INDEFINITE_WAIT)
+        {
+          ULONG now_ms;
+          DosQuerySysInfo(QSV_MS_COUNT, QSV_MS_COUNT, &now_ms, sizeof(now_ms));
+          if (now_ms - start_ms >= timeout)
+          {
+            TRACE("Timed out\n");
+            errno = ETIMEDOUT;
+            rc = -1;
+            break;
+          }
+          wait_ms = timeout - (now_ms - start_ms);
+        }
+
+        if (max_spins == -1)
+          max_spins = spin_max(desc_g);
+
+        if (spins < max_spins)
         {
           /*
-           * While POSIX lists both EACCES and EAGAIN as possible errors for a
-           * blocking condition and the original kLIBC call returns EACCES, we
-           * use EAGAIN here to be GNU/Linux compatible (and the POSIX conforming
-           * app should check for both). This suppresses false failed tdb_brloock
-           * trace log records in Samba.
+           * Spin for a while before going to sleep as short-lived locks (like
+           * tdb record locks) are likely to go away soon and sleeping takes
+           * a ProcBlock and a full wakeup cycle.
            */
-          errno = EAGAIN;
-          rc = -1;
+          ++spins;
+          shared_unlock(&desc_g->lock);
+          desc_g = NULL;
+          spin_pause();
+          continue;
         }
-        else
-        {
-          /* Block this thread due to F_SETLKW */
-          ProcBlock *bp, *b;
 
-          ASSERT(fl->l_type != F_UNLCK);
+        /* Block this thread due to F_SETLKW, spinning didn't help this time */
+        if (!blocked)
+          spin_update(desc_g, 0);
+
+        ASSERT(breq->type != F_UNLCK);
 
-          TRACE("Need type '%c', start %lld, len %lld\n", fl->l_type == F_WRLCK ? 'W' : 'R',
-                (uint64_t)start, (uint64_t)(end == OFF_MAX ? 0 : end - start + 1));
-          TRACE("Will wait (blocked head %p)\n", gpData->fcntl_locking->blocked);
+        TRACE("Need type '%c', start %lld, len %lld\n", breq->type == F_WRLCK ? 'W' : 'R',
+              (uint64_t)breq->start,
+              (uint64_t)(breq->end == OFF_MAX ? 0 : breq->end - breq->start + 1));
+
+        shared_lock(&gpData->fcntl_locking->lock);
+
+        TRACE("Will wait (blocked head %p)\n", desc_g->fcntl_blocked);
+
+        /*
+         * Check if our blocker is itself blocked on us, directly or through
+         * other processes (which would mean a deadlock). Not done for OFD
+         * locks as their owners are not processes.
+         */
+        if (owner == pid && find_deadlock(pid, blocker))
+        {
+          /* Got one; report a deadlock condition */
+          TRACE("Deadlock detected\n");
+          errno = EDEADLK;
+          rc = -1;
+          shared_unlock(&gpData->fcntl_locking->lock);
+          break;
+        }
 
-          /* Check if our blocker is itself blocked on us (which would mean a deadlock) */
-          b = gpData->fcntl_locking->blocked;
-          while (b)
+        /* Initialze the blocking struct if needed */
+        if (!blocked)
+        {
+          GLOBAL_NEW_SLAB(blocked, SlabProcBlock);
+          if (!blocked)
           {
-            if (lock_has_pid(blocker, b->pid) && b->blocker == pid)
-            {
-              /* Got one; report a deadlock condition */
-              TRACE("Deadlock detected\n");
-              errno = EDEADLK;
-              rc = -1;
-              break;
-            }
-            b = b->next;
-          }
-          if (rc == -1)
+            shared_unlock(&gpData->fcntl_locking->lock);
+            bNoMem = 1;
             break;
+          }
+          blocked->pid = pid;
 
-          /* Initialze the blocking struct if needed */
-          if (!blocked)
+          /* Each blocked process waits on its own semaphore */
+          arc = DosCreateEventSem(NULL, &blocked->hev,
+                                  DC_SEM_SHARED | DCE_AUTORESET, FALSE);
+          TRACE_IF(arc, "DosCreateEventSem = %lu\n", arc);
+          if (arc != NO_ERROR)
           {
-            GLOBAL_NEW(blocked);
-            if (!blocked)
-            {
-              bNoMem = 1;
-              break;
-            }
-            blocked->pid = pid;
-            blocked->type = fl->l_type == F_WRLCK ? 'W' : 'R';
-            blocked->start = start;
-            blocked->end = end;
-            strncpy(blocked->path, pFH->pszNativePath, PATH_MAX - 1);
+            slab_free(blocked);
+            blocked = NULL;
+            shared_unlock(&gpData->fcntl_locking->lock);
+            bNoMem = 1;
+            break;
           }
+        }
+
+        /* Remember what we wait for (may change between attempts) */
+        blocked->type = breq->type == F_WRLCK ? 'W' : 'R';
+        blocked->start = breq->start;
+        blocked->end = breq->end;
+        set_blockers(blocked, blocker);
+        blocked->g = desc_g;
 
-          /* Remember the blocking pid */
-          blocked->blocker = blocker->pid;
+        /* Add the new block to the blocked lists */
+        link_blocked(blocked);
 
-          /* Add the new block to the head of the blocked list */
-          blocked->next = gpData->fcntl_locking->blocked;
-          gpData->fcntl_locking->blocked = blocked;
+        shared_unlock(&gpData->fcntl_locking->lock);
 
-          global_unlock();
+        /* Note that we will look up desc_g again after waking up */
+        shared_unlock(&desc_g->lock);
+        desc_g = NULL;
+
+        if (timeout == SEM_INDEFINITE_WAIT)
+          DOS_NI(arc = DosWaitEventSem(blocked->hev, SEM_INDEFINITE_WAIT));
+        else
+          arc = DosWaitEventSem(blocked->hev, wait_ms);
+        TRACE("DosWaitEventSem = %lu\n", arc);
 
-          DOS_NI(arc = DosWaitEventSem(gpData->fcntl_locking->hEvSem, SEM_INDEFINITE_WAIT));
-          TRACE("DosWaitEventSem = %lu\n", arc);
+        ASSERT(arc == NO_ERROR || arc == ERROR_INTERRUPT || arc == ERROR_TIMEOUT);
 
-          ASSERT(arc == NO_ERROR || arc == ERROR_INTERRUPT);
+        if (arc == ERROR_INTERRUPT)
+        {
+          errno = EINTR;
+          rc = -1;
+        }
+        else if (arc == ERROR_TIMEOUT)
+        {
+          /*
+           * Note that we may still be woken up right after the timeout, in
+           * which case we have been already removed from the blocked list.
+           */
+          errno = ETIMEDOUT;
+          rc = -1;
+        }
 
-          if (arc == ERROR_INTERRUPT)
+        if (gbTerminate)
+        {
+          /*
+           * Our process have already freed all blocked data including our
+           * blocked record in fcntl_locking_term() due to unexpected
+           * termination, report it as EINTR just in case (if not already
+           * reporting some error).
+           */
+          TRACE("gbTerminate\n");
+          blocked = NULL;
+          if (rc != -1)
           {
             errno = EINTR;
             rc = -1;
           }
+        }
 
-          global_lock();
+        /*
+         * Note: we don't need to remove our blocked record from the blocked
+         * list if we were woken up because wake_blocked() does that.
+         */
 
-          if (gbTerminate)
+        if (rc == -1)
+        {
+          if (blocked)
           {
-            /*
-             * Our process have already freed all blocked data including our
-             * blocked record in fcntl_locking_term() due to unexpected
-             * termination, report it as EINTR just in case (if not already
-             * reporting some error).
-             */
-            TRACE("gbTerminate\n");
-            blocked = NULL;
-            if (rc != -1)
-            {
-              errno = EINTR;
-              rc = -1;
-            }
+            shared_lock(&gpData->fcntl_locking->lock);
+            unlink_blocked(blocked);
+            shared_unlock(&gpData->fcntl_locking->lock);
           }
-
-          /*
-           * Note: we don't need to remove our blocked record from the blocked
-           * list because it must have been reset by the thread that woke us
-           * up in order to invalidate it (see the comment near the
-           * DosPostEventSem call below).
-           */
-
-          if (rc == -1)
-            break;
-
-          /* Recheck for blocking regions */
-          continue;
+          break;
         }
+
+        /* Recheck for blocking regions */
+        continue;
       }
-      else
+    }
+    else
+    {
+      /* Spinning helped, remember how long it took */
+      if (spins && !blocked)
+        spin_update(desc_g, spins);
+
+      /*
+       * With more than one lock, reserve all memory beforehand so that either
+       * all of them or none are set (a single set_lock either fails before
+       * changing anything or only leaves regions split).
+       */
+      if (num_locks > 1)
       {
-        /*
-         * We are good to set/clear a new lock as requested.
-         */
-        do
+        if (lock_reserve(desc_g, reqs, num_locks, owner, &res) == -1)
         {
-          /* Process the first region */
-          if (lock_needs_mark(lb, fl->l_type, pid))
-          {
-            bNeededMark = 1;
-            if (lb->start == start && lock_end(lb) == end)
-            {
-              /* Simplest case (all done in one step) */
-              rc = lock_mark(lb, fl->l_type, pid);
-              break;
-            }
-            else
-            {
-              /* Split the non-aligned region (head) */
-              struct FcntlLock *ln = NULL;
-              if (lb->start < start)
-              {
-                ln = lock_split(lb, start);
-                if (!ln)
-                {
-                  rc = -1;
-                  break;
-                }
-              }
-              if (lb == le)
-              {
-                /* No more regions */
-                if (ln)
-                {
-                  /* Update lpb/lb, it is used later */
-                  lpb = lb;
-                  lb = ln;
-                }
-                if (lock_end(lb) > end)
-                {
-                  /* Split the non-aligned region (tail) */
-                  if (!lock_split(lb, end + 1))
-                  {
-                    rc = -1;
-                    break;
-                  }
-                }
-                /* All done */
-                rc = lock_mark(lb, fl->l_type, pid);
-                break;
-              }
-              if (ln)
-              {
-                /* Update lpb/lb, it is used later */
-                lpb = lb;
-                lb = ln;
-              }
-              rc = lock_mark(lb, fl->l_type, pid);
-              if (rc == -1)
-                break;
-            }
-          }
-          else if (lb == le)
-          {
-            /* No more regions */
-            break;
-          }
-
-          /* Process the last region */
-          if (lock_needs_mark(le, fl->l_type, pid))
-          {
-            bNeededMark = 1;
-            if (bSeenOtherPid)
-            {
-              /* There are regions with other PIDs, we have to split */
-              if (lock_end(le) > end)
-              {
-                /* Split the non-aligned last region */
-                if (!lock_split(le, end + 1))
-                {
-                  rc = -1;
-                  break;
-                }
-              }
-              rc = lock_mark(le, fl->l_type, pid);
-              if (rc == -1)
-                break;
-            }
-            /* Note: !bSeenOtherPid case is processed later */
-          }
-
-          /* Process the remaining regions */
-          if (!bSeenOtherPid)
-          {
-            /* No regions with other PIDs, we may join */
-            if (lb->next != le)
-            {
-              /* Delete regions between first and last */
-              struct FcntlLock *l = lb->next;
-              while (l != le)
-              {
-                ASSERT(l);
-                struct FcntlLock *next = l->next;
-                lock_free(l);
-                l = next;
-              }
-              lb->next = le;
-            }
-            if (lock_end(le) == end)
-            {
-              /* The last region is fully inside the join */
-              lb->next = le->next;
-              lock_free(le);
-            }
-            else
-            {
-              /* Move the start point of the last region */
-              le->start = end + 1;
-            }
-            /* Update le, it is used later */
-            le = lb;
-          }
-          else
-          {
-            /* Just mark the regions with our type/pid */
-            struct FcntlLock *l = lb->next;
-            while (l != le)
-            {
-              ASSERT(l);
-              if (lock_needs_mark (l, fl->l_type, pid))
-              {
-                bNeededMark = 1;
-                rc = lock_mark(l, fl->l_type, pid);
-                if (rc == -1)
-                  break;
-              }
-              l = l->next;
-            }
-          }
+          bNoMem = 1;
+          break;
         }
-        while (0);
+        pres = &res;
+      }
 
-        /* We may only get -1 above due to mem alloc failure */
+      /* We are good to set/clear the new locks as requested */
+      for (i = 0; i < num_locks; ++i)
+      {
+        if (bFlock)
+          rc = flock_set(desc_g, reqs[i].type, owner, &reqs[i].bNeededMark);
+        else
+          rc = set_lock(desc_g, reqs[i].type, owner, reqs[i].start, reqs[i].end,
+                        pres, &reqs[i].bNeededMark);
+        if (reqs[i].type != F_WRLCK && reqs[i].bNeededMark)
+          bNeedWake = 1;
+        /* We may only get -1 here due to mem alloc failure */
         if (rc == -1)
+        {
+          ASSERT(!pres);
           bNoMem = 1;
-        else
-          optimize_locks(desc_g, lpb, lb, le);
+          break;
+        }
       }
+
+      if (pres)
+        lock_reserve_free(pres);
     }
 
     break;
@@ -1117,15 +2355,57 @@ static int fcntl_locking(int fildes, int cmd, struct flock *fl)
     rc = -1;
   }
 
-  if (cmd != F_GETLK && fl->l_type == F_UNLCK && bNeededMark &&
-      gpData->fcntl_locking->blocked)
+  if (desc_g)
+  {
+    if (bNeedWake)
+    {
+      shared_lock(&gpData->fcntl_locking->lock);
+
+      /*
+       * We unlocked (or downgraded) some locks, release the threads blocked
+       * on the affected regions to let them recheck. Their records are
+       * removed from the blocked list as they may refer to our PID as a
+       * blocker which may be not true any more (and could cause a false
+       * deadlock detection upon our new attempt to lock something during the
+       * current time slice if the yielding below didn't give some blocking
+       * thread a chance to run for some reason). Threads blocked on other
+       * regions or files are not affected by this change and stay asleep.
+       */
+      for (i = 0; i < num_locks; ++i)
+        if (reqs[i].type != F_WRLCK && reqs[i].bNeededMark &&
+            wake_blocked(desc_g, reqs[i].start, reqs[i].end, &wake))
+          bPosted = 1;
+
+      shared_unlock(&gpData->fcntl_locking->lock);
+    }
+
+    TRACE_BEGIN_IF(TRACE_MORE && cmd != F_GETLK, "Locks after:\n");
+    {
+      struct FcntlLock *l;
+      for (l = desc_g->fcntl_locks; l; l = l->next)
+      {
+        TRACE_CONT("- type '%c', start %lld, ", l->type ? l->type : ' ', (uint64_t)l->start);
+        if (l->type == 'r')
+        {
+          int i;
+          TRACE_CONT("pids ");
+          for (i = 0; i < l->pids->used; ++i)
+            TRACE_CONT("%d ", l->pids->list[i]);
+          TRACE_CONT("\n");
+        }
+        else
+          TRACE_CONT("pid %d\n", l->pid);
+      }
+    }
+    TRACE_END();
+
+    shared_unlock(&desc_g->lock);
+  }
+
+  fcntl_locking_wake(&wake);
+
+  if (bPosted)
   {
-    /*
-     * We unlocked some locks and there are blocked threads,
-     * release them to let recheck regions.
-     */
-    arc = DosPostEventSem(gpData->fcntl_locking->hEvSem);
-    TRACE("DosPostEventSem = %lu\n", arc);
     /*
      * Let woken up threads run. W/o this call this thread will continue to run
      * till the end of the time slice and may lock the same region again w/o
@@ -1133,41 +2413,17 @@ static int fcntl_locking(int fildes, int cmd, struct flock *fl)
      * starvation.
      */
     DosSleep(0);
-    /*
-     * Reset the blocked list to invalidate it - the entries in this list may
-     * refer to our PID as a blocker which may be not true any more (and could
-     * cause a false deadlock detection upon our new attempt to lock something
-     * during the current time slice if the above yielding didn't give some
-     * blocking thread a chance to run for some reason).
-     */
-    gpData->fcntl_locking->blocked = NULL;
   }
 
-  TRACE_BEGIN_IF(TRACE_MORE && cmd != F_GETLK, "Locks after:\n");
+  if (blocked)
   {
-    struct FcntlLock *l;
-    for (l = desc_g->fcntl_locks; l; l = l->next)
-    {
-      TRACE_CONT("- type '%c', start %lld, ", l->type ? l->type : ' ', (uint64_t)l->start);
-      if (l->type == 'r')
-      {
-        int i;
-        TRACE_CONT("pids ");
-        for (i = 0; i < l->pids->size; ++i)
-          if (l->pids->list[i])
-            TRACE_CONT("%d ", l->pids->list[i]);
-        TRACE_CONT("\n");
-      }
-      else
-        TRACE_CONT("pid %d\n", l->pid);
-    }
+    arc = DosCloseEventSem(blocked->hev);
+    TRACE_IF(arc, "DosCloseEventSem = %lu\n", arc);
+    free_proc_block(blocked);
   }
-  TRACE_END();
 
-  global_unlock();
-
-  if (blocked)
-    free(blocked);
+  if (reqs != &req)
+    free(reqs);
 
   TRACE_IF(rc, "rc=%d errno=%d\n", rc, errno);
 
@@ -1193,50 +2449,88 @@ int fcntl(int fildes, int cmd, intptr_t *arg)
     case F_GETLK:
     case F_SETLK:
     case F_SETLKW:
-      return fcntl_locking(fildes, cmd, (struct flock *)arg);
+    case F_OFD_GETLK:
+    case F_OFD_SETLK:
+    case F_OFD_SETLKW:
+      return fcntl_locking(fildes, cmd, (struct flock *)arg, 1, SEM_INDEFINITE_WAIT);
     default:
       return _std_fcntl(fildes, cmd, arg);
   }
 }
 
 /**
- * LIBC close callback.
- * Called under global lock and before actually closing the file.
+ * LIBC flock replacement. Whole-file locks are kept in one region per file
+ * (see fcntl_locking) so that they are set and released in O(1) time if
+ * there are no fcntl locks on the file. They are owned by the fd (like OFD
+ * locks) and conflict with fcntl locks of other processes on the same file.
  */
-int fcntl_locking_close(FileDesc *desc)
+int flock(int fildes, int operation)
 {
-  pid_t pid = getpid();
-  int bNeededMark = 0;
+  struct flock fl;
+  int op = operation & ~LOCK_NB;
 
-  /* Go through all locks to unlock any regions this process owns */
-  /* Note: this code is similar to one in fcntl_locking_term */
-  struct FcntlLock *l = desc->g->fcntl_locks;
-  while (l)
+  if (op != LOCK_SH && op != LOCK_EX && op != LOCK_UN)
   {
-    if (lock_needs_mark(l, F_UNLCK, pid))
-    {
-      TRACE("Will unlock [%s], type '%c', start %lld, len %lld\n",
-            desc->g->path, l->type ? l->type : ' ', (uint64_t)l->start, (uint64_t)lock_len(l));
-      int rc = lock_mark(l, F_UNLCK, pid);
-      TRACE_IF(rc, "rc = %d\n", rc);
-      bNeededMark = 1;
-    }
-    l = l->next;
+    errno = EINVAL;
+    return -1;
   }
 
-  if (bNeededMark)
+  fl.l_type = op == LOCK_SH ? F_RDLCK : op == LOCK_EX ? F_WRLCK : F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 0;
+
+  return fcntl_locking(fildes, operation & LOCK_NB ? F_FLOCK : F_FLOCKW, &fl, 1,
+                       SEM_INDEFINITE_WAIT);
+}
+
+int libcx_fcntl_lockv(int fildes, struct flock *locks, size_t num_locks, int flags)
+{
+  if ((flags & ~LIBCX_LOCKV_WAIT) || (!locks && num_locks))
   {
-    optimize_locks(desc->g, NULL, desc->g->fcntl_locks, NULL);
+    errno = EINVAL;
+    return -1;
+  }
 
-    if (gpData->fcntl_locking->blocked)
-    {
-      /* We unblocked something and there are blocked threads, release them */
-      APIRET arc = DosPostEventSem(gpData->fcntl_locking->hEvSem);
-      TRACE("DosPostEventSem = %lu\n", arc);
-      /* Invalidate the blocked list (see the other DosPostEventSem call) */
-      gpData->fcntl_locking->blocked = NULL;
-    }
+  if (!num_locks)
+    return 0;
+
+  return fcntl_locking(fildes, flags & LIBCX_LOCKV_WAIT ? F_SETLKW : F_SETLK,
+                       locks, num_locks, SEM_INDEFINITE_WAIT);
+}
+
+int libcx_fcntl_timedlock(int fildes, int cmd, struct flock *fl, unsigned long timeout)
+{
+  if ((cmd != F_SETLKW && cmd != F_OFD_SETLKW) || !fl)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return fcntl_locking(fildes, cmd, fl, 1, timeout);
+}
+
+/**
+ * LIBC close callback.
+ * Called under file_desc_lock() and before actually closing the file. The
+ * caller must pass @a wake to fcntl_locking_wake() after releasing the lock.
+ */
+int fcntl_locking_close(FileDesc *desc, int fildes, FcntlWakeList *wake)
+{
+  pid_t pid = getpid();
+
+  shared_lock(&desc->g->lock);
+
+  /* Unlock any regions this process owns and OFD locks set through fildes */
+  if (unlock_all(desc->g, pid, fildes))
+  {
+    /* Release processes blocked on this file to let them recheck */
+    shared_lock(&gpData->fcntl_locking->lock);
+    wake_blocked(desc->g, 0, OFF_MAX, wake);
+    shared_unlock(&gpData->fcntl_locking->lock);
   }
 
+  shared_unlock(&desc->g->lock);
+
   return 0;
 }
@@ -0,0 +1,102 @@
+/*
+ * fcntl locking extensions for kLIBC.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBCX_FCNTL_H
+#define LIBCX_FCNTL_H
+
+#include <sys/types.h>
+#include <fcntl.h>
+
+__BEGIN_DECLS
+
+/*
+ * Open file description (OFD) locks. They work like F_GETLK, F_SETLK and
+ * F_SETLKW but the locks are owned by the fd rather than by the process, so
+ * that locks set through different fds conflict with each other (and with
+ * normal locks) even within one process. This lets threads use separate fds
+ * to lock byte ranges of the same file w/o extra serialization. OFD locks are
+ * released when the fd is closed or the process terminates. F_OFD_GETLK
+ * reports -1 in `l_pid` for conflicting OFD locks. Unlike Linux, fds created
+ * by dup() or inherited by fork() do not own the locks of the original fd.
+ * Only fds up to 32767 may be used for OFD locks (ENOLCK is returned for
+ * others).
+ */
+#ifndef F_OFD_GETLK
+#define F_OFD_GETLK 36
+#define F_OFD_SETLK 37
+#define F_OFD_SETLKW 38
+#endif
+
+#define LIBCX_LOCKV_WAIT 0x1
+
+/**
+ * Sets or clears a number of fcntl advisory locks on a file at once.
+ *
+ * Each entry of the `locks` array is interpreted as the `struct flock`
+ * argument of a F_SETLK command. All entries are checked and applied under a
+ * single acquisition of the LIBCx lock so that no other process may observe
+ * or change the file locks in between. Entries are applied in array order, so
+ * a later entry overrides the effect of an earlier one on overlapping ranges.
+ *
+ * The operation is "atomic" which means that it will either apply all entries
+ * and return a success or apply none of them if any entry conflicts with a
+ * lock held by another process. In the latter case, the function fails with
+ * EAGAIN unless LIBCX_LOCKV_WAIT is passed in `flags` in which case it blocks
+ * (as F_SETLKW does, including EDEADLK and EINTR handling) until no entry
+ * conflicts and then applies all of them. This also holds for running out of
+ * memory for lock regions (ENOLCK) as all memory needed to apply the entries
+ * is reserved before applying any of them. Note that ENOLCK is also returned
+ * for series of thousands of entries with overlapping ranges that cut into
+ * read locks of other processes, as the memory they might need is limited.
+ *
+ * @param      fildes     File descriptor.
+ * @param[in]  locks      Array of lock requests.
+ * @param[in]  num_locks  Number of entries in locks array.
+ * @param[in]  flags      0 or LIBCX_LOCKV_WAIT.
+ *
+ * @return     0 on success, otherwise -1 and error code in `errno`. EINVAL is
+ *             returned on unknown flags and invalid entries (in which case no
+ *             entry is applied).
+ */
+int libcx_fcntl_lockv(int fildes, struct flock *locks, size_t num_locks, int flags);
+
+/**
+ * Sets an fcntl advisory lock waiting no longer than the given time.
+ *
+ * Works exactly like fcntl() with the F_SETLKW or F_OFD_SETLKW command (`cmd`)
+ * and the `fl` argument, including EDEADLK and EINTR handling, but fails with
+ * ETIMEDOUT if the lock could not be set within `timeout` milliseconds. A
+ * timeout of 0 makes it fail with ETIMEDOUT (rather than EAGAIN as F_SETLK
+ * does) at once if the requested range is locked by someone else. A timeout of
+ * (unsigned long)-1 means waiting forever.
+ *
+ * @param      fildes   File descriptor.
+ * @param      cmd      F_SETLKW or F_OFD_SETLKW.
+ * @param[in]  fl       Lock request.
+ * @param[in]  timeout  Timeout in milliseconds.
+ *
+ * @return     0 on success, otherwise -1 and error code in `errno`. EINVAL is
+ *             returned on other commands.
+ */
+int libcx_fcntl_timedlock(int fildes, int cmd, struct flock *fl, unsigned long timeout);
+
+__END_DECLS
+
+#endif /* LIBCX_FCNTL_H */
@@ -0,0 +1,304 @@
+/*
+ * Testcase for detecting fcntl deadlocks involving more than two processes.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Builds a chain of CHILDREN processes where child i holds byte i and waits
+ * for byte i + 1 and the last child waits for byte 0 held by the parent.
+ * Checks that the parent gets EDEADLK when it wants byte 1 (which closes the
+ * cycle) and that the chain unwinds normally once the parent releases byte 0.
+ * Then checks that a cycle going through a read lock shared by two processes
+ * is detected no matter which of its owners is part of the cycle.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static int do_test(void);
+#define TEST_FUNCTION do_test()
+#include "../test-skeleton.c"
+
+#define perr(msg, ...) printf("ERROR: " msg "\n" , ##__VA_ARGS__)
+#define perrno(msg, ...) printf("ERROR: " msg ": %s (%d)\n", ##__VA_ARGS__, strerror (errno), errno)
+
+#define CHILDREN 3
+
+#define SHARED_BYTE 5 /* Read locked by both children of test 3 */
+#define CHILD_BYTE 6 /* Held by the blocked child of test 3 */
+#define PARENT_BYTE 7 /* Held by the parent in test 3 */
+
+static int fd;
+
+static int lock_byte(int cmd, short type, off_t offset)
+{
+  struct flock fl;
+
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = offset;
+  fl.l_len = 1;
+
+  return TEMP_FAILURE_RETRY(fcntl(fd, cmd, &fl));
+}
+
+/**
+ * Starts a child that locks byte @a own with @a type, reports that to
+ * @a ready and then waits for byte @a wait (unless it's -1) or for EOF on
+ * @a go.
+ */
+static pid_t start_child(short type, off_t own, off_t wait, int *ready, int *go)
+{
+  char c;
+  pid_t pid = fork();
+  if (pid == -1)
+  {
+    perrno("fork");
+    return -1;
+  }
+
+  if (pid == 0)
+  {
+    close(ready[0]);
+    close(go[1]);
+
+    if (lock_byte(F_SETLK, type, own) == -1)
+    {
+      perrno("child: fcntl(F_SETLK) of byte %d", (int)own);
+      _exit(1);
+    }
+
+    if (write(ready[1], "", 1) != 1)
+      _exit(1);
+
+    if (wait == -1)
+    {
+      if (read(go[0], &c, 1) != 0)
+        _exit(1);
+    }
+    else if (lock_byte(F_SETLKW, F_WRLCK, wait) == -1)
+    {
+      perrno("child: fcntl(F_SETLKW) of byte %d", (int)wait);
+      _exit(1);
+    }
+
+    /* Exit releases the locks */
+    _exit(0);
+  }
+
+  return pid;
+}
+
+static int wait_child(pid_t pid)
+{
+  int status;
+
+  if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) != pid)
+  {
+    perrno("waitpid");
+    return 1;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+  {
+    perr("child %d failed with status 0x%x", pid, status);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int do_test(void)
+{
+  pid_t pids[CHILDREN];
+  int ready[2], go[2];
+  int i, status, rc = 0;
+  char c;
+
+  fd = create_temp_file("tst-deadlk-chain-", NULL);
+  if (fd == -1)
+  {
+    perr("create_temp_file failed");
+    return 1;
+  }
+
+  if (pipe(ready) == -1 || pipe(go) == -1)
+  {
+    perrno("pipe");
+    return 1;
+  }
+
+  if (lock_byte(F_SETLK, F_WRLCK, 0) == -1)
+  {
+    perrno("fcntl(F_SETLK)");
+    return 1;
+  }
+
+  for (i = 1; i <= CHILDREN; ++i)
+  {
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+      perrno("fork");
+      return 1;
+    }
+
+    if (pid == 0)
+    {
+      off_t next = i < CHILDREN ? i + 1 : 0;
+
+      close(ready[0]);
+      close(go[1]);
+
+      if (lock_byte(F_SETLK, F_WRLCK, i) == -1)
+      {
+        perrno("child %d: fcntl(F_SETLK)", i);
+        _exit(1);
+      }
+
+      /* Wait until all children have their bytes (EOF) */
+      if (write(ready[1], "", 1) != 1 || read(go[0], &c, 1) != 0)
+        _exit(1);
+
+      if (lock_byte(F_SETLKW, F_WRLCK, next) == -1)
+      {
+        perrno("child %d: fcntl(F_SETLKW) of byte %d", i, (int)next);
+        _exit(1);
+      }
+
+      /* Exit releases the locks */
+      _exit(0);
+    }
+
+    pids[i - 1] = pid;
+  }
+
+  close(ready[1]);
+  close(go[0]);
+
+  for (i = 0; i < CHILDREN; ++i)
+  {
+    if (read(ready[0], &c, 1) != 1)
+    {
+      perr("child failed to lock its byte");
+      return 1;
+    }
+  }
+
+  /* Let the children block on each other */
+  close(go[1]);
+  sleep(1);
+
+  printf("test 1 (cycle of %d processes)\n", CHILDREN + 1);
+
+  if (lock_byte(F_SETLKW, F_WRLCK, 1) != -1 || errno != EDEADLK)
+  {
+    perr("fcntl(F_SETLKW) didn't fail with EDEADLK");
+    rc = 1;
+  }
+
+  printf("test 2 (chain unwinds)\n");
+
+  if (lock_byte(F_SETLK, F_UNLCK, 0) == -1)
+  {
+    perrno("fcntl(F_UNLCK)");
+    return 1;
+  }
+
+  for (i = 0; i < CHILDREN; ++i)
+  {
+    if (TEMP_FAILURE_RETRY(waitpid(pids[i], &status, 0)) != pids[i])
+    {
+      perrno("waitpid");
+      return 1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+    {
+      perr("child %d failed with status 0x%x", i + 1, status);
+      rc = 1;
+    }
+  }
+
+  if (lock_byte(F_SETLK, F_WRLCK, 1) == -1)
+  {
+    perrno("fcntl(F_SETLK) after children exited");
+    rc = 1;
+  }
+
+  printf("test 3 (cycle through a shared read lock)\n");
+
+  if (pipe(ready) == -1 || pipe(go) == -1)
+  {
+    perrno("pipe");
+    return 1;
+  }
+
+  if (lock_byte(F_SETLK, F_WRLCK, PARENT_BYTE) == -1)
+  {
+    perrno("fcntl(F_SETLK)");
+    return 1;
+  }
+
+  /*
+   * The first reader just holds the shared byte, the second one also waits
+   * for the parent. The writer waits for both readers (the first one being
+   * recorded first) and the parent then wants the writer's byte.
+   */
+  pids[0] = start_child(F_RDLCK, SHARED_BYTE, -1, ready, go);
+  if (pids[0] == -1 || read(ready[0], &c, 1) != 1)
+    return 1;
+  pids[1] = start_child(F_RDLCK, SHARED_BYTE, PARENT_BYTE, ready, go);
+  if (pids[1] == -1 || read(ready[0], &c, 1) != 1)
+    return 1;
+  pids[2] = start_child(F_WRLCK, CHILD_BYTE, SHARED_BYTE, ready, go);
+  if (pids[2] == -1 || read(ready[0], &c, 1) != 1)
+    return 1;
+
+  close(ready[0]);
+  close(ready[1]);
+  close(go[0]);
+
+  /* Let the children block */
+  sleep(1);
+
+  if (lock_byte(F_SETLKW, F_WRLCK, CHILD_BYTE) != -1 || errno != EDEADLK)
+  {
+    perr("fcntl(F_SETLKW) through a shared read lock didn't fail with EDEADLK");
+    rc = 1;
+  }
+
+  /* Release everybody */
+  if (lock_byte(F_SETLK, F_UNLCK, PARENT_BYTE) == -1)
+  {
+    perrno("fcntl(F_UNLCK)");
+    return 1;
+  }
+  close(go[1]);
+
+  for (i = 0; i < 3; ++i)
+    if (wait_child(pids[i]))
+      rc = 1;
+
+  close(fd);
+
+  return rc;
+}
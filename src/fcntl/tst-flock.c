@@ -0,0 +1,345 @@
+/*
+ * Testcase for flock().
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that flock() locks are owned by the fd, conflict with each other
+ * and with fcntl locks of other processes on the same file (but not with
+ * fcntl locks of the same process), may be waited for and are released when
+ * the fd is closed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+
+static int do_test(void);
+#define TEST_FUNCTION do_test()
+#include "../test-skeleton.c"
+
+#define perr(msg, ...) printf("ERROR: " msg "\n" , ##__VA_ARGS__)
+#define perrno(msg, ...) printf("ERROR: " msg ": %s (%d)\n", ##__VA_ARGS__, strerror (errno), errno)
+
+static int fd1, fd2;
+static volatile int locked;
+
+static int range_lock(int fd, short type)
+{
+  struct flock fl;
+
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 10;
+  fl.l_len = 1;
+
+  return fcntl(fd, F_SETLK, &fl);
+}
+
+/**
+ * Runs @a fn in a child process and returns its result (or 1 on failure).
+ */
+static int in_child(int (*fn)(void))
+{
+  pid_t pid;
+  int status;
+
+  pid = fork();
+  if (pid == -1)
+  {
+    perrno("fork");
+    return 1;
+  }
+
+  if (pid == 0)
+    _exit(fn());
+
+  if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) != pid)
+  {
+    perrno("waitpid");
+    return 1;
+  }
+
+  return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+/**
+ * Checks from another process that the flock() lock held through fd2 blocks
+ * fcntl locks.
+ */
+static int check_flock_blocks_fcntl(void)
+{
+  struct flock fl;
+
+  if (range_lock(fd1, F_RDLCK) != -1 || errno != EAGAIN)
+  {
+    perr("child: fcntl(F_SETLK) didn't fail with EAGAIN");
+    return 1;
+  }
+
+  fl.l_type = F_RDLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 10;
+  fl.l_len = 1;
+  if (fcntl(fd1, F_GETLK, &fl) == -1)
+  {
+    perrno("child: fcntl(F_GETLK)");
+    return 1;
+  }
+  if (fl.l_type != F_WRLCK || fl.l_start != 0 || fl.l_len != 0 || fl.l_pid != -1)
+  {
+    perr("child: F_GETLK returned type %d, start %lld, len %lld, pid %d",
+         fl.l_type, (long long)fl.l_start, (long long)fl.l_len, fl.l_pid);
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Checks from another process that the fcntl lock held by the parent blocks
+ * flock().
+ */
+static int check_fcntl_blocks_flock(void)
+{
+  if (flock(fd2, LOCK_SH | LOCK_NB) != -1 || errno != EWOULDBLOCK)
+  {
+    perr("child: flock(fd2, LOCK_SH) didn't fail with EWOULDBLOCK");
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Checks from another process that the byte locked by the parent with
+ * fcntl and the file locked by it with flock() are both unavailable.
+ */
+static int check_both_locked(void)
+{
+  if (range_lock(fd1, F_RDLCK) != -1 || errno != EAGAIN)
+  {
+    perr("child: fcntl(F_SETLK) didn't fail with EAGAIN");
+    return 1;
+  }
+
+  return check_fcntl_blocks_flock();
+}
+
+static void *thread(void *arg)
+{
+  if (TEMP_FAILURE_RETRY(flock(fd1, LOCK_EX)) == -1)
+  {
+    perrno("thread: flock(fd1, LOCK_EX)");
+    return (void *)1;
+  }
+
+  locked = 1;
+
+  return NULL;
+}
+
+static int do_test(void)
+{
+  struct flock fl;
+  pthread_t th;
+  void *res;
+  char *fname;
+
+  fd1 = create_temp_file("tst-flock-", &fname);
+  if (fd1 == -1)
+  {
+    perr("create_temp_file failed");
+    return 1;
+  }
+
+  fd2 = open(fname, O_RDWR);
+  if (fd2 == -1)
+  {
+    perrno("open %s", fname);
+    return 1;
+  }
+
+  printf("test 1 (shared and exclusive locks)\n");
+
+  if (flock(fd1, LOCK_SH) == -1 || flock(fd2, LOCK_SH | LOCK_NB) == -1)
+  {
+    perrno("flock(LOCK_SH)");
+    return 1;
+  }
+  if (flock(fd2, LOCK_EX | LOCK_NB) != -1 || errno != EWOULDBLOCK)
+  {
+    perr("flock(fd2, LOCK_EX) didn't fail with EWOULDBLOCK");
+    return 1;
+  }
+  if (flock(fd1, LOCK_UN) == -1)
+  {
+    perrno("flock(fd1, LOCK_UN)");
+    return 1;
+  }
+  /* Now fd2 is the only owner and may convert its lock */
+  if (flock(fd2, LOCK_EX | LOCK_NB) == -1)
+  {
+    perrno("flock(fd2, LOCK_EX)");
+    return 1;
+  }
+  if (flock(fd1, LOCK_SH | LOCK_NB) != -1 || errno != EWOULDBLOCK)
+  {
+    perr("flock(fd1, LOCK_SH) didn't fail with EWOULDBLOCK");
+    return 1;
+  }
+
+  if (flock(fd1, LOCK_SH | LOCK_EX) != -1 || errno != EINVAL)
+  {
+    perr("flock with bad operation didn't fail with EINVAL");
+    return 1;
+  }
+
+  printf("test 2 (conflicts with fcntl locks of other processes)\n");
+
+  if (in_child(check_flock_blocks_fcntl))
+    return 1;
+
+  if (flock(fd2, LOCK_UN) == -1)
+  {
+    perrno("flock(fd2, LOCK_UN)");
+    return 1;
+  }
+  if (range_lock(fd1, F_WRLCK) == -1)
+  {
+    perrno("fcntl(F_SETLK)");
+    return 1;
+  }
+  if (in_child(check_fcntl_blocks_flock))
+    return 1;
+  if (range_lock(fd1, F_UNLCK) == -1)
+  {
+    perrno("fcntl(F_SETLK, F_UNLCK)");
+    return 1;
+  }
+
+  printf("test 3 (wait)\n");
+
+  if (flock(fd2, LOCK_SH | LOCK_NB) == -1)
+  {
+    perrno("flock(fd2, LOCK_SH)");
+    return 1;
+  }
+
+  if (pthread_create(&th, NULL, thread, NULL) != 0)
+  {
+    perr("pthread_create failed");
+    return 1;
+  }
+
+  /* Let the thread block */
+  sleep(1);
+  if (locked)
+  {
+    perr("thread got the lock held by fd2");
+    return 1;
+  }
+
+  if (flock(fd2, LOCK_UN) == -1)
+  {
+    perrno("flock(fd2, LOCK_UN)");
+    return 1;
+  }
+
+  if (pthread_join(th, &res) != 0 || res != NULL)
+  {
+    perr("thread failed");
+    return 1;
+  }
+  if (!locked)
+  {
+    perr("thread didn't get the lock");
+    return 1;
+  }
+
+  printf("test 4 (no conflicts with fcntl locks of the same process)\n");
+
+  /* Used to hang as the own fcntl lock blocked flock() and the other way round */
+  if (flock(fd1, LOCK_UN) == -1 || range_lock(fd1, F_WRLCK) == -1)
+  {
+    perrno("fcntl(F_SETLK)");
+    return 1;
+  }
+  if (TEMP_FAILURE_RETRY(flock(fd2, LOCK_EX)) == -1)
+  {
+    perrno("flock(fd2, LOCK_EX) with own fcntl lock");
+    return 1;
+  }
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 20;
+  fl.l_len = 1;
+  if (TEMP_FAILURE_RETRY(fcntl(fd1, F_SETLKW, &fl)) == -1)
+  {
+    perrno("fcntl(F_SETLKW) with own flock");
+    return 1;
+  }
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 10;
+  fl.l_len = 1;
+  if (fcntl(fd1, F_GETLK, &fl) == -1 || fl.l_type != F_UNLCK)
+  {
+    perr("F_GETLK reported own flock as a conflict (type %d)", fl.l_type);
+    return 1;
+  }
+
+  /* Both still conflict with other processes */
+  if (in_child(check_both_locked))
+    return 1;
+
+  fl.l_type = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 0;
+  if (fcntl(fd1, F_SETLK, &fl) == -1 || flock(fd2, LOCK_UN) == -1)
+  {
+    perrno("unlock");
+    return 1;
+  }
+  if (flock(fd1, LOCK_EX | LOCK_NB) == -1)
+  {
+    perrno("flock(fd1, LOCK_EX)");
+    return 1;
+  }
+
+  printf("test 5 (close releases the lock)\n");
+
+  close(fd1);
+
+  if (flock(fd2, LOCK_EX | LOCK_NB) == -1)
+  {
+    perrno("flock(fd2, LOCK_EX) after close(fd1)");
+    return 1;
+  }
+
+  close(fd2);
+
+  return 0;
+}
@@ -0,0 +1,339 @@
+/*
+ * Testcase for libcx_fcntl_lockv.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that libcx_fcntl_lockv applies either all or none of the requested
+ * ranges, applies them in order and waits for conflicting ranges to be
+ * released with LIBCX_LOCKV_WAIT. Also checks that a long series of read
+ * locks on an otherwise unlocked file doesn't run out of memory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libcx/fcntl.h"
+
+static int do_test(void);
+#define TEST_FUNCTION do_test()
+#include "../test-skeleton.c"
+
+#define perr(msg, ...) printf("ERROR: " msg "\n" , ##__VA_ARGS__)
+#define perrno(msg, ...) printf("ERROR: " msg ": %s (%d)\n", ##__VA_ARGS__, strerror (errno), errno)
+
+enum { Unlocked = 0, ReadLocked = 1, WriteLocked = 2, Other = 3, Failed = 4 };
+
+#define MANY_LOCKS 4000 /* Number of entries in test 6 */
+#define MANY_START 1000 /* Start of the ranges of test 6 */
+
+static int fd;
+
+static void set(struct flock *fl, short type, off_t start, off_t len)
+{
+  fl->l_type = type;
+  fl->l_whence = SEEK_SET;
+  fl->l_start = start;
+  fl->l_len = len;
+}
+
+/**
+ * Checks from a child process how the given range is locked. Returns
+ * ReadLocked or WriteLocked if it's locked by this process, Unlocked if it's
+ * not locked at all, Other if it's locked by another process and Failed on
+ * failure.
+ */
+static int state(off_t start, off_t len)
+{
+  pid_t pid;
+  int status;
+
+  pid = fork();
+  if (pid == -1)
+  {
+    perrno("fork");
+    return Failed;
+  }
+
+  if (pid == 0)
+  {
+    struct flock fl;
+    set(&fl, F_WRLCK, start, len);
+
+    if (fcntl(fd, F_GETLK, &fl) == -1)
+    {
+      perrno("child: fcntl(F_GETLK)");
+      _exit(Failed);
+    }
+
+    if (fl.l_type == F_UNLCK)
+      _exit(Unlocked);
+    if (fl.l_pid != getppid())
+      _exit(Other);
+    _exit(fl.l_type == F_RDLCK ? ReadLocked : WriteLocked);
+  }
+
+  if (waitpid(pid, &status, 0) == -1)
+  {
+    perrno("waitpid");
+    return Failed;
+  }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) > Other)
+  {
+    perr("child failed with status 0x%x", status);
+    return Failed;
+  }
+
+  return WEXITSTATUS(status);
+}
+
+static int expect(off_t start, off_t len, int expected)
+{
+  int st = state(start, len);
+  if (st != expected)
+  {
+    perr("range %lld/%lld has state %d instead of %d",
+         (long long)start, (long long)len, st, expected);
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Starts a child that write locks the given range and holds it until
+ * something is written to @a go and then for 200 ms more.
+ */
+static pid_t start_holder(off_t start, off_t len, int *go)
+{
+  int ready[2], gop[2];
+  pid_t pid;
+  char c;
+
+  if (pipe(ready) == -1 || pipe(gop) == -1)
+  {
+    perrno("pipe");
+    return -1;
+  }
+
+  pid = fork();
+  if (pid == -1)
+  {
+    perrno("fork");
+    return -1;
+  }
+
+  if (pid == 0)
+  {
+    struct flock fl;
+    set(&fl, F_WRLCK, start, len);
+
+    if (fcntl(fd, F_SETLK, &fl) == -1)
+    {
+      perrno("holder: fcntl(F_SETLK)");
+      _exit(1);
+    }
+
+    if (write(ready[1], "", 1) != 1 || read(gop[0], &c, 1) != 1)
+      _exit(1);
+
+    usleep(200000);
+
+    /* Exit releases the lock */
+    _exit(0);
+  }
+
+  close(ready[1]);
+  close(gop[0]);
+
+  if (read(ready[0], &c, 1) != 1)
+  {
+    perr("holder failed to lock");
+    return -1;
+  }
+
+  close(ready[0]);
+  *go = gop[1];
+
+  return pid;
+}
+
+static int do_test(void)
+{
+  struct flock fls[3], *many;
+  int go, status, i;
+  pid_t holder;
+
+  fd = create_temp_file("tst-lockv-", NULL);
+  if (fd == -1)
+  {
+    perr("create_temp_file failed");
+    return 1;
+  }
+
+  printf("test 1 (invalid arguments)\n");
+
+  set(&fls[0], F_WRLCK, 0, 5);
+  if (libcx_fcntl_lockv(fd, fls, 1, 0x100) != -1 || errno != EINVAL)
+  {
+    perr("libcx_fcntl_lockv with bad flags didn't fail with EINVAL");
+    return 1;
+  }
+
+  set(&fls[1], 1234, 10, 5);
+  if (libcx_fcntl_lockv(fd, fls, 2, 0) != -1 || errno != EINVAL)
+  {
+    perr("libcx_fcntl_lockv with bad type didn't fail with EINVAL");
+    return 1;
+  }
+  if (expect(0, 5, Unlocked))
+    return 1;
+
+  if (libcx_fcntl_lockv(fd, NULL, 0, 0) != 0)
+  {
+    perrno("libcx_fcntl_lockv with no locks");
+    return 1;
+  }
+
+  printf("test 2 (all or nothing)\n");
+
+  holder = start_holder(100, 10, &go);
+  if (holder == -1)
+    return 1;
+
+  set(&fls[0], F_WRLCK, 0, 5);
+  set(&fls[1], F_RDLCK, 50, 5);
+  set(&fls[2], F_WRLCK, 105, 1);
+  if (libcx_fcntl_lockv(fd, fls, 3, 0) != -1 || errno != EAGAIN)
+  {
+    perr("conflicting libcx_fcntl_lockv didn't fail with EAGAIN");
+    return 1;
+  }
+  if (expect(0, 5, Unlocked) || expect(50, 5, Unlocked) ||
+      expect(100, 10, Other))
+    return 1;
+
+  printf("test 3 (batch lock and unlock)\n");
+
+  set(&fls[2], F_WRLCK, 60, 5);
+  if (libcx_fcntl_lockv(fd, fls, 3, 0) == -1)
+  {
+    perrno("libcx_fcntl_lockv");
+    return 1;
+  }
+  if (expect(0, 5, WriteLocked) || expect(50, 5, ReadLocked) ||
+      expect(60, 5, WriteLocked) || expect(5, 45, Unlocked))
+    return 1;
+
+  set(&fls[0], F_UNLCK, 0, 5);
+  set(&fls[1], F_UNLCK, 50, 15);
+  if (libcx_fcntl_lockv(fd, fls, 2, 0) == -1)
+  {
+    perrno("libcx_fcntl_lockv(F_UNLCK)");
+    return 1;
+  }
+  if (expect(0, 100, Unlocked))
+    return 1;
+
+  printf("test 4 (entries are applied in order)\n");
+
+  set(&fls[0], F_WRLCK, 0, 10);
+  set(&fls[1], F_UNLCK, 5, 5);
+  set(&fls[2], F_RDLCK, 8, 1);
+  if (libcx_fcntl_lockv(fd, fls, 3, 0) == -1)
+  {
+    perrno("libcx_fcntl_lockv");
+    return 1;
+  }
+  if (expect(0, 5, WriteLocked) || expect(5, 3, Unlocked) ||
+      expect(8, 1, ReadLocked) || expect(9, 1, Unlocked))
+    return 1;
+
+  printf("test 5 (wait)\n");
+
+  set(&fls[0], F_WRLCK, 20, 5);
+  set(&fls[1], F_WRLCK, 105, 1);
+  if (write(go, "", 1) != 1)
+  {
+    perrno("write");
+    return 1;
+  }
+  if (TEMP_FAILURE_RETRY(libcx_fcntl_lockv(fd, fls, 2, LIBCX_LOCKV_WAIT)) == -1)
+  {
+    perrno("libcx_fcntl_lockv(LIBCX_LOCKV_WAIT)");
+    return 1;
+  }
+  if (waitpid(holder, &status, 0) == -1)
+  {
+    perrno("waitpid");
+    return 1;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+  {
+    perr("holder failed with status 0x%x", status);
+    return 1;
+  }
+  if (expect(20, 5, WriteLocked) || expect(105, 1, WriteLocked) ||
+      expect(100, 5, Unlocked))
+    return 1;
+
+  printf("test 6 (many read locks)\n");
+
+  many = malloc(sizeof(*many) * MANY_LOCKS);
+  if (!many)
+  {
+    perr("malloc failed");
+    return 1;
+  }
+
+  /* Every other byte so that the regions are not joined */
+  for (i = 0; i < MANY_LOCKS; ++i)
+    set(&many[i], F_RDLCK, MANY_START + i * 2, 1);
+  if (libcx_fcntl_lockv(fd, many, MANY_LOCKS, 0) == -1)
+  {
+    perrno("libcx_fcntl_lockv with %d entries", MANY_LOCKS);
+    return 1;
+  }
+  if (expect(MANY_START, 1, ReadLocked) || expect(MANY_START + 1, 1, Unlocked) ||
+      expect(MANY_START + (MANY_LOCKS - 1) * 2, 1, ReadLocked) ||
+      expect(MANY_START + MANY_LOCKS * 2, 0, Unlocked))
+    return 1;
+
+  for (i = 0; i < MANY_LOCKS; ++i)
+    many[i].l_type = F_UNLCK;
+  if (libcx_fcntl_lockv(fd, many, MANY_LOCKS, 0) == -1)
+  {
+    perrno("libcx_fcntl_lockv(F_UNLCK) with %d entries", MANY_LOCKS);
+    return 1;
+  }
+  if (expect(MANY_START, MANY_LOCKS * 2, Unlocked))
+    return 1;
+
+  free(many);
+
+  close(go);
+  close(fd);
+
+  return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * tst-flock-sj.c ported to OFD locks.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the same checks as tst-flock-sj.c but with F_OFD_GETLK, F_OFD_SETLK and
+ * F_OFD_SETLKW instead of the normal commands.
+ */
+
+#include <fcntl.h>
+#include <sys/fcntl.h>
+
+#include "libcx/fcntl.h"
+
+#undef F_GETLK
+#undef F_SETLK
+#undef F_SETLKW
+#define F_GETLK F_OFD_GETLK
+#define F_SETLK F_OFD_SETLK
+#define F_SETLKW F_OFD_SETLKW
+
+#include "tst-flock-sj.c"
@@ -0,0 +1,288 @@
+/*
+ * Testcase for OFD locks used by threads.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * OFD counterpart of tst-flock2.c. Instead of checking that locks are owned
+ * by the process (and not by its threads), checks that OFD locks set through
+ * different fds conflict within one process, so that a thread blocks in
+ * F_OFD_SETLKW until another thread releases the range, that closing the fd
+ * or terminating the process releases them and that unlocking a range through
+ * another owner leaves them in place.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libcx/fcntl.h"
+
+static int do_test(void);
+#define TEST_FUNCTION do_test()
+#include "../test-skeleton.c"
+
+#define perr(msg, ...) printf("ERROR: " msg "\n" , ##__VA_ARGS__)
+#define perrno(msg, ...) printf("ERROR: " msg ": %s (%d)\n", ##__VA_ARGS__, strerror (errno), errno)
+
+static int fd1, fd2;
+static volatile int locked;
+
+static int ofd_lock(int fd, int cmd, short type, off_t start, off_t len)
+{
+  struct flock fl;
+
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = start;
+  fl.l_len = len;
+  fl.l_pid = 0;
+
+  return TEMP_FAILURE_RETRY(fcntl(fd, cmd, &fl));
+}
+
+static void *thread(void *arg)
+{
+  if (ofd_lock(fd2, F_OFD_SETLKW, F_WRLCK, 0, 10) == -1)
+  {
+    perrno("thread: fcntl(F_OFD_SETLKW)");
+    return (void *)1;
+  }
+
+  locked = 1;
+
+  return NULL;
+}
+
+static int do_test(void)
+{
+  struct flock fl;
+  pthread_t th;
+  void *res;
+  char *fname;
+  pid_t pid;
+  int status;
+
+  fd1 = create_temp_file("tst-ofd-flock2-", &fname);
+  if (fd1 == -1)
+  {
+    perr("create_temp_file failed");
+    return 1;
+  }
+
+  fd2 = open(fname, O_RDWR);
+  if (fd2 == -1)
+  {
+    perrno("open %s", fname);
+    return 1;
+  }
+
+  printf("test 1 (fds of one process conflict)\n");
+
+  if (ofd_lock(fd1, F_OFD_SETLK, F_WRLCK, 0, 10) == -1)
+  {
+    perrno("fcntl(fd1, F_OFD_SETLK)");
+    return 1;
+  }
+  if (ofd_lock(fd2, F_OFD_SETLK, F_RDLCK, 5, 10) != -1 || errno != EAGAIN)
+  {
+    perr("fcntl(fd2, F_OFD_SETLK) didn't fail with EAGAIN");
+    return 1;
+  }
+  /* Normal locks of the same process conflict too */
+  if (ofd_lock(fd2, F_SETLK, F_RDLCK, 5, 10) != -1 || errno != EAGAIN)
+  {
+    perr("fcntl(fd2, F_SETLK) didn't fail with EAGAIN");
+    return 1;
+  }
+
+  fl.l_type = F_RDLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 5;
+  fl.l_len = 1;
+  fl.l_pid = 0;
+  if (fcntl(fd2, F_OFD_GETLK, &fl) == -1)
+  {
+    perrno("fcntl(fd2, F_OFD_GETLK)");
+    return 1;
+  }
+  if (fl.l_type != F_WRLCK || fl.l_start != 0 || fl.l_len != 10 || fl.l_pid != -1)
+  {
+    perr("F_OFD_GETLK returned type %d, start %lld, len %lld, pid %d",
+         fl.l_type, (long long)fl.l_start, (long long)fl.l_len, fl.l_pid);
+    return 1;
+  }
+
+  /* The same fd may change its own lock */
+  if (ofd_lock(fd1, F_OFD_SETLK, F_RDLCK, 0, 10) == -1 ||
+      ofd_lock(fd1, F_OFD_SETLK, F_WRLCK, 0, 10) == -1)
+  {
+    perrno("fcntl(fd1, F_OFD_SETLK) of own lock");
+    return 1;
+  }
+
+  printf("test 2 (thread waits for another fd)\n");
+
+  if (pthread_create(&th, NULL, thread, NULL) != 0)
+  {
+    perr("pthread_create failed");
+    return 1;
+  }
+
+  /* Let the thread block */
+  sleep(1);
+  if (locked)
+  {
+    perr("thread got the lock held by fd1");
+    return 1;
+  }
+
+  if (ofd_lock(fd1, F_OFD_SETLK, F_UNLCK, 0, 10) == -1)
+  {
+    perrno("fcntl(fd1, F_OFD_SETLK, F_UNLCK)");
+    return 1;
+  }
+
+  if (pthread_join(th, &res) != 0 || res != NULL)
+  {
+    perr("thread failed");
+    return 1;
+  }
+
+  if (!locked)
+  {
+    perr("thread didn't get the lock");
+    return 1;
+  }
+  if (ofd_lock(fd1, F_OFD_SETLK, F_RDLCK, 0, 1) != -1 || errno != EAGAIN)
+  {
+    perr("fcntl(fd1, F_OFD_SETLK) didn't fail with EAGAIN");
+    return 1;
+  }
+
+  printf("test 3 (close releases fd locks)\n");
+
+  close(fd2);
+
+  if (ofd_lock(fd1, F_OFD_SETLK, F_WRLCK, 0, 10) == -1)
+  {
+    perrno("fcntl(fd1, F_OFD_SETLK) after close(fd2)");
+    return 1;
+  }
+
+  printf("test 4 (process termination releases fd locks)\n");
+
+  if (ofd_lock(fd1, F_OFD_SETLK, F_UNLCK, 0, 0) == -1)
+  {
+    perrno("fcntl(fd1, F_OFD_SETLK, F_UNLCK)");
+    return 1;
+  }
+
+  pid = fork();
+  if (pid == -1)
+  {
+    perrno("fork");
+    return 1;
+  }
+
+  if (pid == 0)
+  {
+    /* Lock through two fds and exit w/o closing them */
+    int fd3 = open(fname, O_RDWR);
+    if (fd3 == -1)
+    {
+      perrno("child: open %s", fname);
+      _exit(1);
+    }
+    if (ofd_lock(fd3, F_OFD_SETLK, F_RDLCK, 0, 10) == -1 ||
+        ofd_lock(fd1, F_OFD_SETLK, F_RDLCK, 5, 10) == -1)
+    {
+      perrno("child: fcntl(F_OFD_SETLK)");
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) != pid)
+  {
+    perrno("waitpid");
+    return 1;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+  {
+    perr("child failed with status 0x%x", status);
+    return 1;
+  }
+
+  if (ofd_lock(fd1, F_OFD_SETLK, F_WRLCK, 0, 0) == -1)
+  {
+    perrno("fcntl(fd1, F_OFD_SETLK) after child exit");
+    return 1;
+  }
+
+  printf("test 5 (other owners' unlocks leave fd locks)\n");
+
+  fd2 = open(fname, O_RDWR);
+  if (fd2 == -1)
+  {
+    perrno("open %s", fname);
+    return 1;
+  }
+
+  if (ofd_lock(fd1, F_OFD_SETLK, F_UNLCK, 0, 0) == -1 ||
+      ofd_lock(fd1, F_OFD_SETLK, F_WRLCK, 10, 11) == -1)
+  {
+    perrno("fcntl(fd1, F_OFD_SETLK)");
+    return 1;
+  }
+
+  /* Unlocks by the process and by another fd must not drop the lock of fd1 */
+  if (ofd_lock(fd1, F_SETLK, F_UNLCK, 0, 100) == -1 ||
+      ofd_lock(fd2, F_OFD_SETLK, F_UNLCK, 0, 100) == -1)
+  {
+    perrno("fcntl(F_UNLCK)");
+    return 1;
+  }
+
+  fl.l_type = F_RDLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 100;
+  fl.l_pid = 0;
+  if (fcntl(fd2, F_OFD_GETLK, &fl) == -1)
+  {
+    perrno("fcntl(fd2, F_OFD_GETLK)");
+    return 1;
+  }
+  if (fl.l_type != F_WRLCK || fl.l_start != 10 || fl.l_len != 11)
+  {
+    perr("F_OFD_GETLK returned type %d, start %lld, len %lld after unlocks",
+         fl.l_type, (long long)fl.l_start, (long long)fl.l_len);
+    return 1;
+  }
+
+  close(fd2);
+  close(fd1);
+
+  return 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * Testcase for libcx_fcntl_timedlock.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that libcx_fcntl_timedlock fails with ETIMEDOUT no sooner than the
+ * given timeout if the range stays locked by another process, leaves no
+ * waiter behind after that and gets the lock if it's released in time.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "libcx/fcntl.h"
+
+static int do_test(void);
+#define TEST_FUNCTION do_test()
+#include "../test-skeleton.c"
+
+#define perr(msg, ...) printf("ERROR: " msg "\n" , ##__VA_ARGS__)
+#define perrno(msg, ...) printf("ERROR: " msg ": %s (%d)\n", ##__VA_ARGS__, strerror (errno), errno)
+
+static int fd;
+
+static void set(struct flock *fl, short type, off_t start, off_t len)
+{
+  fl->l_type = type;
+  fl->l_whence = SEEK_SET;
+  fl->l_start = start;
+  fl->l_len = len;
+}
+
+static long now_ms(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+/**
+ * Starts a child that write locks the given range and holds it until
+ * something is written to @a go and then for @a hold_ms more.
+ */
+static pid_t start_holder(off_t start, off_t len, int hold_ms, int *go)
+{
+  int ready[2], gop[2];
+  pid_t pid;
+  char c;
+
+  if (pipe(ready) == -1 || pipe(gop) == -1)
+  {
+    perrno("pipe");
+    return -1;
+  }
+
+  pid = fork();
+  if (pid == -1)
+  {
+    perrno("fork");
+    return -1;
+  }
+
+  if (pid == 0)
+  {
+    struct flock fl;
+    set(&fl, F_WRLCK, start, len);
+
+    if (fcntl(fd, F_SETLK, &fl) == -1)
+    {
+      perrno("holder: fcntl(F_SETLK)");
+      _exit(1);
+    }
+
+    if (write(ready[1], "", 1) != 1 || read(gop[0], &c, 1) != 1)
+      _exit(1);
+
+    usleep(hold_ms * 1000);
+
+    /* Exit releases the lock */
+    _exit(0);
+  }
+
+  close(ready[1]);
+  close(gop[0]);
+
+  if (read(ready[0], &c, 1) != 1)
+  {
+    perr("holder failed to lock");
+    return -1;
+  }
+
+  close(ready[0]);
+  *go = gop[1];
+
+  return pid;
+}
+
+static int wait_holder(pid_t holder, int go)
+{
+  int status;
+
+  close(go);
+
+  if (TEMP_FAILURE_RETRY(waitpid(holder, &status, 0)) != holder)
+  {
+    perrno("waitpid");
+    return 1;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+  {
+    perr("holder failed with status 0x%x", status);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int do_test(void)
+{
+  struct flock fl;
+  int go;
+  long start, elapsed;
+  pid_t holder;
+
+  fd = create_temp_file("tst-timedlock-", NULL);
+  if (fd == -1)
+  {
+    perr("create_temp_file failed");
+    return 1;
+  }
+
+  printf("test 1 (invalid arguments)\n");
+
+  set(&fl, F_WRLCK, 0, 10);
+  if (libcx_fcntl_timedlock(fd, F_SETLK, &fl, 100) != -1 || errno != EINVAL)
+  {
+    perr("libcx_fcntl_timedlock(F_SETLK) didn't fail with EINVAL");
+    return 1;
+  }
+  if (libcx_fcntl_timedlock(fd, F_SETLKW, NULL, 100) != -1 || errno != EINVAL)
+  {
+    perr("libcx_fcntl_timedlock with no lock didn't fail with EINVAL");
+    return 1;
+  }
+
+  printf("test 2 (no conflict)\n");
+
+  if (libcx_fcntl_timedlock(fd, F_SETLKW, &fl, 0) == -1)
+  {
+    perrno("libcx_fcntl_timedlock");
+    return 1;
+  }
+  set(&fl, F_UNLCK, 0, 10);
+  if (fcntl(fd, F_SETLK, &fl) == -1)
+  {
+    perrno("fcntl(F_UNLCK)");
+    return 1;
+  }
+
+  printf("test 3 (timeout)\n");
+
+  holder = start_holder(0, 10, 300, &go);
+  if (holder == -1)
+    return 1;
+
+  set(&fl, F_RDLCK, 5, 10);
+  if (libcx_fcntl_timedlock(fd, F_SETLKW, &fl, 0) != -1 || errno != ETIMEDOUT)
+  {
+    perr("libcx_fcntl_timedlock with zero timeout didn't fail with ETIMEDOUT");
+    return 1;
+  }
+
+  start = now_ms();
+  if (TEMP_FAILURE_RETRY(libcx_fcntl_timedlock(fd, F_SETLKW, &fl, 200)) != -1 ||
+      errno != ETIMEDOUT)
+  {
+    perr("libcx_fcntl_timedlock didn't fail with ETIMEDOUT");
+    return 1;
+  }
+  elapsed = now_ms() - start;
+  /* Allow for the system timer granularity */
+  if (elapsed < 150 || elapsed > 2000)
+  {
+    perr("libcx_fcntl_timedlock timed out after %ld ms instead of 200 ms", elapsed);
+    return 1;
+  }
+
+  /* OFD variant */
+  if (libcx_fcntl_timedlock(fd, F_OFD_SETLKW, &fl, 50) != -1 || errno != ETIMEDOUT)
+  {
+    perr("libcx_fcntl_timedlock(F_OFD_SETLKW) didn't fail with ETIMEDOUT");
+    return 1;
+  }
+
+  printf("test 4 (lock is released before timeout)\n");
+
+  if (write(go, "", 1) != 1)
+  {
+    perrno("write");
+    return 1;
+  }
+  start = now_ms();
+  if (TEMP_FAILURE_RETRY(libcx_fcntl_timedlock(fd, F_SETLKW, &fl, 5000)) == -1)
+  {
+    perrno("libcx_fcntl_timedlock");
+    return 1;
+  }
+  elapsed = now_ms() - start;
+  if (elapsed > 4000)
+  {
+    perr("libcx_fcntl_timedlock took %ld ms after release", elapsed);
+    return 1;
+  }
+  if (wait_holder(holder, go))
+    return 1;
+
+  printf("test 5 (timed out waiter leaves no trace)\n");
+
+  set(&fl, F_UNLCK, 0, 0);
+  if (fcntl(fd, F_SETLK, &fl) == -1)
+  {
+    perrno("fcntl(F_UNLCK)");
+    return 1;
+  }
+
+  holder = start_holder(0, 10, 100, &go);
+  if (holder == -1)
+    return 1;
+
+  set(&fl, F_WRLCK, 0, 1);
+  if (TEMP_FAILURE_RETRY(libcx_fcntl_timedlock(fd, F_SETLKW, &fl, 50)) != -1 ||
+      errno != ETIMEDOUT)
+  {
+    perr("libcx_fcntl_timedlock didn't fail with ETIMEDOUT");
+    return 1;
+  }
+
+  /* The release must not grant the lock to the timed out request */
+  if (write(go, "", 1) != 1 || wait_holder(holder, go))
+    return 1;
+
+  /* Another process must be able to lock the range now */
+  holder = start_holder(0, 10, 0, &go);
+  if (holder == -1 || write(go, "", 1) != 1 || wait_holder(holder, go))
+    return 1;
+
+  close(fd);
+
+  return 0;
+}
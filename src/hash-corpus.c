@@ -0,0 +1,176 @@
+/*
+ * Path corpus for hash function tests and benchmarks.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Include this file to get make_corpus() that generates native paths like
+ * the ones LIBCx hashes: a few drives and a few dozen directories, many of
+ * them deep and sharing long prefixes, with lots of similarly named files
+ * (numbered sources, objects, logs and so on). Also provides the RS hash
+ * LIBCx used before for comparison and chain_stats() to measure how a hash
+ * distributes the corpus over hash map buckets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+enum { CorpusFilesPerDir = 256 };
+
+static const char *corpus_dirs[] =
+{
+  "\\",
+  "\\OS2\\",
+  "\\OS2\\DLL\\",
+  "\\TMP\\",
+  "\\USR\\BIN\\",
+  "\\USR\\LIB\\",
+  "\\USR\\LIB\\GCC\\I686-PC-OS2-EMX\\9\\",
+  "\\USR\\INCLUDE\\",
+  "\\USR\\INCLUDE\\SYS\\",
+  "\\USR\\INCLUDE\\INNOTEKLIBC\\",
+  "\\USR\\SHARE\\LOCALE\\DE\\LC_MESSAGES\\",
+  "\\USR\\SHARE\\LOCALE\\RU\\LC_MESSAGES\\",
+  "\\USR\\VAR\\LOG\\",
+  "\\USR\\VAR\\CACHE\\FONTCONFIG\\",
+  "\\USR\\VAR\\LIB\\RPM\\",
+  "\\USR\\VAR\\LIB\\RPM\\__DB\\",
+  "\\USR\\VAR\\SPOOL\\MAIL\\",
+  "\\HOME\\USER\\",
+  "\\HOME\\USER\\.CACHE\\MOZILLA\\FIREFOX\\PROFILE.DEFAULT\\CACHE2\\ENTRIES\\",
+  "\\HOME\\USER\\PROJECTS\\LIBCX\\SRC\\",
+  "\\HOME\\USER\\PROJECTS\\LIBCX\\SRC\\FCNTL\\",
+  "\\HOME\\USER\\PROJECTS\\LIBCX\\SRC\\MMAP\\",
+  "\\HOME\\USER\\PROJECTS\\LIBCX\\OUT\\OS2.X86\\RELEASE\\OBJ\\LIBCX\\",
+  "\\HOME\\USER\\PROJECTS\\QT5\\QTBASE\\SRC\\CORELIB\\IO\\",
+  "\\HOME\\USER\\PROJECTS\\QT5\\QTBASE\\SRC\\CORELIB\\KERNEL\\",
+  "\\HOME\\USER\\PROJECTS\\QT5\\BUILD\\QTBASE\\SRC\\CORELIB\\.OBJ\\",
+};
+
+static const char *corpus_drives[] = { "C:", "D:", "H:" };
+
+static const char *corpus_names[] = { "file", "tst-", "lib", "cache", "log", "" };
+
+static const char *corpus_exts[] = { ".c", ".h", ".o", ".dll", ".log", ".tmp", ".db", "" };
+
+/**
+ * Generates the path corpus. Returns an array of paths terminated with NULL
+ * (paths are allocated in one block after the array) and stores the number
+ * of paths in @a count. Returns NULL if there is not enough memory.
+ */
+static char **make_corpus(size_t *count)
+{
+  size_t ndirs = sizeof(corpus_dirs) / sizeof(*corpus_dirs);
+  size_t ndrives = sizeof(corpus_drives) / sizeof(*corpus_drives);
+  size_t nnames = sizeof(corpus_names) / sizeof(*corpus_names);
+  size_t nexts = sizeof(corpus_exts) / sizeof(*corpus_exts);
+  size_t n = ndrives * ndirs * CorpusFilesPerDir, i, dr, di, f, size = 0;
+  char **paths, *buf;
+
+  for (di = 0; di < ndirs; ++di)
+    size += (strlen(corpus_dirs[di]) + 32) * ndrives * CorpusFilesPerDir;
+
+  paths = malloc((n + 1) * sizeof(*paths) + size);
+  if (!paths)
+    return NULL;
+
+  buf = (char *)(paths + n + 1);
+  i = 0;
+
+  for (dr = 0; dr < ndrives; ++dr)
+  {
+    for (di = 0; di < ndirs; ++di)
+    {
+      for (f = 0; f < CorpusFilesPerDir; ++f)
+      {
+        paths[i++] = buf;
+        buf += sprintf(buf, "%s%s%s%u%s", corpus_drives[dr], corpus_dirs[di],
+                       corpus_names[f % nnames], (unsigned)f,
+                       corpus_exts[(f / nnames) % nexts]) + 1;
+      }
+    }
+  }
+
+  paths[i] = NULL;
+  *count = i;
+
+  return paths;
+}
+
+/**
+ * RS hash from the Arash Partow collection which LIBCx used before.
+ */
+static size_t rs_hash_string(const char *str)
+{
+  uint32_t a = 63689;
+  uint32_t hash = 0;
+
+  while (*str)
+  {
+    hash = hash * a + (unsigned char)(*str++);
+    a *= 378551 /* b */;
+  }
+
+  /* LIBCx also mixed high bits in as only low ones select buckets */
+  return hash ^ (hash >> 16);
+}
+
+typedef size_t HASH_FN(const char *str);
+
+typedef struct ChainStats
+{
+  size_t max; /* Longest chain */
+  size_t empty; /* Number of empty buckets */
+  double probes; /* Average number of entries compared by a successful lookup */
+} ChainStats;
+
+/**
+ * Distributes @a count paths over @a nbuckets buckets (a power of two) by
+ * the low bits of @a fn like HashMap does and collects chain statistics.
+ */
+static int chain_stats(char **paths, size_t count, size_t nbuckets, HASH_FN *fn,
+                       ChainStats *stats)
+{
+  size_t *chains = calloc(nbuckets, sizeof(*chains));
+  size_t i, sum = 0;
+
+  if (!chains)
+    return -1;
+
+  for (i = 0; i < count; ++i)
+    ++chains[fn(paths[i]) & (nbuckets - 1)];
+
+  stats->max = stats->empty = 0;
+  for (i = 0; i < nbuckets; ++i)
+  {
+    if (chains[i] > stats->max)
+      stats->max = chains[i];
+    if (!chains[i])
+      ++stats->empty;
+    /* Finding the k-th entry of a chain takes k compares */
+    sum += chains[i] * (chains[i] + 1) / 2;
+  }
+  stats->probes = (double)sum / count;
+
+  free(chains);
+
+  return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * String hash function.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBCX_HASH_H
+#define LIBCX_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Hash of file paths used to pick hash map buckets and locks. This is the
+ * 32-bit MurmurHash3 of the string bytes: it consumes 4 bytes per step and
+ * its finalizer spreads every input bit over all output bits, so both low
+ * and high bits are usable even for long paths that only differ at the end
+ * (e.g. C:\USR\VAR\...). hash_string() reads the string in aligned words
+ * (and so never crosses a page boundary past the terminator). The same
+ * hash may be computed incrementally, piece by piece, with hash_init(),
+ * hash_update() and hash_final().
+ */
+
+#define HASH_SEED 0x9747b28c
+
+typedef uint32_t __attribute__((__may_alias__)) hash_word_t;
+
+/**
+ * Incremental hash state.
+ */
+typedef struct HashState
+{
+  uint32_t h; /* Hash of complete words */
+  uint32_t k; /* Pending bytes of an incomplete word */
+  uint32_t n; /* Number of pending bytes */
+  uint32_t len; /* Number of bytes in complete words */
+} HashState;
+
+static inline uint32_t hash_rotl(uint32_t x, int r)
+{
+  return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32_t hash_scramble(uint32_t k)
+{
+  k *= 0xcc9e2d51;
+  k = hash_rotl(k, 15);
+  k *= 0x1b873593;
+  return k;
+}
+
+static inline uint32_t hash_mix(uint32_t h, uint32_t k)
+{
+  h ^= hash_scramble(k);
+  h = hash_rotl(h, 13);
+  return h * 5 + 0xe6546b64;
+}
+
+static inline uint32_t hash_finish(uint32_t h, uint32_t k, uint32_t len)
+{
+  if (len & 3)
+    h ^= hash_scramble(k);
+  h ^= len;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+static inline void hash_init(HashState *st)
+{
+  st->h = HASH_SEED;
+  st->k = st->n = st->len = 0;
+}
+
+/**
+ * Adds @a len bytes from @a data to the hash.
+ */
+static inline void hash_update(HashState *st, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+
+  while (len)
+  {
+    if (!st->n && len >= 4)
+    {
+      /* Little endian, so this matches the byte by byte path below */
+      st->h = hash_mix(st->h, *(const hash_word_t *)p);
+      st->len += 4;
+      p += 4;
+      len -= 4;
+      continue;
+    }
+
+    st->k |= (uint32_t)*p++ << (st->n * 8);
+    --len;
+    if (++st->n == 4)
+    {
+      st->h = hash_mix(st->h, st->k);
+      st->len += 4;
+      st->k = st->n = 0;
+    }
+  }
+}
+
+static inline size_t hash_final(HashState *st)
+{
+  return hash_finish(st->h, st->k, st->len + st->n);
+}
+
+/**
+ * Returns the hash of a zero-terminated string. Same as hash_update() of all
+ * its bytes (excluding the terminator) followed by hash_final().
+ */
+static inline size_t hash_string(const char *str)
+{
+  const unsigned char *p = (const unsigned char *)str;
+  uint32_t h = HASH_SEED, k = 0, len = 0, n = 0;
+
+  /* Bytes before the first word boundary */
+  for (; (uintptr_t)p & 3; ++p)
+  {
+    if (!*p)
+      return hash_finish(h, k, len + n);
+    k |= (uint32_t)*p << (n * 8);
+    ++n;
+  }
+
+  /* Whole words, combined with the pending bytes if the string is unaligned */
+  for (;; p += 4, len += 4)
+  {
+    uint32_t w = *(const hash_word_t *)p;
+    if ((w - 0x01010101) & ~w & 0x80808080)
+      break; /* Has a zero byte */
+    if (n)
+    {
+      h = hash_mix(h, k | (w << (n * 8)));
+      k = w >> (32 - n * 8);
+    }
+    else
+      h = hash_mix(h, w);
+  }
+
+  /* The rest of the word with the terminator */
+  for (; *p; ++p)
+  {
+    k |= (uint32_t)*p << (n * 8);
+    if (++n == 4)
+    {
+      h = hash_mix(h, k);
+      len += 4;
+      k = n = 0;
+    }
+  }
+
+  return hash_finish(h, k, len + n);
+}
+
+#endif /* LIBCX_HASH_H */
@@ -19,10 +19,210 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Without arguments, prints human readable LIBCx statistics. With --kv or
+ * --json, prints LIBCx counters (see get_stats()) once as key=value lines or
+ * as a JSON object. With --watch <ms>, samples counters every <ms>
+ * milliseconds until interrupted and prints each counter with its change
+ * since the previous sample and, for counters that only grow, the change
+ * rate per second (as key=value lines, with samples separated by an empty
+ * line, or as one JSON object per line).
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+
 #include "shared.h"
 
-int main()
+enum { FormatText, FormatKV, FormatJSON };
+
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: libcx-stats [--kv | --json] [--watch <ms>]\n"
+          "  --kv          print counters as key=value lines\n"
+          "  --json        print counters as a JSON object\n"
+          "  --watch <ms>  print counters with deltas and rates every <ms> ms\n");
+}
+
+static uint64_t now_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/**
+ * Gets a snapshot of all counters into a newly allocated array. Returns the
+ * number of counters or -1 on failure.
+ */
+static int snapshot(StatCounter **counters)
+{
+  int n = get_stats(NULL, 0);
+  if (n == -1)
+    return -1;
+
+  *counters = calloc(n, sizeof(**counters));
+  if (!*counters)
+    return -1;
+
+  return get_stats(*counters, n);
+}
+
+static void print_snapshot(StatCounter *c, int n, int format)
+{
+  int i;
+
+  if (format == FormatJSON)
+  {
+    printf("{\"counters\": {");
+    for (i = 0; i < n; ++i)
+      printf("%s\"%s\": %llu", i ? ", " : "", c[i].name, c[i].value);
+    printf("}}\n");
+  }
+  else
+  {
+    for (i = 0; i < n; ++i)
+      printf("%s=%llu\n", c[i].name, c[i].value);
+  }
+}
+
+static void print_sample(StatCounter *c, StatCounter *prev, int n,
+                         uint64_t time, uint64_t interval, int format)
 {
-  print_stats();
+  int i;
+
+  if (!interval)
+    interval = 1;
+
+  if (format == FormatJSON)
+    printf("{\"time_ms\": %llu, \"interval_ms\": %llu, \"counters\": {",
+           time, interval);
+  else
+    printf("time_ms=%llu\ninterval_ms=%llu\n", time, interval);
+
+  for (i = 0; i < n; ++i)
+  {
+    int64_t delta = (int64_t)(c[i].value - prev[i].value);
+    double rate = (double)delta * 1000 / interval;
+
+    if (format == FormatJSON)
+    {
+      printf("%s\"%s\": {\"value\": %llu, \"delta\": %lld",
+             i ? ", " : "", c[i].name, c[i].value, delta);
+      if (c[i].kind == StatTotal)
+        printf(", \"rate\": %.1f", rate);
+      printf("}");
+    }
+    else
+    {
+      printf("%s=%llu %s.delta=%lld", c[i].name, c[i].value, c[i].name, delta);
+      if (c[i].kind == StatTotal)
+        printf(" %s.rate=%.1f", c[i].name, rate);
+      printf("\n");
+    }
+  }
+
+  printf(format == FormatJSON ? "}}\n" : "\n");
+  fflush(stdout);
+}
+
+static int watch(int period, int format)
+{
+  StatCounter *prev, *cur;
+  uint64_t start, last, time;
+  int n, n2;
+
+  n = snapshot(&prev);
+  if (n == -1)
+    return -1;
+
+  cur = calloc(n, sizeof(*cur));
+  if (!cur)
+    return -1;
+
+  start = last = now_ms();
+
+  while (1)
+  {
+    usleep(period * 1000);
+
+    n2 = get_stats(cur, n);
+    if (n2 == -1)
+      return -1;
+    /* The set of counters never changes but be safe */
+    if (n2 > n)
+      n2 = n;
+
+    time = now_ms();
+    print_sample(cur, prev, n2, time - start, time - last, format);
+    last = time;
+
+    StatCounter *tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int format = FormatText, period = 0, i;
+
+  for (i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "--kv"))
+      format = FormatKV;
+    else if (!strcmp(argv[i], "--json"))
+      format = FormatJSON;
+    else if (!strcmp(argv[i], "--watch") && i + 1 < argc)
+    {
+      char *end;
+      period = strtol(argv[++i], &end, 10);
+      if (*end || period <= 0)
+      {
+        usage();
+        return 1;
+      }
+    }
+    else
+    {
+      usage();
+      return 1;
+    }
+  }
+
+  if (period)
+  {
+    if (format == FormatText)
+      format = FormatKV;
+    if (watch(period, format) == -1)
+    {
+      perror("libcx-stats");
+      return 1;
+    }
+    return 0;
+  }
+
+  if (format == FormatText)
+  {
+    print_stats();
+    return 0;
+  }
+
+  StatCounter *counters;
+  int n = snapshot(&counters);
+  if (n == -1)
+  {
+    perror("libcx-stats");
+    return 1;
+  }
+
+  print_snapshot(counters, n, format);
+
+  free(counters);
   return 0;
 }
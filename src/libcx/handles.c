@@ -121,7 +121,7 @@ static int send_handles_worker(pid_t pid, void *data)
     }
   }
 
-  /* TODO: call GLOBAL_MEM_SET_OWNER(h_data, pid) when it's ready */
+  /* Note that h_data stays owned by the requesting process which frees it */
 
   global_unlock();
 
@@ -149,7 +149,7 @@ int libcx_send_handles(LIBCX_HANDLE *handles, size_t num_handles, pid_t pid, int
 
   do
   {
-    GLOBAL_NEW_PLUS_ARRAY(h_data, h_data->handles, num_handles);
+    GLOBAL_NEW_PLUS_ARRAY_OWNED(h_data, h_data->handles, num_handles);
     if (!h_data)
     {
       errno = ENOMEM;
@@ -248,8 +248,6 @@ int libcx_send_handles(LIBCX_HANDLE *handles, size_t num_handles, pid_t pid, int
           break;
       }
     }
-
-    /* TODO: call GLOBAL_MEM_SET_OWNER(h_data, pid) when it's ready */
   }
   while (0);
 
@@ -321,9 +319,7 @@ int libcx_send_handles(LIBCX_HANDLE *handles, size_t num_handles, pid_t pid, int
     }
   }
 
-  /* TODO: use GLOBAL_DEL(h_data) when it's ready */
-  if (h_data)
-    free(h_data);
+  GLOBAL_DEL(h_data);
 
   TRACE_PERR(rc);
   return rc;
@@ -409,15 +405,9 @@ static int take_handles_worker(pid_t pid, void *data)
     }
   }
 
+  /* We were given h_data for the close request (see libcx_take_handles) */
   if (h_data->flags & LIBCX_HANDLE_CLOSE)
-  {
-    /* TODO: use GLOBAL_DEL(h_data) when it's ready */
-    free(h_data);
-  }
-  else
-  {
-    /* TODO: call GLOBAL_MEM_SET_OWNER(h_data, pid) when it's ready */
-  }
+    GLOBAL_DEL(h_data);
 
   global_unlock();
 
@@ -447,7 +437,7 @@ int libcx_take_handles(LIBCX_HANDLE *handles, size_t num_handles, pid_t pid, int
 
   do
   {
-    GLOBAL_NEW_PLUS_ARRAY(h_data, h_data->handles, num_handles);
+    GLOBAL_NEW_PLUS_ARRAY_OWNED(h_data, h_data->handles, num_handles);
 
     if (!h_data)
     {
@@ -501,8 +491,6 @@ int libcx_take_handles(LIBCX_HANDLE *handles, size_t num_handles, pid_t pid, int
 
     h_data->num_handles = num_handles;
     h_data->flags = (flags & ~LIBCX_HANDLE_CLOSE);
-
-    /* TODO: call GLOBAL_MEM_SET_OWNER(h_data, pid) when it's ready */
   }
   while (0);
 
@@ -590,7 +578,8 @@ int libcx_take_handles(LIBCX_HANDLE *handles, size_t num_handles, pid_t pid, int
          * and the original handles array may be modified by the code above.
          */
 
-        /* TODO: call GLOBAL_MEM_SET_OWNER(h_data, pid) when it's ready */
+        /* Hand h_data over so that it's freed even if the worker never runs */
+        GLOBAL_MEM_SET_OWNER(h_data, pid);
 
         rc = interrupt_request(pid, take_handles_worker, h_data, &result);
 
@@ -603,9 +592,7 @@ int libcx_take_handles(LIBCX_HANDLE *handles, size_t num_handles, pid_t pid, int
     }
   }
 
-  /* TODO: use GLOBAL_DEL(h_data) when it's ready */
-  if (h_data)
-    free(h_data);
+  GLOBAL_DEL(h_data);
 
   TRACE_PERR(rc);
   return rc;
@@ -48,6 +48,7 @@ typedef struct InterruptResult
 
   int rc;
   pid_t pid;
+  pid_t req_pid; /* Requesting process */
   _smutex mutex;
   int8_t flags; /* REQ_RES_* */
 } InterruptResult;
@@ -168,8 +169,6 @@ static void interrupt_pre_term()
   {
     InterruptResult *res = gpProcDesc->interrupts->wait_results;
 
-    /* TODO: call GLOBAL_MEM_SET_OWNER(res, getpid()) when it's ready */
-
     __atomic_set_bit(&res->flags, REQ_RES_WAITING_RELEASE);
 
     global_unlock();
@@ -190,8 +189,8 @@ static void interrupt_pre_term()
 
     global_lock();
 
-    /* It's our responsibility to delete wait_result */
-    free(res);
+    /* It's our responsibility to delete wait_result (we still own it) */
+    GLOBAL_DEL(res);
   }
 
   global_unlock();
@@ -245,19 +244,29 @@ void interrupt_term(ProcDesc *proc)
     {
       if (req->result)
       {
-        /* Signal the waiting party */
+        /* Signal the waiting party and let it free the result */
         _smutex_release(&req->result->mutex);
-
-        /* TODO: call GLOBAL_MEM_SET_OWNER(req->result, req->pid) when it's ready */
+        GLOBAL_MEM_SET_OWNER(req->result, req->pid);
       }
 
       InterruptRequest *req_prev = req;
       req = req->next;
-      free(req_prev);
+      slab_free(req_prev);
+    }
+
+    /*
+     * Results waiting for release may still be used by requesting processes
+     * (which will free them then, see release_result()).
+     */
+    InterruptResult *res = proc->interrupts->wait_results;
+    while (res)
+    {
+      GLOBAL_MEM_SET_OWNER(res, res->req_pid);
+      res = res->wait_next;
     }
 
     /* If there are any unreleased results, release them now. */
-    InterruptResult *res = proc->interrupts->results;
+    res = proc->interrupts->results;
     while (res)
     {
       InterruptResult *res_prev = res;
@@ -266,7 +275,7 @@ void interrupt_term(ProcDesc *proc)
       if (res_prev->pid)
       {
         if (release_result(res_prev))
-          free(res_prev);
+          GLOBAL_DEL(res_prev);
       }
     }
 
@@ -310,16 +319,6 @@ static VOID APIENTRY interrupt_worker(ULONG data)
     gpProcDesc->interrupts->first = NULL;
     gpProcDesc->interrupts->last = NULL;
 
-    /* TODO: call GLOBAL_MEM_SET_OWNER when it's ready: */
-    /*
-    InterruptRequest *req = gpProcDesc->interrupts->active;
-    while (req)
-    {
-      GLOBAL_MEM_SET_OWNER(req->result, getpid());
-      req = req->next;
-    }
-    */
-
     global_unlock();
 
     /*
@@ -349,11 +348,12 @@ static VOID APIENTRY interrupt_worker(ULONG data)
         req->result->wait_next = gpProcDesc->interrupts->wait_results;
         gpProcDesc->interrupts->wait_results = req->result;
 
-        /* Signal the waiting party */
+        /*
+         * Signal the waiting party. Note that we keep owning the result until
+         * it's released by the requesting process (see release_result()).
+         */
         _smutex_release(&req->result->mutex);
 
-        /* TODO: call GLOBAL_MEM_SET_OWNER(req->result, req->pid) when it's ready */
-
         global_unlock();
       }
       else
@@ -364,7 +364,7 @@ static VOID APIENTRY interrupt_worker(ULONG data)
 
       InterruptRequest *req_prev = req;
       req = req->next;
-      free(req_prev);
+      slab_free(req_prev);
 
       /* Forget the deleted request */
       gpProcDesc->interrupts->active = req;
@@ -455,7 +455,9 @@ int interrupt_exception(struct _EXCEPTIONREPORTRECORD *report,
  * target process crashed (in the worker function or elsewhere) before
  * completing.
  *
- * TODO: Use GLOBAL_MEM_SET_OWNER on data and result->data when its ready.
+ * If @a data is a shared block allocated with global_alloc_owned(), the caller
+ * remains its owner. It should be handed over to the target process with
+ * GLOBAL_MEM_SET_OWNER() if the worker function is responsible for freeing it.
  *
  * @return     0 on success or -1 and sets errno on failure.
  */
@@ -486,7 +488,7 @@ int interrupt_request(pid_t pid, INTERRUPT_WORKER *worker, void *data, INTERRUPT
 
     InterruptRequest *req = NULL;
 
-    GLOBAL_NEW(req);
+    GLOBAL_NEW_SLAB(req, SlabInterruptRequest);
     if (!req)
     {
       errno = ENOMEM;
@@ -495,15 +497,16 @@ int interrupt_request(pid_t pid, INTERRUPT_WORKER *worker, void *data, INTERRUPT
 
     if (result)
     {
-      GLOBAL_NEW(req->result);
+      GLOBAL_NEW_OWNED(req->result);
       if (!req->result)
       {
-        free(req);
+        slab_free(req);
         errno = ENOMEM;
         break;
       }
 
       req_result = req->result;
+      req_result->req_pid = getpid();
     }
 
     rc = 0;
@@ -530,8 +533,8 @@ int interrupt_request(pid_t pid, INTERRUPT_WORKER *worker, void *data, INTERRUPT
       {
         /* Free newly created structs on failure to signal */
         if (req_result)
-          free(req_result);
-        free(req);
+          GLOBAL_DEL(req_result);
+        slab_free(req);
         errno = ESRCH;
         rc = -1;
         break;
@@ -545,8 +548,13 @@ int interrupt_request(pid_t pid, INTERRUPT_WORKER *worker, void *data, INTERRUPT
       proc->interrupts->last->next = req;
     proc->interrupts->last = req;
 
-    /* TODO: call GLOBAL_MEM_SET_OWNER(req, pid) when it's ready */
-    /* TODO: call GLOBAL_MEM_SET_OWNER(req_result, pid) when it's ready */
+    /*
+     * The target process frees the request when done and becomes responsible
+     * for the result (note that requests are always freed by their list owner
+     * so they need no ownership tracking).
+     */
+    if (req_result)
+      GLOBAL_MEM_SET_OWNER(req_result, pid);
   }
   while (0);
 
@@ -573,8 +581,6 @@ int interrupt_request(pid_t pid, INTERRUPT_WORKER *worker, void *data, INTERRUPT
     {
       global_lock();
 
-      /* TODO: call GLOBAL_MEM_SET_OWNER(req_result, getpid()) when it's ready */
-
       /* Put the result into the list of results to be released */
       req_result->next = gpProcDesc->interrupts->results;
       gpProcDesc->interrupts->results = req_result;
@@ -627,7 +633,7 @@ void interrupt_request_release(INTERRUPT_RESULT result)
     gpProcDesc->interrupts->results = res->next;
 
   if (release_result(res))
-    free(res);
+    GLOBAL_DEL(res);
 
   global_unlock();
 }
@@ -132,8 +132,18 @@ ULONG _System libcxExceptionHandler(PEXCEPTIONREPORTRECORD report,
   // signals to threads that may happen while holding the mutex as well.
   if (report->ExceptionNum != XCPT_ASYNC_PROCESS_TERMINATE &&
       !(report->fHandlerFlags & (EH_NESTED_CALL | EH_UNWINDING)))
+  {
     global_lock_deathcheck();
 
+    /*
+     * Write out buffered trace messages leading to the crash. Note that the
+     * exception may still be handled further down the chain so don't do a
+     * final drain which may wait and discards records being written (it's
+     * done by ProcessExit if we really crash).
+     */
+    TRACE_DRAIN();
+  }
+
   return XCPT_CONTINUE_SEARCH;
 }
 
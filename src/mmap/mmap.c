@@ -82,11 +82,15 @@ static APIRET DosMyAllocMem(PPVOID addr, ULONG size, ULONG flags)
 
 /**
  * Checks if there is any usage through fds for a given file description
- * and frees it if not.
+ * and frees it if not. Must be called under global_lock().
  */
 static void maybe_free_file_desc(FileDesc *desc)
 {
   int i;
+  size_t hash = desc->g->hash;
+
+  file_desc_lock(hash);
+
   for (i = 0; i < desc->size_fds; ++i)
     if (desc->fds[i] != -1)
       break;
@@ -94,13 +98,14 @@ static void maybe_free_file_desc(FileDesc *desc)
   if (i == desc->size_fds)
   {
     /* This desc is not used any more, free it */
-    size_t bucket = 0;
     FileDesc *prev = NULL;
     ProcDesc *proc = NULL;
-    FileDesc *fdesc = find_file_desc_ex(desc->g->path, &bucket, &prev, &proc);
+    FileDesc *fdesc = find_file_desc_ex(desc->g->path, hash, &prev, &proc);
     ASSERT_MSG(fdesc == desc, "%p %p", fdesc, desc);
-    free_file_desc(fdesc, bucket, prev, proc);
+    free_file_desc(fdesc, hash, prev, proc);
   }
+
+  file_desc_unlock(hash);
 }
 
 /*
@@ -115,7 +120,16 @@ static void free_file_handle(FileHandle *fh)
   ASSERT(!fh->refcnt);
 
   if (fh->dirtymap_sz)
+  {
+    /* Pages may still be dirty if flushing failed, forget them */
+    uint32_t dirty = 0;
+    size_t i;
+    for (i = 0; i < fh->dirtymap_sz / sizeof(*fh->dirtymap); ++i)
+      dirty += __builtin_popcount(fh->dirtymap[i]);
+    if (dirty)
+      __atomic_sub_fetch(&gpData->num_dirty_pages, dirty, __ATOMIC_RELAXED);
     free(fh->dirtymap);
+  }
   DosClose(fh->fd);
 
   if (fh->desc)
@@ -164,7 +178,7 @@ static void free_file_map_mem(FileMapMem *mem)
     m->next = mem->next;
   }
 
-  free(mem);
+  slab_free(mem);
 
   if (!fmap->mems)
   {
@@ -194,6 +208,20 @@ static void free_file_map_mem(FileMapMem *mem)
 
 static MemMap *find_mmap(MemMap *head, ULONG addr, MemMap **prev_out);
 
+/**
+ * Allocates a new zeroed mapping. The File part is only present if @a flags
+ * lack MAP_ANON. Returns NULL if no memory left.
+ */
+static MemMap *new_mmap(int flags)
+{
+  MemMap *m;
+  if (flags & MAP_ANON)
+    GLOBAL_NEW_SLAB(m, SlabMemMap);
+  else
+    GLOBAL_NEW_PLUS_SLAB(m, sizeof(*m->f), SlabFileMemMap);
+  return m;
+}
+
 /*
  * Clones the given mapping. Used in region splitting. Note that this clone is
  * never to be used directly: its next and start/end fields must be fixed
@@ -204,8 +232,7 @@ static MemMap *clone_file_mmap(MemMap *m)
   ASSERT(m->f->fmem);
   ASSERT(m->f->fh);
 
-  MemMap *nm;
-  GLOBAL_NEW_PLUS(nm, sizeof(*nm->f));
+  MemMap *nm = new_mmap(0);
   if (!nm)
     return NULL;
 
@@ -321,7 +348,12 @@ void *mmap(void *addr, size_t len, int prot, int flags,
     global_lock();
 
     /* Get the associated file description that stores the file handle */
-    fdesc = get_file_desc(fildes, pFH->pszNativePath);
+    {
+      size_t hash = file_desc_hash(pFH->pszNativePath);
+      file_desc_lock(hash);
+      fdesc = get_file_desc(fildes, pFH->pszNativePath, hash);
+      file_desc_unlock(hash);
+    }
     if (!fdesc)
     {
       global_unlock();
@@ -348,7 +380,7 @@ void *mmap(void *addr, size_t len, int prot, int flags,
       TRACE ("allocating initial file map & mem object\n");
       GLOBAL_NEW(fmap);
       if (fmap)
-        GLOBAL_NEW(fmem);
+        GLOBAL_NEW_SLAB(fmem, SlabFileMapMem);
       if (!fmap || !fmem)
       {
         if (fmap)
@@ -374,7 +406,7 @@ void *mmap(void *addr, size_t len, int prot, int flags,
       arc = DosMyAllocMem((PPVOID)&fmem->start, fmem->len, fmap_flags);
       if (arc)
       {
-        free(fmem);
+        slab_free(fmem);
         free(fmap);
         global_unlock();
         errno = ENOMEM;
@@ -401,7 +433,7 @@ void *mmap(void *addr, size_t len, int prot, int flags,
       {
         /* Need a new object */
         TRACE ("allocating new mem object\n");
-        GLOBAL_NEW(fmem);
+        GLOBAL_NEW_SLAB(fmem, SlabFileMapMem);
         if (!fmem)
         {
           global_unlock();
@@ -415,7 +447,7 @@ void *mmap(void *addr, size_t len, int prot, int flags,
         arc = DosMyAllocMem((PPVOID)&fmem->start, fmem->len, fmap_flags);
         if (arc)
         {
-          free(fmem);
+          slab_free(fmem);
           global_unlock();
           errno = ENOMEM;
           return MAP_FAILED;
@@ -572,7 +604,7 @@ void *mmap(void *addr, size_t len, int prot, int flags,
   }
 
   /* Allocate a new MemMap entry */
-  GLOBAL_NEW_PLUS(mmap, flags & MAP_ANON ? 0 : sizeof(*mmap->f));
+  mmap = new_mmap(flags);
   if (!mmap)
   {
     /* Free fh if it's not used */
@@ -643,7 +675,7 @@ void *mmap(void *addr, size_t len, int prot, int flags,
   /* Check for a memory allocation failure */
   if (arc)
   {
-    free(mmap);
+    slab_free(mmap);
 
     /* Free fh if it's not used */
     if (fh && !fdesc->fh)
@@ -896,7 +928,7 @@ void *mmap(void *addr, size_t len, int prot, int flags,
        * Now Free the original new mmap. We've cloned everything during overlaps
        * processing so it's no longer needed.
        */
-      free(mmap);
+      slab_free(mmap);
       mmap = m;
 
       /* Bypass fmem and fh reference counter increase */
@@ -992,7 +1024,7 @@ success:
 
 failure:
 
-  free(mmap);
+  slab_free(mmap);
 
   global_unlock();
 
@@ -1199,6 +1231,7 @@ static void flush_dirty_pages(MemMap *m, ULONG off, ULONG len)
           ASSERT_MSG(arc == NO_ERROR, "%ld 0x%lx 0x%lx", arc, page, dos_flags);
 
           m->f->fh->dirtymap[i] &= ~bit;
+          __atomic_decrement_u32(&gpData->num_dirty_pages);
 
           DosExitMustComplete(&nesting);
         }
@@ -1314,7 +1347,7 @@ static void free_mmap(ProcDesc *desc, MemMap *m, MemMap *prev)
   else if (desc)
     desc->mmaps = m->next;
 
-  free(m);
+  slab_free(m);
 }
 
 int munmap(void *addr, size_t len)
@@ -1362,9 +1395,7 @@ int munmap(void *addr, size_t len)
           m, m->start, m->end, m->flags & MAP_ANON ? 0 : m->f->refcnt,
           (ULONG)addr, addr_end);
 
-    MemMap *nm;
-
-    GLOBAL_NEW_PLUS(nm, m->flags & MAP_ANON ? 0 : sizeof(*nm->f));
+    MemMap *nm = new_mmap(m->flags);
     if (nm)
     {
       COPY_STRUCT_PLUS(nm, m, m->flags & MAP_ANON ? 0 : sizeof(*nm->f));
@@ -1676,6 +1707,101 @@ static void schedule_flush_dirty(ProcDesc *desc, int immediate)
   }
 }
 
+/**
+ * Returns a mapping of the current process that is responsible for a fault
+ * at the given address and the description of this process in @a desc_out.
+ * Returns NULL if there is no such mapping or if it's PROT_NONE or if the
+ * address is beyond the last page of the mapped file. Must be called from
+ * under global_lock() or global_lock_shared().
+ */
+static MemMap *find_fault_mmap(ULONG addr, ProcDesc **desc_out)
+{
+  ProcDesc *desc;
+  MemMap *m = NULL;
+
+  desc = find_proc_desc(getpid());
+  if (desc)
+    m = find_mmap(desc->mmaps, addr, NULL);
+
+  /*
+   * Note that we only do something if the found mmap is not PROT_NONE and
+   * let the application crash otherwise (see also mmap()). Also note that we
+   * ignore excpetions for file-bound mappings that address memory beyond the
+   * file's last page.
+   */
+
+  TRACE_IF(m && !(m->flags & MAP_ANON), "file size %llu\n", m->f->fmem->map->size);
+
+  if (m && m->dos_flags & fPERM &&
+      (m->flags & MAP_ANON ||
+       m->f->fmem->map->size > m->f->fmem->off + PAGE_ALIGN(addr - m->f->fmem->start)))
+  {
+    *desc_out = desc;
+    return m;
+  }
+
+  return NULL;
+}
+
+/**
+ * Handles an exception that needs no changes to LIBCx data: a guard page hit
+ * or an access to a page that some other thread or process has already
+ * committed with the necessary permissions. Such repeated faults are by far
+ * the most frequent ones on shared mappings accessed from many threads, so
+ * this is done from under global_lock_shared() to let them run in parallel.
+ * @return 1 to retry execution, 0 to proceed with mmap_exception().
+ */
+static int mmap_exception_shared(struct _EXCEPTIONREPORTRECORD *report, BOOL isGuard)
+{
+  int retry = 0;
+  ProcDesc *desc;
+  ULONG addr = report->ExceptionInfo[1];
+
+  global_lock_shared();
+
+  if (find_fault_mmap(addr, &desc))
+  {
+    APIRET arc;
+    ULONG len = PAGE_SIZE;
+    ULONG dos_flags;
+    ULONG page_addr = PAGE_ALIGN(addr);
+
+    arc = DosQueryMem((PVOID)page_addr, &len, &dos_flags);
+    TRACE_IF(arc, "DosQueryMem = %lu\n", arc);
+    if (!arc)
+    {
+      if (isGuard)
+      {
+        /*
+         * See mmap_exception() for details. Getting the shared lock here
+         * means that the thread committing the page has released global_lock
+         * and the page contents are complete.
+         */
+        retry = 1;
+      }
+      else if (dos_flags & PAG_COMMIT &&
+               ((report->ExceptionInfo[0] == XCPT_WRITE_ACCESS && dos_flags & PAG_WRITE) ||
+                (report->ExceptionInfo[0] == XCPT_READ_ACCESS && dos_flags & PAG_READ)))
+      {
+        /* Some other thread/process was faster and did what's necessary */
+        TRACE("already have necessary permissions\n");
+        if (dos_flags & PAG_GUARD)
+        {
+          /* Optimization: avoid unneededd XCPT_GUARD_PAGE_VIOLATION */
+          arc = DosSetMem((PVOID)page_addr, len, dos_flags & fPERM);
+          TRACE_IF(arc, "DosSetMem = %ld\n", arc);
+        }
+        if (!arc)
+          retry = 1;
+      }
+    }
+  }
+
+  global_unlock_shared();
+
+  return retry;
+}
+
 /**
  * System exception handler for mmap.
  * @return 1 to retry execution, 0 to call other handlers.
@@ -1692,7 +1818,7 @@ int mmap_exception(struct _EXCEPTIONREPORTRECORD *report,
     BOOL isGuard = report->ExceptionNum == XCPT_GUARD_PAGE_VIOLATION;
 
     ProcDesc *desc;
-    MemMap *m = NULL;
+    MemMap *m;
 
     ULONG addr = report->ExceptionInfo[1];
 
@@ -1701,24 +1827,16 @@ int mmap_exception(struct _EXCEPTIONREPORTRECORD *report,
           report->fHandlerFlags, report->NestedExceptionReportRecord, report->ExceptionAddress,
           addr, report->ExceptionInfo[0]);
 
-    global_lock();
-
-    desc = find_proc_desc(getpid());
-    if (desc)
-      m = find_mmap(desc->mmaps, addr, NULL);
-
-    /*
-     * Note that we only do something if the found mmap is not PROT_NONE and
-     * let the application crash otherwise (see also mmap()). Also note that we
-     * ignore excpetions for file-bound mappings that address memory beyond the
-     * file's last page.
-     */
+    if (mmap_exception_shared(report, isGuard))
+    {
+      TRACE("retrying\n");
+      return 1;
+    }
 
-    TRACE_IF(m && !(m->flags & MAP_ANON), "file size %llu\n", m->f->fmem->map->size);
+    global_lock();
 
-    if (m && m->dos_flags & fPERM &&
-        (m->flags & MAP_ANON ||
-         m->f->fmem->map->size > m->f->fmem->off + PAGE_ALIGN(addr - m->f->fmem->start)))
+    m = find_fault_mmap(addr, &desc);
+    if (m)
     {
       APIRET arc;
       ULONG len = PAGE_SIZE;
@@ -1776,6 +1894,8 @@ int mmap_exception(struct _EXCEPTIONREPORTRECORD *report,
                 LONGLONG pn = (m->f->fmem->off + (page_addr - m->f->fmem->start)) / PAGE_SIZE;
                 size_t i = pn / DIRTYMAP_WIDTH;
                 uint32_t bit = 0x1 << (pn % DIRTYMAP_WIDTH);
+                if (!(m->f->fh->dirtymap[i] & bit))
+                  __atomic_increment_u32(&gpData->num_dirty_pages);
                 m->f->fh->dirtymap[i] |= bit;
                 TRACE("Marked bit 0x%x at idx %u as dirty\n", bit, i);
                 schedule_flush_dirty(desc, 0 /* immediate */);
@@ -1889,6 +2009,8 @@ int mmap_exception(struct _EXCEPTIONREPORTRECORD *report,
               LONGLONG pn = (m->f->fmem->off + (page_addr - m->f->fmem->start)) / PAGE_SIZE;
               size_t i = pn / DIRTYMAP_WIDTH;
               uint32_t bit = 0x1 << (pn % DIRTYMAP_WIDTH);
+              if (!(m->f->fh->dirtymap[i] & bit))
+                __atomic_increment_u32(&gpData->num_dirty_pages);
               m->f->fh->dirtymap[i] |= bit;
               TRACE("Marked bit 0x%x at idx %u as dirty\n", bit, i);
               schedule_flush_dirty(desc, 0 /* immediate */);
@@ -2386,8 +2508,11 @@ int ftruncate(int fildes, __off_t length)
     /* Update file size in FileMap structs */
     FileDesc *fdesc;
     SharedFileDesc *fdesc_g;
+    size_t hash = file_desc_hash(pFH->pszNativePath);
 
-    fdesc = find_file_desc(pFH->pszNativePath, &fdesc_g);
+    file_desc_lock(hash);
+    fdesc = find_file_desc(pFH->pszNativePath, hash, &fdesc_g);
+    file_desc_unlock(hash);
 
     if (fdesc_g && fdesc_g->map)
     {
@@ -2534,7 +2659,7 @@ static void forkCompletion(void *pvArg, int rc, __LIBC_FORKCTX enmCtx)
       TRACE_IF(m->flags & MAP_ANON, "restoring mapping %p (start %lx)\n", m, m->start);
       TRACE_IF(!(m->flags & MAP_ANON), "restoring mapping %p (start %lx, fmem %p, fmem->start %lx)\n",
                m, m->start, m->f->fmem, m->f->fmem->start);
-      GLOBAL_NEW_PLUS(newm, m->flags & MAP_ANON ? 0 : sizeof(*newm->f));
+      newm = new_mmap(m->flags);
       if (!newm)
       {
         ok = FALSE;
@@ -2562,7 +2687,12 @@ static void forkCompletion(void *pvArg, int rc, __LIBC_FORKCTX enmCtx)
           dirtymap_sz = DIVIDE_UP(NUM_PAGES(newm->f->fmem->map->size), DIRTYMAP_WIDTH) * (DIRTYMAP_WIDTH / 8);
 
         /* Get a file descrition for this process (will create a new one if needed) */
-        fdesc = get_file_desc(-1, path);
+        {
+          size_t hash = file_desc_hash(path);
+          file_desc_lock(hash);
+          fdesc = get_file_desc(-1, path, hash);
+          file_desc_unlock(hash);
+        }
         if (!fdesc)
         {
           ok = FALSE;
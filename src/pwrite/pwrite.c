@@ -94,22 +94,27 @@ static ssize_t pread_pwrite(int bWrite, int fildes, void *buf,
 
   TRACE("pszNativePath %s, fFlags %x\n", pFH->pszNativePath, pFH->fFlags);
 
-  global_lock();
-
   {
-    FileDesc *desc = get_file_desc(fildes, pFH->pszNativePath);
+    size_t hash = file_desc_hash(pFH->pszNativePath);
+
+    file_desc_lock(hash);
+
+    FileDesc *desc = get_file_desc(fildes, pFH->pszNativePath, hash);
     if (desc)
     {
+      /*
+       * Lazily create a mutex for pread/pwrite serialization. All users of
+       * this file hash to the same bucket so its lock serializes creation.
+       */
       if (desc->g->pwrite_lock == NULLHANDLE)
       {
-        /* Lazily create a mutex for pread/pwrite serialization */
         arc = DosCreateMutexSem(NULL, &desc->g->pwrite_lock, DC_SEM_SHARED, FALSE);
         TRACE("DosCreateMutexSem = %lu\n", arc);
       }
       mutex = desc->g->pwrite_lock;
     }
 
-    global_unlock();
+    file_desc_unlock(hash);
 
     if (!desc || arc != NO_ERROR)
     {
@@ -29,6 +29,7 @@
 #include <limits.h>
 #include <process.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <sys/builtin.h>
 #include <sys/errno.h>
 #include <assert.h>
@@ -36,6 +37,7 @@
 
 #include "shared.h"
 #include "version.h"
+#include "hash.h"
 
 #include "spawn/spawn2-internal.h"
 
@@ -75,24 +77,33 @@
 static char MUTEX_LIBCX[] = "\\SEM32\\LIBCX_MUTEX_V" VERSION_MAJ_MIN_BLD LIBCX_DEBUG_SUFFIX LIBCX_DEV_SUFFIX LIBCX_DEV_HMODSTR_TPL;
 static char SHAREDMEM_LIBCX[] = "\\SHAREMEM\\LIBCX_DATA_V" VERSION_MAJ_MIN_BLD LIBCX_DEBUG_SUFFIX LIBCX_DEV_SUFFIX LIBCX_DEV_HMODSTR_TPL;
 
-#define HEAP_SIZE (1024 * 1024 * 2) /* 2MB - total shared data area size */
+#define HEAP_SIZE (1024 * 1024 * 2) /* 2MB - initial shared data area size */
 #define HEAP_INIT_SIZE 65536 /* Initial size of committed memory */
 #define HEAP_INC_SIZE 65536 /* Heap increment amount */
+#define HEAP_SEG_SIZE (1024 * 1024 * 4) /* 4MB - min size of additional heap segments */
+#define HEAP_MAX_SIZE 64 /* Default max total reserved size in MB (LIBCX_HEAP_MAX) */
+#define HEAP_HWM_PERCENT 80 /* Committed size that triggers a warning, in % of max */
 
-#if defined(TRACE_ENABLED) && defined(TRACE_USE_LIBC_LOG)
+#ifdef TRACE_USE_LIBC_LOG
+
+#ifdef TRACE_ENABLED
+#define TRACE_GROUPS_DEFAULT 1 /* Debug builds have all groups enabled by default */
+#else
+#define TRACE_GROUPS_DEFAULT 0
+#endif
 
 static __LIBC_LOGGROUP  gLogGroup[] =
 {
-  { 1, "nogroup" },           /*  0 */
-  { 1, "fcntl" },             /*  1 */
-  { 1, "pwrite" },            /*  2 */
-  { 1, "select" },            /*  3 */
-  { 1, "mmap" },              /*  4 */
-  { 1, "dosreadbugfix" },     /*  5 */
-  { 1, "exeinfo" },           /*  6 */
-  { 1, "close" },             /*  7 */
-  { 1, "spawn" },             /*  8 */
-  { 1, "shmem" },             /*  9 */
+  { TRACE_GROUPS_DEFAULT, "nogroup" },           /*  0 */
+  { TRACE_GROUPS_DEFAULT, "fcntl" },             /*  1 */
+  { TRACE_GROUPS_DEFAULT, "pwrite" },            /*  2 */
+  { TRACE_GROUPS_DEFAULT, "select" },            /*  3 */
+  { TRACE_GROUPS_DEFAULT, "mmap" },              /*  4 */
+  { TRACE_GROUPS_DEFAULT, "dosreadbugfix" },     /*  5 */
+  { TRACE_GROUPS_DEFAULT, "exeinfo" },           /*  6 */
+  { TRACE_GROUPS_DEFAULT, "close" },             /*  7 */
+  { TRACE_GROUPS_DEFAULT, "spawn" },             /*  8 */
+  { TRACE_GROUPS_DEFAULT, "shmem" },             /*  9 */
 };
 
 static __LIBC_LOGGROUPS gLogGroups =
@@ -100,6 +111,81 @@ static __LIBC_LOGGROUPS gLogGroups =
   0, sizeof(gLogGroup)/sizeof(gLogGroup[0]), gLogGroup
 };
 
+/* Mirrors gLogGroup[].fEnabled for tracepoints (see TRACE_GROUP_ON) */
+uint32_t gTraceGroups = TRACE_GROUPS_DEFAULT ? ~0U : 0;
+
+/**
+ * Updates gTraceGroups after a change in gLogGroup.
+ */
+static void trace_groups_update()
+{
+  uint32_t mask = 0;
+  int i;
+
+  for (i = 0; i < sizeof(gLogGroup)/sizeof(gLogGroup[0]); ++i)
+    if (gLogGroup[i].fEnabled)
+      mask |= 1U << i;
+
+  gTraceGroups = mask;
+}
+
+/**
+ * Enables and disables trace groups at runtime. @a spec has the same syntax
+ * as the LIBCX_TRACE environment variable: a list of group names (or "all")
+ * each prefixed with '+' to enable or '-' to disable it, e.g. "-all+mmap".
+ * Returns 0 on success or -1 and sets errno to EINVAL if @a spec contains an
+ * unknown group (all known groups are still applied).
+ */
+int libcx_trace_set_groups(const char *spec)
+{
+  int rc = 0;
+
+  while (*spec)
+  {
+    int enable = 1, i;
+    size_t len;
+
+    if (*spec == '+' || *spec == '-')
+      enable = *spec++ == '+';
+
+    len = strcspn(spec, "+-, ");
+    if (len == 0)
+    {
+      if (*spec)
+        ++spec;
+      continue;
+    }
+
+    if (len == 3 && !strnicmp(spec, "all", 3))
+    {
+      for (i = 0; i < sizeof(gLogGroup)/sizeof(gLogGroup[0]); ++i)
+        gLogGroup[i].fEnabled = enable;
+    }
+    else
+    {
+      for (i = 0; i < sizeof(gLogGroup)/sizeof(gLogGroup[0]); ++i)
+      {
+        if (strlen(gLogGroup[i].pszGroupName) == len &&
+            !strnicmp(spec, gLogGroup[i].pszGroupName, len))
+        {
+          gLogGroup[i].fEnabled = enable;
+          break;
+        }
+      }
+      if (i == sizeof(gLogGroup)/sizeof(gLogGroup[0]))
+        rc = -1;
+    }
+
+    spec += len;
+  }
+
+  trace_groups_update();
+
+  if (rc)
+    errno = EINVAL;
+  return rc;
+}
+
 #endif
 
 static volatile uint32_t gLogInstanceState = 0;
@@ -116,26 +202,249 @@ ProcDesc *gpProcDesc = NULL;
 
 static HMTX gMutex = NULLHANDLE;
 
+/* Number of heap segments this process got access to */
+static uint32_t gHeapSegsAttached = 0;
+
+/*
+ * Map of fds to FileDesc structs of this process (see fd_map_get()). It's a
+ * two-level table of lazily allocated chunks so that lock-less readers never
+ * see it reallocated.
+ */
+#define FD_MAP_CHUNK_SIZE 256
+#define FD_MAP_CHUNKS 256
+static FileDesc **volatile gFdMap[FD_MAP_CHUNKS];
+static void fd_map_reset();
+
+static void free_owned_mem(ProcDesc *proc);
+
+/*
+ * Number of global_lock_shared() holders in this process. Only counts readers
+ * already registered in gpData->lock_readers so that ProcessExit may drop
+ * them from there if the process dies while holding them.
+ */
+static volatile uint32_t gSharedLocks = 0;
+static void release_shared_locks();
+
+/*
+ * SharedLock spin locks held by threads of this process (NULL for free slots)
+ * so that ProcessExit may release those left by crashed threads before it
+ * requests the global mutex whose owner may be waiting for one of them. Big
+ * enough for hash_map_grow() which holds all bucket locks of a map at once.
+ * Locks that find no free slot are only released under the mutex.
+ */
+#define HELD_LOCKS 256
+static SharedLock *volatile gHeldLocks[HELD_LOCKS];
+static void release_held_locks();
+static void global_lock_direct_begin();
+static void global_lock_direct_end();
+
+/*
+ * Filter of files this process has FileDesc structs for, indexed by the low
+ * bits of file_desc_hash(). Each slot counts all such files mapping to it so
+ * that a zero slot means there is definitely none. Together with the total
+ * number of FileDesc structs it lets close() skip shared data altogether for
+ * files LIBCx doesn't care about. Slots are only changed under the bucket
+ * lock of the respective hash (FILE_FILTER_SIZE is a multiple of
+ * FILE_DESC_LOCKS so all hashes of one slot share the same lock). A forked
+ * child inherits the parent's counts which only makes the filter more
+ * conservative.
+ */
+#define FILE_FILTER_SIZE 1024
+static volatile uint32_t gFileFilter[FILE_FILTER_SIZE];
+static volatile uint32_t gNumFileDescs = 0;
+
 static void APIENTRY ProcessExit(ULONG);
 
-enum { StatsBufSize = 768 };
-static int format_stats(char *buf, int size);
+enum { StatsBufSize = 1536, DetailedStatsBufSize = 6144 };
+static int format_stats(char *buf, int size, int details);
 
 static int init_log_instance();
 
-/*
- * @todo Currently we reserve a static block of HEAP_SIZE at LIBCx init
- * which we commit/release as needed. The disadvantage is obvious - we
- * constantly occupy the address space that could be needed for other
- * purposes, but limit the max memory size which may be not enough under
- * certain LIBCx load. But in order to allow for dynamic allocation of
- * shared memory we need to track all proccess IDs that are currently
- * using LIBCx so that we give them the newly allocated shared memory.
- * This is for later. See https://github.com/bitwiseworks/libcx/issues/9.
+/**
+ * Logs a shared heap usage warning. This is done regardless of trace groups
+ * as running out of shared memory is fatal for all LIBCx processes.
+ */
+static void log_heap_warning(const char *what)
+{
+  if (init_log_instance())
+  {
+    char buf[256];
+    int n;
+    /* Log directly to not depend on enabled trace groups (see libcx_trace) */
+    ULONG ts;
+    DosQuerySysInfo(QSV_MS_COUNT, QSV_MS_COUNT, &ts, sizeof(ts));
+    n = __libc_LogSNPrintf(gLogInstance, buf, sizeof(buf), "%08lx %YT %YG", ts, 0, 0);
+    n += snprintf(buf + n, sizeof(buf) - n, "WARNING!!! LIBCx shared heap %s "
+                  "(committed %u, reserved %u, max %u bytes, %u segments)!!!\n",
+                  what, gpData->size, gpData->reserved, gpData->max_size,
+                  gpData->seg_count);
+    __libc_LogRaw(gLogInstance, __LIBC_LOG_MSGF_FLUSH | __LIBC_LOG_MSGF_ALWAYS, buf, n);
+  }
+}
+
+/**
+ * Gets access to heap segments allocated by other processes since the last
+ * call. Needed only for segments that could not be given to us directly by
+ * add_heap_seg() (i.e. for those allocated before we started).
+ */
+static void attach_heap_segs()
+{
+  APIRET arc;
+
+  while (gHeapSegsAttached < gpData->seg_count)
+  {
+    HeapSeg *seg = &gpData->segs[gHeapSegsAttached];
+
+    /* Note that we may already have access if it was given to us */
+    arc = DosGetSharedMem(seg->base, PAG_READ | PAG_WRITE);
+    TRACE("DosGetSharedMem(%p) = %ld\n", seg->base, arc);
+
+    ++gHeapSegsAttached;
+  }
+}
+
+/**
+ * Gives access to a new heap segment to all other LIBCx processes. Called
+ * with the heap lock held which guarantees that ProcDesc structures are not
+ * freed while we walk the list (we can't take procs bucket locks here as it
+ * would violate the lock hierarchy). A process that is being started or
+ * terminated and is not (or no longer) listed in procs holds global_lock() and
+ * advertises itself in unlisted_pid so that it gets the segment too.
+ */
+static void give_heap_seg(HeapSeg *seg)
+{
+  APIRET arc;
+  pid_t pid = getpid();
+  int i;
+
+  if (gpData->procs.buckets)
+  {
+    /*
+     * Entries may be moved between buckets by a concurrent rehash, so repeat
+     * the walk if it happened meanwhile (giving twice is harmless). Note that
+     * arrays can't be freed while we hold the heap lock. Reading size before
+     * buckets guarantees we don't go beyond the array (see hash_map_grow()).
+     */
+    uint32_t gen;
+    do
+    {
+      size_t b, size;
+      HashMapEntry **buckets[2];
+
+      while (gpData->procs.busy)
+        DosSleep(0);
+      gen = gpData->procs.gen;
+
+      size = gpData->procs.size;
+      buckets[0] = gpData->procs.buckets;
+      buckets[1] = gpData->procs.old_buckets;
+
+      for (i = 0; i < 2; ++i, size /= 2)
+      {
+        if (!buckets[i])
+          continue;
+        for (b = 0; b < size; ++b)
+        {
+          ProcDesc *proc;
+          for (proc = (ProcDesc *)buckets[i][b]; proc; proc = proc->next)
+          {
+            if (proc->pid != pid)
+            {
+              arc = DosGiveSharedMem(seg->base, proc->pid, PAG_READ | PAG_WRITE);
+              TRACE("DosGiveSharedMem(%p, %04x) = %ld\n", seg->base, proc->pid, arc);
+            }
+          }
+        }
+      }
+    }
+    while (gpData->procs.busy || gpData->procs.gen != gen);
+  }
+
+  if (gpData->unlisted_pid && gpData->unlisted_pid != pid)
+  {
+    arc = DosGiveSharedMem(seg->base, gpData->unlisted_pid, PAG_READ | PAG_WRITE);
+    TRACE("DosGiveSharedMem(%p, %04x) = %ld\n", seg->base, gpData->unlisted_pid, arc);
+  }
+}
+
+/**
+ * Allocates a new heap segment that can hold at least @a size bytes and makes
+ * it current. Returns NULL if the heap size limit is reached or if there is
+ * not enough memory.
+ */
+static HeapSeg *add_heap_seg(size_t size)
+{
+  APIRET arc;
+  HeapSeg *seg;
+  char *base;
+
+  if (size < HEAP_SEG_SIZE)
+    size = HEAP_SEG_SIZE;
+
+  if (gpData->seg_count == HEAP_MAX_SEGS || gpData->reserved + size > gpData->max_size)
+  {
+    TRACE("out of memory (reserved %u, max %u, segments %u)\n",
+          gpData->reserved, gpData->max_size, gpData->seg_count);
+    if (!(gpData->heap_warned & 2))
+    {
+      gpData->heap_warned |= 2;
+      log_heap_warning("limit reached");
+    }
+    return NULL;
+  }
+
+  /*
+   * Use an unnamed gettable segment so that processes started later could
+   * get access to it by address (see attach_heap_segs()).
+   */
+  arc = DosAllocSharedMem((PPVOID)&base, NULL, size,
+                          PAG_READ | PAG_WRITE | OBJ_GETTABLE | OBJ_GIVEABLE | OBJ_ANY);
+  TRACE("DosAllocSharedMem(OBJ_ANY, %u) = %ld\n", size, arc);
+
+  if (arc)
+  {
+    /* High memory may be unavailable, try w/o OBJ_ANY */
+    arc = DosAllocSharedMem((PPVOID)&base, NULL, size,
+                            PAG_READ | PAG_WRITE | OBJ_GETTABLE | OBJ_GIVEABLE);
+    TRACE("DosAllocSharedMem(%u) = %ld\n", size, arc);
+  }
+
+  if (arc)
+    return NULL;
+
+  seg = &gpData->segs[gpData->seg_count];
+  seg->base = base;
+  seg->size = size;
+  seg->committed = 0;
+
+  gpData->reserved += size;
+
+  /*
+   * Publish the new segment. Note that the atomic increment is also a full
+   * memory barrier which pairs with the one in shared_init() to make sure the
+   * process being initialized either sees the new segment or is seen in
+   * unlisted_pid by give_heap_seg().
+   */
+  __atomic_increment_u32(&gpData->seg_count);
+
+  give_heap_seg(seg);
+
+  return seg;
+}
+
+/**
+ * Heap callback that provides more memory to the shared heap. Memory is
+ * committed in HEAP_INC_SIZE steps from the current segment (the initial one
+ * of HEAP_SIZE holds SharedData itself). When the current segment is
+ * exhausted, a new one is allocated and given to all LIBCx processes. The
+ * total reserved size is limited by SharedData::max_size and a warning is
+ * logged once the committed size crosses HEAP_HWM_PERCENT of the limit.
+ * See https://github.com/bitwiseworks/libcx/issues/9.
  */
 static void *mem_alloc(Heap_t h, size_t *psize, int *pclean)
 {
   APIRET arc;
+  HeapSeg *seg;
   char *mem;
   size_t size;
 
@@ -143,13 +452,17 @@ static void *mem_alloc(Heap_t h, size_t *psize, int *pclean)
 
   /* Round requested size up to HEAP_INC_SIZE */
   size = (*psize + HEAP_INC_SIZE - 1) / HEAP_INC_SIZE * HEAP_INC_SIZE;
-  if (size + gpData->size > HEAP_SIZE)
+
+  seg = &gpData->segs[gpData->seg_count - 1];
+  if (size + seg->committed > seg->size)
   {
-    TRACE("out of memory");
-    return NULL;
+    /* The rest of the current segment is abandoned, it's too small anyway */
+    seg = add_heap_seg(size);
+    if (!seg)
+      return NULL;
   }
 
-  mem = (char *)gpData + gpData->size;
+  mem = seg->base + seg->committed;
 
   /* Commit the new block */
   arc = DosSetMem(mem, size, PAG_DEFAULT | PAG_COMMIT);
@@ -163,7 +476,19 @@ static void *mem_alloc(Heap_t h, size_t *psize, int *pclean)
   /* Return the actually allocated number of bytes */
   *psize = size;
 
+  seg->committed += size;
   gpData->size += size;
+
+  if (gpData->max_committed < gpData->size)
+    gpData->max_committed = gpData->size;
+
+  if (!(gpData->heap_warned & 1) &&
+      gpData->size > gpData->max_size / 100 * HEAP_HWM_PERCENT)
+  {
+    gpData->heap_warned |= 1;
+    log_heap_warning("high-water mark reached");
+  }
+
   return mem;
 }
 
@@ -179,6 +504,15 @@ static void shared_init(int forked)
   arc = DosExitList(EXLST_ADD, ProcessExit);
   ASSERT_MSG(arc == NO_ERROR, "%ld", arc);
 
+#ifdef TRACE_USE_LIBC_LOG
+  /* Apply LIBCX_TRACE (a forked child inherits the parent's settings) */
+  if (!forked)
+  {
+    __libc_LogGroupInit(&gLogGroups, "LIBCX_TRACE");
+    trace_groups_update();
+  }
+#endif
+
 #if defined(TRACE_ENABLED) && !defined(TRACE_USE_LIBC_LOG)
   /*
    * Allocate a larger buffer to fit lengthy TRACE messages and disable
@@ -230,7 +564,21 @@ static void shared_init(int forked)
         }
 
         /*
-         * It's an ordinary LIBCx process. Increase coutners.
+         * It's an ordinary LIBCx process. Get access to additional heap
+         * segments. Until we are listed in procs, processes growing the heap
+         * will give new segments to us via unlisted_pid. Note that the atomic
+         * exchange is also a full memory barrier (see add_heap_seg()).
+         */
+
+        /* Block readers until we are done, see global_lock_direct_begin() */
+        global_lock_direct_begin();
+
+        __atomic_xchg((volatile unsigned *)&gpData->unlisted_pid, getpid());
+        gHeapSegsAttached = 1;
+        attach_heap_segs();
+
+        /*
+         * Increase coutners.
          */
 
         TRACE("gpData->heap = %p\n", gpData->heap);
@@ -289,7 +637,29 @@ static void shared_init(int forked)
     arc = DosSetMem(gpData, HEAP_INIT_SIZE, PAG_DEFAULT | PAG_COMMIT);
     ASSERT_MSG(arc == NO_ERROR, "%ld", arc);
 
+    /* Nobody can be a reader yet but nested global_lock() calls need this */
+    global_lock_direct_begin();
+
     gpData->size = HEAP_INIT_SIZE;
+    gpData->reserved = HEAP_SIZE;
+    gpData->max_committed = HEAP_INIT_SIZE;
+
+    /* The initial segment is where we are */
+    gpData->segs[0].base = (char *)gpData;
+    gpData->segs[0].size = HEAP_SIZE;
+    gpData->segs[0].committed = HEAP_INIT_SIZE;
+    gpData->seg_count = 1;
+    gHeapSegsAttached = 1;
+
+    /* Set the heap size limit (in megabytes) */
+    {
+      int max_size = HEAP_MAX_SIZE;
+      _getenv_int("LIBCX_HEAP_MAX", &max_size);
+      gpData->max_size = max_size > 0 ? max_size * 1024 * 1024 : 0;
+      if (gpData->max_size < HEAP_SIZE)
+        gpData->max_size = HEAP_SIZE;
+      TRACE("gpData->max_size = %u\n", gpData->max_size);
+    }
 
     /* Create shared heap */
     gpData->heap = _ucreate(gpData + 1, HEAP_INIT_SIZE - sizeof(*gpData),
@@ -304,13 +674,13 @@ static void shared_init(int forked)
     gpData->refcnt = 1;
 
     /* Initialize common structures */
-    GLOBAL_NEW_ARRAY(gpData->procs, PROC_DESC_HASH_SIZE);
-    TRACE("gpData->procs = %p\n", gpData->procs);
-    ASSERT(gpData->procs);
+    rc = hash_map_init(&gpData->procs, PROC_DESC_LOCKS);
+    TRACE("gpData->procs.buckets = %p\n", gpData->procs.buckets);
+    ASSERT(rc == 0);
 
-    GLOBAL_NEW_ARRAY(gpData->files, FILE_DESC_HASH_SIZE);
-    TRACE("gpData->files = %p\n", gpData->files);
-    ASSERT(gpData->files);
+    rc = hash_map_init(&gpData->files, FILE_DESC_LOCKS);
+    TRACE("gpData->files.buckets = %p\n", gpData->files.buckets);
+    ASSERT(rc == 0);
 
     break;
   }
@@ -323,6 +693,10 @@ static void shared_init(int forked)
   ProcDesc *proc = get_proc_desc(getpid());
   ASSERT(proc);
 
+  /* We are listed in procs now, catch segments added in between */
+  attach_heap_segs();
+  __atomic_xchg((volatile unsigned *)&gpData->unlisted_pid, 0);
+
   /* Initialize individual components */
   mmap_init(proc);
   fcntl_locking_init(proc);
@@ -353,6 +727,7 @@ static void shared_init(int forked)
     TRACE("gpProcDesc %p\n", gpProcDesc);
   }
 
+  global_lock_direct_end();
   DosReleaseMutexSem(gMutex);
 
   TRACE("done\n");
@@ -370,6 +745,14 @@ static void shared_term()
 
   ASSERT(gSeenAssertion || gMutex != NULLHANDLE);
 
+  /*
+   * Drop readers left by threads that died in global_lock_shared() and spin
+   * locks left by crashed threads before requesting the mutex, otherwise its
+   * owner (or us) may wait for them forever.
+   */
+  release_shared_locks();
+  release_held_locks();
+
   DOS_NI(arc = DosRequestMutexSem(gMutex, SEM_INDEFINITE_WAIT));
   TRACE("DosRequestMutexSem = %ld\n", arc);
 
@@ -380,6 +763,8 @@ static void shared_term()
    */
   if (gpData && arc == NO_ERROR)
   {
+    global_lock_direct_begin();
+
     if (gpData->heap)
     {
       int i;
@@ -391,6 +776,36 @@ static void shared_term()
       proc = gpProcDesc;
       TRACE("proc %p\n", proc);
 
+      /*
+       * Release system-wide locks we might have left after a crash which
+       * release_held_locks() didn't know about
+       */
+      shared_lock_reset(&gpData->procs_resize_lock);
+      shared_lock_reset(&gpData->files_resize_lock);
+      for (i = 0; i < PROC_DESC_LOCKS; ++i)
+        shared_lock_reset(&gpData->procs_locks[i]);
+      for (i = 0; i < FILE_DESC_LOCKS; ++i)
+        shared_lock_reset(&gpData->files_locks[i]);
+      for (i = 0; i < SlabCount; ++i)
+        shared_lock_reset(&gpData->slabs[i].lock);
+      for (i = 0; i < FILE_DESC_LOCKS; ++i)
+      {
+        size_t b;
+
+        file_desc_lock(i);
+        file_desc_rehash(i, NULL);
+        for (b = i; b < gpData->files.size; b += FILE_DESC_LOCKS)
+        {
+          SharedFileDesc *desc_g = (SharedFileDesc *)gpData->files.buckets[b];
+          while (desc_g)
+          {
+            shared_lock_reset(&desc_g->lock);
+            desc_g = desc_g->next;
+          }
+        }
+        file_desc_unlock(i);
+      }
+
       /* Uninitialize individual components */
       interrupt_term(proc);
       shmem_data_term(proc);
@@ -399,6 +814,9 @@ static void shared_term()
 
       if (proc)
       {
+        /* Release shared blocks nobody took over from this process */
+        free_owned_mem(proc);
+
         if (proc->spawn2_wrappers)
         {
           TRACE("proc->spawn2_wrappers %p\n", proc->spawn2_wrappers);
@@ -420,43 +838,59 @@ static void shared_term()
         }
 
         /* Free common per-process structures */
-        TRACE("proc->files %p\n", proc->files);
-        if (proc->files)
+        TRACE("proc->files.buckets %p\n", proc->files.buckets);
+        if (proc->files.buckets)
         {
-          for (i = 0; i < FILE_DESC_HASH_SIZE; ++i)
+          for (i = 0; i < FILE_DESC_LOCKS; ++i)
           {
-            FileDesc *desc = proc->files[i];
-            while (desc)
+            size_t b;
+
+            file_desc_lock(i);
+            file_desc_rehash(i, proc);
+            for (b = i; b < proc->files.size; b += FILE_DESC_LOCKS)
             {
-              FileDesc *next = desc->next;
-              free_file_desc(desc, i, NULL, NULL);
-              desc = next;
+              /* Each desc is the bucket head at the time it's freed */
+              FileDesc *desc = (FileDesc *)proc->files.buckets[b];
+              while (desc)
+              {
+                FileDesc *next = desc->next;
+                free_file_desc(desc, desc->g->hash, NULL, proc);
+                desc = next;
+              }
             }
+            file_desc_unlock(i);
           }
-          free(proc->files);
+          hash_map_free(&proc->files);
         }
 
-        /* Remove proc from the hash and free it */
+        /*
+         * Remove proc from the hash and free it. We still need new heap
+         * segments until we are done with the heap (see give_heap_seg()).
+         */
+        __atomic_xchg((volatile unsigned *)&gpData->unlisted_pid, getpid());
         proc = take_proc_desc(getpid());
         ASSERT_MSG(proc == gpProcDesc, "%p", proc);
         free(proc);
         gpProcDesc = NULL;
+        fd_map_reset();
       }
 
+      /* Give slabs freed by this process (and others) back to the heap */
+      slab_trim();
+
       if (gpData->refcnt == 0)
       {
         /* We are the last process, free common structures */
-        TRACE("gpData->files %p\n", gpData->files);
-        if (gpData->files)
+        TRACE("gpData->files.buckets %p\n", gpData->files.buckets);
+        if (gpData->files.buckets)
         {
           /* Make sure we don't have lost SharedFileDesc data */
-          for (i = 0; i < FILE_DESC_HASH_SIZE; ++i)
-            ASSERT_MSG(!gpData->files[i], "%p", gpData->files[i]);
-          free(gpData->files);
+          ASSERT_MSG(!gpData->files.count, "%u", gpData->files.count);
+          hash_map_free(&gpData->files);
         }
-        TRACE("gpData->procs %p\n", gpData->procs);
-        if (gpData->procs)
-          free(gpData->procs);
+        TRACE("gpData->procs.buckets %p\n", gpData->procs.buckets);
+        if (gpData->procs.buckets)
+          hash_map_free(&gpData->procs);
       }
 
 #ifdef TRACE_ENABLED
@@ -466,7 +900,7 @@ static void shared_term()
         char *buf = alloca(StatsBufSize);
         if (buf)
         {
-          format_stats(buf, StatsBufSize);
+          format_stats(buf, StatsBufSize, FALSE);
           TRACE("%s", buf);
         }
       }
@@ -485,8 +919,20 @@ static void shared_term()
         rc = _udestroy(gpData->heap, !_FORCE);
         TRACE("_udestroy = %d (%d)\n", rc, errno);
       }
+
+      gpData->unlisted_pid = 0;
+
+      /* Release additional heap segments (the last process frees them) */
+      for (i = 1; i < gpData->seg_count; ++i)
+      {
+        arc = DosFreeMem(gpData->segs[i].base);
+        TRACE("DosFreeMem(%p) = %ld\n", gpData->segs[i].base, arc);
+      }
+      gHeapSegsAttached = 0;
     }
 
+    global_lock_direct_end();
+
     arc = DosFreeMem(gpData);
     TRACE("DosFreeMem = %ld\n", arc);
   }
@@ -572,23 +1018,151 @@ static void APIENTRY ProcessExit(ULONG reason)
 
   shared_term();
 
+  /* Write out what's left in the trace ring */
+  TRACE_DUMP();
+
   DosExitList(EXLST_EXIT, NULL);
 }
 
+/**
+ * Returns the current value of the CPU time stamp counter.
+ */
+static inline uint64_t read_tsc()
+{
+  uint64_t tsc;
+  __asm__ __volatile__("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
+/**
+ * Returns global_lock() statistics of the given call site (allocating a new
+ * entry if needed). Must be called under global_lock().
+ */
+static LockSiteStats *lock_site_stats(const char *site)
+{
+  enum { NumSites = LOCK_STATS_SITES - 1 };
+
+  LockSiteStats *sites = gpData->lock_stats.sites;
+  size_t i, n = ((size_t)site >> 2) % NumSites;
+
+  for (i = 0; i < NumSites; ++i, n = (n + 1) % NumSites)
+  {
+    if (sites[n].site == site)
+      return &sites[n];
+
+    if (!sites[n].site)
+    {
+      sites[n].site = site;
+      strncpy(sites[n].name, site, sizeof(sites[n].name) - 1);
+      return &sites[n];
+    }
+  }
+
+  /* The table is full, account it as other */
+  if (!sites[NumSites].site)
+  {
+    sites[NumSites].site = "<other>";
+    strcpy(sites[NumSites].name, sites[NumSites].site);
+  }
+
+  return &sites[NumSites];
+}
+
+/**
+ * Keeps new global_lock_shared() callers out and waits for the active ones to
+ * finish. Must be called by the outermost gMutex owner. Returns 1 if there
+ * were active readers and 0 otherwise.
+ */
+static int wait_readers()
+{
+  __atomic_xchg((volatile unsigned *)&gpData->lock_writer, 1);
+  if (!gpData->lock_readers)
+    return 0;
+
+  while (gpData->lock_readers)
+    DosSleep(0);
+
+  return 1;
+}
+
+/**
+ * Makes the code that requests gMutex directly (i.e. shared_init() and
+ * shared_term() that run when gpData may not be there yet or any more) a
+ * writer as if it called global_lock(). The depth taken here makes nested
+ * global_lock() calls leave lock_writer alone on return. Must be paired with
+ * global_lock_direct_end() before releasing gMutex.
+ */
+static void global_lock_direct_begin()
+{
+  if (gpData->lock_stats.depth++ == 0)
+    wait_readers();
+}
+
+/**
+ * Undoes global_lock_direct_begin().
+ */
+static void global_lock_direct_end()
+{
+  ASSERT(gpData->lock_stats.depth);
+  if (--gpData->lock_stats.depth == 0)
+    __atomic_xchg((volatile unsigned *)&gpData->lock_writer, 0);
+}
+
 /**
  * Requests the global mutex that protects general access to gpData.
- * Must be always called before accessing gpData members.
+ * Must be always called before accessing gpData members. Use the
+ * global_lock() macro that passes the caller's name as @a site for
+ * LockStats.
  */
-void global_lock()
+void global_lock_ex(const char *site)
 {
   APIRET arc;
+  uint64_t begin, end;
+  int contended = 0;
+  LockStats *stats;
+  LockSiteStats *ss;
 
   ASSERT(gMutex != NULLHANDLE);
   ASSERT(gpData);
 
-  DOS_NI(arc = DosRequestMutexSem(gMutex, SEM_INDEFINITE_WAIT));
+  begin = read_tsc();
+
+  /* Try first to find out if we have to wait */
+  DOS_NI(arc = DosRequestMutexSem(gMutex, SEM_IMMEDIATE_RETURN));
+  if (arc == ERROR_TIMEOUT)
+  {
+    contended = 1;
+    DOS_NI(arc = DosRequestMutexSem(gMutex, SEM_INDEFINITE_WAIT));
+  }
 
   ASSERT_MSG(arc == NO_ERROR, "%ld", arc);
+
+  stats = &gpData->lock_stats;
+
+  if (stats->depth == 0 && wait_readers())
+    contended = 1;
+
+  end = read_tsc();
+
+  ss = lock_site_stats(site);
+
+  ++ss->count;
+  if (contended)
+  {
+    uint64_t wait = end - begin;
+    ++ss->contended;
+    ss->wait_total += wait;
+    if (ss->wait_max < wait)
+      ss->wait_max = wait;
+  }
+
+  if (stats->depth++ == 0)
+  {
+    stats->start = end;
+    stats->owner_site = ss;
+  }
+
+  stats->overhead += read_tsc() - end;
 }
 
 /**
@@ -597,27 +1171,117 @@ void global_lock()
 void global_unlock()
 {
   APIRET arc;
+  LockStats *stats;
 
   ASSERT(gMutex != NULLHANDLE);
 
+  stats = &gpData->lock_stats;
+
+  /* Note that the mutex might have been requested w/o global_lock() */
+  if (stats->depth && --stats->depth == 0)
+  {
+    uint64_t now = read_tsc();
+    uint64_t hold = now - stats->start;
+    int bucket = 0;
+
+    stats->owner_site->hold_total += hold;
+
+    if (hold)
+    {
+      bucket = (63 - __builtin_clzll(hold) - 10) / 3;
+      if (bucket < 0)
+        bucket = 0;
+      else if (bucket >= LOCK_STATS_HIST)
+        bucket = LOCK_STATS_HIST - 1;
+    }
+    ++stats->owner_site->hold_hist[bucket];
+
+    stats->overhead += read_tsc() - now;
+
+    /* Let readers in */
+    __atomic_xchg((volatile unsigned *)&gpData->lock_writer, 0);
+  }
+
   arc = DosReleaseMutexSem(gMutex);
 
   ASSERT_MSG(arc == NO_ERROR, "%ld", arc);
 }
 
 /**
- * Returns PID, TID and the request count of the global mutex owner.
- *
- * On success, the return value indicates the owner state:
- * - 0: the mutex is currently owned and the owner is alive
- * - 1: the mutex is currently owned byt the owner is dead
- * - 2: the mutex is not currently owned
- *
- * Any argument can be NULL to ignore the respective value.
- *
- * Returns -1 and sets errno if an error occurs when querying the owner.
+ * Requests the global mutex in shared (reader) mode. Any number of threads of
+ * any processes may hold it this way at once while nobody holds it with
+ * global_lock(). Meant for short read-only lookups of data only changed
+ * under global_lock(). Must not be nested nor followed by global_lock().
  */
-int global_lock_info(pid_t *pid, int *tid, unsigned *count)
+void global_lock_shared()
+{
+  ASSERT(gpData);
+
+  __atomic_increment_u32(&gpData->lock_stats.shared_count);
+
+  /* Note that locked instructions are full barriers on x86 */
+  if (!gpData->lock_writer)
+  {
+    __atomic_increment_u32(&gpData->lock_readers);
+    if (!gpData->lock_writer)
+    {
+      __atomic_increment_u32(&gSharedLocks);
+      return;
+    }
+    __atomic_decrement_u32(&gpData->lock_readers);
+  }
+
+  /* There is a writer, wait for it on the mutex rather than spin */
+  __atomic_increment_u32(&gpData->lock_stats.shared_waits);
+  global_lock();
+  __atomic_increment_u32(&gpData->lock_readers);
+  __atomic_increment_u32(&gSharedLocks);
+  global_unlock();
+}
+
+/**
+ * Releases the global mutex requested by global_lock_shared().
+ */
+void global_unlock_shared()
+{
+  ASSERT(gpData->lock_readers && gSharedLocks);
+
+  /* Reverse order, see gSharedLocks */
+  __atomic_decrement_u32(&gSharedLocks);
+  __atomic_decrement_u32(&gpData->lock_readers);
+}
+
+/**
+ * Drops all global_lock_shared() readers of this process from
+ * gpData->lock_readers. Called on process termination with no other threads
+ * running. A thread killed between the two counter updates may still leave
+ * one reader behind but never makes us drop somebody else's one.
+ */
+static void release_shared_locks()
+{
+  if (!gpData)
+    return;
+
+  while (gSharedLocks)
+  {
+    __atomic_decrement_u32(&gSharedLocks);
+    __atomic_decrement_u32(&gpData->lock_readers);
+  }
+}
+
+/**
+ * Returns PID, TID and the request count of the global mutex owner.
+ *
+ * On success, the return value indicates the owner state:
+ * - 0: the mutex is currently owned and the owner is alive
+ * - 1: the mutex is currently owned byt the owner is dead
+ * - 2: the mutex is not currently owned
+ *
+ * Any argument can be NULL to ignore the respective value.
+ *
+ * Returns -1 and sets errno if an error occurs when querying the owner.
+ */
+int global_lock_info(pid_t *pid, int *tid, unsigned *count)
 {
   if (gMutex != NULLHANDLE)
   {
@@ -655,17 +1319,175 @@ void global_lock_deathcheck()
       {
         char buf[128];
         int n;
-        /* See libcx_trace (it's not available in release builds so log directly) */
+        /* Log directly to not depend on enabled trace groups (see libcx_trace) */
         ULONG ts;
         DosQuerySysInfo(QSV_MS_COUNT, QSV_MS_COUNT, &ts, sizeof(ts));
         n = __libc_LogSNPrintf(gLogInstance, buf, sizeof(buf), "%08lx %YT %YG", ts, 0, 0);
         n += snprintf(buf + n, sizeof(buf) - n, "OOPS!!! Owner of global LIBCx mutex %08lx is about to die!!!\n", gMutex);
-        __libc_LogRaw(gLogInstance, 0 | __LIBC_LOG_MSGF_FLUSH, buf, n);
+        __libc_LogRaw(gLogInstance, __LIBC_LOG_MSGF_FLUSH | __LIBC_LOG_MSGF_ALWAYS, buf, n);
       }
     }
   }
 }
 
+/*
+ * Number of busy-wait iterations shared_lock() performs before yielding the
+ * time slice and number of yields before it falls back to a real sleep.
+ */
+#define SHARED_LOCK_SPIN_COUNT 256
+#define SHARED_LOCK_YIELD_COUNT 64
+
+/**
+ * Returns a SharedLock owner value for the current thread.
+ */
+static inline uint32_t shared_lock_owner()
+{
+  return (fibGetPid() << 16) | (fibGetTid() & 0xFFFF);
+}
+
+/**
+ * Remembers @a lock in gHeldLocks. Each thread starts looking for a free slot
+ * at its own place to avoid contention. Silently does nothing if all slots
+ * are in use.
+ */
+static inline void held_lock_add(SharedLock *lock)
+{
+  unsigned i, start = fibGetTid() * 8;
+
+  for (i = 0; i < HELD_LOCKS; ++i)
+  {
+    volatile uint32_t *slot = (volatile uint32_t *)&gHeldLocks[(start + i) & (HELD_LOCKS - 1)];
+    if (!*slot && __atomic_cmpxchg32(slot, (uint32_t)lock, 0))
+      return;
+  }
+}
+
+/**
+ * Forgets @a lock remembered by held_lock_add().
+ */
+static inline void held_lock_remove(SharedLock *lock)
+{
+  unsigned i, start = fibGetTid() * 8;
+
+  for (i = 0; i < HELD_LOCKS; ++i)
+  {
+    volatile uint32_t *slot = (volatile uint32_t *)&gHeldLocks[(start + i) & (HELD_LOCKS - 1)];
+    if (*slot == (uint32_t)lock && __atomic_cmpxchg32(slot, 0, (uint32_t)lock))
+      return;
+  }
+}
+
+/**
+ * Releases all spin locks in gHeldLocks that are still owned by this process.
+ * Called on process termination with no other threads running, so all such
+ * locks were left by crashed threads (or by the current one if it crashed).
+ */
+static void release_held_locks()
+{
+  int i;
+
+  for (i = 0; i < HELD_LOCKS; ++i)
+  {
+    SharedLock *lock = gHeldLocks[i];
+    if (lock)
+    {
+      gHeldLocks[i] = NULL;
+      shared_lock_reset(lock);
+    }
+  }
+}
+
+/**
+ * Requests the given system-wide lock. This is a spin lock that busy-waits for
+ * a short while, then yields the time slice and then sleeps until the lock is
+ * released. It is intended for short critical sections only (see the lock
+ * hierarchy in shared.h). Unlike _smutex, it remembers the owner which allows
+ * to detect recursion and to release locks held by crashed threads.
+ */
+void shared_lock(SharedLock *lock)
+{
+  uint32_t owner = shared_lock_owner();
+  unsigned spins = 0;
+
+  ASSERT_MSG(*lock != owner, "%p %08x", lock, owner);
+
+  while (!__atomic_cmpxchg32(lock, owner, 0))
+  {
+    if (spins < SHARED_LOCK_SPIN_COUNT)
+    {
+      __asm__ __volatile__("pause");
+      ++spins;
+    }
+    else if (spins < SHARED_LOCK_SPIN_COUNT + SHARED_LOCK_YIELD_COUNT)
+    {
+      DosSleep(0);
+      ++spins;
+    }
+    else
+    {
+      DosSleep(1);
+    }
+  }
+
+  held_lock_add(lock);
+}
+
+/**
+ * Requests the given system-wide lock without waiting. Returns TRUE if the
+ * lock was free and is now owned by the current thread and FALSE otherwise.
+ */
+int shared_lock_try(SharedLock *lock)
+{
+  uint32_t owner = shared_lock_owner();
+
+  ASSERT_MSG(*lock != owner, "%p %08x", lock, owner);
+
+  if (!__atomic_cmpxchg32(lock, owner, 0))
+    return FALSE;
+
+  held_lock_add(lock);
+
+  return TRUE;
+}
+
+/**
+ * Releases the system-wide lock requested by shared_lock().
+ */
+void shared_unlock(SharedLock *lock)
+{
+  uint32_t owner = shared_lock_owner();
+  uint32_t prev;
+
+  held_lock_remove(lock);
+
+  prev = __atomic_xchg((volatile unsigned *)lock, 0);
+
+  ASSERT_MSG(prev == owner, "%p %08x %08x", lock, prev, owner);
+}
+
+/**
+ * Returns TRUE if the given lock is owned by the current thread.
+ */
+int shared_lock_owned(SharedLock *lock)
+{
+  return *lock == shared_lock_owner();
+}
+
+/**
+ * Releases the given lock if it is owned by any thread of the current process.
+ * Used at process termination to recover locks left after a crash.
+ */
+void shared_lock_reset(SharedLock *lock)
+{
+  uint32_t owner = *lock;
+
+  if (owner && (owner >> 16) == fibGetPid())
+  {
+    TRACE("lock %p owned by %08x, resetting\n", lock, owner);
+    __atomic_cmpxchg32(lock, 0, owner);
+  }
+}
+
 /**
  * Returns the spawn2 semaphore lazily creating it or making sure it's
  * available in the given process (the current process if NULL). Will return
@@ -724,89 +1546,564 @@ _fmutex *global_tcpip_sem()
 
   ProcDesc *proc = find_proc_desc(getpid());
 
-  ASSERT(proc);
+  ASSERT(proc);
+
+  if (proc->tcpip_fsem.hev == NULLHANDLE)
+  {
+    /*
+     * Lazily create the mutex. Note that we never destroy it as
+     * process-specific ones will be freed automatically on process termination
+     */
+    int rc = _fmutex_create(&proc->tcpip_fsem, 0);
+    ASSERT(!rc);
+  }
+
+  fsem = &proc->tcpip_fsem;
+
+  global_unlock();
+
+  return fsem;
+}
+
+/**
+ * Allocates a new block of shared LIBCX memory. Must be called under
+ * global_lock().
+ */
+void *global_alloc(size_t size)
+{
+#ifdef STATS_ENABLED
+  void *result = _ucalloc(gpData->heap, 1, size);
+  if (result)
+  {
+    _HEAPSTATS hst;
+    if (_ustats(gpData->heap, &hst) == 0 && gpData->max_heap_used < hst._used)
+      gpData->max_heap_used = hst._used;
+  }
+  return result;
+#else
+  return _ucalloc(gpData->heap, 1, size);
+#endif
+}
+
+/**
+ * Header of a shared block with an owner process (see global_alloc_owned()).
+ */
+typedef struct OwnedMem
+{
+  struct OwnedMem *next;
+  struct OwnedMem *prev;
+  ProcDesc *proc; /* Owner process */
+  uint32_t align; /* Keeps blocks 8-byte aligned */
+} OwnedMem;
+
+static void owned_mem_link(OwnedMem *mem, ProcDesc *proc)
+{
+  mem->proc = proc;
+  mem->prev = NULL;
+  mem->next = proc->owned;
+  if (proc->owned)
+    proc->owned->prev = mem;
+  proc->owned = mem;
+}
+
+static void owned_mem_unlink(OwnedMem *mem)
+{
+  if (mem->prev)
+    mem->prev->next = mem->next;
+  else
+    mem->proc->owned = mem->next;
+  if (mem->next)
+    mem->next->prev = mem->prev;
+}
+
+/**
+ * Allocates a new block of shared LIBCx memory owned by the current process.
+ * Such blocks are kept on a per-process list and the ones still owned by a
+ * process when it terminates (normally or not) are freed all at once. Blocks
+ * passed to other processes should be handed over with global_mem_set_owner()
+ * once the other process becomes responsible for freeing them. Blocks must be
+ * freed with global_free_owned() rather than with free().
+ */
+void *global_alloc_owned(size_t size)
+{
+  OwnedMem *mem;
+
+  ASSERT(gpProcDesc);
+
+  global_lock();
+
+  mem = (OwnedMem *)global_alloc(sizeof(OwnedMem) + size);
+  if (mem)
+    owned_mem_link(mem, gpProcDesc);
+
+  global_unlock();
+
+  return mem ? mem + 1 : NULL;
+}
+
+/**
+ * Frees a block allocated with global_alloc_owned() regardless of its current
+ * owner. Does nothing if @a ptr is NULL.
+ */
+void global_free_owned(void *ptr)
+{
+  OwnedMem *mem;
+
+  if (!ptr)
+    return;
+
+  mem = (OwnedMem *)ptr - 1;
+
+  global_lock();
+
+  owned_mem_unlink(mem);
+  free(mem);
+
+  global_unlock();
+}
+
+/**
+ * Makes process @a pid the owner of a block allocated with
+ * global_alloc_owned(). The ownership is not changed if there is no such
+ * process (so that the block is still freed when the current owner ends).
+ */
+void global_mem_set_owner(void *ptr, pid_t pid)
+{
+  OwnedMem *mem;
+  ProcDesc *proc;
+
+  ASSERT(ptr);
+  mem = (OwnedMem *)ptr - 1;
+
+  global_lock();
+
+  if (mem->proc->pid != pid)
+  {
+    proc = find_proc_desc(pid);
+    if (proc)
+    {
+      owned_mem_unlink(mem);
+      owned_mem_link(mem, proc);
+    }
+    else
+    {
+      TRACE("no process %x to own %p, keeping it with %x\n", pid, ptr, mem->proc->pid);
+    }
+  }
+
+  global_unlock();
+}
+
+/**
+ * Frees all blocks still owned by the given process. Must be called under
+ * global_lock() after all components have released their data.
+ */
+static void free_owned_mem(ProcDesc *proc)
+{
+  while (proc->owned)
+  {
+    OwnedMem *mem = proc->owned;
+    TRACE("freeing owned block %p\n", mem + 1);
+    proc->owned = mem->next;
+    free(mem);
+  }
+}
+
+/* Approximate size of a slab (including the Slab header) */
+#define SLAB_SIZE 4096
+/* Minimum number of objects per slab (for big objects) */
+#define SLAB_MIN_OBJS 8
+
+/**
+ * Slab object header. Links free objects together and points to the owning
+ * slab for allocated ones (so that slab_free() needs no cache ID).
+ */
+typedef struct SlabObj
+{
+  union
+  {
+    struct SlabObj *next; /* Next free object of the slab */
+    Slab *slab; /* Owning slab of the allocated object */
+    uint64_t align; /* Keeps objects 8-byte aligned */
+  };
+} SlabObj;
+
+static void slab_list_add(Slab **list, Slab *slab)
+{
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+static void slab_list_remove(Slab **list, Slab *slab)
+{
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+}
+
+/**
+ * Allocates a zeroed object from the slab cache @a id. All objects of the same
+ * cache must be of the same @a size. Objects must be freed with slab_free()
+ * rather than with free(). Returns NULL if there is not enough shared memory.
+ * May be called with any LIBCx locks held except the shared heap one.
+ */
+void *slab_alloc(enum SlabId id, size_t size)
+{
+  SlabCache *cache;
+  SlabObj *obj;
+  Slab *slab;
+
+  ASSERT_MSG(id < SlabCount, "%d", id);
+  cache = &gpData->slabs[id];
+
+  size = sizeof(SlabObj) + ((size + sizeof(SlabObj) - 1) & ~(sizeof(SlabObj) - 1));
+
+  shared_lock(&cache->lock);
+
+  if (!cache->size)
+  {
+    cache->size = size;
+    cache->per_slab = (SLAB_SIZE - sizeof(Slab)) / size;
+    if (cache->per_slab < SLAB_MIN_OBJS)
+      cache->per_slab = SLAB_MIN_OBJS;
+  }
+
+  ASSERT_MSG(cache->size == size, "%d: %u != %u", id, cache->size, size);
+
+  if (!cache->partial)
+  {
+    uint32_t i, per_slab = cache->per_slab;
+
+    /* The heap may block so allocate the new slab without the lock */
+    shared_unlock(&cache->lock);
+
+    slab = (Slab *)global_alloc(sizeof(Slab) + size * per_slab);
+    if (!slab)
+      return NULL;
+
+    slab->id = id;
+    slab->free = (SlabObj *)(slab + 1);
+    obj = slab->free;
+    for (i = 1; i < per_slab; ++i)
+      obj = obj->next = (SlabObj *)((char *)obj + size);
+
+    shared_lock(&cache->lock);
+
+    slab_list_add(&cache->partial, slab);
+    ++cache->num_slabs;
+  }
+
+  slab = cache->partial;
+  obj = slab->free;
+  slab->free = obj->next;
+  ++slab->used;
+
+  if (!slab->free)
+  {
+    slab_list_remove(&cache->partial, slab);
+    slab_list_add(&cache->full, slab);
+  }
+
+  ++cache->num_objs;
+
+  shared_unlock(&cache->lock);
+
+  obj->slab = slab;
+  bzero(obj + 1, size - sizeof(SlabObj));
+
+  return obj + 1;
+}
+
+/**
+ * Frees an object allocated with slab_alloc(). Does nothing if @a ptr is
+ * NULL. Slabs that become empty are kept for reuse until slab_trim().
+ */
+void slab_free(void *ptr)
+{
+  SlabCache *cache;
+  SlabObj *obj;
+  Slab *slab;
+
+  if (!ptr)
+    return;
+
+  obj = (SlabObj *)ptr - 1;
+  slab = obj->slab;
+
+  ASSERT_MSG(slab && slab->id < SlabCount, "%p %p", ptr, slab);
+  cache = &gpData->slabs[slab->id];
+
+  shared_lock(&cache->lock);
+
+  ASSERT_MSG(slab->used, "%p %p", ptr, slab);
+
+  if (!slab->free)
+  {
+    slab_list_remove(&cache->full, slab);
+    slab_list_add(&cache->partial, slab);
+  }
+
+  obj->next = slab->free;
+  slab->free = obj;
+  --slab->used;
+
+  --cache->num_objs;
+
+  shared_unlock(&cache->lock);
+}
+
+/**
+ * Gives all empty slabs of all slab caches back to the shared heap. Called on
+ * process termination when a lot of objects usually gets freed at once.
+ */
+void slab_trim()
+{
+  Slab *empty = NULL;
+  int i;
+
+  for (i = 0; i < SlabCount; ++i)
+  {
+    SlabCache *cache = &gpData->slabs[i];
+    Slab *slab;
+
+    shared_lock(&cache->lock);
+
+    slab = cache->partial;
+    while (slab)
+    {
+      Slab *next = slab->next;
+      if (!slab->used)
+      {
+        slab_list_remove(&cache->partial, slab);
+        --cache->num_slabs;
+        slab->next = empty;
+        empty = slab;
+      }
+      slab = next;
+    }
+
+    shared_unlock(&cache->lock);
+  }
+
+  /* Free them without holding spin locks as the heap may block */
+  while (empty)
+  {
+    Slab *next = empty->next;
+    free(empty);
+    empty = next;
+  }
+}
+
+/**
+ * Reallocates a memory block with `realloc` and fills the new part with zeroes
+ * if @a new_size is bigger than @a old_size.
+ */
+void *crealloc(void *ptr, size_t old_size, size_t new_size)
+{
+  void *new_ptr = realloc(ptr, new_size);
+  if (new_ptr && new_size > old_size)
+    bzero(new_ptr + old_size, new_size - old_size);
+  return new_ptr;
+}
+
+/*
+ * Max average number of entries per bucket. Exceeding it doubles the number
+ * of buckets.
+ */
+#define HASH_MAP_MAX_LOAD 2
+
+/**
+ * Initializes the given hash map with @a size buckets (must be a power of
+ * two). Returns 0 on success and -1 if there is not enough memory.
+ */
+int hash_map_init(HashMap *map, size_t size)
+{
+  CLEAR_STRUCT(map);
+
+  GLOBAL_NEW_ARRAY(map->buckets, size);
+  if (!map->buckets)
+    return -1;
+
+  map->size = size;
+  return 0;
+}
+
+/**
+ * Frees memory used by the given hash map (but not its entries).
+ */
+void hash_map_free(HashMap *map)
+{
+  free(map->buckets);
+  if (map->old_buckets)
+    free(map->old_buckets);
+  CLEAR_STRUCT(map);
+}
+
+/**
+ * Moves all entries guarded by the given lock from old buckets to new ones
+ * if not already done. Must be called under that lock.
+ */
+void hash_map_rehash(HashMap *map, size_t lock, size_t nlocks, HASH_MAP_HASH_FN *hash_fn)
+{
+  size_t b, old_size;
+
+  if (!map->rehash[lock])
+    return;
+
+  __atomic_increment_u32(&map->busy);
 
-  if (proc->tcpip_fsem.hev == NULLHANDLE)
+  old_size = map->size / 2;
+  for (b = lock; b < old_size; b += nlocks)
   {
-    /*
-     * Lazily create the mutex. Note that we never destroy it as
-     * process-specific ones will be freed automatically on process termination
-     */
-    int rc = _fmutex_create(&proc->tcpip_fsem, 0);
-    ASSERT(!rc);
+    HashMapEntry *e = map->old_buckets[b];
+    while (e)
+    {
+      HashMapEntry *next = e->next;
+      HashMapEntry **bucket = &map->buckets[hash_fn(e) & (map->size - 1)];
+      e->next = *bucket;
+      *bucket = e;
+      e = next;
+    }
+    map->old_buckets[b] = NULL;
   }
 
-  fsem = &proc->tcpip_fsem;
+  map->rehash[lock] = 0;
 
-  global_unlock();
+  __atomic_increment_u32(&map->gen);
+  __atomic_decrement_u32(&map->busy);
 
-  return fsem;
+  /* The last one frees old buckets (nobody else may access them now) */
+  if (__atomic_decrement_u32(&map->rehash_left) == 0)
+  {
+    HashMapEntry **old_buckets = map->old_buckets;
+    map->old_buckets = NULL;
+    free(old_buckets);
+  }
 }
 
 /**
- * Allocates a new block of shared LIBCX memory. Must be called under
- * global_lock().
+ * Returns a pointer to the bucket head for the given hash. Finishes rehash of
+ * buckets guarded by the same lock if needed. Must be called under the lock
+ * guarding the given hash (hash % nlocks).
  */
-void *global_alloc(size_t size)
+HashMapEntry **hash_map_bucket(HashMap *map, size_t hash, size_t nlocks, HASH_MAP_HASH_FN *hash_fn)
 {
-#ifdef STATS_ENABLED
-  void *result = _ucalloc(gpData->heap, 1, size);
-  if (result)
-  {
-    _HEAPSTATS hst;
-    if (_ustats(gpData->heap, &hst) == 0 && gpData->max_heap_used < hst._used)
-      gpData->max_heap_used = hst._used;
-  }
-  return result;
-#else
-  return _ucalloc(gpData->heap, 1, size);
-#endif
+  if (map->old_buckets)
+    hash_map_rehash(map, hash & (nlocks - 1), nlocks, hash_fn);
+
+  return &map->buckets[hash & (map->size - 1)];
 }
 
-static size_t hash_string(const char *str)
+/**
+ * Doubles the number of buckets of the given hash map. Must be called under
+ * lock @a held which guards a bucket of this map, all other locks are taken
+ * here. Does nothing if another resize of a map guarded by the same set of
+ * locks is in progress (it will be retried by a later insertion).
+ */
+static void hash_map_grow(HashMap *map, size_t held, SharedLock *locks, size_t nlocks,
+                          SharedLock *resize_lock, HASH_MAP_HASH_FN *hash_fn)
 {
+  HashMapEntry **buckets;
+  size_t i;
+
   /*
-   * Based on RS hash function from Arash Partow collection
-   * (http://www.partow.net/programming/hashfunctions/).
-   * According to https://habrahabr.ru/post/219139/ this function
-   * produces few collisions and is rather fast.
+   * Another grower may hold a lock we need and wait for ours, so only go on
+   * if we are the only one. Others only hold one lock at a time and will
+   * release it without waiting for us.
    */
+  if (!shared_lock_try(resize_lock))
+    return;
 
-  size_t a = 63689;
-  size_t hash = 0;
+  for (i = 0; i < nlocks; ++i)
+    if (i != held)
+      shared_lock(&locks[i]);
 
-  while (*str)
+  /* Check again as another grower could have done it before we locked */
+  if (map->count > map->size * HASH_MAP_MAX_LOAD)
   {
-    hash = hash * a + (unsigned char)(*str++);
-    a *= 378551 /* b */;
+    /* Finish the previous rehash if it is not complete yet */
+    if (map->old_buckets)
+      for (i = 0; i < nlocks; ++i)
+        hash_map_rehash(map, i, nlocks, hash_fn);
+
+    GLOBAL_NEW_ARRAY(buckets, map->size * 2);
+    TRACE_IF(!buckets, "no memory to grow map %p to %u buckets\n", map, map->size * 2);
+    if (buckets)
+    {
+      TRACE("growing map %p to %u buckets (%u entries)\n", map, map->size * 2, map->count);
+
+      __atomic_increment_u32(&map->busy);
+
+      /* Note that lock-less readers read size first (see give_heap_seg()) */
+      map->old_buckets = map->buckets;
+      map->buckets = buckets;
+      map->size *= 2;
+
+      memset(map->rehash, 1, nlocks);
+      map->rehash_left = nlocks;
+
+      __atomic_increment_u32(&map->gen);
+      __atomic_decrement_u32(&map->busy);
+    }
   }
 
-  return hash;
+  for (i = 0; i < nlocks; ++i)
+    if (i != held)
+      shared_unlock(&locks[i]);
+
+  shared_unlock(resize_lock);
 }
 
 /**
- * Reallocates a memory block with `realloc` and fills the new part with zeroes
- * if @a new_size is bigger than @a old_size.
+ * Puts an entry to the head of the given bucket of the given hash map and
+ * grows the map if it gets overloaded. Must be called under the lock guarding
+ * the bucket (which is @a held).
  */
-void *crealloc(void *ptr, size_t old_size, size_t new_size)
+void hash_map_add(HashMap *map, HashMapEntry **bucket, HashMapEntry *entry,
+                  size_t held, SharedLock *locks, size_t nlocks,
+                  SharedLock *resize_lock, HASH_MAP_HASH_FN *hash_fn)
 {
-  void *new_ptr = realloc(ptr, new_size);
-  if (new_ptr && new_size > old_size)
-    bzero(new_ptr + old_size, new_size - old_size);
-  return new_ptr;
+  entry->next = *bucket;
+  *bucket = entry;
+
+  if (__atomic_increment_u32(&map->count) > map->size * HASH_MAP_MAX_LOAD)
+    hash_map_grow(map, held, locks, nlocks, resize_lock, hash_fn);
+}
+
+static size_t proc_desc_entry_hash(HashMapEntry *entry)
+{
+  return ((ProcDesc *)entry)->pid;
+}
+
+static size_t shared_file_desc_entry_hash(HashMapEntry *entry)
+{
+  return ((SharedFileDesc *)entry)->hash;
+}
+
+static size_t file_desc_entry_hash(HashMapEntry *entry)
+{
+  return ((FileDesc *)entry)->g->hash;
 }
 
 /**
  * Returns a process description sturcture for the given process.
- * Must be called under global_lock().
+ * Note that ProcDesc structures are only freed under global_lock() so it must
+ * be held when using a description of another process.
  * Returns NULL when opt is HashMapOpt_New and there is not enough memory
  * to allocate a new sctructure, or when opt is not HashMapOpt_New and there
  * is no description for the given process.
  */
 ProcDesc *get_proc_desc_ex(pid_t pid, enum HashMapOpt opt)
 {
-  size_t bucket;
+  size_t lock;
   ProcDesc *desc, *prev;
+  HashMapEntry **bucket;
   int rc;
 
   ASSERT(gpData);
@@ -817,10 +2114,14 @@ ProcDesc *get_proc_desc_ex(pid_t pid, enum HashMapOpt opt)
 
   /*
    * We use identity as the hash function as we get a regularly ascending
-   * sequence of PIDs on input and prime for the hash table size.
+   * sequence of PIDs on input which is evenly spread over buckets.
    */
-  bucket = pid % PROC_DESC_HASH_SIZE;
-  desc = gpData->procs[bucket];
+  lock = pid & (PROC_DESC_LOCKS - 1);
+
+  shared_lock(&gpData->procs_locks[lock]);
+
+  bucket = hash_map_bucket(&gpData->procs, pid, PROC_DESC_LOCKS, proc_desc_entry_hash);
+  desc = (ProcDesc *)*bucket;
   prev = NULL;
 
   while (desc)
@@ -839,18 +2140,31 @@ ProcDesc *get_proc_desc_ex(pid_t pid, enum HashMapOpt opt)
       /* Initialize the new desc */
       desc->pid = pid;
 
-      /* Call component-specific initialization */
-      /* NOTE: None at the moment. */
+      /*
+       * Create a process-specific file desc hash map right away so that
+       * get_file_desc_ex() doesn't need to serialize lazy creation.
+       */
+      if (hash_map_init(&desc->files, FILE_DESC_LOCKS) == 0)
+      {
+        /* Call component-specific initialization */
+        /* NOTE: None at the moment. */
 
-      /* Put to the head of the bucket */
-      desc->next = gpData->procs[bucket];
-      gpData->procs[bucket] = desc;
+        /* Put to the head of the bucket */
+        hash_map_add(&gpData->procs, bucket, (HashMapEntry *)desc,
+                     lock, gpData->procs_locks, PROC_DESC_LOCKS,
+                     &gpData->procs_resize_lock, proc_desc_entry_hash);
 
+        __atomic_increment_u32(&gpData->num_procs);
 #if STATS_ENABLED
-      ++gpData->num_procs;
-      if (gpData->num_procs > gpData->max_procs)
-        gpData->max_procs = gpData->num_procs;
+        if (gpData->num_procs > gpData->max_procs)
+          gpData->max_procs = gpData->num_procs;
 #endif
+      }
+      else
+      {
+        free(desc);
+        desc = NULL;
+      }
     }
   }
   else if (desc && opt == HashMapOpt_Take)
@@ -859,24 +2173,118 @@ ProcDesc *get_proc_desc_ex(pid_t pid, enum HashMapOpt opt)
     if (prev)
       prev->next = desc->next;
     else
-      gpData->procs[bucket] = desc->next;
+      *bucket = (HashMapEntry *)desc->next;
 
-#if STATS_ENABLED
-    --gpData->num_procs;
-#endif
+    __atomic_decrement_u32(&gpData->procs.count);
+    __atomic_decrement_u32(&gpData->num_procs);
   }
 
+  shared_unlock(&gpData->procs_locks[lock]);
+
   return desc;
 }
 
+/**
+ * Returns the hash of file descriptions for the given file name. The returned
+ * value is to be used with file_desc_lock() and file_desc_unlock().
+ */
+size_t file_desc_hash(const char *path)
+{
+  return hash_string(path);
+}
+
+/**
+ * Finishes rehash of gpData->files and, if @a proc is not NULL, of its files
+ * for buckets guarded by the file bucket lock @a lock (which must be held).
+ * Needed before walking these buckets directly.
+ */
+void file_desc_rehash(size_t lock, ProcDesc *proc)
+{
+  ASSERT_MSG(shared_lock_owned(&gpData->files_locks[lock]), "%u", lock);
+
+  if (gpData->files.old_buckets)
+    hash_map_rehash(&gpData->files, lock, FILE_DESC_LOCKS, shared_file_desc_entry_hash);
+  if (proc && proc->files.old_buckets)
+    hash_map_rehash(&proc->files, lock, FILE_DESC_LOCKS, file_desc_entry_hash);
+}
+
+/**
+ * Returns a FileDesc of this process associated with the given fd or NULL if
+ * there is none. The returned value is only a hint as the fd may have been
+ * closed and reused without LIBCx knowing it (e.g. by dup2), so the caller
+ * must check that the description is for the file it expects.
+ */
+static FileDesc *fd_map_get(int fd)
+{
+  FileDesc **chunk;
+
+  if (fd < 0 || fd >= FD_MAP_CHUNK_SIZE * FD_MAP_CHUNKS)
+    return NULL;
+
+  chunk = gFdMap[fd / FD_MAP_CHUNK_SIZE];
+  return chunk ? chunk[fd % FD_MAP_CHUNK_SIZE] : NULL;
+}
+
+/**
+ * Associates the given fd with the given FileDesc of this process (or removes
+ * the association if @a desc is NULL). Must be called under the bucket lock
+ * of @a desc (or of the one being removed).
+ */
+static void fd_map_set(int fd, FileDesc *desc)
+{
+  FileDesc **chunk;
+
+  if (fd < 0 || fd >= FD_MAP_CHUNK_SIZE * FD_MAP_CHUNKS)
+    return;
+
+  chunk = gFdMap[fd / FD_MAP_CHUNK_SIZE];
+  if (!chunk)
+  {
+    if (!desc)
+      return;
+
+    /* Threads may race here as they may hold different bucket locks */
+    NEW_ARRAY(chunk, FD_MAP_CHUNK_SIZE);
+    if (!chunk)
+      return;
+    if (!__atomic_cmpxchg32((volatile uint32_t *)&gFdMap[fd / FD_MAP_CHUNK_SIZE],
+                            (uint32_t)chunk, 0))
+    {
+      free(chunk);
+      chunk = gFdMap[fd / FD_MAP_CHUNK_SIZE];
+    }
+  }
+
+  chunk[fd % FD_MAP_CHUNK_SIZE] = desc;
+}
+
+/**
+ * Resets the fd map of this process. Used on init and term.
+ */
+static void fd_map_reset()
+{
+  int i;
+
+  for (i = 0; i < FD_MAP_CHUNKS; ++i)
+  {
+    if (gFdMap[i])
+    {
+      free(gFdMap[i]);
+      gFdMap[i] = NULL;
+    }
+  }
+}
+
 /**
  * Returns a file description structure for the given process and file name.
- * Must be called under global_lock().
+ * The hash argument must be file_desc_hash(path), it's passed in because the
+ * caller needs it for locking anyway. Must be called under file_desc_lock()
+ * for this hash.
  * The fd argument is only used when it's not -1 and when opt is HashMapOpt_New
  * - in this case the given fd will be associated with the returned description
  * so that when close is called on that fd it will be deassociated (and will
- * cause the desc deletion if there is no other use of it). Optional o_bucket,
- * o_prev and o_proc arguments will receive the appropriate values for the
+ * cause the desc deletion if there is no other use of it). Optional o_prev
+ * and o_proc arguments will receive the appropriate values for the
  * returned file description when they are not NULL (and may be later used in
  * e.g. a free_file_desc_ex() call). Optional o_desc_g, when not NULL, will
  * receive a global (shared) file description - this is the only way to get it
@@ -885,11 +2293,12 @@ ProcDesc *get_proc_desc_ex(pid_t pid, enum HashMapOpt opt)
  * to allocate a new sctructure, or when opt is not HashMapOpt_New and there
  * is no descriptor for the given file.
  */
-FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, enum HashMapOpt opt,
-                           size_t *o_bucket, FileDesc **o_prev, ProcDesc **o_proc,
+FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, size_t hash,
+                           enum HashMapOpt opt, FileDesc **o_prev, ProcDesc **o_proc,
                            SharedFileDesc **o_desc_g)
 {
-  size_t bucket;
+  size_t lock;
+  HashMapEntry **bucket, **bucket_g;
   FileDesc *desc, *prev;
   ProcDesc *proc;
   int rc;
@@ -906,22 +2315,26 @@ FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, enum HashMapOpt
   if (!proc)
     return NULL;
 
-  if (!proc->files)
-  {
-    /* Lazily create a process-specific file desc hash map */
-    GLOBAL_NEW_ARRAY(proc->files, FILE_DESC_HASH_SIZE);
-    if (!proc->files)
-      return NULL;
-  }
+  ASSERT(proc->files.buckets);
+
+#ifdef DEBUG
+  ASSERT_MSG(hash == file_desc_hash(path), "%x %x", hash, file_desc_hash(path));
+#endif
+
+  lock = hash & (FILE_DESC_LOCKS - 1);
+  ASSERT_MSG(shared_lock_owned(&gpData->files_locks[lock]), "%u", lock);
 
-  bucket = hash_string(path) % FILE_DESC_HASH_SIZE;
-  desc = proc->files[bucket];
+  bucket = hash_map_bucket(&proc->files, hash, FILE_DESC_LOCKS, file_desc_entry_hash);
+  bucket_g = hash_map_bucket(&gpData->files, hash, FILE_DESC_LOCKS, shared_file_desc_entry_hash);
+
+  desc = (FileDesc *)*bucket;
   prev = NULL;
 
+  /* Compare hashes first to avoid string comparison of unrelated paths */
   while (desc)
   {
     ASSERT(desc->g);
-    if (strcmp(desc->g->path, path) == 0)
+    if (desc->g->hash == hash && strcmp(desc->g->path, path) == 0)
       break;
     prev = desc;
     desc = desc->next;
@@ -942,10 +2355,10 @@ FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, enum HashMapOpt
         memset(&desc->fds[1], 0xFF, sizeof(desc->fds[0]) * (FDArrayInc - 1));
 
         /* Associate with the shared part, if any */
-        desc->g = gpData->files[bucket];
+        desc->g = (SharedFileDesc *)*bucket_g;
         while (desc->g)
         {
-          if (strcmp(desc->g->path, path) == 0)
+          if (desc->g->hash == hash && strcmp(desc->g->path, path) == 0)
             break;
           desc->g = desc->g->next;
         }
@@ -957,11 +2370,12 @@ FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, enum HashMapOpt
           if (desc->g)
           {
             desc->g->refcnt = 1;
+            desc->g->hash = hash;
             desc->g->path = ((char *)(desc->g + 1));
             strcpy(desc->g->path, path);
           }
 
-          TRACE("new global file desc %p for [%s]\n", desc->g, desc->g->path);
+          TRACE("new global file desc %p for [%s]\n", desc->g, path);
         }
         else
         {
@@ -986,28 +2400,40 @@ FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, enum HashMapOpt
             if (desc->g->refcnt == 1)
             {
               /* Put to the head of the bucket (shared part) */
-              desc->g->next = gpData->files[bucket];
-              gpData->files[bucket] = desc->g;
+              hash_map_add(&gpData->files, bucket_g, (HashMapEntry *)desc->g,
+                           lock, gpData->files_locks, FILE_DESC_LOCKS,
+                           &gpData->files_resize_lock, shared_file_desc_entry_hash);
 
+              __atomic_increment_u32(&gpData->num_shared_files);
 #if STATS_ENABLED
-              ++gpData->num_shared_files;
               if (gpData->num_shared_files > gpData->max_shared_files)
                 gpData->max_shared_files = gpData->num_shared_files;
 #endif
             }
 
             /* Put to the head of the bucket */
-            desc->next = proc->files[bucket];
-            proc->files[bucket] = desc;
+            hash_map_add(&proc->files, bucket, (HashMapEntry *)desc,
+                         lock, gpData->files_locks, FILE_DESC_LOCKS,
+                         &gpData->files_resize_lock, file_desc_entry_hash);
+
+            if (proc->pid == getpid())
+            {
+              __atomic_increment_u32(&gFileFilter[hash & (FILE_FILTER_SIZE - 1)]);
+              __atomic_increment_u32(&gNumFileDescs);
+            }
 
+            __atomic_increment_u32(&gpData->num_files);
 #if STATS_ENABLED
-            ++gpData->num_files;
             if (gpData->num_files > gpData->max_files)
               gpData->max_files = gpData->num_files;
 #endif
+
+            TRACE("new file desc %p for g %p [%s] (refcnt %d)\n",
+                  desc, desc->g, desc->g->path, desc->g->refcnt);
           }
           else
           {
+            TRACE("no memory for file desc [%s]\n", path);
             if (desc->g->refcnt == 1)
               free(desc->g);
             else
@@ -1016,9 +2442,6 @@ FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, enum HashMapOpt
             free(desc);
             desc = NULL;
           }
-
-          TRACE("new file desc %p for g %p [%s] (refcnt %d)\n",
-                desc, desc->g, desc->g->path, desc->g->refcnt);
         }
         else
         {
@@ -1062,6 +2485,10 @@ FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, enum HashMapOpt
       else
         desc = NULL;
     }
+
+    /* Make close() find it quickly */
+    if (desc && proc == gpProcDesc)
+      fd_map_set(fd, desc);
   }
   else if (opt == HashMapOpt_None)
   {
@@ -1070,11 +2497,11 @@ FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, enum HashMapOpt
       if (!desc)
       {
         /* Return a global description if there is any */
-        SharedFileDesc *desc_g = gpData->files[bucket];
+        SharedFileDesc *desc_g = (SharedFileDesc *)*bucket_g;
 
         while (desc_g)
         {
-          if (strcmp(desc_g->path, path) == 0)
+          if (desc_g->hash == hash && strcmp(desc_g->path, path) == 0)
             break;
           desc_g = desc_g->next;
         }
@@ -1088,8 +2515,6 @@ FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, enum HashMapOpt
     }
   }
 
-  if (o_bucket)
-    *o_bucket = bucket;
   if (o_prev)
     *o_prev = prev;
   if (o_proc)
@@ -1099,13 +2524,13 @@ FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, enum HashMapOpt
 }
 
 /**
- * Frees the given file description. Note that bucket, prev, and proc must be
+ * Frees the given file description. Note that hash, prev, and proc must be
  * valid values as received from find_file_desc_ex in order to maintain
- * the map of remaining file descriptions. An exception is when all file
- * descriptions for a given process are deleted at once in which case only
- * bucket must be valid (and equal to an index of desc in the bucket).
+ * the map of remaining file descriptions (prev is NULL if desc is the bucket
+ * head). Must be called under both global_lock() and file_desc_lock() for the
+ * given hash.
  */
-void free_file_desc(FileDesc *desc, size_t bucket, FileDesc *prev, ProcDesc *proc)
+void free_file_desc(FileDesc *desc, size_t hash, FileDesc *prev, ProcDesc *proc)
 {
   ASSERT(desc);
   ASSERT(desc->g);
@@ -1116,51 +2541,81 @@ void free_file_desc(FileDesc *desc, size_t bucket, FileDesc *prev, ProcDesc *pro
   ASSERT_MSG(!desc->fh, "%p", desc->fh);
   ASSERT_MSG(!desc->map, "%p", desc->map);
 
-  ASSERT_MSG(bucket <= FILE_DESC_HASH_SIZE, "%u", bucket);
+  ASSERT(proc);
+  ASSERT_MSG(shared_lock_owned(&gpData->files_locks[hash & (FILE_DESC_LOCKS - 1)]), "%x", hash);
+
+  SharedFileDesc *desc_g = desc->g;
+
+  /*
+   * If it's the last reference, wait for those who looked up the shared part
+   * before we took the bucket lock to finish with it (e.g. fcntl_locking()).
+   * Nobody else may find it while we hold the bucket lock.
+   */
+  if (desc_g->refcnt == 1)
+    shared_lock(&desc_g->lock);
 
   /* Call component-specific uninitialization */
   pwrite_filedesc_term(desc);
   fcntl_locking_filedesc_term(desc);
 
-  --desc->g->refcnt;
-  if (desc->g->refcnt == 0)
+  --desc_g->refcnt;
+  if (desc_g->refcnt == 0)
   {
-    TRACE("Will free global file desc %p\n", desc->g);
+    TRACE("Will free global file desc %p\n", desc_g);
 
     /* Remove from the hash map (shared part) */
-    SharedFileDesc *prev_g = gpData->files[bucket];
-    if (prev_g == desc->g)
+    HashMapEntry **bucket_g = hash_map_bucket(&gpData->files, hash, FILE_DESC_LOCKS,
+                                              shared_file_desc_entry_hash);
+    SharedFileDesc *prev_g = (SharedFileDesc *)*bucket_g;
+    if (prev_g == desc_g)
     {
-      gpData->files[bucket] = desc->g->next;
+      *bucket_g = (HashMapEntry *)desc_g->next;
     }
     else
     {
-      while (prev_g && prev_g->next != desc->g)
+      while (prev_g && prev_g->next != desc_g)
         prev_g = prev_g->next;
       ASSERT(prev_g);
-      prev_g->next = desc->g->next;
+      prev_g->next = desc_g->next;
     }
 
+    shared_unlock(&desc_g->lock);
+
     /* And free data (shared part) */
-    free(desc->g);
+    free(desc_g);
 
-#if STATS_ENABLED
-    --gpData->num_shared_files;
-#endif
+    __atomic_decrement_u32(&gpData->files.count);
+    __atomic_decrement_u32(&gpData->num_shared_files);
   }
 
   /* Remove from the hash map */
   if (prev)
     prev->next = desc->next;
-  else if (proc)
-    proc->files[bucket] = desc->next;
+  else
+    *hash_map_bucket(&proc->files, hash, FILE_DESC_LOCKS, file_desc_entry_hash) = (HashMapEntry *)desc->next;
+
+  /* Remove remaining fd associations (if any) from the fd map */
+  if (proc == gpProcDesc)
+  {
+    int i;
+    for (i = 0; i < desc->size_fds; ++i)
+      if (desc->fds[i] != -1 && fd_map_get(desc->fds[i]) == desc)
+        fd_map_set(desc->fds[i], NULL);
+  }
+
+  __atomic_decrement_u32(&proc->files.count);
+
+  if (proc->pid == getpid())
+  {
+    ASSERT(gFileFilter[hash & (FILE_FILTER_SIZE - 1)] && gNumFileDescs);
+    __atomic_decrement_u32(&gFileFilter[hash & (FILE_FILTER_SIZE - 1)]);
+    __atomic_decrement_u32(&gNumFileDescs);
+  }
 
   free(desc->fds);
   free(desc);
 
-#if STATS_ENABLED
-  --gpData->num_files;
-#endif
+  __atomic_decrement_u32(&gpData->num_files);
 }
 
 int _std_close(int fildes);
@@ -1177,21 +2632,41 @@ int close(int fildes)
   int rc = 0;
 
   pFH = __libc_FH(fildes);
-  if (pFH && pFH->pszNativePath)
+
+  /*
+   * Note that we have to check file descriptions even if the fd was never
+   * associated with any because closing any fd of a file must release fcntl
+   * locks held on it by this process. But there is nothing to check if this
+   * process has no file descriptions at all (the most common case) or none
+   * for this file according to gFileFilter (no shared data is touched then).
+   */
+  if (pFH && pFH->pszNativePath && gNumFileDescs)
   {
-    TRACE_TO(TRACE_GROUP_CLOSE, "pszNativePath %s, fFlags %x\n", pFH->pszNativePath, pFH->fFlags);
+    size_t hash = file_desc_hash(pFH->pszNativePath);
+
+    if (!gFileFilter[hash & (FILE_FILTER_SIZE - 1)])
+      return _std_close(fildes);
 
-    global_lock();
+    TRACE_TO(TRACE_GROUP_CLOSE, "pszNativePath %s, fFlags %x\n", pFH->pszNativePath, pFH->fFlags);
 
-    size_t bucket = 0;
     FileDesc *prev = NULL;
     ProcDesc *proc = NULL;
-    FileDesc *desc = find_file_desc_ex(pFH->pszNativePath, &bucket, &prev, &proc);
+    int seen_other_use = 1;
+    FcntlWakeList wake;
+
+    wake.num = 0;
+
+    file_desc_lock(hash);
+
+    /* Try the fd map first (but it may be stale, see fd_map_get()) */
+    FileDesc *desc = fd_map_get(fildes);
+    if (!desc || desc->g->hash != hash || strcmp(desc->g->path, pFH->pszNativePath) != 0)
+      desc = find_file_desc(pFH->pszNativePath, hash, NULL);
     if (desc)
     {
       TRACE_TO(TRACE_GROUP_CLOSE, "Found file desc %p for [%s]\n", desc, desc->g->path);
 
-      rc = fcntl_locking_close(desc);
+      rc = fcntl_locking_close(desc, fildes, &wake);
 
       if (rc == 0)
       {
@@ -1208,41 +2683,263 @@ int close(int fildes)
           if (desc->fds[i] == fildes)
           {
             desc->fds[i] = -1;
+            fd_map_set(fildes, NULL);
             break;
           }
           if (desc->fds[i] != -1)
             seen_other_fd = 1;
         }
 
-        if (desc->fh == NULL && desc->map == NULL && !seen_other_fd)
-        {
-          /* Finish checking if there is any usage through fds for this desc */
-          for (++i; i < desc->size_fds; ++i)
-            if (desc->fds[i] != -1)
-              break;
-          seen_other_fd = i < desc->size_fds;
+        if (desc->fh == NULL && desc->map == NULL && !seen_other_fd)
+        {
+          /* Finish checking if there is any usage through fds for this desc */
+          for (++i; i < desc->size_fds; ++i)
+            if (desc->fds[i] != -1)
+              break;
+          seen_other_fd = i < desc->size_fds;
+
+          seen_other_use = seen_other_fd;
+        }
+      }
+    }
+
+    file_desc_unlock(hash);
+
+    /* Let the waiters on the locks we released recheck them */
+    fcntl_locking_wake(&wake);
+
+    if (!seen_other_use)
+    {
+      /*
+       * File descriptions are only freed under global_lock() (mmap relies on
+       * that) so request it and recheck the usage as things might have changed
+       * while we were not holding the bucket lock.
+       */
+      global_lock();
+      file_desc_lock(hash);
+
+      desc = find_file_desc_ex(pFH->pszNativePath, hash, &prev, &proc);
+      if (desc && desc->fh == NULL && desc->map == NULL)
+      {
+        int i;
+        for (i = 0; i < desc->size_fds; ++i)
+          if (desc->fds[i] != -1)
+            break;
+
+        if (i == desc->size_fds)
+          free_file_desc(desc, hash, prev, proc);
+      }
+
+      file_desc_unlock(hash);
+      global_unlock();
+    }
+  }
+
+  if (rc != 0)
+    return rc;
+
+  return _std_close(fildes);
+}
+
+/**
+ * Prints load factor and chain length statistics of the given hash map to a
+ * buffer. Takes all locks guarding the map one by one.
+ * @return snprintf return value.
+ */
+static int format_hash_map_stats(char *buf, int size, const char *name, HashMap *map,
+                                 SharedLock *locks, size_t nlocks, HASH_MAP_HASH_FN *hash_fn)
+{
+  size_t i, b;
+  unsigned count = 0, used = 0, max_chain = 0, map_size;
+
+  for (i = 0; i < nlocks; ++i)
+  {
+    shared_lock(&locks[i]);
+
+    if (map->old_buckets)
+      hash_map_rehash(map, i, nlocks, hash_fn);
+
+    for (b = i; b < map->size; b += nlocks)
+    {
+      unsigned chain = 0;
+      HashMapEntry *e;
+      for (e = map->buckets[b]; e; e = e->next)
+        ++chain;
+      if (chain)
+      {
+        count += chain;
+        ++used;
+        if (max_chain < chain)
+          max_chain = chain;
+      }
+    }
+
+    shared_unlock(&locks[i]);
+  }
+
+  /* Note that the map may grow meanwhile but it's just stats */
+  map_size = map->size;
+
+  unsigned load = count * 100 / map_size;
+  unsigned avg_chain = used ? count * 100 / used : 0;
+
+  return snprintf(buf, size,
+                  "%-15s %7u %7u %4u.%02u %7u %4u.%02u %5u\n",
+                  name, count, map_size, load / 100, load % 100,
+                  used, avg_chain / 100, avg_chain % 100, max_chain);
+}
+
+/**
+ * Prints hash map statistics to a buffer. Must not be called when any bucket
+ * locks are held by the current thread (e.g. from libcx_assert()).
+ * @return snprintf return value.
+ */
+static int format_hash_stats(char *buf, int size)
+{
+  int nret;
+
+  if (!gpData)
+    return 0;
+
+  nret = snprintf(buf, size,
+                  "===== LIBCx hash maps =====\n"
+                  "map             entries buckets    load    used   chain   max\n");
+
+  if (nret < size - 1)
+    nret += format_hash_map_stats(buf + nret, size - nret, "ProcDesc",
+                                  &gpData->procs, gpData->procs_locks,
+                                  PROC_DESC_LOCKS, proc_desc_entry_hash);
+  if (nret < size - 1)
+    nret += format_hash_map_stats(buf + nret, size - nret, "SharedFileDesc",
+                                  &gpData->files, gpData->files_locks,
+                                  FILE_DESC_LOCKS, shared_file_desc_entry_hash);
+  if (nret < size - 1 && gpProcDesc)
+    nret += format_hash_map_stats(buf + nret, size - nret, "FileDesc (self)",
+                                  &gpProcDesc->files, gpData->files_locks,
+                                  FILE_DESC_LOCKS, file_desc_entry_hash);
+
+  return nret;
+}
+
+/**
+ * Returns the TSC frequency in MHz measured against the high resolution timer.
+ * The first measurement takes about 10 ms (so it should not be done under
+ * global_lock()), the result is then cached in LockStats when possible.
+ */
+static unsigned tsc_mhz()
+{
+  ULONG freq;
+  QWORD qw;
+  uint64_t t1, t2, tsc1, tsc2;
+  unsigned mhz;
+
+  if (gpData && gpData->lock_stats.tsc_mhz)
+    return gpData->lock_stats.tsc_mhz;
+
+  if (DosTmrQueryFreq(&freq) || DosTmrQueryTime(&qw))
+    return 0;
+
+  t1 = ((uint64_t)qw.ulHi << 32) | qw.ulLo;
+  tsc1 = read_tsc();
+  do
+  {
+    DosTmrQueryTime(&qw);
+    t2 = ((uint64_t)qw.ulHi << 32) | qw.ulLo;
+  }
+  while (t2 - t1 < freq / 100);
+  tsc2 = read_tsc();
+
+  mhz = (unsigned)((tsc2 - tsc1) * freq / (t2 - t1) / 1000000);
+  if (gpData)
+    gpData->lock_stats.tsc_mhz = mhz;
+
+  return mhz;
+}
+
+/**
+ * Prints global_lock() statistics (see LockStats) to a buffer. Shows up to 16
+ * call sites with the biggest total wait + hold time. Should be called under
+ * global_lock() to get consistent numbers.
+ */
+static int format_lock_stats(char *buf, int size)
+{
+  enum { MaxSites = 16 };
+
+  LockSiteStats *sites[MaxSites];
+  LockStats *stats;
+  uint64_t count = 0;
+  unsigned mhz;
+  int nret, nsites = 0, i, j;
+
+  if (!gpData)
+    return 0;
+
+  stats = &gpData->lock_stats;
+
+  /* Pick the top sites with a simple insertion sort */
+  for (i = 0; i < LOCK_STATS_SITES; ++i)
+  {
+    LockSiteStats *ss = &stats->sites[i];
+    if (!ss->site)
+      continue;
+
+    count += ss->count;
 
-          if (!seen_other_fd)
-            free_file_desc(desc, bucket, prev, proc);
-        }
-      }
+    for (j = nsites; j > 0; --j)
+    {
+      LockSiteStats *ss2 = sites[j - 1];
+      if (ss2->wait_total + ss2->hold_total >= ss->wait_total + ss->hold_total)
+        break;
+      if (j < MaxSites)
+        sites[j] = ss2;
+    }
+    if (j < MaxSites)
+    {
+      sites[j] = ss;
+      if (nsites < MaxSites)
+        ++nsites;
     }
-
-    global_unlock();
   }
 
-  if (rc != 0)
-    return rc;
+  mhz = tsc_mhz();
+  if (!mhz)
+    mhz = 1;
 
-  return _std_close(fildes);
+  nret = snprintf(buf, size,
+                  "===== LIBCx global_lock stats (TSC %u MHz) =====\n"
+                  "acquisitions: %llu, instrumentation overhead: %llu us (%llu ns each)\n"
+                  "shared acquisitions: %u, waited for writer: %u\n"
+                  "site                          count   cont  wait us   max us  hold us"
+                  "   hold <2^13,16,19,22,25,28,31 and more ticks\n",
+                  mhz, count, stats->overhead / mhz,
+                  count ? stats->overhead * 1000 / mhz / count : 0,
+                  stats->shared_count, stats->shared_waits);
+
+  for (i = 0; i < nsites && nret < size - 1; ++i)
+  {
+    LockSiteStats *ss = sites[i];
+    nret += snprintf(buf + nret, size - nret,
+                     "%-26.26s %8u %6u %8llu %8llu %8llu  ",
+                     ss->name, ss->count, ss->contended,
+                     ss->wait_total / mhz, ss->wait_max / mhz,
+                     ss->hold_total / mhz);
+    for (j = 0; j < LOCK_STATS_HIST && nret < size - 1; ++j)
+      nret += snprintf(buf + nret, size - nret, " %u", ss->hold_hist[j]);
+    if (nret < size - 1)
+      nret += snprintf(buf + nret, size - nret, "\n");
+  }
+
+  return nret;
 }
 
 /**
  * Prints LIBCx statistics to a buffer which must be at least StatsBufSize
- * bytes long, otherwise truncation will happen.
+ * bytes long, otherwise truncation will happen. Hash map and global_lock()
+ * statistics are only included if @a details is TRUE (see format_hash_stats()
+ * and format_lock_stats()) and need DetailedStatsBufSize bytes.
  * @return snprintf return value.
  */
-static int format_stats(char *buf, int size)
+static int format_stats(char *buf, int size, int details)
 {
   int rc;
   _HEAPSTATS hst;
@@ -1258,58 +2955,32 @@ static int format_stats(char *buf, int size)
     return snprintf(buf, size, "_ustats failed with %d (%d)\n", rc, errno);
   }
 
-  size_t num_procs = 0;
-  size_t num_files = 0;
-  size_t num_shared_files = 0;
-#ifdef STATS_ENABLED
-  num_procs = gpData->num_procs;
-  num_files = gpData->num_files;
-  num_shared_files = gpData->num_shared_files;
-#else
-  int i, j;
-
-  /* No statistics available, calculate them on the fly */
-  for (i = 0; i < PROC_DESC_HASH_SIZE; ++i)
-  {
-    ProcDesc *proc = gpData->procs[i];
-    while (proc)
-    {
-      ++num_procs;
-
-      if (proc->files)
-      {
-        for (j = 0; j < FILE_DESC_HASH_SIZE; ++j)
-        {
-          FileDesc *desc = proc->files[j];
-          while (desc)
-          {
-            ++num_files;
-            desc = desc->next;
-          }
-        }
-      }
-
-      proc = proc->next;
-    }
-  }
-
-  for (i = 0; i < FILE_DESC_HASH_SIZE; ++i)
+  /*
+   * Note that these counters are maintained atomically as the respective hash
+   * maps are not guarded by global_lock() any more.
+   */
+  size_t num_procs = gpData->num_procs;
+  size_t num_files = gpData->num_files;
+  size_t num_shared_files = gpData->num_shared_files;
+
+  /* Slab counters are not guarded here as well but it's fine for stats */
+  size_t num_slab_objs = 0, num_slabs = 0;
+  int i;
+  for (i = 0; i < SlabCount; ++i)
   {
-    SharedFileDesc *desc = gpData->files[i];
-    while (desc)
-    {
-      ++num_shared_files;
-      desc = desc->next;
-    }
+    num_slab_objs += gpData->slabs[i].num_objs;
+    num_slabs += gpData->slabs[i].num_slabs;
   }
-#endif
 
   int nret;
   nret = snprintf(buf, size,
                   "\n"
                   "===== LIBCx resource usage =====\n"
                   "Reserved memory size:  %d bytes\n"
+                  "Reserved memory max:   %d bytes\n"
                   "Committed memory size: %d bytes\n"
+                  "Committed memory max:  %d bytes\n"
+                  "Heap segments:         %d of %d\n"
                   "Heap size total:       %d bytes\n"
                   "Heap size used now:    %d bytes\n"
 #ifdef STATS_ENABLED
@@ -1327,7 +2998,10 @@ static int format_stats(char *buf, int size)
 #ifdef STATS_ENABLED
                   "SharedFileDesc structs used max: %d\n"
 #endif
-                  , HEAP_SIZE, gpData->size
+                  "Slab objects used now:           %d (in %d slabs)\n"
+                  , gpData->reserved, gpData->max_size
+                  , gpData->size, gpData->max_committed
+                  , gpData->seg_count, HEAP_MAX_SEGS
                   , hst._provided, hst._used
 #ifdef STATS_ENABLED
                   , gpData->max_heap_used
@@ -1344,6 +3018,7 @@ static int format_stats(char *buf, int size)
 #ifdef STATS_ENABLED
                   , gpData->max_shared_files
 #endif
+                  , num_slab_objs, num_slabs
                   );
 
   if (nret < size - 1)
@@ -1375,6 +3050,12 @@ static int format_stats(char *buf, int size)
     }
   }
 
+  if (nret < size - 1 && details)
+    nret += format_hash_stats(buf + nret, size - nret);
+
+  if (nret < size - 1 && details)
+    nret += format_lock_stats(buf + nret, size - nret);
+
   if (nret < size - 1)
     nret += snprintf(buf + nret, size - nret, "===== LIBCx stats end =====\n");
 
@@ -1397,13 +3078,96 @@ void print_stats()
     printf("LIBCx module:  %s\n", name);
   }
 
-  global_lock();
+  /* Measure it now rather than under the lock in format_lock_stats() */
+  tsc_mhz();
+
+  global_lock_shared();
+
+  char buf[DetailedStatsBufSize];
+  format_stats(buf, sizeof(buf), TRUE);
+
+  global_unlock_shared();
 
-  char buf[StatsBufSize];
-  format_stats(buf, sizeof(buf));
   fputs(buf, stdout);
+}
 
-  global_unlock();
+/**
+ * Collects LIBCx resource usage counters for monitoring tools. Fills up to
+ * @a max entries of @a counters and returns the total number of counters
+ * which is the same on every call (so the caller may use the result to
+ * allocate a big enough array). Counters are read without locks except
+ * shmem ones so they are not necessarily consistent with each other.
+ * Returns -1 and sets errno on failure.
+ */
+int get_stats(StatCounter *counters, int max)
+{
+  _HEAPSTATS hst;
+  uint32_t shmem_objects = 0, shmem_handles = 0;
+  uint64_t acquisitions = 0, contended = 0;
+  uint64_t slab_objs = 0, slabs = 0;
+  int n = 0, i;
+
+#define STAT(nm, k, v) do { \
+  if (n < max) { counters[n].name = (nm); counters[n].kind = (k); counters[n].value = (v); } \
+  ++n; \
+} while (0)
+
+  if (!gpData)
+  {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (_ustats(gpData->heap, &hst))
+    memset(&hst, 0, sizeof(hst));
+
+  for (i = 0; i < SlabCount; ++i)
+  {
+    slab_objs += gpData->slabs[i].num_objs;
+    slabs += gpData->slabs[i].num_slabs;
+  }
+
+  for (i = 0; i < LOCK_STATS_SITES; ++i)
+  {
+    acquisitions += gpData->lock_stats.sites[i].count;
+    contended += gpData->lock_stats.sites[i].contended;
+  }
+
+  shmem_get_stats(&shmem_objects, &shmem_handles);
+
+  STAT("mem.reserved", StatGauge, gpData->reserved);
+  STAT("mem.reserved_max", StatGauge, gpData->max_size);
+  STAT("mem.committed", StatGauge, gpData->size);
+  STAT("mem.committed_max", StatGauge, gpData->max_committed);
+  STAT("mem.segments", StatGauge, gpData->seg_count);
+  STAT("heap.total", StatGauge, hst._provided);
+  STAT("heap.used", StatGauge, hst._used);
+  STAT("slab.objects", StatGauge, slab_objs);
+  STAT("slab.slabs", StatGauge, slabs);
+  STAT("procs", StatGauge, gpData->num_procs);
+  STAT("files.descs", StatGauge, gpData->num_files);
+  STAT("files.shared", StatGauge, gpData->num_shared_files);
+  STAT("fcntl.regions", StatGauge, gpData->slabs[SlabFcntlLock].num_objs);
+  STAT("fcntl.blocked", StatGauge, gpData->slabs[SlabProcBlock].num_objs);
+  STAT("mmap.mappings", StatGauge, gpData->slabs[SlabMemMap].num_objs +
+                                   gpData->slabs[SlabFileMemMap].num_objs);
+  STAT("mmap.file_mappings", StatGauge, gpData->slabs[SlabFileMemMap].num_objs);
+  STAT("mmap.file_mems", StatGauge, gpData->slabs[SlabFileMapMem].num_objs);
+  STAT("mmap.dirty_pages", StatGauge, gpData->num_dirty_pages);
+  STAT("shmem.objects", StatGauge, shmem_objects);
+  STAT("shmem.handles", StatGauge, shmem_handles);
+  STAT("shmem.proc_handles", StatGauge, gpData->slabs[SlabShmemProcHnd].num_objs);
+  STAT("shmem.views", StatGauge, gpData->slabs[SlabShmemView].num_objs);
+  STAT("interrupt.queued", StatGauge, gpData->slabs[SlabInterruptRequest].num_objs);
+  STAT("lock.acquisitions", StatTotal, acquisitions);
+  STAT("lock.contended", StatTotal, contended);
+  STAT("lock.shared", StatTotal, gpData->lock_stats.shared_count);
+  STAT("lock.shared_waits", StatTotal, gpData->lock_stats.shared_waits);
+  STAT("lock.readers", StatGauge, gpData->lock_readers);
+
+#undef STAT
+
+  return n;
 }
 
 #ifdef DEBUG
@@ -1425,7 +3189,464 @@ void force_libcx_init()
 }
 #endif
 
-#if defined(TRACE_ENABLED) && defined(TRACE_USE_LIBC_LOG)
+#ifdef TRACE_USE_LIBC_LOG
+
+/*
+ * Trace ring buffer. When LIBCX_TRACE_RING is set to a non-zero size in KB,
+ * libcx_trace() doesn't format and write messages synchronously but stores
+ * them in a per-process ring of fixed-size binary records instead: the TSC
+ * timestamp, the group, the call site, the format string and a copy of the
+ * arguments. Writers only reserve a record with an atomic increment, so
+ * tracing doesn't serialize threads nor make system calls. A drainer thread
+ * formats the records and writes them to the log in the background. The ring
+ * is also drained on assertions, crashes and process exit. If writers are
+ * faster than the drainer, the oldest records are overwritten and reported
+ * as lost.
+ */
+
+#define TRACE_REC_SIZE 256 /* Size of one record in bytes */
+#define TRACE_REC_MAX_STRS 8 /* Max number of %s arguments in one record */
+#define TRACE_RING_MIN_RECS 64 /* Min number of records in the ring */
+#define TRACE_RING_DRAIN_DELAY 100 /* Drainer idle period, ms */
+
+typedef struct TraceRec
+{
+  volatile uint32_t seq; /* trace_seq() of the ring index when complete, 0 while being written */
+  uint16_t group; /* Trace group */
+  uint16_t tid; /* Thread ID */
+  uint64_t tsc; /* Time stamp counter */
+  const char *file; /* Call site (see libcx_trace()) */
+  int line;
+  const char *func;
+  const char *format; /* NULL if data contains preformatted text */
+  uint8_t num_strs; /* Number of %s arguments */
+  uint8_t strs[TRACE_REC_MAX_STRS]; /* Offsets of %s arguments in data */
+  char data[0]; /* Arguments followed by %s strings stored backwards from the end */
+} TraceRec;
+
+enum { TraceRecDataSize = TRACE_REC_SIZE - offsetof(TraceRec, data) };
+
+static struct
+{
+  TraceRec *recs; /* NULL if the ring is not in use */
+  uint32_t mask; /* Number of records - 1 */
+  volatile uint32_t head; /* Next record to write */
+  uint32_t tail; /* Next record to output */
+  uint32_t lost; /* Records overwritten before output */
+  volatile uint32_t draining; /* 1 while someone outputs records */
+  HEV hev; /* Wakes up the drainer */
+  ULONG base_ms; /* QSV_MS_COUNT at ring creation */
+  uint64_t base_tsc; /* TSC at ring creation */
+  unsigned mhz; /* TSC frequency (measured by the drainer) */
+  char msg[1024]; /* Drainer's message buffer */
+} gTraceRing;
+
+/**
+ * Returns a non-zero completion mark for the record at the given ring index.
+ */
+static inline uint32_t trace_seq(uint32_t idx)
+{
+  return idx + 1 ? idx + 1 : 1;
+}
+
+/**
+ * Copies arguments described by @a format from @a args to @a rec in the
+ * layout of the i386 stack so that a va_list may be pointed to them later.
+ * Strings of %s arguments are copied to the record as well (and truncated if
+ * they don't fit). Returns FALSE if the arguments don't fit in the record or
+ * if the format has unsupported conversions.
+ */
+static int trace_rec_pack(TraceRec *rec, const char *format, va_list args)
+{
+  const char *p;
+  size_t n = 0, str_end = TraceRecDataSize;
+
+#define PUT(type) \
+  do { \
+    type v_ = va_arg(args, type); \
+    if (n + sizeof(v_) > str_end) \
+      return FALSE; \
+    memcpy(rec->data + n, &v_, sizeof(v_)); \
+    n += sizeof(v_); \
+  } while (0)
+
+  rec->num_strs = 0;
+
+  for (p = format; *p; ++p)
+  {
+    int ll = 0, ld = 0;
+
+    if (*p != '%')
+      continue;
+    if (*++p == '%')
+      continue;
+
+    while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0' || *p == '\'')
+      ++p;
+
+    if (*p == '*')
+    {
+      ++p;
+      PUT(int);
+    }
+    else
+      while (*p >= '0' && *p <= '9')
+        ++p;
+
+    if (*p == '.')
+    {
+      if (*++p == '*')
+      {
+        ++p;
+        PUT(int);
+      }
+      else
+        while (*p >= '0' && *p <= '9')
+          ++p;
+    }
+
+    for (;; ++p)
+    {
+      if (*p == 'l' && p[1] == 'l')
+        ll = 1, ++p;
+      else if (*p == 'q' || *p == 'j')
+        ll = 1;
+      else if (*p == 'L')
+        ll = ld = 1;
+      else if (*p != 'h' && *p != 'l' && *p != 'z' && *p != 't')
+        break;
+    }
+
+    switch (*p)
+    {
+      case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        if (ll)
+          PUT(long long);
+        else
+          PUT(int);
+        break;
+
+      case 'c': case 'p':
+        PUT(int);
+        break;
+
+      case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        if (ld)
+          PUT(long double);
+        else
+          PUT(double);
+        break;
+
+      case 's':
+      {
+        const char *s = va_arg(args, const char *);
+        size_t len;
+        uint32_t off;
+
+        if (!s)
+          s = "(null)";
+        if (rec->num_strs == TRACE_REC_MAX_STRS || n + sizeof(off) + 1 > str_end)
+          return FALSE;
+
+        /* Leave some room for the remaining arguments */
+        len = strnlen(s, (str_end - n - sizeof(off) - 1) * 3 / 4);
+        str_end -= len + 1;
+        memcpy(rec->data + str_end, s, len);
+        rec->data[str_end + len] = '\0';
+
+        /* Store the offset for now, see trace_rec_format() */
+        off = str_end;
+        rec->strs[rec->num_strs++] = n;
+        memcpy(rec->data + n, &off, sizeof(off));
+        n += sizeof(off);
+        break;
+      }
+
+      default:
+        /* %n, wide strings and such are not supported */
+        return FALSE;
+    }
+
+    if (!*p)
+      break;
+  }
+
+#undef PUT
+
+  return TRUE;
+}
+
+/**
+ * Formats a copy of the trace record to @a buf and returns the length of
+ * the resulting string (not including the terminating null).
+ */
+static int trace_rec_format(TraceRec *rec, char *buf, int size)
+{
+  int n = 0;
+
+  if (rec->file != NULL && rec->line != 0 && rec->func != NULL)
+    n = snprintf(buf, size, "%08lx %02x %-4.4s %s:%d:%s: ",
+                 gTraceRing.base_ms + (ULONG)((rec->tsc - gTraceRing.base_tsc) / (gTraceRing.mhz * 1000)),
+                 rec->tid, gLogGroup[rec->group].pszGroupName, _getname(rec->file), rec->line, rec->func);
+  else if (rec->file == NULL && rec->line == 0 && rec->func == NULL)
+    n = snprintf(buf, size, "%08lx %02x %-4.4s ",
+                 gTraceRing.base_ms + (ULONG)((rec->tsc - gTraceRing.base_tsc) / (gTraceRing.mhz * 1000)),
+                 rec->tid, gLogGroup[rec->group].pszGroupName);
+
+  if (n < size)
+  {
+    if (rec->format)
+    {
+      int i;
+
+      /* Turn string offsets into pointers */
+      for (i = 0; i < rec->num_strs; ++i)
+      {
+        uint32_t off;
+        char *str;
+        memcpy(&off, rec->data + rec->strs[i], sizeof(off));
+        str = rec->data + off;
+        memcpy(rec->data + rec->strs[i], &str, sizeof(str));
+      }
+
+      /* Note that this relies on va_list being a plain stack pointer (i386) */
+      n += vsnprintf(buf + n, size - n, rec->format, (va_list)rec->data);
+    }
+    else
+    {
+      n += snprintf(buf + n, size - n, "%s", rec->data);
+    }
+  }
+
+  return n < size ? n : size - 1;
+}
+
+/**
+ * Writes out all complete records from the trace ring. If @a final is TRUE,
+ * records that are still being written are skipped (and reported as lost)
+ * rather than waited for, and the call waits for a concurrent drain (if any)
+ * to finish. Used on assertions, crashes and process termination.
+ */
+static void trace_ring_drain(int final)
+{
+  TraceRec *rec = (TraceRec *)alloca(TRACE_REC_SIZE);
+  uint32_t size, lost;
+  int i;
+
+  if (!gTraceRing.recs || !gLogInstance)
+    return;
+
+  /* Only one drainer at a time (give up after a second in final mode) */
+  for (i = 0; !__atomic_cmpxchg32(&gTraceRing.draining, 1, 0); ++i)
+  {
+    if (!final || i == 1000)
+      return;
+    DosSleep(1);
+  }
+
+  if (!gTraceRing.mhz)
+  {
+    gTraceRing.mhz = tsc_mhz();
+    if (!gTraceRing.mhz)
+      gTraceRing.mhz = 1;
+  }
+
+  size = gTraceRing.mask + 1;
+  lost = gTraceRing.lost;
+
+  while (gTraceRing.tail != gTraceRing.head)
+  {
+    uint32_t tail = gTraceRing.tail;
+    TraceRec *r;
+    uint32_t seq;
+    int n;
+
+    if (gTraceRing.head - tail > size)
+    {
+      /* Writers went full circle and overwrote these */
+      gTraceRing.lost += gTraceRing.head - tail - size;
+      gTraceRing.tail += gTraceRing.head - tail - size;
+      continue;
+    }
+
+    r = &gTraceRing.recs[tail & gTraceRing.mask];
+    seq = r->seq;
+
+    if (seq == trace_seq(tail))
+    {
+      memcpy(rec, r, TRACE_REC_SIZE);
+      __asm__ __volatile__("" ::: "memory");
+      /*
+       * Once a writer went full circle, the record may be torn even with the
+       * right seq: a late writer of this index may set it after a writer of
+       * the next round has cleared it and both wrote the data at once.
+       */
+      if (r->seq == seq && gTraceRing.head - tail <= size)
+      {
+        if (lost != gTraceRing.lost)
+        {
+          n = snprintf(gTraceRing.msg, sizeof(gTraceRing.msg),
+                       "<%u trace records lost>\n", gTraceRing.lost - lost);
+          __libc_LogRaw(gLogInstance, __LIBC_LOG_MSGF_ALWAYS, gTraceRing.msg, n);
+          lost = gTraceRing.lost;
+        }
+
+        n = trace_rec_format(rec, gTraceRing.msg, sizeof(gTraceRing.msg));
+        __libc_LogRaw(gLogInstance, rec->group |
+                      (tail + 1 == gTraceRing.head ? __LIBC_LOG_MSGF_FLUSH : 0),
+                      gTraceRing.msg, n);
+      }
+      else
+      {
+        /* Overwritten while we were copying it (or torn) */
+        ++gTraceRing.lost;
+      }
+    }
+    else if (seq == 0 || seq == trace_seq(tail - size))
+    {
+      /* Still being written */
+      if (!final)
+        break;
+      ++gTraceRing.lost;
+    }
+    else
+    {
+      /* Already overwritten by a newer record */
+      ++gTraceRing.lost;
+    }
+
+    ++gTraceRing.tail;
+  }
+
+  if (lost != gTraceRing.lost)
+  {
+    int n = snprintf(gTraceRing.msg, sizeof(gTraceRing.msg),
+                     "<%u trace records lost>\n", gTraceRing.lost - lost);
+    __libc_LogRaw(gLogInstance, __LIBC_LOG_MSGF_FLUSH | __LIBC_LOG_MSGF_ALWAYS, gTraceRing.msg, n);
+  }
+
+  gTraceRing.draining = 0;
+}
+
+/**
+ * Trace ring drainer thread. Note that it's started with DosCreateThread as
+ * it may happen in any context (see interrupt_exception() for details).
+ */
+static void APIENTRY trace_ring_thread(ULONG arg)
+{
+  ULONG cnt;
+
+  while (1)
+  {
+    DosWaitEventSem(gTraceRing.hev, TRACE_RING_DRAIN_DELAY);
+    DosResetEventSem(gTraceRing.hev, &cnt);
+    trace_ring_drain(FALSE);
+  }
+}
+
+/**
+ * Sets up the trace ring if LIBCX_TRACE_RING requests it.
+ */
+static void trace_ring_init()
+{
+  int kb = 0;
+  uint32_t num = TRACE_RING_MIN_RECS;
+  TraceRec *recs;
+  TID tid;
+
+  _getenv_int("LIBCX_TRACE_RING", &kb);
+  if (kb <= 0)
+    return;
+
+  while (num * 2 <= (uint32_t)kb * 1024 / TRACE_REC_SIZE)
+    num *= 2;
+
+  recs = calloc(num, TRACE_REC_SIZE);
+  if (!recs)
+    return;
+
+  if (DosCreateEventSem(NULL, &gTraceRing.hev, 0, FALSE) ||
+      DosCreateThread(&tid, trace_ring_thread, 0, CREATE_READY, 64 * 1024))
+  {
+    free(recs);
+    return;
+  }
+
+  gTraceRing.mask = num - 1;
+  DosQuerySysInfo(QSV_MS_COUNT, QSV_MS_COUNT, &gTraceRing.base_ms, sizeof(gTraceRing.base_ms));
+  gTraceRing.base_tsc = read_tsc();
+
+  /* Let others use the ring (see libcx_trace()) */
+  __asm__ __volatile__("" ::: "memory");
+  gTraceRing.recs = recs;
+}
+
+/**
+ * Discards the trace ring inherited from the parent in a forked child (the
+ * parent's drainer thread and semaphore don't exist here).
+ */
+static void trace_ring_reset()
+{
+  free(gTraceRing.recs);
+  memset(&gTraceRing, 0, offsetof(typeof(gTraceRing), msg));
+}
+
+/**
+ * Stores a trace message in the trace ring.
+ */
+static void trace_ring_put(unsigned traceGroup, const char *file, int line, const char *func, const char *format, va_list args)
+{
+  uint32_t idx = __atomic_fetch_add(&gTraceRing.head, 1, __ATOMIC_RELAXED);
+  TraceRec *rec = &gTraceRing.recs[idx & gTraceRing.mask];
+  va_list args2;
+
+  rec->seq = 0;
+  __asm__ __volatile__("" ::: "memory");
+
+  rec->tsc = read_tsc();
+  rec->group = traceGroup;
+  rec->tid = _gettid();
+  rec->file = file;
+  rec->line = line;
+  rec->func = func;
+  rec->format = format;
+
+  va_copy(args2, args);
+  if (!trace_rec_pack(rec, format, args2))
+  {
+    /* Fall back to formatting right away */
+    vsnprintf(rec->data, TraceRecDataSize, format, args);
+    rec->format = NULL;
+  }
+  va_end(args2);
+
+  __asm__ __volatile__("" ::: "memory");
+  rec->seq = trace_seq(idx);
+
+  /* Wake up the drainer each time half of the ring is filled */
+  if (!(idx & (gTraceRing.mask >> 1)))
+    DosPostEventSem(gTraceRing.hev);
+}
+
+/**
+ * Writes out trace records buffered in the trace ring, if any (see
+ * trace_ring_drain()). Called on assertions and process termination.
+ */
+void libcx_trace_dump()
+{
+  trace_ring_drain(TRUE);
+}
+
+/**
+ * Writes out complete trace records buffered in the trace ring, if any,
+ * without waiting for a concurrent drain or dropping records still being
+ * written (see trace_ring_drain()). Called on exceptions that may or may not
+ * end up in process termination (which does a final drain anyway).
+ */
+void libcx_trace_drain()
+{
+  trace_ring_drain(FALSE);
+}
 
 void libcx_trace(unsigned traceGroup, const char *file, int line, const char *func, const char *format, ...)
 {
@@ -1439,6 +3660,19 @@ void libcx_trace(unsigned traceGroup, const char *file, int line, const char *fu
   traceGroup &= ~TRACE_FLAG_MASK;
 
   va_list args;
+
+  if (gTraceRing.recs)
+  {
+    /* Skip disabled groups right away to save ring space */
+    if (traceGroup < gLogGroups.cGroups && !gLogGroup[traceGroup].fEnabled)
+      return;
+
+    va_start(args, format);
+    trace_ring_put(traceGroup, file, line, func, format, args);
+    va_end(args);
+    return;
+  }
+
   char *msg;
   unsigned cch;
   int n;
@@ -1476,7 +3710,7 @@ void libcx_trace(unsigned traceGroup, const char *file, int line, const char *fu
   __libc_LogRaw(gLogInstance, traceGroup | __LIBC_LOG_MSGF_FLUSH, msg, cch);
 }
 
-#endif /* defined(TRACE_ENABLED) && defined(TRACE_USE_LIBC_LOG) */
+#endif /* TRACE_USE_LIBC_LOG */
 
 /**
  * Returns TRUE if the log instance was successfully initialized and FALSE otherwise.
@@ -1501,9 +3735,8 @@ static int init_log_instance()
   void *logInstance = NULL;
   __LIBC_LOGGROUPS *logGroups = NULL;
 
-#if defined(TRACE_ENABLED)
+#ifdef TRACE_USE_LIBC_LOG
   logGroups = &gLogGroups;
-  __libc_LogGroupInit(&gLogGroups, "LIBCX_TRACE");
 #endif
 
   int flags = __LIBC_LOG_INIT_NOLEGEND;
@@ -1554,6 +3787,10 @@ static int init_log_instance()
    * Finish initialization by storing the instance and setting the state to 2
    * (this will unfreeze other threads that started instance creation, if any).
    */
+#ifdef TRACE_USE_LIBC_LOG
+  trace_ring_init();
+#endif
+
   gLogInstance = logInstance;
   gLogInstanceState = 2;
   return TRUE;
@@ -1563,6 +3800,9 @@ void libcx_assert(const char *string, const char *fname, unsigned int line, cons
 {
   gSeenAssertion = TRUE;
 
+  /* Put buffered trace messages before the assertion */
+  TRACE_DUMP();
+
   int dupToConsole = (gLogInstance || init_log_instance()) ? !__libc_LogIsOutputToConsole(gLogInstance) : TRUE;
 
   char *buf = NULL;
@@ -1628,7 +3868,7 @@ void libcx_assert(const char *string, const char *fname, unsigned int line, cons
 
       /* Add LIBCx stats to the assertion message - it might be useful */
       if (bufLeft >= 1)
-        msgSize += format_stats(msg + msgSize, bufLeft);
+        msgSize += format_stats(msg + msgSize, bufLeft, FALSE);
     }
   }
 
@@ -1760,9 +4000,17 @@ static void forkCompletion(void *pvArg, int rc, __LIBC_FORKCTX enmCtx)
     gLogInstance = NULL;
   }
 
+#ifdef TRACE_USE_LIBC_LOG
+  /* Start a new trace ring (if we keep the log instance, it won't happen) */
+  trace_ring_reset();
+  if (gLogInstance)
+    trace_ring_init();
+#endif
+
   /* Reset other fields inherited from the parent but meaningless in the child */
   gSeenAssertion = FALSE;
   gpProcDesc = NULL;
+  fd_map_reset();
 
   /*
    * Initialize LIBCx in the forked child (note that for normal children this is
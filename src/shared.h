@@ -26,11 +26,26 @@
 #include <string.h> /* for TRACE_ERRNO */
 #include <sys/param.h> /* PAGE_SIZE */
 #include <sys/fmutex.h>
+#include <stdint.h>
 
 /** Executes statement(s) syntactically wrapped as a func call. */
 #define do_(stmt) if (1) { stmt; } else do {} while (0)
 
-#ifdef TRACE_ENABLED
+/*
+ * Debug builds (TRACE_ENABLED) have all trace groups enabled by default.
+ * Release builds keep the same tracepoints but have all groups disabled by
+ * default. In both cases, groups are switched with the LIBCX_TRACE environment
+ * variable (e.g. LIBCX_TRACE=-all+fcntl+mmap) or libcx_trace_set_groups() at
+ * runtime. Defining TRACE_DISABLED compiles all tracepoints out.
+ */
+#if defined(TRACE_ENABLED) || !defined(TRACE_DISABLED)
+
+#ifndef TRACE_ENABLED
+/* The LIBC log is the only option in release builds */
+#undef TRACE_USE_LIBC_LOG
+#undef TRACE_MORE
+#define TRACE_MORE 0
+#endif
 
 #ifndef TRACE_USE_LIBC_LOG
 #define TRACE_USE_LIBC_LOG 1
@@ -60,26 +75,43 @@
 #define TRACE_FLAG_NOSTD 0x10000000
 
 #ifdef TRACE_USE_LIBC_LOG
+/**
+ * Bit mask of enabled trace groups (bit N is set if group N is enabled). Every
+ * tracepoint checks the bit of its group before anything else so that the
+ * cost of a disabled tracepoint is one memory load and a well predicted
+ * branch.
+ */
+extern uint32_t gTraceGroups;
+#define TRACE_GROUP_ON(grp) (gTraceGroups & (1U << ((grp) & ~TRACE_FLAG_MASK)))
+#define TRACE_ON() TRACE_GROUP_ON(TRACE_GROUP)
 void libcx_trace(unsigned traceGroup, const char *file, int line, const char *func, const char *format, ...) __printflike(5, 6);
+void libcx_trace_dump();
+void libcx_trace_drain();
+int libcx_trace_set_groups(const char *spec);
 #define TRACE_FLUSH() do {} while (0)
-#define TRACE_RAW(msg, ...) libcx_trace(TRACE_GROUP, __FILE__, __LINE__, __FUNCTION__, msg, ## __VA_ARGS__)
-#define TRACE_CONT(msg, ...) libcx_trace(TRACE_GROUP, NULL, -1, NULL, msg, ## __VA_ARGS__)
-#define TRACE_TO(grp, msg, ...) libcx_trace(grp, __FILE__, __LINE__, __FUNCTION__, msg, ## __VA_ARGS__)
+#define TRACE_DUMP() libcx_trace_dump()
+#define TRACE_DRAIN() libcx_trace_drain()
+#define TRACE_RAW(msg, ...) do { if (TRACE_ON()) libcx_trace(TRACE_GROUP, __FILE__, __LINE__, __FUNCTION__, msg, ## __VA_ARGS__); } while (0)
+#define TRACE_CONT(msg, ...) do { if (TRACE_ON()) libcx_trace(TRACE_GROUP, NULL, -1, NULL, msg, ## __VA_ARGS__); } while (0)
+#define TRACE_TO(grp, msg, ...) do { if (TRACE_GROUP_ON(grp)) libcx_trace(grp, __FILE__, __LINE__, __FUNCTION__, msg, ## __VA_ARGS__); } while (0)
 #else
+#define TRACE_ON() 1
 #define TRACE_FLUSH() fflush(stdout)
+#define TRACE_DUMP() TRACE_FLUSH()
+#define TRACE_DRAIN() TRACE_FLUSH()
 #define TRACE_RAW(msg, ...) printf("*** [%d:%d] %s:%d:%s: " msg, getpid(), _gettid(), __FILE__, __LINE__, __FUNCTION__, ## __VA_ARGS__)
 #define TRACE_CONT(msg, ...) printf(msg, ## __VA_ARGS__)
 #define TRACE_TO(grp, msg, ...) TRACE_RAW(msg, ## __VA_ARGS__)
 #endif
 
 #define TRACE(msg, ...) do { TRACE_RAW(msg, ## __VA_ARGS__); TRACE_FLUSH(); } while(0)
-#define TRACE_BEGIN(msg, ...) { do { TRACE_RAW(msg, ## __VA_ARGS__); } while(0)
+#define TRACE_BEGIN(msg, ...) if (TRACE_ON()) { do { TRACE_RAW(msg, ## __VA_ARGS__); } while(0)
 #define TRACE_END() TRACE_FLUSH(); } do {} while(0)
-#define TRACE_IF(cond, msg, ...) if (cond) TRACE(msg, ## __VA_ARGS__)
-#define TRACE_BEGIN_IF(cond, msg, ...) if (cond) TRACE_BEGIN(msg, ## __VA_ARGS__)
+#define TRACE_IF(cond, msg, ...) if (TRACE_ON() && (cond)) TRACE(msg, ## __VA_ARGS__)
+#define TRACE_BEGIN_IF(cond, msg, ...) if (TRACE_ON() && (cond)) TRACE_BEGIN(msg, ## __VA_ARGS__)
 
 #define TRACE_ERRNO(msg, ...) TRACE(msg ": %s (%d)\n", ##__VA_ARGS__, strerror(errno), errno)
-#define TRACE_ERRNO_IF(cond, msg, ...) if (cond) TRACE_ERRNO(msg, ## __VA_ARGS__)
+#define TRACE_ERRNO_IF(cond, msg, ...) if (TRACE_ON() && (cond)) TRACE_ERRNO(msg, ## __VA_ARGS__)
 
 #define TRACE_AND(stmt, msg, ...) do_(TRACE(msg, ##__VA_ARGS__); stmt)
 #define TRACE_ERRNO_AND(stmt, msg, ...) do_(TRACE_ERRNO(msg, ##__VA_ARGS__); stmt)
@@ -89,7 +121,10 @@ void libcx_trace(unsigned traceGroup, const char *file, int line, const char *fu
 #else
 
 #define TRACE_MORE 0
+#define TRACE_ON() 0
 #define TRACE_FLUSH() do {} while (0)
+#define TRACE_DUMP() do {} while (0)
+#define TRACE_DRAIN() do {} while (0)
 #define TRACE_RAW(msg, ...) do {} while (0)
 #define TRACE_TO(grp, msg, ...) do {} while (0)
 #define TRACE(msg, ...) do {} while (0)
@@ -104,7 +139,7 @@ void libcx_trace(unsigned traceGroup, const char *file, int line, const char *fu
 #define TRACE_ERRNO_AND(stmt, msg, ...) do_(stmt)
 #define TRACE_PERR(rc) do {} while (0)
 
-#endif /* TRACE_ENABLED */
+#endif /* defined(TRACE_ENABLED) || !defined(TRACE_DISABLED) */
 
 #ifndef ASSERT_USE_LIBC_LOG
 #define ASSERT_USE_LIBC_LOG 1
@@ -154,9 +189,47 @@ void libcx_assert(const char *string, const char *fname, unsigned int line, cons
 /** Returns the number of pages needed for count bytes. */
 #define NUM_PAGES(count) DIVIDE_UP((count), PAGE_SIZE)
 
-#define FILE_DESC_HASH_SIZE 127 /* Prime */
+#define FILE_DESC_LOCKS 128 /* Number of file bucket locks (power of two) */
+
+#define PROC_DESC_LOCKS 16 /* Number of process bucket locks (power of two) */
 
-#define PROC_DESC_HASH_SIZE 17 /* Prime */
+#define HASH_MAP_MAX_LOCKS 128 /* Max number of locks guarding one HashMap */
+
+#define HEAP_MAX_SEGS 32 /* Max number of shared heap segments */
+
+/**
+ * Lightweight system-wide lock placed in shared memory (see shared_lock()).
+ * Holds the PID and TID of the owner or 0 when not owned.
+ */
+typedef volatile uint32_t SharedLock;
+
+/**
+ * Generic hash map entry. Real entries must start with the next pointer.
+ */
+typedef struct HashMapEntry
+{
+  struct HashMapEntry *next;
+} HashMapEntry;
+
+/**
+ * Hash map with incremental resize (see hash_map_bucket()). The number of
+ * buckets is a power of two not less than the number of locks guarding the
+ * map (also a power of two) so that bucket b is always guarded by lock
+ * b % nlocks. Doubling the number of buckets keeps every entry under the same
+ * lock, so old buckets are moved to new ones lazily, one lock's share at a
+ * time, by the first access under that lock.
+ */
+typedef struct HashMap
+{
+  HashMapEntry **buckets; /* Bucket array of size */
+  HashMapEntry **old_buckets; /* Bucket array of size / 2 while rehashing */
+  volatile size_t size; /* Number of buckets */
+  volatile uint32_t count; /* Number of entries */
+  volatile uint32_t rehash_left; /* Number of locks with pending rehash */
+  volatile uint32_t busy; /* Number of rehash operations in progress */
+  volatile uint32_t gen; /* Number of completed rehash operations */
+  uint8_t rehash[HASH_MAP_MAX_LOCKS]; /* Per-lock pending rehash flag */
+} HashMap;
 
 /**
  * Global system-wide file description (hash map entry).
@@ -166,11 +239,17 @@ typedef struct SharedFileDesc
   struct SharedFileDesc *next;
 
   int refcnt; /* Number of FileDesc sturcts using us */
+  SharedLock lock; /* Guards fcntl_locks, fcntl_lock_tree and flock_lock */
 
+  size_t hash; /* file_desc_hash(path) */
   char *path; /* File name with full path (follows the struct) */
   struct FileMap *map; /* Per-file mmap data */
   struct FcntlLock *fcntl_locks; /* Active fcntl file locks */
-  unsigned long pwrite_lock; /* Mutex used in pwrite/pread */
+  struct FcntlLock *fcntl_lock_tree; /* Root of the fcntl_locks treap */
+  struct FcntlLock *flock_lock; /* Whole-file flock() lock (see flock) */
+  unsigned fcntl_spins; /* Recent F_SETLKW spin counts (x8 average, see spin_update) */
+  struct ProcBlock *fcntl_blocked; /* Processes blocked on this file (guarded by FcntlLocking::lock) */
+  unsigned long pwrite_lock; /* Mutex used in pwrite/pread (guarded by the file bucket lock) */
 } SharedFileDesc;
 
 /**
@@ -206,7 +285,7 @@ typedef struct ProcDesc
   struct ProcDesc *next;
 
   pid_t pid;
-  FileDesc **files; /* Process-specific file descrition hash map of FILE_DESC_HASH_SIZE */
+  HashMap files; /* Process-specific file descriptions (FileDesc) */
   struct ProcMemMap *mmap; /* Process-specific data for mmap */
   struct MemMap *mmaps; /* Process-visible memory mapings */
   int flags; /* Process-specific flags */
@@ -214,29 +293,134 @@ typedef struct ProcDesc
   struct SpawnWrappers *spawn2_wrappers; /* spawn2 wrapper->wrapped mappings */
   _fmutex tcpip_fsem; /* Mutex for making thread-safe TCP/IP DLL calls */
   struct Interrupts *interrupts; /* Interrupt request data for this process */
+  struct OwnedMem *owned; /* Shared blocks owned by this process (see global_alloc_owned()) */
 } ProcDesc;
 
+/**
+ * Shared heap segment.
+ */
+typedef struct HeapSeg
+{
+  char *base; /* Segment address */
+  size_t size; /* Reserved size */
+  size_t committed; /* Committed size */
+} HeapSeg;
+
+/**
+ * Slab caches for frequently allocated fixed-size shared objects (see
+ * slab_alloc()).
+ */
+enum SlabId
+{
+  SlabFcntlLock,
+  SlabProcBlock,
+  SlabMemMap, /* MAP_ANONYMOUS MemMap */
+  SlabFileMemMap, /* MemMap with the File part */
+  SlabFileMapMem,
+  SlabShmemView,
+  SlabShmemProcHnd,
+  SlabInterruptRequest,
+  SlabCount
+};
+
+/**
+ * Slab (a chunk of objects of the same size allocated from the shared heap).
+ */
+typedef struct Slab
+{
+  struct Slab *next;
+  struct Slab *prev;
+  struct SlabObj *free; /* Free objects */
+  uint16_t used; /* Number of allocated objects */
+  uint16_t id; /* Cache this slab belongs to (SlabId) */
+} Slab;
+
+/**
+ * Slab cache for objects of one type.
+ */
+typedef struct SlabCache
+{
+  SharedLock lock; /* Guards this cache and its slabs */
+  uint32_t size; /* Object size (including the header), 0 until first use */
+  uint32_t per_slab; /* Number of objects per slab */
+  Slab *partial; /* Slabs with free objects (including empty ones) */
+  Slab *full; /* Slabs with no free objects */
+  uint32_t num_slabs; /* Number of slabs */
+  uint32_t num_objs; /* Number of allocated objects */
+} SlabCache;
+
+/* Max number of global_lock() call sites tracked by LockStats */
+#define LOCK_STATS_SITES 64
+/* Number of hold time histogram buckets (see LockStats) */
+#define LOCK_STATS_HIST 8
+
+/**
+ * global_lock() statistics of one call site. Times are in TSC ticks.
+ */
+typedef struct LockSiteStats
+{
+  const char *site; /* Call site (function name) or NULL if unused */
+  char name[32]; /* Copy of the name for printing from other processes */
+  uint32_t count; /* Number of acquisitions */
+  uint32_t contended; /* Number of acquisitions that had to wait */
+  uint64_t wait_total; /* Total wait time */
+  uint64_t wait_max; /* Max wait time */
+  uint64_t hold_total; /* Total hold time (outermost acquisitions only) */
+  uint32_t hold_hist[LOCK_STATS_HIST]; /* Hold times, bucket N is < 2^(10+3*(N+1)) ticks */
+} LockSiteStats;
+
+/**
+ * global_lock() statistics. Guarded by global_lock() itself.
+ */
+typedef struct LockStats
+{
+  uint32_t depth; /* Recursion depth of the current owner */
+  uint64_t start; /* Time of the outermost acquisition by the current owner */
+  LockSiteStats *owner_site; /* Site of the outermost acquisition */
+  uint64_t overhead; /* Time spent in collecting these statistics */
+  volatile uint32_t shared_count; /* Number of global_lock_shared() calls */
+  volatile uint32_t shared_waits; /* Number of them that had to wait for a writer */
+  volatile uint32_t tsc_mhz; /* TSC frequency in MHz, 0 until measured (see tsc_mhz()) */
+  LockSiteStats sites[LOCK_STATS_SITES]; /* Last one collects all overflows */
+} LockStats;
+
 /**
  * Global system-wide data structure (header).
  */
 typedef struct SharedData
 {
-  size_t size; /* Committed size */
+  size_t size; /* Committed size (all segments) */
   Heap_t heap; /* Shared heap */
   int refcnt; /* Number of processes using us */
-  ProcDesc **procs; /* Process description hash map of PROC_INFO_HASH_SIZE */
-  SharedFileDesc **files; /* File description hash map of FILE_DESC_HASH_SIZE */
+  HashMap procs; /* Process descriptions (ProcDesc) */
+  HashMap files; /* Global file descriptions (SharedFileDesc) */
   struct FcntlLocking *fcntl_locking; /* Shared data for fcntl locking */
   unsigned long spawn2_sem; /* Signals spawn2 wrapper events */
   int spawn2_sem_refcnt; /* Number of processes using it */
   struct ShmemData *shmem; /* shmem API data structure */
+  SharedLock procs_locks[PROC_DESC_LOCKS]; /* Guard procs buckets */
+  SharedLock files_locks[FILE_DESC_LOCKS]; /* Guard files and ProcDesc::files buckets */
+  SharedLock procs_resize_lock; /* Serializes resizing of procs */
+  SharedLock files_resize_lock; /* Serializes resizing of files and ProcDesc::files */
+  volatile uint32_t num_procs; /* Number of ProcDesc structs */
+  volatile uint32_t num_files; /* Number of FileDesc structs (all processes) */
+  volatile uint32_t num_shared_files; /* Number of SharedFileDesc structs */
+  size_t reserved; /* Reserved size (all segments) */
+  size_t max_size; /* Max reserved size (LIBCX_HEAP_MAX) */
+  size_t max_committed; /* Max committed size (high-water mark) */
+  int heap_warned; /* Set once the high-water mark warning is logged */
+  volatile pid_t unlisted_pid; /* Process in init/term absent in procs (see mem_alloc) */
+  volatile uint32_t seg_count; /* Number of used entries in segs */
+  HeapSeg segs[HEAP_MAX_SEGS]; /* Heap segments, segs[0] is the one we live in */
+  SlabCache slabs[SlabCount]; /* Slab caches */
+  LockStats lock_stats; /* global_lock() contention and hold time statistics */
+  volatile uint32_t lock_readers; /* Number of global_lock_shared() holders */
+  volatile uint32_t lock_writer; /* 1 while global_lock() is held */
+  volatile uint32_t num_dirty_pages; /* Number of dirty pages of all file mappings */
 #ifdef STATS_ENABLED
   size_t max_heap_used; /* Max size of used heap space */
-  size_t num_procs; /* Number of ProcDesc structs */
   size_t max_procs; /* Max number of ProcDesc structs */
-  size_t num_files; /* Number of FileDesc structs (all processes) */
   size_t max_files; /* Max number of FileDesc structs (all processes) */
-  size_t num_shared_files; /* Number of SharedFileDesc structs */
   size_t max_shared_files; /* Max number of SharedFileDesc structs */
 #endif
   /* Heap memory follows here */
@@ -264,11 +448,79 @@ struct _EXCEPTIONREPORTRECORD;
 struct _EXCEPTIONREGISTRATIONRECORD;
 struct _CONTEXT;
 
-void global_lock();
+/*
+ * Lock hierarchy. Locks must always be taken in the order listed below (from
+ * outer to inner) and an inner lock must never be held when requesting an
+ * outer one. Locks of the same level must not be nested unless stated
+ * otherwise.
+ *
+ * 1. global_lock(). Guards process startup and termination, ProcDesc
+ *    contents, mmap state (SharedFileDesc::map, FileDesc::map and
+ *    FileDesc::fh), spawn2, handles and interrupts. FileDesc and
+ *    SharedFileDesc structures are only freed under this lock so holding it
+ *    keeps them alive. This lock is recursive. Read-only lookups may use
+ *    global_lock_shared() instead which lets readers run concurrently but
+ *    excludes global_lock() holders. A shared holder must not request
+ *    global_lock() or global_lock_shared() again.
+ * 2. shmem mutex (see shmem_lock() in shmem.c). Guards shmem API data.
+ * 3. File bucket lock (file_desc_lock()). Guards the gpData->files buckets and
+ *    the respective ProcDesc::files buckets of every process along with the
+ *    FileDesc and SharedFileDesc structures linked there (except members
+ *    guarded by other locks). Resizing a map takes all bucket locks of the
+ *    map in ascending order (besides the one already held) under the
+ *    files_resize_lock which is only ever tried, never waited for.
+ * 4. SharedFileDesc::lock. Guards fcntl locks of the given file (the pwrite
+ *    mutex is created under the bucket lock). Must be requested with the file's bucket lock held (which
+ *    may be released afterwards).
+ * 5. fcntl blocked list lock (FcntlLocking::lock).
+ * 6. Process bucket lock (taken internally by get_proc_desc_ex()). Resizing
+ *    follows the same rules as for file bucket locks (procs_resize_lock).
+ * 7. Slab cache lock (taken internally by slab_alloc() and slab_free()).
+ * 8. Shared heap (taken internally by GLOBAL_NEW and friends).
+ *
+ * Levels 3-7 are SharedLock spin locks which are not recursive and must only
+ * be held for short periods of time, with no blocking calls in between. The
+ * only exception is shared heap growth (level 8 may be taken under any of
+ * them): when the heap runs out of committed memory, it commits more with
+ * DosSetMem and, when the current segment is exhausted, allocates a new one
+ * and gives it to all LIBCx processes. None of these calls waits for other
+ * processes and new segments are bounded by HEAP_MAX_SEGS and
+ * SharedData::max_size over the lifetime of the shared heap. Spin locks left
+ * by crashed threads are released before their process requests the global
+ * mutex on termination (as its owner may be waiting for them).
+ */
+
+void global_lock_ex(const char *site);
 void global_unlock();
+void global_lock_shared();
+void global_unlock_shared();
 int global_lock_info(pid_t *pid, int *tid, unsigned *count);
 void global_lock_deathcheck();
 
+/* Requests the global mutex recording the caller in LockStats */
+#define global_lock() global_lock_ex(__FUNCTION__)
+
+void shared_lock(SharedLock *lock);
+int shared_lock_try(SharedLock *lock);
+void shared_unlock(SharedLock *lock);
+int shared_lock_owned(SharedLock *lock);
+void shared_lock_reset(SharedLock *lock);
+
+typedef size_t HASH_MAP_HASH_FN(HashMapEntry *entry);
+
+int hash_map_init(HashMap *map, size_t size);
+void hash_map_free(HashMap *map);
+void hash_map_rehash(HashMap *map, size_t lock, size_t nlocks, HASH_MAP_HASH_FN *hash_fn);
+HashMapEntry **hash_map_bucket(HashMap *map, size_t hash, size_t nlocks, HASH_MAP_HASH_FN *hash_fn);
+void hash_map_add(HashMap *map, HashMapEntry **bucket, HashMapEntry *entry,
+                  size_t held, SharedLock *locks, size_t nlocks,
+                  SharedLock *resize_lock, HASH_MAP_HASH_FN *hash_fn);
+
+size_t file_desc_hash(const char *path);
+static inline void file_desc_lock(size_t hash) { shared_lock(&gpData->files_locks[hash & (FILE_DESC_LOCKS - 1)]); }
+static inline void file_desc_unlock(size_t hash) { shared_unlock(&gpData->files_locks[hash & (FILE_DESC_LOCKS - 1)]); }
+void file_desc_rehash(size_t lock, ProcDesc *proc);
+
 unsigned long global_spawn2_sem(ProcDesc *proc);
 _fmutex *global_tcpip_sem();
 
@@ -281,6 +533,22 @@ void *crealloc(void *ptr, size_t old_size, size_t new_size);
 #define GLOBAL_NEW_ARRAY(ptr, sz) (ptr) = (__typeof(ptr))global_alloc(sizeof(*(ptr)) * (sz))
 #define GLOBAL_NEW_PLUS_ARRAY(ptr, arr, sz) (ptr) = (__typeof(ptr))global_alloc(sizeof(*(ptr)) + sizeof(*(arr)) * (sz))
 
+void *global_alloc_owned(size_t size);
+void global_free_owned(void *ptr);
+void global_mem_set_owner(void *ptr, pid_t pid);
+
+#define GLOBAL_NEW_OWNED(ptr) (ptr) = (__typeof(ptr))global_alloc_owned(sizeof(*(ptr)))
+#define GLOBAL_NEW_PLUS_ARRAY_OWNED(ptr, arr, sz) (ptr) = (__typeof(ptr))global_alloc_owned(sizeof(*(ptr)) + sizeof(*(arr)) * (sz))
+#define GLOBAL_MEM_SET_OWNER(ptr, pid) global_mem_set_owner((ptr), (pid))
+#define GLOBAL_DEL(ptr) global_free_owned(ptr)
+
+void *slab_alloc(enum SlabId id, size_t size);
+void slab_free(void *ptr);
+void slab_trim();
+
+#define GLOBAL_NEW_SLAB(ptr, id) (ptr) = (__typeof(ptr))slab_alloc((id), sizeof(*(ptr)))
+#define GLOBAL_NEW_PLUS_SLAB(ptr, more, id) (ptr) = (__typeof(ptr))slab_alloc((id), sizeof(*(ptr)) + (more))
+
 #define NEW(ptr) (ptr) = (__typeof(ptr))calloc(1, sizeof(*(ptr)))
 #define NEW_PLUS(ptr, more) (ptr) = (__typeof(ptr))calloc(1, sizeof(*(ptr)) + (more))
 #define NEW_ARRAY(ptr, sz) (ptr) = (__typeof(ptr))calloc((sz), sizeof(*(ptr)))
@@ -309,18 +577,31 @@ static inline ProcDesc *get_proc_desc(pid_t pid) { return get_proc_desc_ex(pid,
 static inline ProcDesc *find_proc_desc(pid_t pid) { return get_proc_desc_ex(pid, HashMapOpt_None); }
 static inline ProcDesc *take_proc_desc(pid_t pid) { return get_proc_desc_ex(pid, HashMapOpt_Take); }
 
-FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, enum HashMapOpt opt, size_t *o_bucket, FileDesc **o_prev, ProcDesc **o_proc, SharedFileDesc **o_desc_g);
-static inline FileDesc *get_file_desc(int fd, const char *path) { return get_file_desc_ex(-1, fd, path, HashMapOpt_New, NULL, NULL, NULL, NULL); }
-static inline FileDesc *find_file_desc(const char *path, SharedFileDesc **o_desc_g) { return get_file_desc_ex(-1, -1, path, HashMapOpt_None, NULL, NULL, NULL, o_desc_g); }
-static inline FileDesc *find_file_desc_ex(const char *path, size_t *o_bucket, FileDesc **o_prev, ProcDesc **o_proc) { return get_file_desc_ex(-1, -1, path, HashMapOpt_None, o_bucket, o_prev, o_proc, NULL); }
-void free_file_desc(FileDesc *desc, size_t bucket, FileDesc *prev, ProcDesc *proc);
+FileDesc *get_file_desc_ex(pid_t pid, int fd, const char *path, size_t hash, enum HashMapOpt opt, FileDesc **o_prev, ProcDesc **o_proc, SharedFileDesc **o_desc_g);
+static inline FileDesc *get_file_desc(int fd, const char *path, size_t hash) { return get_file_desc_ex(-1, fd, path, hash, HashMapOpt_New, NULL, NULL, NULL); }
+static inline FileDesc *find_file_desc(const char *path, size_t hash, SharedFileDesc **o_desc_g) { return get_file_desc_ex(-1, -1, path, hash, HashMapOpt_None, NULL, NULL, o_desc_g); }
+static inline FileDesc *find_file_desc_ex(const char *path, size_t hash, FileDesc **o_prev, ProcDesc **o_proc) { return get_file_desc_ex(-1, -1, path, hash, HashMapOpt_None, o_prev, o_proc, NULL); }
+void free_file_desc(FileDesc *desc, size_t hash, FileDesc *prev, ProcDesc *proc);
 
 void fcntl_locking_init(ProcDesc *proc);
 void fcntl_locking_term(ProcDesc *proc);
 int fcntl_locking_filedesc_init(FileDesc *desc);
 void fcntl_locking_filedesc_term(FileDesc *desc);
 
-int fcntl_locking_close(FileDesc *desc);
+/*
+ * Event semaphores of F_SETLKW waiters woken up under fcntl spin locks. They
+ * are opened there and posted and closed later by fcntl_locking_wake() once
+ * no spin locks are held.
+ */
+#define FCNTL_WAKE_BATCH 32
+typedef struct FcntlWakeList
+{
+  int num; /* Number of semaphores in hevs */
+  unsigned long hevs[FCNTL_WAKE_BATCH];
+} FcntlWakeList;
+
+int fcntl_locking_close(FileDesc *desc, int fildes, FcntlWakeList *wake);
+void fcntl_locking_wake(FcntlWakeList *wake);
 
 int pwrite_filedesc_init(FileDesc *desc);
 void pwrite_filedesc_term(FileDesc *desc);
@@ -333,6 +614,7 @@ int mmap_exception(struct _EXCEPTIONREPORTRECORD *report,
 
 void shmem_data_init(ProcDesc *proc);
 void shmem_data_term(ProcDesc *proc);
+void shmem_get_stats(uint32_t *num_objects, uint32_t *num_handles);
 
 void interrupt_init(ProcDesc *proc, int forked);
 void interrupt_term(ProcDesc *proc);
@@ -348,6 +630,27 @@ void interrupt_request_release(INTERRUPT_RESULT result);
 
 void print_stats();
 
+/**
+ * Kinds of counters returned by get_stats().
+ */
+enum
+{
+  StatGauge = 0, /* Current amount of something, may go up and down */
+  StatTotal = 1, /* Number of events since LIBCx start, only grows */
+};
+
+/**
+ * Single LIBCx counter returned by get_stats().
+ */
+typedef struct StatCounter
+{
+  const char *name; /* Dot-separated name, e.g. "fcntl.regions" (static) */
+  int kind; /* StatGauge or StatTotal */
+  uint64_t value; /* Counter value */
+} StatCounter;
+
+int get_stats(StatCounter *counters, int max);
+
 void touch_pages(void *buf, size_t len);
 
 char *get_module_name(char *buf, size_t len);
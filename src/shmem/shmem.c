@@ -82,6 +82,7 @@ typedef struct ShmemHandle
  */
 typedef struct ShmemData
 {
+  HMTX mutex; /* Guards shmem data (see shmem_lock) */
   ShmemObj *objects; /* List of all memory objects */
   ShmemHandle *handles; /* Array of all available handles */
   size_t handles_size; /* Size of the handle array */
@@ -369,16 +370,53 @@ static ShmemHandle *unref_handle(SHMEM h)
  */
 void shmem_data_init(ProcDesc *proc)
 {
+  APIRET arc;
+
   if (gpData->refcnt == 1)
   {
     /* We are the first processs, initialize shmem structures */
     GLOBAL_NEW(gpData->shmem);
     ASSERT(gpData->shmem);
 
+    arc = DosCreateMutexSem(NULL, &gpData->shmem->mutex, DC_SEM_SHARED, FALSE);
+    ASSERT_MSG(arc == NO_ERROR, "%ld", arc);
+
     gpData->shmem->handles_size = SHMEM_MIN_HANDLES;
     GLOBAL_NEW_ARRAY(gpData->shmem->handles, gpData->shmem->handles_size);
     ASSERT(gpData->shmem->handles);
   }
+  else
+  {
+    ASSERT(gpData->shmem);
+    ASSERT(gpData->shmem->mutex);
+    arc = DosOpenMutexSem(NULL, &gpData->shmem->mutex);
+    ASSERT_MSG(arc == NO_ERROR, "%ld", arc);
+  }
+}
+
+/**
+ * Requests the mutex that guards shmem data. This mutex is used instead of
+ * global_lock() to let shmem API calls run in parallel with other LIBCx
+ * operations. Note that it may be requested under global_lock() but not
+ * vice versa (see the lock hierarchy in shared.h).
+ */
+static void shmem_lock()
+{
+  APIRET arc;
+
+  DOS_NI(arc = DosRequestMutexSem(gpData->shmem->mutex, SEM_INDEFINITE_WAIT));
+
+  ASSERT_MSG(arc == NO_ERROR, "%ld", arc);
+}
+
+/**
+ * Releases the mutex requested by shmem_lock().
+ */
+static void shmem_unlock()
+{
+  APIRET arc = DosReleaseMutexSem(gpData->shmem->mutex);
+
+  ASSERT_MSG(arc == NO_ERROR, "%ld", arc);
 }
 
 /**
@@ -388,6 +426,12 @@ void shmem_data_init(ProcDesc *proc)
  */
 void shmem_data_term(ProcDesc *proc)
 {
+  APIRET arc;
+
+  /* Note that the mutex will be released if the owner thread crashed */
+  DOS_NI(arc = DosRequestMutexSem(gpData->shmem->mutex, SEM_INDEFINITE_WAIT));
+  TRACE("DosRequestMutexSem = %ld\n", arc);
+
   TRACE("gpData->shmem->objects %p gpData->shmem->handles_count %u\n",
         gpData->shmem->objects, gpData->shmem->handles_count);
 
@@ -413,7 +457,7 @@ void shmem_data_term(ProcDesc *proc)
 
         ShmemProcHnd *prev_proc_hnd = proc_hnd;
         proc_hnd = proc_hnd->next;
-        free(prev_proc_hnd);
+        slab_free(prev_proc_hnd);
       }
       proc->handles = NULL;
 
@@ -423,7 +467,7 @@ void shmem_data_term(ProcDesc *proc)
       {
         ShmemView *prev_view = view;
         view = view->next;
-        free(prev_view);
+        slab_free(prev_view);
       }
       proc->views = NULL;
 
@@ -442,8 +486,39 @@ void shmem_data_term(ProcDesc *proc)
     ASSERT_MSG(!gpData->shmem->objects, "%p\n", gpData->shmem->objects);
 
     free(gpData->shmem->handles);
+  }
+
+  DosReleaseMutexSem(gpData->shmem->mutex);
+
+  arc = DosCloseMutexSem(gpData->shmem->mutex);
+  TRACE("DosCloseMutexSem = %ld\n", arc);
+
+  if (gpData->refcnt == 0)
     free(gpData->shmem);
+}
+
+/**
+ * Returns the number of memory objects and used handles for get_stats().
+ */
+void shmem_get_stats(uint32_t *num_objects, uint32_t *num_handles)
+{
+  *num_objects = *num_handles = 0;
+
+  if (!gpData->shmem)
+    return;
+
+  shmem_lock();
+
+  ShmemObj *obj = gpData->shmem->objects;
+  while (obj)
+  {
+    ++(*num_objects);
+    obj = obj->next;
   }
+
+  *num_handles = gpData->shmem->handles_count;
+
+  shmem_unlock();
 }
 
 SHMEM shmem_create(size_t size, int flags)
@@ -487,7 +562,7 @@ SHMEM shmem_create(size_t size, int flags)
 
   SHMEM h = SHMEM_INVALID;
 
-  global_lock();
+  shmem_lock();
 
   do
   {
@@ -507,7 +582,7 @@ SHMEM shmem_create(size_t size, int flags)
     }
 
     ShmemProcHnd *proc_hnd;
-    if (!(GLOBAL_NEW(proc_hnd)))
+    if (!(GLOBAL_NEW_SLAB(proc_hnd, SlabShmemProcHnd)))
     {
       free(proc);
       free(obj);
@@ -518,7 +593,7 @@ SHMEM shmem_create(size_t size, int flags)
     ShmemHandle *hnd = alloc_handle(&h, NULL);
     if (!hnd)
     {
-      free(proc_hnd);
+      slab_free(proc_hnd);
       free(proc);
       free(obj);
       errno = ENOMEM;
@@ -548,7 +623,7 @@ SHMEM shmem_create(size_t size, int flags)
   }
   while (0);
 
-  global_unlock();
+  shmem_unlock();
 
   /* Free the OS/2 memory object on failure */
   if (h == SHMEM_INVALID)
@@ -571,7 +646,7 @@ int shmem_give(SHMEM h, pid_t pid, int flags)
 
   int rc = -1;
 
-  global_lock();
+  shmem_lock();
 
   do
   {
@@ -597,7 +672,7 @@ int shmem_give(SHMEM h, pid_t pid, int flags)
       }
     }
 
-    if (!(GLOBAL_NEW(proc_hnd)))
+    if (!(GLOBAL_NEW_SLAB(proc_hnd, SlabShmemProcHnd)))
     {
       errno = ENOMEM;
       break;
@@ -607,7 +682,7 @@ int shmem_give(SHMEM h, pid_t pid, int flags)
     {
       if (!(GLOBAL_NEW(proc)))
       {
-        free(proc_hnd);
+        slab_free(proc_hnd);
         errno = ENOMEM;
         break;
       }
@@ -623,7 +698,7 @@ int shmem_give(SHMEM h, pid_t pid, int flags)
       if (arc)
       {
         /* Free the new, unused proc_handle and proc entry */
-        free(proc_hnd);
+        slab_free(proc_hnd);
         free(proc);
         errno = __libc_native2errno(arc);
         break;
@@ -652,7 +727,7 @@ int shmem_give(SHMEM h, pid_t pid, int flags)
   }
   while (0);
 
-  global_unlock();
+  shmem_unlock();
 
   TRACE("rc %d errno %d\n", rc, errno);
   return rc;
@@ -671,7 +746,7 @@ int shmem_open(SHMEM h, int flags)
 
   int rc = -1;
 
-  global_lock();
+  shmem_lock();
 
   do
   {
@@ -697,7 +772,7 @@ int shmem_open(SHMEM h, int flags)
       }
     }
 
-    if (!(GLOBAL_NEW(proc_hnd)))
+    if (!(GLOBAL_NEW_SLAB(proc_hnd, SlabShmemProcHnd)))
     {
       errno = ENOMEM;
       break;
@@ -707,7 +782,7 @@ int shmem_open(SHMEM h, int flags)
     {
       if (!(GLOBAL_NEW(proc)))
       {
-        free(proc_hnd);
+        slab_free(proc_hnd);
         errno = ENOMEM;
         break;
       }
@@ -723,7 +798,7 @@ int shmem_open(SHMEM h, int flags)
       if (arc)
       {
         /* Free the new, unused proc_handle and proc entry */
-        free(proc_hnd);
+        slab_free(proc_hnd);
         free(proc);
         errno = __libc_native2errno(arc);
         break;
@@ -752,7 +827,7 @@ int shmem_open(SHMEM h, int flags)
   }
   while (0);
 
-  global_unlock();
+  shmem_unlock();
 
   TRACE("rc %d errno %d\n", rc, errno);
   return rc;
@@ -771,7 +846,7 @@ SHMEM shmem_duplicate(SHMEM h, int flags)
 
   SHMEM dup_h = SHMEM_INVALID;
 
-  global_lock();
+  shmem_lock();
 
   do
   {
@@ -796,7 +871,7 @@ SHMEM shmem_duplicate(SHMEM h, int flags)
     }
 
     ShmemProcHnd *dup_proc_hnd;
-    if (!(GLOBAL_NEW(dup_proc_hnd)))
+    if (!(GLOBAL_NEW_SLAB(dup_proc_hnd, SlabShmemProcHnd)))
     {
       errno = ENOMEM;
       break;
@@ -805,7 +880,7 @@ SHMEM shmem_duplicate(SHMEM h, int flags)
     ShmemHandle *dup_hnd = alloc_handle(&dup_h, &hnd);
     if (!dup_hnd)
     {
-      free(dup_proc_hnd);
+      slab_free(dup_proc_hnd);
       errno = ENOMEM;
       break;
     }
@@ -825,7 +900,7 @@ SHMEM shmem_duplicate(SHMEM h, int flags)
   }
   while (0);
 
-  global_unlock();
+  shmem_unlock();
 
   TRACE("dup_h %u errno %d\n", dup_h, errno);
   return dup_h;
@@ -844,7 +919,7 @@ int shmem_close(SHMEM h)
 
   int rc = -1;
 
-  global_lock();
+  shmem_lock();
 
   do
   {
@@ -875,7 +950,7 @@ int shmem_close(SHMEM h)
       prev_proc_hnd->next = proc_hnd->next;
     else
       proc->handles = proc_hnd->next;
-    free(proc_hnd);
+    slab_free(proc_hnd);
 
     /* Get rid of the proc entry if no handles and views (will also free mem) */
     if (!proc->handles && !proc->views)
@@ -888,7 +963,7 @@ int shmem_close(SHMEM h)
   }
   while (0);
 
-  global_unlock();
+  shmem_unlock();
 
   TRACE("rc %d errno %d\n", rc, errno);
   return rc;
@@ -908,7 +983,7 @@ void *shmem_map(SHMEM h, off_t offset, size_t length)
 
   void *addr = NULL;
 
-  global_lock();
+  shmem_lock();
 
   do
   {
@@ -987,7 +1062,7 @@ void *shmem_map(SHMEM h, off_t offset, size_t length)
     {
       /* Allocate a new view */
       ShmemView *new_view;
-      GLOBAL_NEW(new_view);
+      GLOBAL_NEW_SLAB(new_view, SlabShmemView);
       if (!new_view)
       {
         errno = ENOMEM;
@@ -1024,7 +1099,7 @@ void *shmem_map(SHMEM h, off_t offset, size_t length)
   }
   while (0);
 
-  global_unlock();
+  shmem_unlock();
 
   TRACE("addr %p errno %d\n", addr, errno);
   return addr;
@@ -1043,7 +1118,7 @@ int shmem_unmap(void *addr)
 
   int rc = -1;
 
-  global_lock();
+  shmem_lock();
 
   do
   {
@@ -1102,7 +1177,7 @@ int shmem_unmap(void *addr)
         prev_view->next = view->next;
       else
         proc->views = view->next;
-      free(view);
+      slab_free(view);
 
       if (proc->views && proc->rw_views == 0)
       {
@@ -1129,7 +1204,7 @@ int shmem_unmap(void *addr)
   }
   while (0);
 
-  global_unlock();
+  shmem_unlock();
 
   TRACE("rc %d errno %d\n", rc, errno);
   return rc;
@@ -1148,7 +1223,7 @@ int shmem_get_info(SHMEM h, int *flags, size_t *size, size_t *act_size)
 
   int rc = -1;
 
-  global_lock();
+  shmem_lock();
 
   do
   {
@@ -1190,7 +1265,7 @@ int shmem_get_info(SHMEM h, int *flags, size_t *size, size_t *act_size)
   }
   while (0);
 
-  global_unlock();
+  shmem_unlock();
 
   TRACE("rc %d errno %d\n", rc, errno);
   return rc;
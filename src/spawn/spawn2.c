@@ -1290,7 +1290,7 @@ int _std_waitid(idtype_t enmIdType, id_t Id, siginfo_t *pSigInfo, int fOptions);
 int _libc___waitpid(int pid, int *status, int options);
 ULONG APIENTRY _doscalls_DosWaitChild (ULONG ulAction, ULONG ulWait, PRESULTCODES pReturnCodes, PPID ppidOut, PID pidIn);
 
-// NOTE: Must be called under global_lock
+// NOTE: Must be called under global_lock or global_lock_shared
 static void lookup_wrapper_pid(pid_t pid, pid_t *wrapper_pid, pid_t *child_pid)
 {
   ProcDesc *proc = find_proc_desc(getpid());
@@ -1340,9 +1340,9 @@ pid_t wait4(pid_t pid, int *piStatus, int fOptions, struct rusage *pRUsage)
   if (pid > 0)
   {
     /* It could be the P_2_THRADSAFE wrapped process, look for a wrapper */
-    global_lock();
+    global_lock_shared();
     lookup_wrapper_pid(pid, &wrapper_pid, &child_pid);
-    global_unlock();
+    global_unlock_shared();
     TRACE("wrapper_pid %d, child_pid %d\n", wrapper_pid, child_pid);
 
     if (pid == child_pid)
@@ -1395,9 +1395,9 @@ int waitid(idtype_t enmIdType, id_t Id, siginfo_t *pSigInfo, int fOptions)
   if (enmIdType == P_PID && Id > 0)
   {
     /* It could be the P_2_THRADSAFE wrapped process, look for a wrapper */
-    global_lock();
+    global_lock_shared();
     lookup_wrapper_pid(Id, &wrapper_pid, &child_pid);
-    global_unlock ();
+    global_unlock_shared();
     TRACE("wrapper_pid %d, child_pid %d\n", wrapper_pid, child_pid);
 
     if (Id == child_pid)
@@ -1439,9 +1439,9 @@ int __waitpid(int pid, int *status, int options)
   if (pid != 0)
   {
     /* It could be the P_2_THRADSAFE wrapped process, look for a wrapper */
-    global_lock();
+    global_lock_shared();
     lookup_wrapper_pid(pid, &wrapper_pid, &child_pid);
-    global_unlock ();
+    global_unlock_shared();
     TRACE("wrapper_pid %d, child_pid %d\n", wrapper_pid, child_pid);
 
     if (pid == child_pid)
@@ -1479,9 +1479,9 @@ ULONG APIENTRY DosWaitChild (ULONG ulAction, ULONG ulWait, PRESULTCODES pReturnC
   if (ulAction == DCWA_PROCESS && pidIn != 0)
   {
     /* It could be the P_2_THRADSAFE wrapped process, look for a wrapper */
-    global_lock();
+    global_lock_shared();
     lookup_wrapper_pid(pidIn, &wrapper_pid, &child_pid);
-    global_unlock ();
+    global_unlock_shared();
     TRACE("wrapper_pid %d, child_pid %d\n", wrapper_pid, child_pid);
 
     if (pidIn == child_pid)
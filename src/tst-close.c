@@ -0,0 +1,181 @@
+/*
+ * Testcase for close() processing of tracked and untracked fds.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that closing any fd of a file releases fcntl locks of this process
+ * on it, including fds LIBCx never saw and fds reused after dup2.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static int do_test(void);
+#define TEST_FUNCTION do_test()
+#include "test-skeleton.c"
+
+#define perr(msg, ...) printf("ERROR: " msg "\n" , ##__VA_ARGS__)
+#define perrno(msg, ...) printf("ERROR: " msg ": %s (%d)\n", ##__VA_ARGS__, strerror (errno), errno)
+
+static int lock(int fd)
+{
+  struct flock fl;
+
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 1;
+
+  if (fcntl(fd, F_SETLK, &fl) == -1)
+  {
+    perrno("fcntl(F_SETLK)");
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Checks from a child process if the first byte of @a file is locked.
+ * Returns 1 if it's locked, 0 if not and -1 on failure.
+ */
+static int is_locked(const char *file)
+{
+  pid_t pid;
+  int status;
+
+  pid = fork();
+  if (pid == -1)
+  {
+    perrno("fork");
+    return -1;
+  }
+
+  if (pid == 0)
+  {
+    struct flock fl;
+    int fd = open(file, O_RDWR);
+    if (fd == -1)
+    {
+      perrno("child: open %s", file);
+      _exit(2);
+    }
+
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 1;
+
+    if (fcntl(fd, F_GETLK, &fl) == -1)
+    {
+      perrno("child: fcntl(F_GETLK)");
+      _exit(2);
+    }
+
+    _exit(fl.l_type != F_UNLCK);
+  }
+
+  if (waitpid(pid, &status, 0) == -1)
+  {
+    perrno("waitpid");
+    return -1;
+  }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) > 1)
+  {
+    perr("child failed with status 0x%x", status);
+    return -1;
+  }
+
+  return WEXITSTATUS(status);
+}
+
+static int do_test(void)
+{
+  char file1[] = "tst-close-1.tmp";
+  char file2[] = "tst-close-2.tmp";
+  int fd1, fd2, fd3;
+
+  fd1 = open(file1, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  fd2 = open(file1, O_RDWR);
+  fd3 = open(file2, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd1 == -1 || fd2 == -1 || fd3 == -1)
+  {
+    perrno("open");
+    return 1;
+  }
+
+  printf("test 1 (close of untracked fd)\n");
+
+  if (lock(fd1))
+    return 1;
+  if (is_locked(file1) != 1)
+  {
+    perr("file1 is not locked");
+    return 1;
+  }
+
+  /* fd2 was never used with LIBCx APIs but must release the lock */
+  if (close(fd2) == -1)
+  {
+    perrno("close(fd2)");
+    return 1;
+  }
+  if (is_locked(file1) != 0)
+  {
+    perr("file1 is still locked after close(fd2)");
+    return 1;
+  }
+
+  printf("test 2 (close of fd reused by dup2)\n");
+
+  if (lock(fd1) || lock(fd3))
+    return 1;
+
+  /* fd1 is now silently closed by dup2 and refers to file2 */
+  if (dup2(fd3, fd1) == -1)
+  {
+    perrno("dup2");
+    return 1;
+  }
+
+  /* Closing it must release the lock on file2 */
+  if (close(fd1) == -1)
+  {
+    perrno("close(fd1)");
+    return 1;
+  }
+  if (is_locked(file2) != 0)
+  {
+    perr("file2 is still locked after close(fd1)");
+    return 1;
+  }
+
+  close(fd3);
+
+  unlink(file1);
+  unlink(file2);
+
+  return 0;
+}
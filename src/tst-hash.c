@@ -0,0 +1,180 @@
+/*
+ * Testcase for the path hash function.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that hash_string() gives the same result for any string alignment
+ * and as the incremental form, and that it spreads a realistic path corpus
+ * over hash map buckets (FILE_DESC_LOCKS of them initially and more after
+ * growth) as evenly as a random function would. Chain statistics of the RS
+ * hash LIBCx used before are printed for comparison.
+ */
+
+#include <math.h>
+
+static int do_test(void);
+#define TEST_FUNCTION do_test()
+#include "test-skeleton.c"
+
+#include "hash-corpus.c"
+
+#include "shared.h" /* FILE_DESC_LOCKS */
+
+#define perr(msg, ...) printf("ERROR: " msg "\n" , ##__VA_ARGS__)
+
+static size_t hash_chunked(const char *str, size_t chunk)
+{
+  HashState st;
+  size_t len = strlen(str), n;
+
+  hash_init(&st);
+  for (; len; str += n, len -= n)
+  {
+    n = len < chunk ? len : chunk;
+    hash_update(&st, str, n);
+  }
+
+  return hash_final(&st);
+}
+
+static int test_consistency(char **paths, size_t count)
+{
+  static const struct { const char *str; uint32_t hash; } vectors[] =
+  {
+    /* Reference MurmurHash3_x86_32 values for HASH_SEED */
+    { "", 0xebb6c228 },
+    { "Hello, world!", 0x24884cba },
+    { "The quick brown fox jumps over the lazy dog", 0x2fa826cd },
+  };
+  static const size_t chunks[] = { 1, 2, 3, 5, 8, 1000 };
+  union { uint32_t align; char buf[1024]; } u;
+  size_t i, j, off;
+
+  printf("test 1 (consistency)\n");
+
+  for (i = 0; i < sizeof(vectors) / sizeof(*vectors); ++i)
+  {
+    if (hash_string(vectors[i].str) != vectors[i].hash)
+    {
+      perr("hash of [%s] is 0x%x instead of 0x%x", vectors[i].str,
+           (unsigned)hash_string(vectors[i].str), vectors[i].hash);
+      return 1;
+    }
+  }
+
+  for (i = 0; i < count; ++i)
+  {
+    size_t hash = hash_string(paths[i]);
+
+    /* The string may start at any offset within a word */
+    for (off = 1; off < 4; ++off)
+    {
+      strcpy(u.buf + off, paths[i]);
+      if (hash_string(u.buf + off) != hash)
+      {
+        perr("hash of [%s] at offset %u is 0x%x instead of 0x%x", paths[i],
+             (unsigned)off, (unsigned)hash_string(u.buf + off), (unsigned)hash);
+        return 1;
+      }
+    }
+
+    for (j = 0; j < sizeof(chunks) / sizeof(*chunks); ++j)
+    {
+      if (hash_chunked(paths[i], chunks[j]) != hash)
+      {
+        perr("incremental hash of [%s] by %u bytes is 0x%x instead of 0x%x",
+             paths[i], (unsigned)chunks[j],
+             (unsigned)hash_chunked(paths[i], chunks[j]), (unsigned)hash);
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int test_distribution(char **paths, size_t count)
+{
+  static const size_t sizes[] = { FILE_DESC_LOCKS, FILE_DESC_LOCKS * 8, FILE_DESC_LOCKS * 64 };
+  size_t i;
+
+  printf("test 2 (distribution of %u paths)\n", (unsigned)count);
+  printf("buckets  hash     max chain  empty  avg probes (random function)\n");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i)
+  {
+    size_t nbuckets = sizes[i];
+    double mean = (double)count / nbuckets;
+    /* Expected values for a random function */
+    double probes = 1 + (double)(count - 1) / (2 * nbuckets);
+    double empty = nbuckets * exp(-mean);
+    ChainStats rs, mm;
+
+    if (chain_stats(paths, count, nbuckets, rs_hash_string, &rs) ||
+        chain_stats(paths, count, nbuckets, hash_string, &mm))
+    {
+      perr("out of memory");
+      return 1;
+    }
+
+    printf("%7u  RS       %9u  %5u  %10.2f\n", (unsigned)nbuckets,
+           (unsigned)rs.max, (unsigned)rs.empty, rs.probes);
+    printf("%7u  Murmur3  %9u  %5u  %10.2f (%.2f)\n", (unsigned)nbuckets,
+           (unsigned)mm.max, (unsigned)mm.empty, mm.probes, probes);
+
+    /* Allow for some deviation from the expected values */
+    if (mm.probes > probes * 1.05)
+    {
+      perr("average number of probes is %.2f, expected %.2f", mm.probes, probes);
+      return 1;
+    }
+    if (mm.max > mean + 6 * sqrt(mean) + 3)
+    {
+      perr("longest chain is %u, mean %.2f", (unsigned)mm.max, mean);
+      return 1;
+    }
+    if (mm.empty > empty + 6 * sqrt(empty) + 3)
+    {
+      perr("%u empty buckets, expected %.2f", (unsigned)mm.empty, empty);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int do_test(void)
+{
+  size_t count;
+  char **paths;
+  int rc;
+
+  paths = make_corpus(&count);
+  if (!paths)
+  {
+    perr("out of memory");
+    return 1;
+  }
+
+  rc = test_consistency(paths, count) || test_distribution(paths, count);
+
+  free(paths);
+
+  return rc;
+}
@@ -0,0 +1,206 @@
+/*
+ * Testcase for shared heap growth beyond the initial segment.
+ * Copyright (C) 2026 bww bitwise works GmbH.
+ * This file is part of the kLIBC Extension Library.
+ *
+ * The kLIBC Extension Library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * The kLIBC Extension Library is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the GNU C Library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Holds tens of thousands of fcntl lock regions and MemMap entries at once
+ * which takes more shared memory than the initial 2MB heap segment provides.
+ * A forked child then checks that it sees all the locks (i.e. it got access
+ * to the additional segments).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+static int do_test(void);
+#define TEST_FUNCTION do_test()
+#include "test-skeleton.c"
+
+#define perr(msg, ...) printf("ERROR: " msg "\n" , ##__VA_ARGS__)
+#define perrno(msg, ...) printf("ERROR: " msg ": %s (%d)\n", ##__VA_ARGS__, strerror (errno), errno)
+
+#define PAGE_SIZE 4096
+
+enum
+{
+  NumLocks = 30000, /* Every lock creates two regions (locked + gap) */
+  NumHoles = 10000, /* Every hole creates one more MemMap entry */
+};
+
+static int check_locks(int fd)
+{
+  struct flock fl;
+  int i;
+
+  for (i = 0; i < NumLocks; i += NumLocks / 100)
+  {
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = i * 2;
+    fl.l_len = 1;
+
+    if (fcntl(fd, F_GETLK, &fl) == -1)
+    {
+      perrno("fcntl(F_GETLK) at %d", i * 2);
+      return 1;
+    }
+
+    if (fl.l_type != F_WRLCK)
+    {
+      perr("region at %d has type %d", i * 2, fl.l_type);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int do_test(void)
+{
+  char file[] = "tst-heap.tmp";
+  struct flock fl;
+  char *addr;
+  int fd, i, status;
+  pid_t pid;
+
+  fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+  {
+    perrno("open %s", file);
+    return 1;
+  }
+
+  printf("locking %d regions\n", NumLocks);
+
+  fl.l_whence = SEEK_SET;
+  fl.l_len = 1;
+
+  /* Go backwards so that each new region is found at the list head */
+  for (i = NumLocks - 1; i >= 0; --i)
+  {
+    fl.l_type = F_WRLCK;
+    fl.l_start = i * 2;
+    if (fcntl(fd, F_SETLK, &fl) == -1)
+    {
+      perrno("fcntl(F_SETLK) at %d", i * 2);
+      return 1;
+    }
+  }
+
+  printf("making %d holes in mmap\n", NumHoles);
+
+  addr = mmap(NULL, NumHoles * 2 * PAGE_SIZE, PROT_READ | PROT_WRITE,
+              MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (addr == MAP_FAILED)
+  {
+    perrno("mmap");
+    return 1;
+  }
+
+  /* Go backwards so that each split happens in the last MemMap entry */
+  for (i = NumHoles - 1; i >= 0; --i)
+  {
+    if (munmap(addr + (i * 2 + 1) * PAGE_SIZE, PAGE_SIZE) == -1)
+    {
+      perrno("munmap at %d", i);
+      return 1;
+    }
+  }
+
+  /* Make sure the remaining pages are still accessible */
+  for (i = 0; i < NumHoles; ++i)
+    addr[i * 2 * PAGE_SIZE] = 1;
+
+  printf("checking locks in child\n");
+
+  pid = fork();
+  if (pid == -1)
+  {
+    perrno("fork");
+    return 1;
+  }
+
+  if (pid == 0)
+  {
+    int cfd = open(file, O_RDWR);
+    if (cfd == -1)
+    {
+      perrno("child: open %s", file);
+      _exit(1);
+    }
+
+    if (check_locks(cfd))
+      _exit(1);
+
+    /* Add a few locks of our own in gaps */
+    for (i = 0; i < 100; ++i)
+    {
+      fl.l_type = F_WRLCK;
+      fl.l_start = i * 2 + 1;
+      if (fcntl(cfd, F_SETLK, &fl) == -1)
+      {
+        perrno("child: fcntl(F_SETLK) at %d", i * 2 + 1);
+        _exit(1);
+      }
+    }
+
+    close(cfd);
+    _exit(0);
+  }
+
+  if (waitpid(pid, &status, 0) == -1)
+  {
+    perrno("waitpid");
+    return 1;
+  }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+  {
+    perr("child failed with status 0x%x", status);
+    return 1;
+  }
+
+  printf("unlocking and unmapping\n");
+
+  fl.l_type = F_UNLCK;
+  fl.l_start = 0;
+  fl.l_len = 0;
+  if (fcntl(fd, F_SETLK, &fl) == -1)
+  {
+    perrno("fcntl(F_UNLCK)");
+    return 1;
+  }
+
+  if (munmap(addr, NumHoles * 2 * PAGE_SIZE) == -1)
+  {
+    perrno("munmap");
+    return 1;
+  }
+
+  close(fd);
+  unlink(file);
+
+  return 0;
+}